@@ -0,0 +1,152 @@
+/***************************************************************************
+ *   Copyright (C) 2015 by OmanTek                                         *
+ *   Author Kyle Hayes  kylehayes@omantek.com                              *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+
+/*
+ * This example reads from a large DINT array with many tags, like async.c.  Instead of polling
+ * the status of each tag, it registers a callback on each tag and waits for all the callbacks
+ * to report that the reads are done.
+ */
+
+
+#include <stdio.h>
+#include "../lib/libplctag.h"
+#include "utils.h"
+
+
+#define TAG_ATTRIBS "protocol=ab_eip&gateway=10.206.1.40&path=1,4&cpu=LGX&elem_type=DINT&elem_count=%d&name=TestBigArray[%d]&debug=4"
+#define NUM_TAGS  (30)
+#define NUM_ELEMS (1000)
+#define DATA_TIMEOUT (5000)
+
+
+/* each tag only touches its own entry so no locking is needed. */
+static volatile int read_status[NUM_TAGS];
+
+
+static void tag_callback(int32_t tag_id, int event, int status, void *userdata)
+{
+    int index = (int)(intptr_t)userdata;
+
+    switch(event) {
+    case PLCTAG_EVENT_READ_COMPLETED:
+        fprintf(stderr, "Tag %d (%d) read completed, data[0]=%d.\n", index, tag_id, plc_tag_get_int32(tag_id, 0));
+        break;
+
+    case PLCTAG_EVENT_WRITE_COMPLETED:
+        fprintf(stderr, "Tag %d (%d) write completed.\n", index, tag_id);
+        break;
+
+    case PLCTAG_EVENT_ABORTED:
+        fprintf(stderr, "Tag %d (%d) operation aborted: %s.\n", index, tag_id, plc_tag_decode_error(status));
+        break;
+
+    case PLCTAG_EVENT_ERROR:
+        fprintf(stderr, "Tag %d (%d) operation failed: %s.\n", index, tag_id, plc_tag_decode_error(status));
+        break;
+
+    default:
+        fprintf(stderr, "Tag %d (%d) unknown event %d!\n", index, tag_id, event);
+        break;
+    }
+
+    read_status[index] = status;
+}
+
+
+
+int main()
+{
+    int32_t tag[NUM_TAGS];
+    int rc;
+    int i;
+    int64_t timeout = DATA_TIMEOUT + util_time_ms();
+    int done = 0;
+    int64_t start = 0;
+    int64_t end = 0;
+    int num_elems_per_tag = NUM_ELEMS / NUM_TAGS;
+
+    /* create the tags */
+    for(i=0; i< NUM_TAGS; i++) {
+        char tmp_tag_path[256] = {0,};
+        snprintf_platform(tmp_tag_path, sizeof tmp_tag_path,TAG_ATTRIBS, num_elems_per_tag, i);
+
+        fprintf(stderr, "Attempting to create tag with attribute string '%s'\n",tmp_tag_path);
+
+        tag[i]  = plc_tag_create(tmp_tag_path, DATA_TIMEOUT);
+
+        if(tag[i] < 0) {
+            fprintf(stderr,"Error %s: could not create tag %d\n",plc_tag_decode_error(tag[i]), i);
+            return 1;
+        }
+
+        rc = plc_tag_register_callback(tag[i], tag_callback, (void *)(intptr_t)i);
+        if(rc != PLCTAG_STATUS_OK) {
+            fprintf(stderr,"Error %s: could not register callback on tag %d\n",plc_tag_decode_error(rc), i);
+            return 1;
+        }
+    }
+
+    start = util_time_ms();
+
+    /* start all the reads, the callbacks tell us when they are done. */
+    for(i=0; i < NUM_TAGS; i++) {
+        read_status[i] = PLCTAG_STATUS_PENDING;
+
+        rc = plc_tag_read(tag[i], 0);
+
+        if(rc != PLCTAG_STATUS_OK && rc != PLCTAG_STATUS_PENDING) {
+            fprintf(stderr,"ERROR: Unable to read the data! Got error code %d: %s\n",rc, plc_tag_decode_error(rc));
+
+            return 0;
+        }
+    }
+
+    /* wait for all the callbacks */
+    do {
+        done = 1;
+
+        for(i=0; i < NUM_TAGS; i++) {
+            if(read_status[i] == PLCTAG_STATUS_PENDING) {
+                done = 0;
+            }
+        }
+
+        if(!done) {
+            util_sleep_ms(1);
+        }
+    } while(timeout > util_time_ms() && !done);
+
+    end = util_time_ms();
+
+    if(!done) {
+        fprintf(stderr, "Timeout waiting for tags to finish reading!\n");
+    }
+
+    /* we are done */
+    for(i=0; i < NUM_TAGS; i++) {
+        plc_tag_destroy(tag[i]);
+    }
+
+    fprintf(stderr, "Read %d tags in %dms\n", NUM_TAGS, (int)(end - start));
+
+    return (done ? 0 : 1);
+}
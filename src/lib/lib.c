@@ -41,36 +41,97 @@
 #include <util/attr.h>
 #include <util/debug.h>
 #include <util/hash.h>
-#include <util/hashtable.h>
 #include <util/rc.h>
 #include <util/vector.h>
 #include <ab/ab.h>
 
 
-#define INITIAL_TAG_TABLE_SIZE (201)
-
 #define TAG_ID_MASK (0xFFFFFFF)
 
-#define MAX_TAG_MAP_ATTEMPTS (50)
+/* tag lookup slots, the count must be a power of two.  More tags than slots are chained. */
+#define TAG_SLOT_COUNT (0x10000)
+#define TAG_SLOT_MASK (TAG_SLOT_COUNT - 1)
+
+#define COMPLETION_QUEUE_MIN_SIZE (100)
+#define COMPLETION_QUEUE_INC_SIZE (100)
+
+/* subscription timer wheel, one revolution is SUBSCRIPTION_WHEEL_SLOTS * SUBSCRIPTION_TICK_MS. */
+#define SUBSCRIPTION_TICK_MS (10)
+#define SUBSCRIPTION_WHEEL_SLOTS (128)
+#define SUBSCRIPTION_SLOT_MIN_SIZE (10)
+#define SUBSCRIPTION_SLOT_INC_SIZE (10)
 
 /* these are only internal to the file */
 
 static volatile int32_t next_tag_id = 10; /* MAGIC */
-static volatile hashtable_p tags = NULL;
+/*
+ * Tags are found by ID in a fixed array of slots.  The slot is the ID
+ * masked down.  When there are more tags than slots, the tags that share
+ * a slot are chained through slot_next.  Each slot has its own spin lock
+ * so that lookups of different tags never wait on each other.  The mutex
+ * only serializes handing out IDs.
+ */
+struct tag_slot_t {
+    lock_t lock;
+    plc_tag_p tag;
+};
+
+static struct tag_slot_t *tag_slots = NULL;
 static mutex_p tag_lookup_mutex = NULL;
 
 static volatile int library_terminating = 0;
 static thread_p tag_tickler_thread = NULL;
 
+/* IDs of tags with completed requests, filled by the protocol threads. */
+static mutex_p completion_mutex = NULL;
+static vector_p completed_tags = NULL;
+static event_loop_p tickler_loop = NULL;
+
+/* per tag state of a plc_tag_read_many() call. */
+struct read_many_entry {
+    plc_tag_p tag;
+    int status;
+    int event;
+    int held;
+    int skipped;    /* busy, left to whoever is using it */
+    tag_callback_func callback;
+    void *userdata;
+};
+
+/* periodic reads of subscribed tags. */
+struct subscription_t {
+    int32_t tag_id;
+    int generation;
+    int64_t due_time;
+};
+
+static mutex_p subscription_mutex = NULL;
+static cond_p subscription_cond = NULL;
+static vector_p subscription_wheel[SUBSCRIPTION_WHEEL_SLOTS] = {NULL};
+static thread_p subscription_thread = NULL;
+
 //static mutex_p global_library_mutex = NULL;
 
 
 
 /* helper functions. */
 static plc_tag_p lookup_tag(int32_t id);
+static plc_tag_p *find_slot_entry_unsafe(int32_t tag_id);
 static int add_tag_lookup(plc_tag_p tag);
 static int tag_id_inc(int id);
 static THREAD_FUNC(tag_tickler_func);
+static void tag_queue_tickle(int32_t tag_id);
+static int tag_finish_operation(plc_tag_p tag, int status);
+static int read_many(int32_t *ids, int count, int timeout, int skip_busy);
+static void read_many_start(struct read_many_entry *entry, int64_t start_time, int skip_busy);
+static void read_many_hold(struct read_many_entry *entries, int count, int hold);
+static THREAD_FUNC(subscription_func);
+static int subscription_insert_unsafe(struct subscription_t *sub);
+static void copy_elements(uint8_t *dst, const uint8_t *src, int elem_size, int count);
+static int check_array_bounds(plc_tag_p tag, int offset, int elem_size, int count);
+static int read_tag_data(plc_tag_p tag, int offset, uint8_t *dst, int elem_size, int count);
+static int get_array(int32_t id, int offset, void *dst, int elem_size, int count);
+static int set_array(int32_t id, int offset, const void *src, int elem_size, int count);
 //static int to_tag_index(int id);
 
 /*
@@ -84,22 +145,68 @@ int lib_init(void)
 
     pdebug(DEBUG_INFO,"Setting up global library data.");
 
-    pdebug(DEBUG_INFO,"Creating tag hashtable.");
-    if((tags = hashtable_create(INITIAL_TAG_TABLE_SIZE)) == NULL) { /* MAGIC */
-        pdebug(DEBUG_ERROR, "Unable to create tag hashtable!");
+    pdebug(DEBUG_INFO,"Creating tag lookup slots.");
+    if((tag_slots = (struct tag_slot_t *)mem_alloc((int)sizeof(struct tag_slot_t) * TAG_SLOT_COUNT)) == NULL) {
+        pdebug(DEBUG_ERROR, "Unable to allocate tag lookup slots!");
         return PLCTAG_ERR_NO_MEM;
     }
 
-    pdebug(DEBUG_INFO,"Creating tag hashtable mutex.");
+    pdebug(DEBUG_INFO,"Creating tag lookup mutex.");
     rc = mutex_create((mutex_p *)&tag_lookup_mutex);
     if (rc != PLCTAG_STATUS_OK) {
-        pdebug(DEBUG_ERROR, "Unable to create tag hashtable mutex!");
+        pdebug(DEBUG_ERROR, "Unable to create tag lookup mutex!");
+        return rc;
+    }
+
+    pdebug(DEBUG_INFO,"Creating tag completion queue.");
+    rc = mutex_create(&completion_mutex);
+    if (rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_ERROR, "Unable to create tag completion queue mutex!");
+        return rc;
+    }
+
+    if((completed_tags = vector_create(COMPLETION_QUEUE_MIN_SIZE, COMPLETION_QUEUE_INC_SIZE)) == NULL) {
+        pdebug(DEBUG_ERROR, "Unable to create tag completion queue!");
+        return PLCTAG_ERR_NO_MEM;
+    }
+
+    rc = event_loop_create(&tickler_loop);
+    if (rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_ERROR, "Unable to create tag tickler event loop!");
+        return rc;
     }
 
     pdebug(DEBUG_INFO,"Creating tag tickler thread.");
     rc = thread_create(&tag_tickler_thread, tag_tickler_func, 32*1024, NULL);
     if (rc != PLCTAG_STATUS_OK) {
         pdebug(DEBUG_ERROR, "Unable to create tag tickler thread!");
+        return rc;
+    }
+
+    pdebug(DEBUG_INFO,"Creating tag subscription timer wheel.");
+    rc = mutex_create(&subscription_mutex);
+    if (rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_ERROR, "Unable to create tag subscription mutex!");
+        return rc;
+    }
+
+    rc = cond_create(&subscription_cond);
+    if (rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_ERROR, "Unable to create tag subscription condition!");
+        return rc;
+    }
+
+    for(int i=0; i < SUBSCRIPTION_WHEEL_SLOTS; i++) {
+        if((subscription_wheel[i] = vector_create(SUBSCRIPTION_SLOT_MIN_SIZE, SUBSCRIPTION_SLOT_INC_SIZE)) == NULL) {
+            pdebug(DEBUG_ERROR, "Unable to create tag subscription timer wheel!");
+            return PLCTAG_ERR_NO_MEM;
+        }
+    }
+
+    pdebug(DEBUG_INFO,"Creating tag subscription thread.");
+    rc = thread_create(&subscription_thread, subscription_func, 32*1024, NULL);
+    if (rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_ERROR, "Unable to create tag subscription thread!");
     }
 
     pdebug(DEBUG_INFO,"Done.");
@@ -116,14 +223,43 @@ void lib_teardown(void)
 
     pdebug(DEBUG_INFO,"Tearing down tag tickler thread.");
     library_terminating = 1;
+    event_loop_wake(tickler_loop);
     thread_join(tag_tickler_thread);
     thread_destroy(&tag_tickler_thread);
 
+    pdebug(DEBUG_INFO,"Tearing down tag subscription thread.");
+    cond_signal(subscription_cond);
+    thread_join(subscription_thread);
+    thread_destroy(&subscription_thread);
+
+    pdebug(DEBUG_INFO,"Tearing down tag subscription timer wheel.");
+    for(int i=0; i < SUBSCRIPTION_WHEEL_SLOTS; i++) {
+        vector_p slot = subscription_wheel[i];
+
+        if(slot) {
+            for(int j=0; j < vector_length(slot); j++) {
+                mem_free(vector_get(slot, j));
+            }
+
+            vector_destroy(slot);
+            subscription_wheel[i] = NULL;
+        }
+    }
+    cond_destroy(&subscription_cond);
+    mutex_destroy(&subscription_mutex);
+
+    pdebug(DEBUG_INFO,"Tearing down tag completion queue.");
+    event_loop_destroy(&tickler_loop);
+    vector_destroy(completed_tags);
+    completed_tags = NULL;
+    mutex_destroy(&completion_mutex);
+
     pdebug(DEBUG_INFO,"Tearing down tag lookup mutex.");
     mutex_destroy(&tag_lookup_mutex);
 
-    pdebug(DEBUG_INFO, "Destroying tag hashtable.");
-    hashtable_destroy(tags);
+    pdebug(DEBUG_INFO, "Freeing tag lookup slots.");
+    mem_free(tag_slots);
+    tag_slots = NULL;
 
 //    pdebug(DEBUG_INFO,"Destroying global library mutex.");
 //    if(global_library_mutex) {
@@ -136,46 +272,147 @@ void lib_teardown(void)
 
 
 
+/*
+ * tag_notify_complete
+ *
+ * Called by the protocol layers when a request for a tag finishes, for
+ * any reason.  Any thread waiting in plc_tag_read() or plc_tag_write()
+ * is woken up and the tickler thread will call the tag's tickler function
+ * to pick up the result.  This is safe to call from any thread.
+ */
+
+void tag_notify_complete(int32_t tag_id)
+{
+    plc_tag_p tag = NULL;
+
+    spin_block(&tag_slots[tag_id & TAG_SLOT_MASK].lock) {
+        plc_tag_p *entry = find_slot_entry_unsafe(tag_id);
+
+        if(*entry && (*entry)->tag_cond) {
+            tag = rc_inc(*entry);
+        }
+    }
+
+    /* wake up any thread blocked in a synchronous call on the tag, outside the spin lock. */
+    if(tag) {
+        cond_signal(tag->tag_cond);
+        rc_dec(tag);
+    }
+
+    tag_queue_tickle(tag_id);
+}
+
+
+
+/* have the tickler thread look at the tag. */
+void tag_queue_tickle(int32_t tag_id)
+{
+    int rc = PLCTAG_STATUS_OK;
+
+    critical_block(completion_mutex) {
+        rc = vector_put(completed_tags, vector_length(completed_tags), (void *)(intptr_t)tag_id);
+    }
+
+    if(rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_ERROR, "Unable to queue completion for tag %d!", tag_id);
+        return;
+    }
+
+    event_loop_wake(tickler_loop);
+}
+
+
+
+/*
+ * tag_api_unlock
+ *
+ * Release the tag's API mutex.  If the tickler thread skipped the tag
+ * while the mutex was held, queue the tag for it again.
+ */
+void tag_api_unlock(plc_tag_p tag)
+{
+    mutex_unlock(tag->api_mutex);
+
+    /* pairs with the barrier in the tickler, see tag_tickler_func(). */
+    mem_barrier();
+
+    if(tag->tickle_pending) {
+        tag->tickle_pending = 0;
+        tag_queue_tickle(tag->tag_id);
+    }
+}
+
+
+
+/*
+ * The tickler thread only looks at tags that have had a request
+ * complete.  It sleeps until a protocol thread queues a tag ID.
+ *
+ * A tag whose API mutex is held by another thread is not retried on a
+ * timer.  It is marked and the thread holding the mutex queues it again
+ * when it lets go, see tag_api_unlock().
+ */
+
 THREAD_FUNC(tag_tickler_func)
 {
+    vector_p ready_tags = NULL;
+    event_loop_event_t event;
+
     (void)arg;
 
     debug_set_tag_id(0);
 
     pdebug(DEBUG_INFO,"Starting.");
 
-    while(!library_terminating) {
-        int max_index;
+    if((ready_tags = vector_create(COMPLETION_QUEUE_MIN_SIZE, COMPLETION_QUEUE_INC_SIZE)) == NULL) {
+        pdebug(DEBUG_ERROR, "Unable to create tag completion queue!");
+        THREAD_RETURN(0);
+    }
 
-        critical_block(tag_lookup_mutex) {
-            max_index = hashtable_capacity(tags);
+    while(!library_terminating) {
+        /* take everything queued so far, new completions go into the other vector. */
+        critical_block(completion_mutex) {
+            vector_p tmp = completed_tags;
+            completed_tags = ready_tags;
+            ready_tags = tmp;
         }
 
-        for(int i=0; i < max_index; i++) {
+        for(int i=0; i < vector_length(ready_tags); i++) {
+            int32_t tag_id = (int32_t)(intptr_t)vector_get(ready_tags, i);
             plc_tag_p tag = NULL;
 
-            critical_block(tag_lookup_mutex) {
-                /* look up the max index again. it may have changed. */
-                max_index = hashtable_capacity(tags);
-
-                if(i < max_index) {
-                    tag = hashtable_get_index(tags, i);
-
-                    if(tag) {
-                        debug_set_tag_id(tag->tag_id);
-                        tag = rc_inc(tag);
-                    }
-                } else {
-                    debug_set_tag_id(0);
-                    tag = NULL;
-                }
-            }
+            /* the tag may have been destroyed already. */
+            tag = lookup_tag(tag_id);
 
             if(tag && tag->vtable->tickler) {
+                /* mark the tag before trying the mutex so that a release in between is not missed. */
+                tag->tickle_pending = 1;
+                mem_barrier();
+
                 if(mutex_try_lock(tag->api_mutex) == PLCTAG_STATUS_OK) {
+                    int status = PLCTAG_STATUS_OK;
+                    int event = 0;
+                    tag_callback_func callback = NULL;
+                    void *userdata = NULL;
+
+                    tag->tickle_pending = 0;
+
                     tag->vtable->tickler(tag);
 
+                    status = tag->vtable->status(tag);
+                    event = tag_finish_operation(tag, status);
+                    callback = tag->callback;
+                    userdata = tag->userdata;
+
                     mutex_unlock(tag->api_mutex);
+
+                    /* call back outside the mutex so that the callback can use the tag. */
+                    if(event && callback) {
+                        callback(tag_id, event, status, userdata);
+                    }
+                } else {
+                    /* someone else has the tag, they will queue it again when they are done. */
+                    pdebug(DEBUG_SPEW, "Tag %d is busy, leaving it to the mutex holder.", tag_id);
                 }
             }
 
@@ -185,11 +422,26 @@ THREAD_FUNC(tag_tickler_func)
             }
         }
 
+        while(vector_length(ready_tags) > 0) {
+            vector_remove(ready_tags, vector_length(ready_tags) - 1);
+        }
+
         if(!library_terminating) {
-            sleep_ms(1);
+            int pending = 0;
+
+            critical_block(completion_mutex) {
+                pending = vector_length(completed_tags);
+            }
+
+            /* only sleep if nothing new came in while we were working. */
+            if(pending <= 0) {
+                event_loop_wait(tickler_loop, -1, &event, 1);
+            }
         }
     }
 
+    vector_destroy(ready_tags);
+
     debug_set_tag_id(0);
 
     pdebug(DEBUG_INFO,"Terminating.");
@@ -199,349 +451,1283 @@ THREAD_FUNC(tag_tickler_func)
 
 
 
-/**************************************************************************
- ***************************  API Functions  ******************************
- **************************************************************************/
-
-
 /*
- * plc_tag_decode_error()
- *
- * This takes an integer error value and turns it into a printable string.
+ * The subscription thread wakes up every tick, takes the subscriptions
+ * that are due off the timer wheel and starts reads on all of them at
+ * once so that they are packed together.  Results come back through
+ * the tickler thread like any other asynchronous read.
  *
- * FIXME - this should produce better errors than this!
+ * Subscriptions are removed lazily.  An entry whose tag is gone or
+ * whose generation no longer matches the tag is dropped when it comes
+ * due.
  */
 
+THREAD_FUNC(subscription_func)
+{
+    vector_p due_tags = NULL;
+    int64_t last_tick = time_ms() / SUBSCRIPTION_TICK_MS;
 
+    (void)arg;
 
-LIB_EXPORT const char *plc_tag_decode_error(int rc)
-{
-    switch(rc) {
-    case PLCTAG_STATUS_PENDING:
-        return "PLCTAG_STATUS_PENDING";
-    case PLCTAG_STATUS_OK:
-        return "PLCTAG_STATUS_OK";
-    case PLCTAG_ERR_ABORT:
-        return "PLCTAG_ERR_ABORT";
-    case PLCTAG_ERR_BAD_CONFIG:
-        return "PLCTAG_ERR_BAD_CONFIG";
-    case PLCTAG_ERR_BAD_CONNECTION:
-        return "PLCTAG_ERR_BAD_CONNECTION";
-    case PLCTAG_ERR_BAD_DATA:
-        return "PLCTAG_ERR_BAD_DATA";
-    case PLCTAG_ERR_BAD_DEVICE:
-        return "PLCTAG_ERR_BAD_DEVICE";
-    case PLCTAG_ERR_BAD_GATEWAY:
-        return "PLCTAG_ERR_BAD_GATEWAY";
-    case PLCTAG_ERR_BAD_PARAM:
-        return "PLCTAG_ERR_BAD_PARAM";
-    case PLCTAG_ERR_BAD_REPLY:
-        return "PLCTAG_ERR_BAD_REPLY";
-    case PLCTAG_ERR_BAD_STATUS:
-        return "PLCTAG_ERR_BAD_STATUS";
-    case PLCTAG_ERR_CLOSE:
-        return "PLCTAG_ERR_CLOSE";
-    case PLCTAG_ERR_CREATE:
-        return "PLCTAG_ERR_CREATE";
-    case PLCTAG_ERR_DUPLICATE:
-        return "PLCTAG_ERR_DUPLICATE";
-    case PLCTAG_ERR_ENCODE:
-        return "PLCTAG_ERR_ENCODE";
-    case PLCTAG_ERR_MUTEX_DESTROY:
-        return "PLCTAG_ERR_MUTEX_DESTROY";
-    case PLCTAG_ERR_MUTEX_INIT:
-        return "PLCTAG_ERR_MUTEX_INIT";
-    case PLCTAG_ERR_MUTEX_LOCK:
-        return "PLCTAG_ERR_MUTEX_LOCK";
-    case PLCTAG_ERR_MUTEX_UNLOCK:
-        return "PLCTAG_ERR_MUTEX_UNLOCK";
-    case PLCTAG_ERR_NOT_ALLOWED:
-        return "PLCTAG_ERR_NOT_ALLOWED";
-    case PLCTAG_ERR_NOT_FOUND:
-        return "PLCTAG_ERR_NOT_FOUND";
-    case PLCTAG_ERR_NOT_IMPLEMENTED:
-        return "PLCTAG_ERR_NOT_IMPLEMENTED";
-    case PLCTAG_ERR_NO_DATA:
-        return "PLCTAG_ERR_NO_DATA";
-    case PLCTAG_ERR_NO_MATCH:
-        return "PLCTAG_ERR_NO_MATCH";
-    case PLCTAG_ERR_NO_MEM:
-        return "PLCTAG_ERR_NO_MEM";
-    case PLCTAG_ERR_NO_RESOURCES:
-        return "PLCTAG_ERR_NO_RESOURCES";
-    case PLCTAG_ERR_NULL_PTR:
-        return "PLCTAG_ERR_NULL_PTR";
-    case PLCTAG_ERR_OPEN:
-        return "PLCTAG_ERR_OPEN";
-    case PLCTAG_ERR_OUT_OF_BOUNDS:
-        return "PLCTAG_ERR_OUT_OF_BOUNDS";
-    case PLCTAG_ERR_READ:
-        return "PLCTAG_ERR_READ";
-    case PLCTAG_ERR_REMOTE_ERR:
-        return "PLCTAG_ERR_REMOTE_ERR";
-    case PLCTAG_ERR_THREAD_CREATE:
-        return "PLCTAG_ERR_THREAD_CREATE";
-    case PLCTAG_ERR_THREAD_JOIN:
-        return "PLCTAG_ERR_THREAD_JOIN";
-    case PLCTAG_ERR_TIMEOUT:
-        return "PLCTAG_ERR_TIMEOUT";
-    case PLCTAG_ERR_TOO_LARGE:
-        return "PLCTAG_ERR_TOO_LARGE";
-    case PLCTAG_ERR_TOO_SMALL:
-        return "PLCTAG_ERR_TOO_SMALL";
-    case PLCTAG_ERR_UNSUPPORTED:
-        return "PLCTAG_ERR_UNSUPPORTED";
-    case PLCTAG_ERR_WINSOCK:
-        return "PLCTAG_ERR_WINSOCK";
-    case PLCTAG_ERR_WRITE:
-        return "PLCTAG_ERR_WRITE";
-    case PLCTAG_ERR_PARTIAL:
-        return "PLCTAG_ERR_PARTIAL";
+    debug_set_tag_id(0);
 
-    default:
-        return "Unknown error.";
-        break;
+    pdebug(DEBUG_INFO,"Starting.");
+
+    if((due_tags = vector_create(SUBSCRIPTION_SLOT_MIN_SIZE, SUBSCRIPTION_SLOT_INC_SIZE)) == NULL) {
+        pdebug(DEBUG_ERROR, "Unable to create subscription due list!");
+        THREAD_RETURN(0);
     }
 
-    return "Unknown error.";
-}
+    while(!library_terminating) {
+        int64_t now = time_ms();
+        int64_t now_tick = now / SUBSCRIPTION_TICK_MS;
+        int64_t first_tick = last_tick + 1;
+        int num_due = 0;
+
+        /* if we fell behind by more than a revolution, each slot only needs one look. */
+        if(now_tick - first_tick >= SUBSCRIPTION_WHEEL_SLOTS) {
+            first_tick = now_tick - SUBSCRIPTION_WHEEL_SLOTS + 1;
+        }
 
+        critical_block(subscription_mutex) {
+            for(int64_t tick = first_tick; tick <= now_tick; tick++) {
+                vector_p slot = subscription_wheel[tick % SUBSCRIPTION_WHEEL_SLOTS];
 
+                for(int i=0; i < vector_length(slot); i++) {
+                    struct subscription_t *sub = vector_get(slot, i);
+                    plc_tag_p tag = NULL;
+                    int period_ms = 0;
 
-/*
- * plc_tag_create()
- *
- * Just pass through to the plc_tag_create_sync() function.
- *
- * This is where the dispatch occurs to the protocol specific implementation.
- */
+                    /* due on a later revolution of the wheel? */
+                    if(sub->due_time / SUBSCRIPTION_TICK_MS > now_tick) {
+                        continue;
+                    }
 
-LIB_EXPORT int32_t plc_tag_create(const char *attrib_str, int timeout)
-{
-    plc_tag_p tag = PLC_TAG_P_NULL;
-    int id = PLCTAG_ERR_OUT_OF_BOUNDS;
-    attr attribs = NULL;
-    int rc = PLCTAG_STATUS_OK;
-    int read_cache_ms = 0;
-    tag_create_function tag_constructor;
+                    vector_remove(slot, i);
+                    i--;
 
-    pdebug(DEBUG_INFO,"Starting");
+                    tag = lookup_tag(sub->tag_id);
+                    if(tag && tag->subscribe_generation == sub->generation) {
+                        period_ms = tag->subscribe_ms;
+                    }
 
-    if((rc = initialize_modules()) != PLCTAG_STATUS_OK) {
-        pdebug(DEBUG_ERROR,"Unable to initialize the internal library state!");
-        return rc;
-    }
+                    if(tag) {
+                        rc_dec(tag);
+                    }
 
-    if(!attrib_str || str_length(attrib_str) == 0) {
-        pdebug(DEBUG_WARN,"Tag attribute string is null or zero length!");
-        return PLCTAG_ERR_TOO_SMALL;
-    }
+                    if(period_ms <= 0) {
+                        mem_free(sub);
+                        continue;
+                    }
 
-    attribs = attr_create_from_str(attrib_str);
-    if(!attribs) {
-        pdebug(DEBUG_WARN,"Unable to parse attribute string!");
-        return PLCTAG_ERR_BAD_DATA;
-    }
+                    vector_put(due_tags, vector_length(due_tags), (void *)(intptr_t)sub->tag_id);
 
-    /* set debug level */
-    set_debug_level(attr_get_int(attribs, "debug", DEBUG_NONE));
+                    /* if we missed whole periods, skip them rather than reading several times. */
+                    sub->due_time += period_ms;
+                    if(sub->due_time / SUBSCRIPTION_TICK_MS <= now_tick) {
+                        sub->due_time = (now_tick + 1) * SUBSCRIPTION_TICK_MS;
+                    }
 
-    /*
-     * create the tag, this is protocol specific.
-     *
+                    if(subscription_insert_unsafe(sub) != PLCTAG_STATUS_OK) {
+                        pdebug(DEBUG_WARN, "Unable to reschedule subscription for tag %d!", sub->tag_id);
+                        mem_free(sub);
+                    }
+                }
+            }
+        }
+
+        last_tick = now_tick;
+        num_due = vector_length(due_tags);
+
+        if(num_due > 0) {
+            int32_t *ids = (int32_t *)mem_alloc((int)sizeof(int32_t) * num_due);
+
+            if(ids) {
+                for(int i=0; i < num_due; i++) {
+                    ids[i] = (int32_t)(intptr_t)vector_get(due_tags, i);
+                }
+
+                pdebug(DEBUG_DETAIL, "Starting reads on %d subscribed tags.", num_due);
+
+                read_many(ids, num_due, 0, 1);
+
+                mem_free(ids);
+            } else {
+                pdebug(DEBUG_ERROR, "Unable to allocate memory for %d subscribed tags!", num_due);
+            }
+
+            while(vector_length(due_tags) > 0) {
+                vector_remove(due_tags, vector_length(due_tags) - 1);
+            }
+        }
+
+        if(!library_terminating) {
+            cond_wait(subscription_cond, (int)((now_tick + 1) * SUBSCRIPTION_TICK_MS - time_ms()));
+        }
+    }
+
+    vector_destroy(due_tags);
+
+    pdebug(DEBUG_INFO,"Terminating.");
+
+    THREAD_RETURN(0);
+}
+
+
+
+/*
+ * subscription_insert_unsafe
+ *
+ * Put a subscription entry into the wheel slot for its due time.  Must be
+ * called with the subscription mutex held.
+ */
+
+int subscription_insert_unsafe(struct subscription_t *sub)
+{
+    vector_p slot = subscription_wheel[(sub->due_time / SUBSCRIPTION_TICK_MS) % SUBSCRIPTION_WHEEL_SLOTS];
+
+    return vector_put(slot, vector_length(slot), sub);
+}
+
+
+
+/*
+ * tag_finish_operation
+ *
+ * Figure out which callback event, if any, the passed status means for the
+ * read or write in flight on the tag.  If the operation is done, it is no
+ * longer marked as in flight.  Must be called with the tag API mutex held.
+ */
+
+int tag_finish_operation(plc_tag_p tag, int status)
+{
+    int event = 0;
+
+    if(status == PLCTAG_STATUS_PENDING) {
+        return 0;
+    }
+
+    if(tag->read_in_flight) {
+        event = PLCTAG_EVENT_READ_COMPLETED;
+    } else if(tag->write_in_flight) {
+        event = PLCTAG_EVENT_WRITE_COMPLETED;
+    } else {
+        return 0;
+    }
+
+    if(status == PLCTAG_ERR_ABORT) {
+        event = PLCTAG_EVENT_ABORTED;
+    } else if(status != PLCTAG_STATUS_OK) {
+        event = PLCTAG_EVENT_ERROR;
+    }
+
+    /* the data is as old as the request for it. */
+    if(event == PLCTAG_EVENT_READ_COMPLETED) {
+        tag->read_time = tag->read_start_time;
+        tag->data_generation++;
+    }
+
+    tag->read_in_flight = 0;
+    tag->write_in_flight = 0;
+
+    return event;
+}
+
+
+
+/*
+ * find_free_data_buffer
+ *
+ * Find a data buffer that is not the front buffer, is not pinned and is
+ * not being filled by a read.  Allocates a new one if needed.  Returns
+ * the index or -1.
+ */
+
+static int find_free_data_buffer(plc_tag_p tag)
+{
+    int index = -1;
+
+    for(int i=0; i < tag->num_data_buffers; i++) {
+        if(i != tag->data_front && i != tag->data_back && !tag->data_pins[i]) {
+            index = i;
+            break;
+        }
+    }
+
+    if(index < 0 && tag->num_data_buffers < TAG_MAX_DATA_BUFFERS) {
+        index = tag->num_data_buffers;
+
+        tag->data_buffers[index] = (uint8_t *)mem_alloc(tag->size);
+        if(!tag->data_buffers[index]) {
+            pdebug(DEBUG_ERROR, "Unable to allocate tag data buffer!");
+            return -1;
+        }
+
+        tag->num_data_buffers++;
+    }
+
+    if(index < 0) {
+        pdebug(DEBUG_WARN, "No free tag data buffer out of %d!", TAG_MAX_DATA_BUFFERS);
+    }
+
+    return index;
+}
+
+
+
+/*
+ * tag_data_for_update
+ *
+ * Start an in place change of the tag data.  If the current data buffer
+ * is pinned by a snapshot, the data is moved to a buffer that is not
+ * pinned first so that the snapshot does not change.
+ *
+ * Getters do not take the API mutex.  They check tag->data_seq before
+ * and after copying and retry if it changed or was odd.  This makes the
+ * sequence odd until tag_data_update_done() is called.
+ *
+ * Must be called with the tag API mutex held, or from the tickler.
+ */
+
+uint8_t *tag_data_for_update(plc_tag_p tag)
+{
+    int index = -1;
+
+    if(tag->num_data_buffers && tag->data_pins[tag->data_front]) {
+        index = find_free_data_buffer(tag);
+        if(index < 0) {
+            return NULL;
+        }
+
+        pdebug(DEBUG_DETAIL, "Tag data is pinned, switching to buffer %d.", index);
+
+        mem_copy(tag->data_buffers[index], tag->data, tag->size);
+    }
+
+    tag->data_seq++;
+    mem_barrier();
+
+    if(index >= 0) {
+        tag->data_front = index;
+        tag->data = tag->data_buffers[index];
+    }
+
+    return tag->data;
+}
+
+
+
+/*
+ * tag_data_update_done
+ *
+ * Finish a change started with tag_data_for_update().
+ */
+
+void tag_data_update_done(plc_tag_p tag)
+{
+    mem_barrier();
+    tag->data_seq++;
+
+    tag->data_generation++;
+}
+
+
+
+/*
+ * tag_data_read_buffer
+ *
+ * Get the back buffer that a read fills.  The same buffer is returned
+ * until tag_data_read_done() swaps it in, so a read that comes back in
+ * several fragments fills one buffer.  Getters never see it until then.
+ *
+ * Returns NULL if no buffer is free.
+ */
+
+uint8_t *tag_data_read_buffer(plc_tag_p tag)
+{
+    if(tag->data_back < 0) {
+        tag->data_back = find_free_data_buffer(tag);
+    }
+
+    if(tag->data_back < 0) {
+        return NULL;
+    }
+
+    return tag->data_buffers[tag->data_back];
+}
+
+
+
+/*
+ * tag_data_read_done
+ *
+ * Swap the back buffer filled by a read in as the front buffer.  If
+ * the read filled less than the whole buffer, the rest is copied from
+ * the old data.
+ */
+
+void tag_data_read_done(plc_tag_p tag, int size_read)
+{
+    uint8_t *back = NULL;
+
+    if(tag->data_back < 0) {
+        return;
+    }
+
+    back = tag->data_buffers[tag->data_back];
+
+    if(size_read < tag->size) {
+        mem_copy(back + size_read, tag->data + size_read, tag->size - size_read);
+    }
+
+    tag->data_seq++;
+    mem_barrier();
+
+    tag->data_front = tag->data_back;
+    tag->data = back;
+    tag->data_back = -1;
+
+    mem_barrier();
+    tag->data_seq++;
+}
+
+
+
+/*
+ * tag_data_buffers_destroy
+ *
+ * Free the extra data buffers and point the tag back at the buffer the
+ * protocol allocated so that the protocol can free it.
+ */
+
+void tag_data_buffers_destroy(plc_tag_p tag)
+{
+    if(!tag->num_data_buffers) {
+        return;
+    }
+
+    for(int i=1; i < tag->num_data_buffers; i++) {
+        mem_free(tag->data_buffers[i]);
+        tag->data_buffers[i] = NULL;
+    }
+
+    tag->data = tag->data_buffers[0];
+    tag->data_buffers[0] = NULL;
+    tag->num_data_buffers = 0;
+    tag->data_front = 0;
+}
+
+
+
+/**************************************************************************
+ ***************************  API Functions  ******************************
+ **************************************************************************/
+
+
+/*
+ * plc_tag_decode_error()
+ *
+ * This takes an integer error value and turns it into a printable string.
+ *
+ * FIXME - this should produce better errors than this!
+ */
+
+
+
+LIB_EXPORT const char *plc_tag_decode_error(int rc)
+{
+    switch(rc) {
+    case PLCTAG_STATUS_PENDING:
+        return "PLCTAG_STATUS_PENDING";
+    case PLCTAG_STATUS_OK:
+        return "PLCTAG_STATUS_OK";
+    case PLCTAG_ERR_ABORT:
+        return "PLCTAG_ERR_ABORT";
+    case PLCTAG_ERR_BAD_CONFIG:
+        return "PLCTAG_ERR_BAD_CONFIG";
+    case PLCTAG_ERR_BAD_CONNECTION:
+        return "PLCTAG_ERR_BAD_CONNECTION";
+    case PLCTAG_ERR_BAD_DATA:
+        return "PLCTAG_ERR_BAD_DATA";
+    case PLCTAG_ERR_BAD_DEVICE:
+        return "PLCTAG_ERR_BAD_DEVICE";
+    case PLCTAG_ERR_BAD_GATEWAY:
+        return "PLCTAG_ERR_BAD_GATEWAY";
+    case PLCTAG_ERR_BAD_PARAM:
+        return "PLCTAG_ERR_BAD_PARAM";
+    case PLCTAG_ERR_BAD_REPLY:
+        return "PLCTAG_ERR_BAD_REPLY";
+    case PLCTAG_ERR_BAD_STATUS:
+        return "PLCTAG_ERR_BAD_STATUS";
+    case PLCTAG_ERR_CLOSE:
+        return "PLCTAG_ERR_CLOSE";
+    case PLCTAG_ERR_CREATE:
+        return "PLCTAG_ERR_CREATE";
+    case PLCTAG_ERR_DUPLICATE:
+        return "PLCTAG_ERR_DUPLICATE";
+    case PLCTAG_ERR_ENCODE:
+        return "PLCTAG_ERR_ENCODE";
+    case PLCTAG_ERR_MUTEX_DESTROY:
+        return "PLCTAG_ERR_MUTEX_DESTROY";
+    case PLCTAG_ERR_MUTEX_INIT:
+        return "PLCTAG_ERR_MUTEX_INIT";
+    case PLCTAG_ERR_MUTEX_LOCK:
+        return "PLCTAG_ERR_MUTEX_LOCK";
+    case PLCTAG_ERR_MUTEX_UNLOCK:
+        return "PLCTAG_ERR_MUTEX_UNLOCK";
+    case PLCTAG_ERR_NOT_ALLOWED:
+        return "PLCTAG_ERR_NOT_ALLOWED";
+    case PLCTAG_ERR_NOT_FOUND:
+        return "PLCTAG_ERR_NOT_FOUND";
+    case PLCTAG_ERR_NOT_IMPLEMENTED:
+        return "PLCTAG_ERR_NOT_IMPLEMENTED";
+    case PLCTAG_ERR_NO_DATA:
+        return "PLCTAG_ERR_NO_DATA";
+    case PLCTAG_ERR_NO_MATCH:
+        return "PLCTAG_ERR_NO_MATCH";
+    case PLCTAG_ERR_NO_MEM:
+        return "PLCTAG_ERR_NO_MEM";
+    case PLCTAG_ERR_NO_RESOURCES:
+        return "PLCTAG_ERR_NO_RESOURCES";
+    case PLCTAG_ERR_NULL_PTR:
+        return "PLCTAG_ERR_NULL_PTR";
+    case PLCTAG_ERR_OPEN:
+        return "PLCTAG_ERR_OPEN";
+    case PLCTAG_ERR_OUT_OF_BOUNDS:
+        return "PLCTAG_ERR_OUT_OF_BOUNDS";
+    case PLCTAG_ERR_READ:
+        return "PLCTAG_ERR_READ";
+    case PLCTAG_ERR_REMOTE_ERR:
+        return "PLCTAG_ERR_REMOTE_ERR";
+    case PLCTAG_ERR_THREAD_CREATE:
+        return "PLCTAG_ERR_THREAD_CREATE";
+    case PLCTAG_ERR_THREAD_JOIN:
+        return "PLCTAG_ERR_THREAD_JOIN";
+    case PLCTAG_ERR_TIMEOUT:
+        return "PLCTAG_ERR_TIMEOUT";
+    case PLCTAG_ERR_TOO_LARGE:
+        return "PLCTAG_ERR_TOO_LARGE";
+    case PLCTAG_ERR_TOO_SMALL:
+        return "PLCTAG_ERR_TOO_SMALL";
+    case PLCTAG_ERR_UNSUPPORTED:
+        return "PLCTAG_ERR_UNSUPPORTED";
+    case PLCTAG_ERR_WINSOCK:
+        return "PLCTAG_ERR_WINSOCK";
+    case PLCTAG_ERR_WRITE:
+        return "PLCTAG_ERR_WRITE";
+    case PLCTAG_ERR_PARTIAL:
+        return "PLCTAG_ERR_PARTIAL";
+    case PLCTAG_ERR_PLC_OFFLINE:
+        return "PLCTAG_ERR_PLC_OFFLINE";
+
+    default:
+        return "Unknown error.";
+        break;
+    }
+
+    return "Unknown error.";
+}
+
+
+
+/*
+ * plc_tag_create()
+ *
+ * Just pass through to the plc_tag_create_sync() function.
+ *
+ * This is where the dispatch occurs to the protocol specific implementation.
+ */
+
+LIB_EXPORT int32_t plc_tag_create(const char *attrib_str, int timeout)
+{
+    plc_tag_p tag = PLC_TAG_P_NULL;
+    int id = PLCTAG_ERR_OUT_OF_BOUNDS;
+    attr attribs = NULL;
+    int rc = PLCTAG_STATUS_OK;
+    int read_cache_ms = 0;
+    tag_create_function tag_constructor;
+
+    pdebug(DEBUG_INFO,"Starting");
+
+    if((rc = initialize_modules()) != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_ERROR,"Unable to initialize the internal library state!");
+        return rc;
+    }
+
+    if(!attrib_str || str_length(attrib_str) == 0) {
+        pdebug(DEBUG_WARN,"Tag attribute string is null or zero length!");
+        return PLCTAG_ERR_TOO_SMALL;
+    }
+
+    attribs = attr_create_from_str(attrib_str);
+    if(!attribs) {
+        pdebug(DEBUG_WARN,"Unable to parse attribute string!");
+        return PLCTAG_ERR_BAD_DATA;
+    }
+
+    /* set debug level */
+    set_debug_level(attr_get_int(attribs, "debug", DEBUG_NONE));
+
+    /*
+     * create the tag, this is protocol specific.
+     *
      * If this routine wants to keep the attributes around, it needs
      * to clone them.
      */
-    tag_constructor = find_tag_create_func(attribs);
+    tag_constructor = find_tag_create_func(attribs);
+
+    if(!tag_constructor) {
+        pdebug(DEBUG_WARN,"Tag creation failed, no tag constructor found for tag type!");
+        attr_destroy(attribs);
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+
+    tag = tag_constructor(attribs);
+
+    /*
+     * FIXME - this really should be here???  Maybe not?  But, this is
+     * the only place it can be without making every protocol type do this automatically.
+     */
+    if(!tag) {
+        pdebug(DEBUG_WARN, "Tag creation failed, skipping mutex creation and other generic setup.");
+        attr_destroy(attribs);
+        return PLCTAG_ERR_CREATE;
+    }
+
+    rc = mutex_create(&(tag->ext_mutex));
+    if(rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN,"Unable to create tag external mutex!");
+        rc_dec(tag);
+        return PLCTAG_ERR_CREATE;
+    }
+
+    rc = mutex_create(&(tag->api_mutex));
+    if(rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN,"Unable to create tag API mutex!");
+        rc_dec(tag);
+        return PLCTAG_ERR_CREATE;
+    }
+
+    rc = cond_create(&(tag->tag_cond));
+    if(rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN,"Unable to create tag condition!");
+        rc_dec(tag);
+        return PLCTAG_ERR_CREATE;
+    }
+
+    /* the protocol's data buffer is the first of the data buffers. */
+    if(tag->data) {
+        tag->data_buffers[0] = tag->data;
+        tag->num_data_buffers = 1;
+        tag->data_front = 0;
+    }
+
+    tag->data_back = -1;
+
+    /* set up the read cache config. */
+    read_cache_ms = attr_get_int(attribs,"read_cache_ms",0);
+    if(read_cache_ms < 0) {
+        pdebug(DEBUG_WARN, "read_cache_ms value must be positive, using zero.");
+        read_cache_ms = 0;
+    }
+
+    tag->read_cache_expire = (uint64_t)0;
+    tag->read_cache_ms = (uint64_t)read_cache_ms;
+
+    /*
+     * Release memory for attributes
+     *
+     * some code is commented out that would have kept a pointer
+     * to the attributes in the tag and released the memory upon
+     * tag destruction. To prevent a memory leak without maintaining
+     * that pointer, the memory needs to be released here.
+     */
+    attr_destroy(attribs);
+
+    /*
+    * if there is a timeout, then loop until we get
+    * an error or we timeout.
+    */
+    if(timeout) {
+        int64_t timeout_time = timeout + time_ms();
+        int64_t start_time = time_ms();
+
+        /* get the tag status. */
+        rc = tag->vtable->status(tag);
+
+        while(rc == PLCTAG_STATUS_PENDING && timeout_time > time_ms()) {
+            /* give some time to the tickler function. */
+            if(tag->vtable->tickler) {
+                tag->vtable->tickler(tag);
+            }
+
+            rc = tag->vtable->status(tag);
+
+            /*
+             * terminate early and do not wait again if the
+             * IO is done.
+             */
+            if(rc != PLCTAG_STATUS_PENDING) {
+                break;
+            }
+
+            sleep_ms(1); /* MAGIC */
+        }
+
+        /*
+         * if we dropped out of the while loop but the status is
+         * still pending, then we timed out.
+         *
+         * Abort the operation and set the status to show the timeout.
+         */
+        if(rc == PLCTAG_STATUS_PENDING) {
+            pdebug(DEBUG_WARN,"Timeout waiting for tag to be ready!");
+            tag->vtable->abort(tag);
+            rc = PLCTAG_ERR_TIMEOUT;
+        }
+
+        /* check to see if there was an error during tag creation. */
+        if(rc != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_WARN, "Error %s while trying to create tag!", plc_tag_decode_error(rc));
+            rc_dec(tag);
+            return rc;
+        }
+
+        pdebug(DEBUG_INFO,"tag set up elapsed time %ldms",(time_ms()-start_time));
+    }
+
+    /* map the tag to a tag ID */
+    id = add_tag_lookup(tag);
+
+    /* if the mapping failed, then punt */
+    if(id < 0) {
+        pdebug(DEBUG_ERROR, "Unable to map tag %p to lookup table entry, rc=%s", tag, plc_tag_decode_error(id));
+        rc_dec(tag);
+        return id;
+    }
+
+    /* save this for later. */
+    tag->tag_id = id;
+
+    debug_set_tag_id(id);
+
+    /*
+     * let the protocol finish the parts of the set up that need a usable
+     * tag.  Other threads can reach the tag through the protocol after this.
+     */
+    if(tag->vtable->created) {
+        rc = tag->vtable->created(tag);
+        if(rc != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_WARN,"Unable to finish setting up the tag!");
+            plc_tag_destroy(id);
+            return rc;
+        }
+    }
+
+    pdebug(DEBUG_INFO, "Returning mapped tag ID %d", id);
+
+    pdebug(DEBUG_INFO,"Done.");
+
+    return id;
+}
+
+
+
+/*
+ * plc_tag_lock
+ *
+ * Lock the tag against use by other threads.  Because operations on a tag are
+ * very much asynchronous, actions like getting and extracting the data from
+ * a tag take more than one API call.  If more than one thread is using the same tag,
+ * then the internal state of the tag will get broken and you will probably experience
+ * a crash.
+ *
+ * This should be used to initially lock a tag when starting operations with it
+ * followed by a call to plc_tag_unlock when you have everything you need from the tag.
+ */
+
+LIB_EXPORT int plc_tag_lock(int32_t id)
+{
+    int rc = PLCTAG_STATUS_OK;
+    plc_tag_p tag = lookup_tag(id);
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    if(!tag) {
+        pdebug(DEBUG_WARN,"Tag not found.");
+        return PLCTAG_ERR_NOT_FOUND;
+    }
+
+    tag_api_block(tag) {
+        rc = mutex_lock(tag->ext_mutex);
+    }
+
+    rc_dec(tag);
+
+    pdebug(DEBUG_INFO, "Done.");
+
+    return rc;
+}
+
+
+
+
+/*
+ * plc_tag_unlock
+ *
+ * The opposite action of plc_tag_unlock.  This allows other threads to access the
+ * tag.
+ */
+
+LIB_EXPORT int plc_tag_unlock(int32_t id)
+{
+    int rc = PLCTAG_STATUS_OK;
+    plc_tag_p tag = lookup_tag(id);
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    if(!tag) {
+        pdebug(DEBUG_WARN,"Tag not found.");
+        return PLCTAG_ERR_NOT_FOUND;
+    }
+
+    tag_api_block(tag) {
+        rc = mutex_unlock(tag->ext_mutex);
+    }
+
+    rc_dec(tag);
+
+    pdebug(DEBUG_INFO, "Done.");
+
+    return rc;
+}
+
+
+
+
+/*
+ * plc_tag_abort()
+ *
+ * This function calls through the vtable in the passed tag to call
+ * the protocol-specific implementation.
+ *
+ * The implementation must do whatever is necessary to abort any
+ * ongoing IO.
+ *
+ * The status of the operation is returned.
+ */
+
+int plc_tag_abort(int32_t id)
+{
+    int rc = PLCTAG_STATUS_OK;
+    plc_tag_p tag = lookup_tag(id);
+    int event = 0;
+    tag_callback_func callback = NULL;
+    void *userdata = NULL;
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    if(!tag) {
+        pdebug(DEBUG_WARN,"Tag not found.");
+        return PLCTAG_ERR_NOT_FOUND;
+    }
+
+    tag_api_block(tag) {
+        /* who knows what state the tag data is in.  */
+        tag->read_cache_expire = (uint64_t)0;
+
+        if(!tag->vtable || !tag->vtable->abort) {
+            pdebug(DEBUG_WARN,"Tag does not have a abort function!");
+            rc = PLCTAG_ERR_NOT_IMPLEMENTED;
+        }
+
+        /* this may be synchronous. */
+        rc = tag->vtable->abort(tag);
+
+        event = tag_finish_operation(tag, PLCTAG_ERR_ABORT);
+        callback = tag->callback;
+        userdata = tag->userdata;
+    }
+
+    if(event && callback) {
+        callback(id, event, PLCTAG_ERR_ABORT, userdata);
+    }
+
+    rc_dec(tag);
+
+    pdebug(DEBUG_INFO, "Done.");
+
+    return rc;
+}
+
+
 
-    if(!tag_constructor) {
-        pdebug(DEBUG_WARN,"Tag creation failed, no tag constructor found for tag type!");
-        attr_destroy(attribs);
-        return PLCTAG_ERR_BAD_PARAM;
+
+/*
+ * plc_tag_destroy()
+ *
+ * Remove all implementation specific details about a tag and clear its
+ * memory.
+ */
+
+
+LIB_EXPORT int plc_tag_destroy(int32_t tag_id)
+{
+    plc_tag_p tag = NULL;
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    if(tag_id <= 0 || tag_id >= TAG_ID_MASK) {
+        pdebug(DEBUG_WARN, "Called with zero or invalid tag!");
+        return PLCTAG_ERR_NULL_PTR;
     }
 
-    tag = tag_constructor(attribs);
+    /* the table's reference is passed to us. */
+    spin_block(&tag_slots[tag_id & TAG_SLOT_MASK].lock) {
+        plc_tag_p *entry = find_slot_entry_unsafe(tag_id);
+
+        tag = *entry;
+
+        if(tag) {
+            *entry = tag->slot_next;
+            tag->slot_next = NULL;
+        }
+    }
 
-    /*
-     * FIXME - this really should be here???  Maybe not?  But, this is
-     * the only place it can be without making every protocol type do this automatically.
-     */
     if(!tag) {
-        pdebug(DEBUG_WARN, "Tag creation failed, skipping mutex creation and other generic setup.");
-        attr_destroy(attribs);
-        return PLCTAG_ERR_CREATE;
+        pdebug(DEBUG_WARN, "Called with non-existent tag!");
+        return PLCTAG_ERR_NOT_FOUND;
     }
 
-    rc = mutex_create(&(tag->ext_mutex));
-    if(rc != PLCTAG_STATUS_OK) {
-        pdebug(DEBUG_WARN,"Unable to create tag external mutex!");
-        rc_dec(tag);
-        return PLCTAG_ERR_CREATE;
+    /* release the reference outside the mutex. */
+    rc_dec(tag);
+
+    pdebug(DEBUG_INFO, "Done.");
+
+    debug_set_tag_id(0);
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+
+
+/*
+ * plc_tag_read()
+ *
+ * This function calls through the vtable in the passed tag to call
+ * the protocol-specific implementation.  That starts the read operation.
+ * If there is a timeout passed, then this routine waits for either
+ * a timeout or an error.
+ *
+ * The status of the operation is returned.
+ */
+
+LIB_EXPORT int plc_tag_read(int32_t id, int timeout)
+{
+    int rc = PLCTAG_STATUS_OK;
+    plc_tag_p tag = lookup_tag(id);
+    int event = 0;
+    tag_callback_func callback = NULL;
+    void *userdata = NULL;
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    if(!tag) {
+        pdebug(DEBUG_WARN,"Tag not found.");
+        return PLCTAG_ERR_NOT_FOUND;
     }
 
-    rc = mutex_create(&(tag->api_mutex));
-    if(rc != PLCTAG_STATUS_OK) {
-        pdebug(DEBUG_WARN,"Unable to create tag API mutex!");
-        rc_dec(tag);
-        return PLCTAG_ERR_CREATE;
+    tag_api_block(tag) {
+        callback = tag->callback;
+        userdata = tag->userdata;
+
+        /* check read cache, if not expired, return existing data. */
+        if(tag->read_cache_expire > time_ms()) {
+            pdebug(DEBUG_INFO, "Returning cached data.");
+            rc = PLCTAG_STATUS_OK;
+            event = PLCTAG_EVENT_READ_COMPLETED;
+            break;
+        }
+
+        /* throw away any stale signal from an earlier operation. */
+        cond_clear(tag->tag_cond);
+
+        tag->read_start_time = time_ms();
+
+        /* the protocol implementation does not do the timeout. */
+        rc = tag->vtable->read(tag);
+
+        tag->read_in_flight = 1;
+        tag->write_in_flight = 0;
+
+        /* if error, return now */
+        if(rc != PLCTAG_STATUS_PENDING && rc != PLCTAG_STATUS_OK) {
+            event = tag_finish_operation(tag, rc);
+            break;
+        }
+
+        /* set up the cache time.  This works when read_cache_ms is zero as it is already expired. */
+        tag->read_cache_expire = time_ms() + tag->read_cache_ms;
+
+        /*
+         * if there is a timeout, then loop until we get
+         * an error or we timeout.
+         */
+        if(timeout) {
+            int64_t timeout_time = timeout + time_ms();
+            int64_t start_time = time_ms();
+
+            while(rc == PLCTAG_STATUS_PENDING && timeout_time > time_ms()) {
+                /* give some time to the tickler function. */
+                if(tag->vtable->tickler) {
+                    tag->vtable->tickler(tag);
+                }
+
+                rc = tag->vtable->status(tag);
+
+                /*
+                 * terminate early and do not wait again if the
+                 * IO is done.
+                 */
+                if(rc != PLCTAG_STATUS_PENDING) {
+                    break;
+                }
+
+                /* wait for the session to finish a request for this tag. */
+                cond_wait(tag->tag_cond, (int)(timeout_time - time_ms()));
+            }
+
+            /*
+             * if we dropped out of the while loop but the status is
+             * still pending, then we timed out.
+             *
+             * Abort the operation and set the status to show the timeout.
+             */
+            if(rc == PLCTAG_STATUS_PENDING) {
+                tag->vtable->abort(tag);
+                event = tag_finish_operation(tag, PLCTAG_ERR_ABORT);
+                rc = PLCTAG_ERR_TIMEOUT;
+            }
+
+            pdebug(DEBUG_INFO,"elapsed time %ldms",(time_ms()-start_time));
+        }
+
+        if(!event) {
+            event = tag_finish_operation(tag, rc);
+        }
+    } /* end of api mutex block */
+
+    if(event && callback) {
+        callback(id, event, rc, userdata);
     }
 
-    /* set up the read cache config. */
-    read_cache_ms = attr_get_int(attribs,"read_cache_ms",0);
-    if(read_cache_ms < 0) {
-        pdebug(DEBUG_WARN, "read_cache_ms value must be positive, using zero.");
-        read_cache_ms = 0;
+    rc_dec(tag);
+
+    pdebug(DEBUG_INFO, "Done");
+
+    return rc;
+}
+
+
+
+
+
+
+/*
+ * plc_tag_read_many
+ *
+ * Start reads on a set of tags at the same time.  The sessions of the
+ * tags are held while the requests are queued so that the requests are
+ * packed into as few packets as possible.  If the timeout is non-zero,
+ * wait until all the reads are done or the timeout occurs.  Reads that
+ * are still running at the timeout are aborted.
+ *
+ * Returns the first error found, PLCTAG_STATUS_PENDING if the timeout
+ * is zero and some reads are still running, or PLCTAG_STATUS_OK.  Use
+ * plc_tag_status() to get the result for each tag.
+ */
+
+LIB_EXPORT int plc_tag_read_many(int32_t *ids, int count, int timeout)
+{
+    return read_many(ids, count, timeout, 0);
+}
+
+
+/*
+ * read_many
+ *
+ * This does the work for plc_tag_read_many().  If skip_busy is set, tags
+ * that already have a read or write in flight, or whose API mutex is held
+ * by another thread, are left alone instead of waited for.
+ */
+
+int read_many(int32_t *ids, int count, int timeout, int skip_busy)
+{
+    int rc = PLCTAG_STATUS_OK;
+    struct read_many_entry *entries = NULL;
+    int64_t start_time = time_ms();
+    int64_t timeout_time = start_time + timeout;
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    if(!ids || count <= 0) {
+        pdebug(DEBUG_WARN, "Tag ID list is null or empty!");
+        return PLCTAG_ERR_BAD_PARAM;
     }
 
-    tag->read_cache_expire = (uint64_t)0;
-    tag->read_cache_ms = (uint64_t)read_cache_ms;
+    entries = (struct read_many_entry *)mem_alloc((int)sizeof(struct read_many_entry) * count);
+    if(!entries) {
+        pdebug(DEBUG_ERROR, "Unable to allocate memory for %d tags!", count);
+        return PLCTAG_ERR_NO_MEM;
+    }
 
-    /*
-     * Release memory for attributes
-     *
-     * some code is commented out that would have kept a pointer
-     * to the attributes in the tag and released the memory upon
-     * tag destruction. To prevent a memory leak without maintaining
-     * that pointer, the memory needs to be released here.
-     */
-    attr_destroy(attribs);
+    for(int i=0; i < count; i++) {
+        entries[i].tag = lookup_tag(ids[i]);
+        entries[i].status = (entries[i].tag ? PLCTAG_STATUS_OK : PLCTAG_ERR_NOT_FOUND);
+    }
 
     /*
-    * if there is a timeout, then loop until we get
-    * an error or we timeout.
-    */
-    if(timeout) {
-        int64_t timeout_time = timeout + time_ms();
-        int64_t start_time = time_ms();
+     * Queue the reads with the sessions held so that the requests are
+     * packed.  A session is only held once the tag's API mutex is ours.
+     * If we have to wait for another thread to give up a tag, the holds
+     * are released first so that the sessions are not stalled while we
+     * wait.
+     */
+    for(int i=0; i < count; i++) {
+        plc_tag_p tag = entries[i].tag;
 
-        /* get the tag status. */
-        rc = tag->vtable->status(tag);
+        if(!tag) {
+            continue;
+        }
 
-        while(rc == PLCTAG_STATUS_PENDING && timeout_time > time_ms()) {
-            /* give some time to the tickler function. */
-            if(tag->vtable->tickler) {
-                tag->vtable->tickler(tag);
+        if(mutex_try_lock(tag->api_mutex) != PLCTAG_STATUS_OK) {
+            if(skip_busy) {
+                pdebug(DEBUG_SPEW, "Skipping busy tag %d.", tag->tag_id);
+                entries[i].status = PLCTAG_STATUS_PENDING;
+                entries[i].skipped = 1;
+                continue;
             }
 
-            rc = tag->vtable->status(tag);
+            read_many_hold(entries, i, 0);
+            mutex_lock(tag->api_mutex);
+            read_many_hold(entries, i, 1);
+        }
 
-            /*
-             * terminate early and do not wait again if the
-             * IO is done.
-             */
-            if(rc != PLCTAG_STATUS_PENDING) {
-                break;
+        if(tag->vtable->batch_start) {
+            tag->vtable->batch_start(tag);
+            entries[i].held = 1;
+        }
+
+        read_many_start(&entries[i], start_time, skip_busy);
+
+        tag_api_unlock(tag);
+    }
+
+    /* let the sessions pack and send the whole batch. */
+    read_many_hold(entries, count, 0);
+
+    if(timeout) {
+        for(int i=0; i < count; i++) {
+            plc_tag_p tag = entries[i].tag;
+
+            if(entries[i].skipped) {
+                continue;
             }
 
-            sleep_ms(1); /* MAGIC */
-        }
+            while(entries[i].status == PLCTAG_STATUS_PENDING) {
+                tag_api_block(tag) {
+                    if(tag->vtable->tickler) {
+                        tag->vtable->tickler(tag);
+                    }
 
-        /*
-         * if we dropped out of the while loop but the status is
-         * still pending, then we timed out.
-         *
-         * Abort the operation and set the status to show the timeout.
-         */
-        if(rc == PLCTAG_STATUS_PENDING) {
-            pdebug(DEBUG_WARN,"Timeout waiting for tag to be ready!");
-            tag->vtable->abort(tag);
-            rc = PLCTAG_ERR_TIMEOUT;
+                    entries[i].status = tag->vtable->status(tag);
+                }
+
+                if(entries[i].status != PLCTAG_STATUS_PENDING || timeout_time <= time_ms()) {
+                    break;
+                }
+
+                /* wait for the session to finish a request for this tag. */
+                cond_wait(tag->tag_cond, (int)(timeout_time - time_ms()));
+            }
         }
+    }
 
-        /* check to see if there was an error during tag creation. */
-        if(rc != PLCTAG_STATUS_OK) {
-            pdebug(DEBUG_WARN, "Error %s while trying to create tag!", plc_tag_decode_error(rc));
-            rc_dec(tag);
-            return rc;
+    /*
+     * abort anything that did not finish in time, and pick up the final status.
+     * Skipped tags belong to another thread or operation, so leave them be.
+     */
+    for(int i=0; i < count; i++) {
+        plc_tag_p tag = entries[i].tag;
+
+        if(!tag || entries[i].event || entries[i].skipped) {
+            continue;
         }
 
-        pdebug(DEBUG_INFO,"tag set up elapsed time %ldms",(time_ms()-start_time));
+        tag_api_block(tag) {
+            if(timeout && entries[i].status == PLCTAG_STATUS_PENDING) {
+                tag->vtable->abort(tag);
+                entries[i].event = tag_finish_operation(tag, PLCTAG_ERR_ABORT);
+                entries[i].status = PLCTAG_ERR_TIMEOUT;
+                break;
+            }
+
+            entries[i].event = tag_finish_operation(tag, entries[i].status);
+        }
     }
 
-    /* map the tag to a tag ID */
-    id = add_tag_lookup(tag);
+    pdebug(DEBUG_INFO,"elapsed time %ldms",(time_ms()-start_time));
 
-    /* if the mapping failed, then punt */
-    if(id < 0) {
-        pdebug(DEBUG_ERROR, "Unable to map tag %p to lookup table entry, rc=%s", tag, plc_tag_decode_error(id));
-        rc_dec(tag);
-        return id;
-    }
+    for(int i=0; i < count; i++) {
+        if(entries[i].event && entries[i].callback) {
+            entries[i].callback(ids[i], entries[i].event, entries[i].status, entries[i].userdata);
+        }
 
-    /* save this for later. */
-    tag->tag_id = id;
+        if(rc == PLCTAG_STATUS_OK || (rc == PLCTAG_STATUS_PENDING && entries[i].status != PLCTAG_STATUS_OK)) {
+            rc = entries[i].status;
+        }
 
-    debug_set_tag_id(id);
+        if(entries[i].tag) {
+            rc_dec(entries[i].tag);
+        }
+    }
 
-    pdebug(DEBUG_INFO, "Returning mapped tag ID %d", id);
+    mem_free(entries);
 
-    pdebug(DEBUG_INFO,"Done.");
+    pdebug(DEBUG_INFO, "Done.");
 
-    return id;
+    return rc;
 }
 
 
 
+
+
 /*
- * plc_tag_lock
- *
- * Lock the tag against use by other threads.  Because operations on a tag are
- * very much asynchronous, actions like getting and extracting the data from
- * a tag take more than one API call.  If more than one thread is using the same tag,
- * then the internal state of the tag will get broken and you will probably experience
- * a crash.
+ * read_many_start
  *
- * This should be used to initially lock a tag when starting operations with it
- * followed by a call to plc_tag_unlock when you have everything you need from the tag.
+ * Start the read of one tag of a plc_tag_read_many() call.  Must be
+ * called with the tag's API mutex held.
  */
 
-LIB_EXPORT int plc_tag_lock(int32_t id)
+void read_many_start(struct read_many_entry *entry, int64_t start_time, int skip_busy)
 {
-    int rc = PLCTAG_STATUS_OK;
-    plc_tag_p tag = lookup_tag(id);
+    plc_tag_p tag = entry->tag;
 
-    pdebug(DEBUG_INFO, "Starting.");
+    entry->callback = tag->callback;
+    entry->userdata = tag->userdata;
 
-    if(!tag) {
-        pdebug(DEBUG_WARN,"Tag not found.");
-        return PLCTAG_ERR_NOT_FOUND;
+    /* check read cache, if not expired, use the existing data. */
+    if(tag->read_cache_expire > time_ms()) {
+        entry->status = PLCTAG_STATUS_OK;
+        entry->event = PLCTAG_EVENT_READ_COMPLETED;
+        return;
     }
 
-    critical_block(tag->api_mutex) {
-        rc = mutex_lock(tag->ext_mutex);
+    if(skip_busy && (tag->read_in_flight || tag->write_in_flight)) {
+        entry->status = PLCTAG_STATUS_PENDING;
+        entry->skipped = 1;
+        return;
     }
 
-    rc_dec(tag);
+    cond_clear(tag->tag_cond);
 
-    pdebug(DEBUG_INFO, "Done.");
+    /* all the tags in the batch get the same read time. */
+    tag->read_start_time = start_time;
 
-    return rc;
+    entry->status = tag->vtable->read(tag);
+
+    tag->read_in_flight = 1;
+    tag->write_in_flight = 0;
+
+    if(entry->status != PLCTAG_STATUS_PENDING && entry->status != PLCTAG_STATUS_OK) {
+        entry->event = tag_finish_operation(tag, entry->status);
+        return;
+    }
+
+    tag->read_cache_expire = time_ms() + tag->read_cache_ms;
+}
+
+
+/*
+ * read_many_hold
+ *
+ * Take (hold != 0) or release the session holds of the first count
+ * entries of a plc_tag_read_many() call.  Only the entries that took a
+ * hold when their read was queued are touched.
+ */
+
+void read_many_hold(struct read_many_entry *entries, int count, int hold)
+{
+    for(int i=0; i < count; i++) {
+        plc_tag_p tag = entries[i].tag;
+
+        if(!entries[i].held) {
+            continue;
+        }
+
+        if(hold) {
+            tag->vtable->batch_start(tag);
+        } else {
+            tag->vtable->batch_end(tag);
+        }
+    }
 }
 
 
 
 
 /*
- * plc_tag_unlock
+ * plc_tag_subscribe
  *
- * The opposite action of plc_tag_unlock.  This allows other threads to access the
- * tag.
+ * Have the library read the tag every period_ms milliseconds.  Reads of
+ * all the subscribed tags that come due in the same scheduler tick are
+ * started together so that they are packed.  The first read is started
+ * on the next tick.  Subscribing again changes the period.
  */
 
-LIB_EXPORT int plc_tag_unlock(int32_t id)
+LIB_EXPORT int plc_tag_subscribe(int32_t id, int period_ms)
 {
     int rc = PLCTAG_STATUS_OK;
-    plc_tag_p tag = lookup_tag(id);
+    plc_tag_p tag = NULL;
+    struct subscription_t *sub = NULL;
 
     pdebug(DEBUG_INFO, "Starting.");
 
+    if(period_ms <= 0) {
+        pdebug(DEBUG_WARN, "Subscription period must be greater than zero!");
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+
+    tag = lookup_tag(id);
     if(!tag) {
         pdebug(DEBUG_WARN,"Tag not found.");
         return PLCTAG_ERR_NOT_FOUND;
     }
 
-    critical_block(tag->api_mutex) {
-        rc = mutex_unlock(tag->ext_mutex);
+    sub = (struct subscription_t *)mem_alloc((int)sizeof(struct subscription_t));
+    if(!sub) {
+        pdebug(DEBUG_ERROR, "Unable to allocate subscription entry!");
+        rc_dec(tag);
+        return PLCTAG_ERR_NO_MEM;
+    }
+
+    critical_block(subscription_mutex) {
+        /* any old entry in the wheel is dropped when it comes due. */
+        tag->subscribe_ms = period_ms;
+        tag->subscribe_generation++;
+
+        sub->tag_id = id;
+        sub->generation = tag->subscribe_generation;
+        sub->due_time = (time_ms() / SUBSCRIPTION_TICK_MS + 1) * SUBSCRIPTION_TICK_MS;
+
+        rc = subscription_insert_unsafe(sub);
+        if(rc != PLCTAG_STATUS_OK) {
+            tag->subscribe_ms = 0;
+            mem_free(sub);
+        }
     }
 
     rc_dec(tag);
@@ -553,20 +1739,14 @@ LIB_EXPORT int plc_tag_unlock(int32_t id)
 
 
 
-
 /*
- * plc_tag_abort()
- *
- * This function calls through the vtable in the passed tag to call
- * the protocol-specific implementation.
+ * plc_tag_unsubscribe
  *
- * The implementation must do whatever is necessary to abort any
- * ongoing IO.
- *
- * The status of the operation is returned.
+ * Stop the periodic reads of the tag.  A read already started is not
+ * aborted.
  */
 
-int plc_tag_abort(int32_t id)
+LIB_EXPORT int plc_tag_unsubscribe(int32_t id)
 {
     int rc = PLCTAG_STATUS_OK;
     plc_tag_p tag = lookup_tag(id);
@@ -578,17 +1758,15 @@ int plc_tag_abort(int32_t id)
         return PLCTAG_ERR_NOT_FOUND;
     }
 
-    critical_block(tag->api_mutex) {
-        /* who knows what state the tag data is in.  */
-        tag->read_cache_expire = (uint64_t)0;
-
-        if(!tag->vtable || !tag->vtable->abort) {
-            pdebug(DEBUG_WARN,"Tag does not have a abort function!");
-            rc = PLCTAG_ERR_NOT_IMPLEMENTED;
+    critical_block(subscription_mutex) {
+        if(tag->subscribe_ms <= 0) {
+            pdebug(DEBUG_WARN, "Tag is not subscribed.");
+            rc = PLCTAG_ERR_NOT_FOUND;
+            break;
         }
 
-        /* this may be synchronous. */
-        rc = tag->vtable->abort(tag);
+        tag->subscribe_ms = 0;
+        tag->subscribe_generation++;
     }
 
     rc_dec(tag);
@@ -601,42 +1779,54 @@ int plc_tag_abort(int32_t id)
 
 
 
+
 /*
- * plc_tag_destroy()
+ * plc_tag_status
  *
- * Remove all implementation specific details about a tag and clear its
- * memory.
+ * Return the current status of the tag.  This will be PLCTAG_STATUS_PENDING if there is
+ * an uncompleted IO operation.  It will be PLCTAG_STATUS_OK if everything is fine.  Other
+ * errors will be returned as appropriate.
+ *
+ * This is a function provided by the underlying protocol implementation.
  */
 
 
-LIB_EXPORT int plc_tag_destroy(int32_t tag_id)
+int plc_tag_status(int32_t id)
 {
-    plc_tag_p tag = NULL;
+    int rc = PLCTAG_STATUS_OK;
+    plc_tag_p tag = lookup_tag(id);
+    int event = 0;
+    tag_callback_func callback = NULL;
+    void *userdata = NULL;
 
-    pdebug(DEBUG_INFO, "Starting.");
+    pdebug(DEBUG_SPEW, "Starting.");
 
-    if(tag_id <= 0 || tag_id >= TAG_ID_MASK) {
-        pdebug(DEBUG_WARN, "Called with zero or invalid tag!");
-        return PLCTAG_ERR_NULL_PTR;
+    if(!tag) {
+        pdebug(DEBUG_WARN,"Tag not found.");
+        return PLCTAG_ERR_NOT_FOUND;
     }
 
-    critical_block(tag_lookup_mutex) {
-        tag = hashtable_remove(tags, tag_id);
+    tag_api_block(tag) {
+        if(tag && tag->vtable->tickler) {
+            tag->vtable->tickler(tag);
+        }
+
+        rc = tag->vtable->status(tag);
+
+        event = tag_finish_operation(tag, rc);
+        callback = tag->callback;
+        userdata = tag->userdata;
     }
 
-    if(!tag) {
-        pdebug(DEBUG_WARN, "Called with non-existent tag!");
-        return PLCTAG_ERR_NOT_FOUND;
+    if(event && callback) {
+        callback(id, event, rc, userdata);
     }
 
-    /* release the reference outside the mutex. */
     rc_dec(tag);
 
-    pdebug(DEBUG_INFO, "Done.");
-
-    debug_set_tag_id(0);
+    pdebug(DEBUG_SPEW, "Done with rc=%s.", plc_tag_decode_error(rc));
 
-    return PLCTAG_STATUS_OK;
+    return rc;
 }
 
 
@@ -644,54 +1834,58 @@ LIB_EXPORT int plc_tag_destroy(int32_t tag_id)
 
 
 /*
- * plc_tag_read()
+ * plc_tag_write()
  *
  * This function calls through the vtable in the passed tag to call
- * the protocol-specific implementation.  That starts the read operation.
+ * the protocol-specific implementation.  That starts the write operation.
  * If there is a timeout passed, then this routine waits for either
  * a timeout or an error.
  *
  * The status of the operation is returned.
  */
 
-LIB_EXPORT int plc_tag_read(int32_t id, int timeout)
+LIB_EXPORT int plc_tag_write(int32_t id, int timeout)
 {
     int rc = PLCTAG_STATUS_OK;
     plc_tag_p tag = lookup_tag(id);
+    int event = 0;
+    tag_callback_func callback = NULL;
+    void *userdata = NULL;
 
-    pdebug(DEBUG_INFO, "Starting.");
+    pdebug(DEBUG_SPEW, "Starting.");
 
     if(!tag) {
         pdebug(DEBUG_WARN,"Tag not found.");
         return PLCTAG_ERR_NOT_FOUND;
     }
 
-    critical_block(tag->api_mutex) {
-        /* check read cache, if not expired, return existing data. */
-        if(tag->read_cache_expire > time_ms()) {
-            pdebug(DEBUG_INFO, "Returning cached data.");
-            rc = PLCTAG_STATUS_OK;
-            break;
-        }
+    tag_api_block(tag) {
+        /* throw away any stale signal from an earlier operation. */
+        cond_clear(tag->tag_cond);
+
+        callback = tag->callback;
+        userdata = tag->userdata;
 
         /* the protocol implementation does not do the timeout. */
-        rc = tag->vtable->read(tag);
+        rc = tag->vtable->write(tag);
+
+        tag->read_in_flight = 0;
+        tag->write_in_flight = 1;
 
         /* if error, return now */
         if(rc != PLCTAG_STATUS_PENDING && rc != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_WARN,"Response from write command is not OK!");
+            event = tag_finish_operation(tag, rc);
             break;
         }
 
-        /* set up the cache time.  This works when read_cache_ms is zero as it is already expired. */
-        tag->read_cache_expire = time_ms() + tag->read_cache_ms;
-
         /*
          * if there is a timeout, then loop until we get
          * an error or we timeout.
          */
         if(timeout) {
-            int64_t timeout_time = timeout + time_ms();
             int64_t start_time = time_ms();
+            int64_t timeout_time = timeout + start_time;
 
             while(rc == PLCTAG_STATUS_PENDING && timeout_time > time_ms()) {
                 /* give some time to the tickler function. */
@@ -709,7 +1903,8 @@ LIB_EXPORT int plc_tag_read(int32_t id, int timeout)
                     break;
                 }
 
-                sleep_ms(1); /* MAGIC */
+                /* wait for the session to finish a request for this tag. */
+                cond_wait(tag->tag_cond, (int)(timeout_time - time_ms()));
             }
 
             /*
@@ -719,14 +1914,24 @@ LIB_EXPORT int plc_tag_read(int32_t id, int timeout)
              * Abort the operation and set the status to show the timeout.
              */
             if(rc == PLCTAG_STATUS_PENDING) {
+                pdebug(DEBUG_WARN, "Write operation timed out.");
                 tag->vtable->abort(tag);
+                event = tag_finish_operation(tag, PLCTAG_ERR_ABORT);
                 rc = PLCTAG_ERR_TIMEOUT;
             }
 
-            pdebug(DEBUG_INFO,"elapsed time %ldms",(time_ms()-start_time));
+            pdebug(DEBUG_INFO,"elapsed time %lldms",(time_ms()-start_time));
+        }
+
+        if(!event) {
+            event = tag_finish_operation(tag, rc);
         }
     } /* end of api mutex block */
 
+    if(event && callback) {
+        callback(id, event, rc, userdata);
+    }
+
     rc_dec(tag);
 
     pdebug(DEBUG_INFO, "Done");
@@ -738,128 +1943,83 @@ LIB_EXPORT int plc_tag_read(int32_t id, int timeout)
 
 
 
-
 /*
- * plc_tag_status
- *
- * Return the current status of the tag.  This will be PLCTAG_STATUS_PENDING if there is
- * an uncompleted IO operation.  It will be PLCTAG_STATUS_OK if everything is fine.  Other
- * errors will be returned as appropriate.
+ * plc_tag_register_callback()
  *
- * This is a function provided by the underlying protocol implementation.
+ * Set the function to call when a read or write on the tag finishes.
+ * Only one callback is allowed per tag.
  */
 
-
-int plc_tag_status(int32_t id)
+LIB_EXPORT int plc_tag_register_callback(int32_t id, tag_callback_func callback_func, void *userdata)
 {
     int rc = PLCTAG_STATUS_OK;
     plc_tag_p tag = lookup_tag(id);
 
-    pdebug(DEBUG_SPEW, "Starting.");
+    pdebug(DEBUG_INFO, "Starting.");
 
     if(!tag) {
         pdebug(DEBUG_WARN,"Tag not found.");
         return PLCTAG_ERR_NOT_FOUND;
     }
 
-    critical_block(tag->api_mutex) {
-        if(tag && tag->vtable->tickler) {
-            tag->vtable->tickler(tag);
+    if(!callback_func) {
+        pdebug(DEBUG_WARN, "Callback function pointer is null!");
+        rc_dec(tag);
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    tag_api_block(tag) {
+        if(tag->callback) {
+            pdebug(DEBUG_WARN, "Tag already has a callback registered!");
+            rc = PLCTAG_ERR_DUPLICATE;
+            break;
         }
 
-        rc = tag->vtable->status(tag);
+        tag->callback = callback_func;
+        tag->userdata = userdata;
     }
 
     rc_dec(tag);
 
-    pdebug(DEBUG_SPEW, "Done with rc=%s.", plc_tag_decode_error(rc));
+    pdebug(DEBUG_INFO, "Done.");
 
     return rc;
 }
 
 
 
-
-
 /*
- * plc_tag_write()
- *
- * This function calls through the vtable in the passed tag to call
- * the protocol-specific implementation.  That starts the write operation.
- * If there is a timeout passed, then this routine waits for either
- * a timeout or an error.
+ * plc_tag_unregister_callback()
  *
- * The status of the operation is returned.
+ * Remove the callback from the tag.
  */
 
-LIB_EXPORT int plc_tag_write(int32_t id, int timeout)
+LIB_EXPORT int plc_tag_unregister_callback(int32_t id)
 {
     int rc = PLCTAG_STATUS_OK;
     plc_tag_p tag = lookup_tag(id);
 
-    pdebug(DEBUG_SPEW, "Starting.");
+    pdebug(DEBUG_INFO, "Starting.");
 
     if(!tag) {
         pdebug(DEBUG_WARN,"Tag not found.");
         return PLCTAG_ERR_NOT_FOUND;
     }
 
-    critical_block(tag->api_mutex) {
-        /* the protocol implementation does not do the timeout. */
-        rc = tag->vtable->write(tag);
-
-        /* if error, return now */
-        if(rc != PLCTAG_STATUS_PENDING && rc != PLCTAG_STATUS_OK) {
-            pdebug(DEBUG_WARN,"Response from write command is not OK!");
+    tag_api_block(tag) {
+        if(!tag->callback) {
+            pdebug(DEBUG_WARN, "Tag does not have a callback registered!");
+            rc = PLCTAG_ERR_NOT_FOUND;
             break;
         }
 
-        /*
-         * if there is a timeout, then loop until we get
-         * an error or we timeout.
-         */
-        if(timeout) {
-            int64_t start_time = time_ms();
-            int64_t timeout_time = timeout + start_time;
-
-            while(rc == PLCTAG_STATUS_PENDING && timeout_time > time_ms()) {
-                /* give some time to the tickler function. */
-                if(tag->vtable->tickler) {
-                    tag->vtable->tickler(tag);
-                }
-
-                rc = tag->vtable->status(tag);
-
-                /*
-                 * terminate early and do not wait again if the
-                 * IO is done.
-                 */
-                if(rc != PLCTAG_STATUS_PENDING) {
-                    break;
-                }
-
-                sleep_ms(1); /* MAGIC */
-            }
-
-            /*
-             * if we dropped out of the while loop but the status is
-             * still pending, then we timed out.
-             *
-             * Abort the operation and set the status to show the timeout.
-             */
-            if(rc == PLCTAG_STATUS_PENDING) {
-                pdebug(DEBUG_WARN, "Write operation timed out.");
-                tag->vtable->abort(tag);
-                rc = PLCTAG_ERR_TIMEOUT;
-            }
-
-            pdebug(DEBUG_INFO,"elapsed time %lldms",(time_ms()-start_time));
-        }
-    } /* end of api mutex block */
+        tag->callback = NULL;
+        tag->userdata = NULL;
+    }
 
     rc_dec(tag);
 
-    pdebug(DEBUG_INFO, "Done");
+    pdebug(DEBUG_INFO, "Done.");
 
     return rc;
 }
@@ -886,7 +2046,7 @@ LIB_EXPORT int plc_tag_get_size(int32_t id)
         return PLCTAG_ERR_NOT_FOUND;
     }
 
-    critical_block(tag->api_mutex) {
+    tag_api_block(tag) {
         result = tag->size;
     }
 
@@ -902,9 +2062,47 @@ LIB_EXPORT int plc_tag_get_size(int32_t id)
 
 
 
+/*
+ * plc_tag_get_read_time
+ *
+ * Return the time, in milliseconds since the epoch, at which the read that
+ * produced the tag's data was started.  Tags read together, in a read group
+ * or with plc_tag_read_many(), get the same time.  Returns zero if the tag
+ * has not been read yet.
+ */
+
+LIB_EXPORT int64_t plc_tag_get_read_time(int32_t id)
+{
+    int64_t result = 0;
+    plc_tag_p tag = lookup_tag(id);
+
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    if(!tag) {
+        pdebug(DEBUG_WARN,"Tag not found.");
+        return PLCTAG_ERR_NOT_FOUND;
+    }
+
+    tag_api_block(tag) {
+        result = tag->read_time;
+    }
+
+    rc_dec(tag);
+
+    pdebug(DEBUG_SPEW, "Done.");
+
+    return result;
+}
+
+
+
+
+
+
 LIB_EXPORT uint64_t plc_tag_get_uint64(int32_t id, int offset)
 {
     uint64_t res = UINT64_MAX;
+    uint8_t data[sizeof(uint64_t)];
     plc_tag_p tag = lookup_tag(id);
 
     pdebug(DEBUG_SPEW, "Starting.");
@@ -914,28 +2112,100 @@ LIB_EXPORT uint64_t plc_tag_get_uint64(int32_t id, int offset)
         return res;
     }
 
-    critical_block(tag->api_mutex) {
+    if(read_tag_data(tag, offset, data, 1, (int)sizeof(uint64_t)) == PLCTAG_STATUS_OK) {
+        res = ((uint64_t)(data[0])) +
+              ((uint64_t)(data[1]) << 8) +
+              ((uint64_t)(data[2]) << 16) +
+              ((uint64_t)(data[3]) << 24) +
+              ((uint64_t)(data[4]) << 32) +
+              ((uint64_t)(data[5]) << 40) +
+              ((uint64_t)(data[6]) << 48) +
+              ((uint64_t)(data[7]) << 56);
+
+    }
+
+    rc_dec(tag);
+
+    return res;
+}
+
+
+
+LIB_EXPORT int plc_tag_set_uint64(int32_t id, int offset, uint64_t val)
+{
+    int rc = PLCTAG_STATUS_OK;
+    plc_tag_p tag = lookup_tag(id);
+
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    if(!tag) {
+        pdebug(DEBUG_WARN,"Tag not found.");
+        return PLCTAG_ERR_NOT_FOUND;
+    }
+
+    tag_api_block(tag) {
         /* is there data? */
         if(!tag->data) {
             pdebug(DEBUG_WARN,"Tag has no data!");
+            rc = PLCTAG_ERR_NO_DATA;
             break;
         }
 
         /* is there enough data */
         if((offset < 0) || (offset + ((int)sizeof(uint64_t)) > tag->size)) {
             pdebug(DEBUG_WARN,"Data offset out of bounds.");
+            rc = PLCTAG_ERR_OUT_OF_BOUNDS;
+            break;
+        }
+
+        if(!tag_data_for_update(tag)) {
+            rc = PLCTAG_ERR_NO_RESOURCES;
             break;
         }
 
-        res = ((uint64_t)(tag->data[offset])) +
-              ((uint64_t)(tag->data[offset+1]) << 8) +
-              ((uint64_t)(tag->data[offset+2]) << 16) +
-              ((uint64_t)(tag->data[offset+3]) << 24) +
-              ((uint64_t)(tag->data[offset+4]) << 32) +
-              ((uint64_t)(tag->data[offset+5]) << 40) +
-              ((uint64_t)(tag->data[offset+6]) << 48) +
-              ((uint64_t)(tag->data[offset+7]) << 56);
+        /* write the data. */
+        tag->data[offset]   = (uint8_t)(val & 0xFF);
+        tag->data[offset+1] = (uint8_t)((val >> 8) & 0xFF);
+        tag->data[offset+2] = (uint8_t)((val >> 16) & 0xFF);
+        tag->data[offset+3] = (uint8_t)((val >> 24) & 0xFF);
+        tag->data[offset+4] = (uint8_t)((val >> 32) & 0xFF);
+        tag->data[offset+5] = (uint8_t)((val >> 40) & 0xFF);
+        tag->data[offset+6] = (uint8_t)((val >> 48) & 0xFF);
+        tag->data[offset+7] = (uint8_t)((val >> 56) & 0xFF);
+
+        tag_data_update_done(tag);
+    }
+
+    rc_dec(tag);
+
+    return rc;
+}
+
+
+
+
+LIB_EXPORT int64_t  plc_tag_get_int64(int32_t id, int offset)
+{
+    int64_t res = INT64_MIN;
+    uint8_t data[sizeof(int64_t)];
+    plc_tag_p tag = lookup_tag(id);
+
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    if(!tag) {
+        pdebug(DEBUG_WARN,"Tag not found.");
+        return res;
+    }
 
+    if(read_tag_data(tag, offset, data, 1, (int)sizeof(int64_t)) == PLCTAG_STATUS_OK) {
+        res = (int64_t)(((uint64_t)(data[0])) +
+                        ((uint64_t)(data[1]) << 8) +
+                        ((uint64_t)(data[2]) << 16) +
+                        ((uint64_t)(data[3]) << 24) +
+                        ((uint64_t)(data[4]) << 32) +
+                        ((uint64_t)(data[5]) << 40) +
+                        ((uint64_t)(data[6]) << 48) +
+                        ((uint64_t)(data[7]) << 56));
     }
 
     rc_dec(tag);
@@ -945,8 +2215,9 @@ LIB_EXPORT uint64_t plc_tag_get_uint64(int32_t id, int offset)
 
 
 
-LIB_EXPORT int plc_tag_set_uint64(int32_t id, int offset, uint64_t val)
+LIB_EXPORT int plc_tag_set_int64(int32_t id, int offset, int64_t ival)
 {
+    uint64_t val = (uint64_t)(ival);
     int rc = PLCTAG_STATUS_OK;
     plc_tag_p tag = lookup_tag(id);
 
@@ -957,7 +2228,7 @@ LIB_EXPORT int plc_tag_set_uint64(int32_t id, int offset, uint64_t val)
         return PLCTAG_ERR_NOT_FOUND;
     }
 
-    critical_block(tag->api_mutex) {
+    tag_api_block(tag) {
         /* is there data? */
         if(!tag->data) {
             pdebug(DEBUG_WARN,"Tag has no data!");
@@ -966,13 +2237,17 @@ LIB_EXPORT int plc_tag_set_uint64(int32_t id, int offset, uint64_t val)
         }
 
         /* is there enough data */
-        if((offset < 0) || (offset + ((int)sizeof(uint64_t)) > tag->size)) {
+        if((offset < 0) || (offset + ((int)sizeof(int64_t)) > tag->size)) {
             pdebug(DEBUG_WARN,"Data offset out of bounds.");
             rc = PLCTAG_ERR_OUT_OF_BOUNDS;
             break;
         }
 
-        /* write the data. */
+        if(!tag_data_for_update(tag)) {
+            rc = PLCTAG_ERR_NO_RESOURCES;
+            break;
+        }
+
         tag->data[offset]   = (uint8_t)(val & 0xFF);
         tag->data[offset+1] = (uint8_t)((val >> 8) & 0xFF);
         tag->data[offset+2] = (uint8_t)((val >> 16) & 0xFF);
@@ -981,6 +2256,8 @@ LIB_EXPORT int plc_tag_set_uint64(int32_t id, int offset, uint64_t val)
         tag->data[offset+5] = (uint8_t)((val >> 40) & 0xFF);
         tag->data[offset+6] = (uint8_t)((val >> 48) & 0xFF);
         tag->data[offset+7] = (uint8_t)((val >> 56) & 0xFF);
+
+        tag_data_update_done(tag);
     }
 
     rc_dec(tag);
@@ -991,9 +2268,15 @@ LIB_EXPORT int plc_tag_set_uint64(int32_t id, int offset, uint64_t val)
 
 
 
-LIB_EXPORT int64_t  plc_tag_get_int64(int32_t id, int offset)
+
+
+
+
+
+LIB_EXPORT uint32_t plc_tag_get_uint32(int32_t id, int offset)
 {
-    int64_t res = INT64_MIN;
+    uint32_t res = UINT32_MAX;
+    uint8_t data[sizeof(uint32_t)];
     plc_tag_p tag = lookup_tag(id);
 
     pdebug(DEBUG_SPEW, "Starting.");
@@ -1003,27 +2286,87 @@ LIB_EXPORT int64_t  plc_tag_get_int64(int32_t id, int offset)
         return res;
     }
 
-    critical_block(tag->api_mutex) {
+    if(read_tag_data(tag, offset, data, 1, (int)sizeof(uint32_t)) == PLCTAG_STATUS_OK) {
+        res = ((uint32_t)(data[0])) +
+              ((uint32_t)(data[1]) << 8) +
+              ((uint32_t)(data[2]) << 16) +
+              ((uint32_t)(data[3]) << 24);
+    }
+
+    rc_dec(tag);
+
+    return res;
+}
+
+
+
+LIB_EXPORT int plc_tag_set_uint32(int32_t id, int offset, uint32_t val)
+{
+    int rc = PLCTAG_STATUS_OK;
+    plc_tag_p tag = lookup_tag(id);
+
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    if(!tag) {
+        pdebug(DEBUG_WARN,"Tag not found.");
+        return PLCTAG_ERR_NOT_FOUND;
+    }
+
+    tag_api_block(tag) {
         /* is there data? */
         if(!tag->data) {
             pdebug(DEBUG_WARN,"Tag has no data!");
+            rc = PLCTAG_ERR_NO_DATA;
             break;
         }
 
         /* is there enough data */
-        if((offset < 0) || (offset + ((int)sizeof(int64_t)) > tag->size)) {
+        if((offset < 0) || (offset + ((int)sizeof(uint32_t)) > tag->size)) {
             pdebug(DEBUG_WARN,"Data offset out of bounds.");
+            rc = PLCTAG_ERR_OUT_OF_BOUNDS;
+            break;
+        }
+
+        if(!tag_data_for_update(tag)) {
+            rc = PLCTAG_ERR_NO_RESOURCES;
             break;
         }
 
-        res = (int64_t)(((uint64_t)(tag->data[offset])) +
-                        ((uint64_t)(tag->data[offset+1]) << 8) +
-                        ((uint64_t)(tag->data[offset+2]) << 16) +
-                        ((uint64_t)(tag->data[offset+3]) << 24) +
-                        ((uint64_t)(tag->data[offset+4]) << 32) +
-                        ((uint64_t)(tag->data[offset+5]) << 40) +
-                        ((uint64_t)(tag->data[offset+6]) << 48) +
-                        ((uint64_t)(tag->data[offset+7]) << 56));
+        /* write the data. */
+        tag->data[offset]   = (uint8_t)(val & 0xFF);
+        tag->data[offset+1] = (uint8_t)((val >> 8) & 0xFF);
+        tag->data[offset+2] = (uint8_t)((val >> 16) & 0xFF);
+        tag->data[offset+3] = (uint8_t)((val >> 24) & 0xFF);
+
+        tag_data_update_done(tag);
+    }
+
+    rc_dec(tag);
+
+    return rc;
+}
+
+
+
+
+LIB_EXPORT int32_t  plc_tag_get_int32(int32_t id, int offset)
+{
+    int32_t res = INT32_MIN;
+    uint8_t data[sizeof(int32_t)];
+    plc_tag_p tag = lookup_tag(id);
+
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    if(!tag) {
+        pdebug(DEBUG_WARN,"Tag not found.");
+        return res;
+    }
+
+    if(read_tag_data(tag, offset, data, 1, (int)sizeof(int32_t)) == PLCTAG_STATUS_OK) {
+        res = (int32_t)(((uint32_t)(data[0])) +
+                        ((uint32_t)(data[1]) << 8) +
+                        ((uint32_t)(data[2]) << 16) +
+                        ((uint32_t)(data[3]) << 24));
     }
 
     rc_dec(tag);
@@ -1033,9 +2376,9 @@ LIB_EXPORT int64_t  plc_tag_get_int64(int32_t id, int offset)
 
 
 
-LIB_EXPORT int plc_tag_set_int64(int32_t id, int offset, int64_t ival)
+LIB_EXPORT int plc_tag_set_int32(int32_t id, int offset, int32_t ival)
 {
-    uint64_t val = (uint64_t)(ival);
+    uint32_t val = (uint32_t)(ival);
     int rc = PLCTAG_STATUS_OK;
     plc_tag_p tag = lookup_tag(id);
 
@@ -1046,7 +2389,7 @@ LIB_EXPORT int plc_tag_set_int64(int32_t id, int offset, int64_t ival)
         return PLCTAG_ERR_NOT_FOUND;
     }
 
-    critical_block(tag->api_mutex) {
+    tag_api_block(tag) {
         /* is there data? */
         if(!tag->data) {
             pdebug(DEBUG_WARN,"Tag has no data!");
@@ -1055,20 +2398,23 @@ LIB_EXPORT int plc_tag_set_int64(int32_t id, int offset, int64_t ival)
         }
 
         /* is there enough data */
-        if((offset < 0) || (offset + ((int)sizeof(int64_t)) > tag->size)) {
+        if((offset < 0) || (offset + ((int)sizeof(int32_t)) > tag->size)) {
             pdebug(DEBUG_WARN,"Data offset out of bounds.");
             rc = PLCTAG_ERR_OUT_OF_BOUNDS;
             break;
         }
 
+        if(!tag_data_for_update(tag)) {
+            rc = PLCTAG_ERR_NO_RESOURCES;
+            break;
+        }
+
         tag->data[offset]   = (uint8_t)(val & 0xFF);
         tag->data[offset+1] = (uint8_t)((val >> 8) & 0xFF);
         tag->data[offset+2] = (uint8_t)((val >> 16) & 0xFF);
         tag->data[offset+3] = (uint8_t)((val >> 24) & 0xFF);
-        tag->data[offset+4] = (uint8_t)((val >> 32) & 0xFF);
-        tag->data[offset+5] = (uint8_t)((val >> 40) & 0xFF);
-        tag->data[offset+6] = (uint8_t)((val >> 48) & 0xFF);
-        tag->data[offset+7] = (uint8_t)((val >> 56) & 0xFF);
+
+        tag_data_update_done(tag);
     }
 
     rc_dec(tag);
@@ -1084,9 +2430,10 @@ LIB_EXPORT int plc_tag_set_int64(int32_t id, int offset, int64_t ival)
 
 
 
-LIB_EXPORT uint32_t plc_tag_get_uint32(int32_t id, int offset)
+LIB_EXPORT uint16_t plc_tag_get_uint16(int32_t id, int offset)
 {
-    uint32_t res = UINT32_MAX;
+    uint16_t res = UINT16_MAX;
+    uint8_t data[sizeof(uint16_t)];
     plc_tag_p tag = lookup_tag(id);
 
     pdebug(DEBUG_SPEW, "Starting.");
@@ -1096,23 +2443,86 @@ LIB_EXPORT uint32_t plc_tag_get_uint32(int32_t id, int offset)
         return res;
     }
 
-    critical_block(tag->api_mutex) {
+    if(read_tag_data(tag, offset, data, 1, (int)sizeof(uint16_t)) == PLCTAG_STATUS_OK) {
+        res = (uint16_t)((data[0]) +
+                         ((data[1]) << 8));
+    }
+
+    rc_dec(tag);
+
+    return res;
+}
+
+
+
+
+LIB_EXPORT int plc_tag_set_uint16(int32_t id, int offset, uint16_t val)
+{
+    int rc = PLCTAG_STATUS_OK;
+    plc_tag_p tag = lookup_tag(id);
+
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    if(!tag) {
+        pdebug(DEBUG_WARN,"Tag not found.");
+        return PLCTAG_ERR_NOT_FOUND;
+    }
+
+    tag_api_block(tag) {
         /* is there data? */
         if(!tag->data) {
             pdebug(DEBUG_WARN,"Tag has no data!");
+            rc = PLCTAG_ERR_NO_DATA;
             break;
         }
 
         /* is there enough data */
-        if((offset < 0) || (offset + ((int)sizeof(uint32_t)) > tag->size)) {
+        if((offset < 0) || (offset + ((int)sizeof(uint16_t)) > tag->size)) {
             pdebug(DEBUG_WARN,"Data offset out of bounds.");
+            rc = PLCTAG_ERR_OUT_OF_BOUNDS;
+            break;
+        }
+
+        if(!tag_data_for_update(tag)) {
+            rc = PLCTAG_ERR_NO_RESOURCES;
             break;
         }
 
-        res = ((uint32_t)(tag->data[offset])) +
-              ((uint32_t)(tag->data[offset+1]) << 8) +
-              ((uint32_t)(tag->data[offset+2]) << 16) +
-              ((uint32_t)(tag->data[offset+3]) << 24);
+        tag->data[offset]   = (uint8_t)(val & 0xFF);
+        tag->data[offset+1] = (uint8_t)((val >> 8) & 0xFF);
+
+        tag_data_update_done(tag);
+    }
+
+    rc_dec(tag);
+
+    return rc;
+}
+
+
+
+
+
+
+
+
+
+LIB_EXPORT int16_t  plc_tag_get_int16(int32_t id, int offset)
+{
+    int16_t res = INT16_MIN;
+    uint8_t data[sizeof(int16_t)];
+    plc_tag_p tag = lookup_tag(id);
+
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    if(!tag) {
+        pdebug(DEBUG_WARN,"Tag not found.");
+        return res;
+    }
+
+    if(read_tag_data(tag, offset, data, 1, (int)sizeof(int16_t)) == PLCTAG_STATUS_OK) {
+        res = (int16_t)(((data[0])) +
+                        ((data[1]) << 8));
     }
 
     rc_dec(tag);
@@ -1122,8 +2532,10 @@ LIB_EXPORT uint32_t plc_tag_get_uint32(int32_t id, int offset)
 
 
 
-LIB_EXPORT int plc_tag_set_uint32(int32_t id, int offset, uint32_t val)
+
+LIB_EXPORT int plc_tag_set_int16(int32_t id, int offset, int16_t ival)
 {
+    uint16_t val = (uint16_t)(ival);
     int rc = PLCTAG_STATUS_OK;
     plc_tag_p tag = lookup_tag(id);
 
@@ -1134,7 +2546,7 @@ LIB_EXPORT int plc_tag_set_uint32(int32_t id, int offset, uint32_t val)
         return PLCTAG_ERR_NOT_FOUND;
     }
 
-    critical_block(tag->api_mutex) {
+    tag_api_block(tag) {
         /* is there data? */
         if(!tag->data) {
             pdebug(DEBUG_WARN,"Tag has no data!");
@@ -1143,17 +2555,21 @@ LIB_EXPORT int plc_tag_set_uint32(int32_t id, int offset, uint32_t val)
         }
 
         /* is there enough data */
-        if((offset < 0) || (offset + ((int)sizeof(uint32_t)) > tag->size)) {
+        if((offset < 0) || (offset + ((int)sizeof(int16_t)) > tag->size)) {
             pdebug(DEBUG_WARN,"Data offset out of bounds.");
             rc = PLCTAG_ERR_OUT_OF_BOUNDS;
             break;
         }
 
-        /* write the data. */
+        if(!tag_data_for_update(tag)) {
+            rc = PLCTAG_ERR_NO_RESOURCES;
+            break;
+        }
+
         tag->data[offset]   = (uint8_t)(val & 0xFF);
         tag->data[offset+1] = (uint8_t)((val >> 8) & 0xFF);
-        tag->data[offset+2] = (uint8_t)((val >> 16) & 0xFF);
-        tag->data[offset+3] = (uint8_t)((val >> 24) & 0xFF);
+
+        tag_data_update_done(tag);
     }
 
     rc_dec(tag);
@@ -1164,9 +2580,14 @@ LIB_EXPORT int plc_tag_set_uint32(int32_t id, int offset, uint32_t val)
 
 
 
-LIB_EXPORT int32_t  plc_tag_get_int32(int32_t id, int offset)
+
+
+
+
+LIB_EXPORT uint8_t plc_tag_get_uint8(int32_t id, int offset)
 {
-    int32_t res = INT32_MIN;
+    uint8_t res = UINT8_MAX;
+    uint8_t data[sizeof(uint8_t)];
     plc_tag_p tag = lookup_tag(id);
 
     pdebug(DEBUG_SPEW, "Starting.");
@@ -1176,23 +2597,8 @@ LIB_EXPORT int32_t  plc_tag_get_int32(int32_t id, int offset)
         return res;
     }
 
-    critical_block(tag->api_mutex) {
-        /* is there data? */
-        if(!tag->data) {
-            pdebug(DEBUG_WARN,"Tag has no data!");
-            break;
-        }
-
-        /* is there enough data */
-        if((offset < 0) || (offset + ((int)sizeof(int32_t)) > tag->size)) {
-            pdebug(DEBUG_WARN,"Data offset out of bounds.");
-            break;
-        }
-
-        res = (int32_t)(((uint32_t)(tag->data[offset])) +
-                        ((uint32_t)(tag->data[offset+1]) << 8) +
-                        ((uint32_t)(tag->data[offset+2]) << 16) +
-                        ((uint32_t)(tag->data[offset+3]) << 24));
+    if(read_tag_data(tag, offset, data, 1, (int)sizeof(uint8_t)) == PLCTAG_STATUS_OK) {
+        res = data[0];
     }
 
     rc_dec(tag);
@@ -1202,9 +2608,9 @@ LIB_EXPORT int32_t  plc_tag_get_int32(int32_t id, int offset)
 
 
 
-LIB_EXPORT int plc_tag_set_int32(int32_t id, int offset, int32_t ival)
+
+LIB_EXPORT int plc_tag_set_uint8(int32_t id, int offset, uint8_t val)
 {
-    uint32_t val = (uint32_t)(ival);
     int rc = PLCTAG_STATUS_OK;
     plc_tag_p tag = lookup_tag(id);
 
@@ -1215,7 +2621,7 @@ LIB_EXPORT int plc_tag_set_int32(int32_t id, int offset, int32_t ival)
         return PLCTAG_ERR_NOT_FOUND;
     }
 
-    critical_block(tag->api_mutex) {
+    tag_api_block(tag) {
         /* is there data? */
         if(!tag->data) {
             pdebug(DEBUG_WARN,"Tag has no data!");
@@ -1224,16 +2630,20 @@ LIB_EXPORT int plc_tag_set_int32(int32_t id, int offset, int32_t ival)
         }
 
         /* is there enough data */
-        if((offset < 0) || (offset + ((int)sizeof(int32_t)) > tag->size)) {
+        if((offset < 0) || (offset + ((int)sizeof(uint8_t)) > tag->size)) {
             pdebug(DEBUG_WARN,"Data offset out of bounds.");
             rc = PLCTAG_ERR_OUT_OF_BOUNDS;
             break;
         }
 
-        tag->data[offset]   = (uint8_t)(val & 0xFF);
-        tag->data[offset+1] = (uint8_t)((val >> 8) & 0xFF);
-        tag->data[offset+2] = (uint8_t)((val >> 16) & 0xFF);
-        tag->data[offset+3] = (uint8_t)((val >> 24) & 0xFF);
+        if(!tag_data_for_update(tag)) {
+            rc = PLCTAG_ERR_NO_RESOURCES;
+            break;
+        }
+
+        tag->data[offset] = val;
+
+        tag_data_update_done(tag);
     }
 
     rc_dec(tag);
@@ -1245,13 +2655,10 @@ LIB_EXPORT int plc_tag_set_int32(int32_t id, int offset, int32_t ival)
 
 
 
-
-
-
-
-LIB_EXPORT uint16_t plc_tag_get_uint16(int32_t id, int offset)
+LIB_EXPORT int8_t plc_tag_get_int8(int32_t id, int offset)
 {
-    uint16_t res = UINT16_MAX;
+    int8_t res = INT8_MIN;
+    uint8_t data[sizeof(int8_t)];
     plc_tag_p tag = lookup_tag(id);
 
     pdebug(DEBUG_SPEW, "Starting.");
@@ -1261,21 +2668,8 @@ LIB_EXPORT uint16_t plc_tag_get_uint16(int32_t id, int offset)
         return res;
     }
 
-    critical_block(tag->api_mutex) {
-        /* is there data? */
-        if(!tag->data) {
-            pdebug(DEBUG_WARN,"Tag has no data!");
-            break;
-        }
-
-        /* is there enough data */
-        if((offset < 0) || (offset + ((int)sizeof(uint16_t)) > tag->size)) {
-            pdebug(DEBUG_WARN,"Data offset out of bounds.");
-            break;
-        }
-
-        res = (uint16_t)((tag->data[offset]) +
-                         ((tag->data[offset+1]) << 8));
+    if(read_tag_data(tag, offset, data, 1, (int)sizeof(int8_t)) == PLCTAG_STATUS_OK) {
+        res = (int8_t)(data[0]);
     }
 
     rc_dec(tag);
@@ -1286,8 +2680,9 @@ LIB_EXPORT uint16_t plc_tag_get_uint16(int32_t id, int offset)
 
 
 
-LIB_EXPORT int plc_tag_set_uint16(int32_t id, int offset, uint16_t val)
+LIB_EXPORT int plc_tag_set_int8(int32_t id, int offset, int8_t ival)
 {
+    uint8_t val = (uint8_t)(ival);
     int rc = PLCTAG_STATUS_OK;
     plc_tag_p tag = lookup_tag(id);
 
@@ -1298,7 +2693,7 @@ LIB_EXPORT int plc_tag_set_uint16(int32_t id, int offset, uint16_t val)
         return PLCTAG_ERR_NOT_FOUND;
     }
 
-    critical_block(tag->api_mutex) {
+    tag_api_block(tag) {
         /* is there data? */
         if(!tag->data) {
             pdebug(DEBUG_WARN,"Tag has no data!");
@@ -1307,14 +2702,20 @@ LIB_EXPORT int plc_tag_set_uint16(int32_t id, int offset, uint16_t val)
         }
 
         /* is there enough data */
-        if((offset < 0) || (offset + ((int)sizeof(uint16_t)) > tag->size)) {
+        if((offset < 0) || (offset + ((int)sizeof(int8_t)) > tag->size)) {
             pdebug(DEBUG_WARN,"Data offset out of bounds.");
             rc = PLCTAG_ERR_OUT_OF_BOUNDS;
             break;
         }
 
-        tag->data[offset]   = (uint8_t)(val & 0xFF);
-        tag->data[offset+1] = (uint8_t)((val >> 8) & 0xFF);
+        if(!tag_data_for_update(tag)) {
+            rc = PLCTAG_ERR_NO_RESOURCES;
+            break;
+        }
+
+        tag->data[offset] = (uint8_t)val;
+
+        tag_data_update_done(tag);
     }
 
     rc_dec(tag);
@@ -1327,12 +2728,11 @@ LIB_EXPORT int plc_tag_set_uint16(int32_t id, int offset, uint16_t val)
 
 
 
-
-
-
-LIB_EXPORT int16_t  plc_tag_get_int16(int32_t id, int offset)
+LIB_EXPORT double plc_tag_get_float64(int32_t id, int offset)
 {
-    int16_t res = INT16_MIN;
+    uint64_t ures = 0;
+    double res = DBL_MAX;
+    uint8_t data[sizeof(ures)];
     plc_tag_p tag = lookup_tag(id);
 
     pdebug(DEBUG_SPEW, "Starting.");
@@ -1342,35 +2742,32 @@ LIB_EXPORT int16_t  plc_tag_get_int16(int32_t id, int offset)
         return res;
     }
 
-    critical_block(tag->api_mutex) {
-        /* is there data? */
-        if(!tag->data) {
-            pdebug(DEBUG_WARN,"Tag has no data!");
-            break;
-        }
-
-        /* is there enough data */
-        if((offset < 0) || (offset + ((int)sizeof(int16_t)) > tag->size)) {
-            pdebug(DEBUG_WARN,"Data offset out of bounds.");
-            break;
-        }
-
-        res = (int16_t)(((tag->data[offset])) +
-                        ((tag->data[offset+1]) << 8));
+    if(read_tag_data(tag, offset, data, 1, (int)sizeof(ures)) == PLCTAG_STATUS_OK) {
+        ures = ((uint64_t)(data[0])) +
+               ((uint64_t)(data[1]) << 8) +
+               ((uint64_t)(data[2]) << 16) +
+               ((uint64_t)(data[3]) << 24) +
+               ((uint64_t)(data[4]) << 32) +
+               ((uint64_t)(data[5]) << 40) +
+               ((uint64_t)(data[6]) << 48) +
+               ((uint64_t)(data[7]) << 56);
     }
 
     rc_dec(tag);
 
+    /* copy the data */
+    mem_copy(&res,&ures,sizeof(res));
+
     return res;
 }
 
 
 
 
-LIB_EXPORT int plc_tag_set_int16(int32_t id, int offset, int16_t ival)
+LIB_EXPORT int plc_tag_set_float64(int32_t id, int offset, double fval)
 {
-    uint16_t val = (uint16_t)(ival);
     int rc = PLCTAG_STATUS_OK;
+    uint64_t val = 0;
     plc_tag_p tag = lookup_tag(id);
 
     pdebug(DEBUG_SPEW, "Starting.");
@@ -1380,7 +2777,9 @@ LIB_EXPORT int plc_tag_set_int16(int32_t id, int offset, int16_t ival)
         return PLCTAG_ERR_NOT_FOUND;
     }
 
-    critical_block(tag->api_mutex) {
+    mem_copy(&val, &fval, sizeof(val));
+
+    tag_api_block(tag) {
         /* is there data? */
         if(!tag->data) {
             pdebug(DEBUG_WARN,"Tag has no data!");
@@ -1389,14 +2788,27 @@ LIB_EXPORT int plc_tag_set_int16(int32_t id, int offset, int16_t ival)
         }
 
         /* is there enough data */
-        if((offset < 0) || (offset + ((int)sizeof(int16_t)) > tag->size)) {
+        if((offset < 0) || (offset + ((int)sizeof(val)) > tag->size)) {
             pdebug(DEBUG_WARN,"Data offset out of bounds.");
             rc = PLCTAG_ERR_OUT_OF_BOUNDS;
             break;
         }
 
+        if(!tag_data_for_update(tag)) {
+            rc = PLCTAG_ERR_NO_RESOURCES;
+            break;
+        }
+
         tag->data[offset]   = (uint8_t)(val & 0xFF);
         tag->data[offset+1] = (uint8_t)((val >> 8) & 0xFF);
+        tag->data[offset+2] = (uint8_t)((val >> 16) & 0xFF);
+        tag->data[offset+3] = (uint8_t)((val >> 24) & 0xFF);
+        tag->data[offset+4] = (uint8_t)((val >> 32) & 0xFF);
+        tag->data[offset+5] = (uint8_t)((val >> 40) & 0xFF);
+        tag->data[offset+6] = (uint8_t)((val >> 48) & 0xFF);
+        tag->data[offset+7] = (uint8_t)((val >> 56) & 0xFF);
+
+        tag_data_update_done(tag);
     }
 
     rc_dec(tag);
@@ -1406,14 +2818,11 @@ LIB_EXPORT int plc_tag_set_int16(int32_t id, int offset, int16_t ival)
 
 
 
-
-
-
-
-
-LIB_EXPORT uint8_t plc_tag_get_uint8(int32_t id, int offset)
+LIB_EXPORT float plc_tag_get_float32(int32_t id, int offset)
 {
-    uint8_t res = UINT8_MAX;
+    uint32_t ures;
+    float res = FLT_MAX;
+    uint8_t data[sizeof(ures)];
     plc_tag_p tag = lookup_tag(id);
 
     pdebug(DEBUG_SPEW, "Starting.");
@@ -1423,33 +2832,28 @@ LIB_EXPORT uint8_t plc_tag_get_uint8(int32_t id, int offset)
         return res;
     }
 
-    critical_block(tag->api_mutex) {
-        /* is there data? */
-        if(!tag->data) {
-            pdebug(DEBUG_WARN,"Tag has no data!");
-            break;
-        }
-
-        /* is there enough data */
-        if((offset < 0) || (offset + ((int)sizeof(uint8_t)) > tag->size)) {
-            pdebug(DEBUG_WARN,"Data offset out of bounds.");
-            break;
-        }
-
-        res = tag->data[offset];
+    if(read_tag_data(tag, offset, data, 1, (int)sizeof(ures)) == PLCTAG_STATUS_OK) {
+        ures = ((uint32_t)(data[0])) +
+               ((uint32_t)(data[1]) << 8) +
+               ((uint32_t)(data[2]) << 16) +
+               ((uint32_t)(data[3]) << 24);
     }
 
     rc_dec(tag);
 
+    /* copy the data */
+    mem_copy(&res,&ures,sizeof(res));
+
     return res;
 }
 
 
 
 
-LIB_EXPORT int plc_tag_set_uint8(int32_t id, int offset, uint8_t val)
+LIB_EXPORT int plc_tag_set_float32(int32_t id, int offset, float fval)
 {
     int rc = PLCTAG_STATUS_OK;
+    uint32_t val = 0;
     plc_tag_p tag = lookup_tag(id);
 
     pdebug(DEBUG_SPEW, "Starting.");
@@ -1459,7 +2863,9 @@ LIB_EXPORT int plc_tag_set_uint8(int32_t id, int offset, uint8_t val)
         return PLCTAG_ERR_NOT_FOUND;
     }
 
-    critical_block(tag->api_mutex) {
+    mem_copy(&val, &fval, sizeof(val));
+
+    tag_api_block(tag) {
         /* is there data? */
         if(!tag->data) {
             pdebug(DEBUG_WARN,"Tag has no data!");
@@ -1468,13 +2874,23 @@ LIB_EXPORT int plc_tag_set_uint8(int32_t id, int offset, uint8_t val)
         }
 
         /* is there enough data */
-        if((offset < 0) || (offset + ((int)sizeof(uint8_t)) > tag->size)) {
+        if((offset < 0) || (offset + ((int)sizeof(val)) > tag->size)) {
             pdebug(DEBUG_WARN,"Data offset out of bounds.");
             rc = PLCTAG_ERR_OUT_OF_BOUNDS;
             break;
         }
 
-        tag->data[offset] = val;
+        if(!tag_data_for_update(tag)) {
+            rc = PLCTAG_ERR_NO_RESOURCES;
+            break;
+        }
+
+        tag->data[offset]   = (uint8_t)(val & 0xFF);
+        tag->data[offset+1] = (uint8_t)((val >> 8) & 0xFF);
+        tag->data[offset+2] = (uint8_t)((val >> 16) & 0xFF);
+        tag->data[offset+3] = (uint8_t)((val >> 24) & 0xFF);
+
+        tag_data_update_done(tag);
     }
 
     rc_dec(tag);
@@ -1484,48 +2900,73 @@ LIB_EXPORT int plc_tag_set_uint8(int32_t id, int offset, uint8_t val)
 
 
 
+/*
+ * plc_tag_pin_data
+ *
+ * Return a pointer to the tag's current data buffer without copying it.
+ * The buffer will not change until it is released with plc_tag_release_data().
+ * Reads and sets that happen in the mean time go to another buffer.  The
+ * generation goes up every time the tag data changes.
+ */
 
-
-LIB_EXPORT int8_t plc_tag_get_int8(int32_t id, int offset)
+LIB_EXPORT int plc_tag_pin_data(int32_t id, const uint8_t **data, int *size, uint64_t *generation)
 {
-    int8_t res = INT8_MIN;
-    plc_tag_p tag = lookup_tag(id);
+    int rc = PLCTAG_STATUS_OK;
+    plc_tag_p tag = NULL;
 
     pdebug(DEBUG_SPEW, "Starting.");
 
+    if(!data) {
+        pdebug(DEBUG_WARN,"Null data pointer.");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    *data = NULL;
+
+    tag = lookup_tag(id);
     if(!tag) {
         pdebug(DEBUG_WARN,"Tag not found.");
-        return res;
+        return PLCTAG_ERR_NOT_FOUND;
     }
 
-    critical_block(tag->api_mutex) {
-        /* is there data? */
-        if(!tag->data) {
+    tag_api_block(tag) {
+        if(!tag->num_data_buffers) {
             pdebug(DEBUG_WARN,"Tag has no data!");
+            rc = PLCTAG_ERR_NO_DATA;
             break;
         }
 
-        /* is there enough data */
-        if((offset < 0) || (offset + ((int)sizeof(int8_t)) > tag->size)) {
-            pdebug(DEBUG_WARN,"Data offset out of bounds.");
-            break;
+        tag->data_pins[tag->data_front]++;
+
+        *data = tag->data;
+
+        if(size) {
+            *size = tag->size;
         }
 
-        res = (int8_t)(tag->data[offset]);
+        if(generation) {
+            *generation = tag->data_generation;
+        }
     }
 
     rc_dec(tag);
 
-    return res;
+    pdebug(DEBUG_SPEW, "Done.");
+
+    return rc;
 }
 
 
 
+/*
+ * plc_tag_release_data
+ *
+ * Release a data buffer pinned with plc_tag_pin_data().
+ */
 
-LIB_EXPORT int plc_tag_set_int8(int32_t id, int offset, int8_t ival)
+LIB_EXPORT int plc_tag_release_data(int32_t id, const uint8_t *data)
 {
-    uint8_t val = (uint8_t)(ival);
-    int rc = PLCTAG_STATUS_OK;
+    int rc = PLCTAG_ERR_NOT_FOUND;
     plc_tag_p tag = lookup_tag(id);
 
     pdebug(DEBUG_SPEW, "Starting.");
@@ -1535,210 +2976,176 @@ LIB_EXPORT int plc_tag_set_int8(int32_t id, int offset, int8_t ival)
         return PLCTAG_ERR_NOT_FOUND;
     }
 
-    critical_block(tag->api_mutex) {
-        /* is there data? */
-        if(!tag->data) {
-            pdebug(DEBUG_WARN,"Tag has no data!");
-            rc = PLCTAG_ERR_NO_DATA;
-            break;
-        }
-
-        /* is there enough data */
-        if((offset < 0) || (offset + ((int)sizeof(int8_t)) > tag->size)) {
-            pdebug(DEBUG_WARN,"Data offset out of bounds.");
-            rc = PLCTAG_ERR_OUT_OF_BOUNDS;
-            break;
+    tag_api_block(tag) {
+        for(int i=0; i < tag->num_data_buffers; i++) {
+            if(tag->data_buffers[i] == data && tag->data_pins[i] > 0) {
+                tag->data_pins[i]--;
+                rc = PLCTAG_STATUS_OK;
+                break;
+            }
         }
+    }
 
-        tag->data[offset] = (uint8_t)val;
+    if(rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN,"Data buffer is not pinned.");
     }
 
     rc_dec(tag);
 
+    pdebug(DEBUG_SPEW, "Done.");
+
     return rc;
 }
 
 
 
+/*
+ * Bulk accessors.
+ *
+ * These copy count elements starting at the byte offset with one lookup
+ * and one lock.  The tag data is little endian.  On a little endian host
+ * the copy is a plain memory copy, otherwise each element is byte swapped.
+ */
 
+LIB_EXPORT int plc_tag_get_bytes(int32_t id, int offset, uint8_t *buffer, int size)
+{
+    return get_array(id, offset, buffer, 1, size);
+}
 
 
-LIB_EXPORT double plc_tag_get_float64(int32_t id, int offset)
+LIB_EXPORT int plc_tag_set_bytes(int32_t id, int offset, const uint8_t *buffer, int size)
 {
-    uint64_t ures = 0;
-    double res = DBL_MAX;
-    plc_tag_p tag = lookup_tag(id);
+    return set_array(id, offset, buffer, 1, size);
+}
 
-    pdebug(DEBUG_SPEW, "Starting.");
 
-    if(!tag) {
-        pdebug(DEBUG_WARN,"Tag not found.");
-        return res;
-    }
 
-    critical_block(tag->api_mutex) {
-        /* is there data? */
-        if(!tag->data) {
-            pdebug(DEBUG_WARN,"Tag has no data!");
-            break;
-        }
+LIB_EXPORT int plc_tag_get_uint64_array(int32_t id, int offset, uint64_t *dst, int count)
+{
+    return get_array(id, offset, dst, (int)sizeof(uint64_t), count);
+}
 
-        /* is there enough data */
-        if((offset < 0) || (offset + ((int)sizeof(ures)) > tag->size)) {
-            pdebug(DEBUG_WARN,"Data offset out of bounds.");
-            break;
-        }
 
-        ures = ((uint64_t)(tag->data[offset])) +
-               ((uint64_t)(tag->data[offset+1]) << 8) +
-               ((uint64_t)(tag->data[offset+2]) << 16) +
-               ((uint64_t)(tag->data[offset+3]) << 24) +
-               ((uint64_t)(tag->data[offset+4]) << 32) +
-               ((uint64_t)(tag->data[offset+5]) << 40) +
-               ((uint64_t)(tag->data[offset+6]) << 48) +
-               ((uint64_t)(tag->data[offset+7]) << 56);
-    }
+LIB_EXPORT int plc_tag_set_uint64_array(int32_t id, int offset, const uint64_t *src, int count)
+{
+    return set_array(id, offset, src, (int)sizeof(uint64_t), count);
+}
 
-    rc_dec(tag);
 
-    /* copy the data */
-    mem_copy(&res,&ures,sizeof(res));
 
-    return res;
+LIB_EXPORT int plc_tag_get_int64_array(int32_t id, int offset, int64_t *dst, int count)
+{
+    return get_array(id, offset, dst, (int)sizeof(int64_t), count);
+}
+
+
+LIB_EXPORT int plc_tag_set_int64_array(int32_t id, int offset, const int64_t *src, int count)
+{
+    return set_array(id, offset, src, (int)sizeof(int64_t), count);
+}
+
+
+
+LIB_EXPORT int plc_tag_get_uint32_array(int32_t id, int offset, uint32_t *dst, int count)
+{
+    return get_array(id, offset, dst, (int)sizeof(uint32_t), count);
+}
+
+
+LIB_EXPORT int plc_tag_set_uint32_array(int32_t id, int offset, const uint32_t *src, int count)
+{
+    return set_array(id, offset, src, (int)sizeof(uint32_t), count);
 }
 
 
 
+LIB_EXPORT int plc_tag_get_int32_array(int32_t id, int offset, int32_t *dst, int count)
+{
+    return get_array(id, offset, dst, (int)sizeof(int32_t), count);
+}
 
-LIB_EXPORT int plc_tag_set_float64(int32_t id, int offset, double fval)
+
+LIB_EXPORT int plc_tag_set_int32_array(int32_t id, int offset, const int32_t *src, int count)
 {
-    int rc = PLCTAG_STATUS_OK;
-    uint64_t val = 0;
-    plc_tag_p tag = lookup_tag(id);
+    return set_array(id, offset, src, (int)sizeof(int32_t), count);
+}
 
-    pdebug(DEBUG_SPEW, "Starting.");
 
-    if(!tag) {
-        pdebug(DEBUG_WARN,"Tag not found.");
-        return PLCTAG_ERR_NOT_FOUND;
-    }
 
-    mem_copy(&val, &fval, sizeof(val));
+LIB_EXPORT int plc_tag_get_uint16_array(int32_t id, int offset, uint16_t *dst, int count)
+{
+    return get_array(id, offset, dst, (int)sizeof(uint16_t), count);
+}
 
-    critical_block(tag->api_mutex) {
-        /* is there data? */
-        if(!tag->data) {
-            pdebug(DEBUG_WARN,"Tag has no data!");
-            rc = PLCTAG_ERR_NO_DATA;
-            break;
-        }
 
-        /* is there enough data */
-        if((offset < 0) || (offset + ((int)sizeof(val)) > tag->size)) {
-            pdebug(DEBUG_WARN,"Data offset out of bounds.");
-            rc = PLCTAG_ERR_OUT_OF_BOUNDS;
-            break;
-        }
+LIB_EXPORT int plc_tag_set_uint16_array(int32_t id, int offset, const uint16_t *src, int count)
+{
+    return set_array(id, offset, src, (int)sizeof(uint16_t), count);
+}
 
-        tag->data[offset]   = (uint8_t)(val & 0xFF);
-        tag->data[offset+1] = (uint8_t)((val >> 8) & 0xFF);
-        tag->data[offset+2] = (uint8_t)((val >> 16) & 0xFF);
-        tag->data[offset+3] = (uint8_t)((val >> 24) & 0xFF);
-        tag->data[offset+4] = (uint8_t)((val >> 32) & 0xFF);
-        tag->data[offset+5] = (uint8_t)((val >> 40) & 0xFF);
-        tag->data[offset+6] = (uint8_t)((val >> 48) & 0xFF);
-        tag->data[offset+7] = (uint8_t)((val >> 56) & 0xFF);
-    }
 
-    rc_dec(tag);
 
-    return rc;
+LIB_EXPORT int plc_tag_get_int16_array(int32_t id, int offset, int16_t *dst, int count)
+{
+    return get_array(id, offset, dst, (int)sizeof(int16_t), count);
 }
 
 
-
-LIB_EXPORT float plc_tag_get_float32(int32_t id, int offset)
+LIB_EXPORT int plc_tag_set_int16_array(int32_t id, int offset, const int16_t *src, int count)
 {
-    uint32_t ures;
-    float res = FLT_MAX;
-    plc_tag_p tag = lookup_tag(id);
+    return set_array(id, offset, src, (int)sizeof(int16_t), count);
+}
 
-    pdebug(DEBUG_SPEW, "Starting.");
 
-    if(!tag) {
-        pdebug(DEBUG_WARN,"Tag not found.");
-        return res;
-    }
 
-    critical_block(tag->api_mutex) {
-        /* is there data? */
-        if(!tag->data) {
-            pdebug(DEBUG_WARN,"Tag has no data!");
-            break;
-        }
+LIB_EXPORT int plc_tag_get_uint8_array(int32_t id, int offset, uint8_t *dst, int count)
+{
+    return get_array(id, offset, dst, (int)sizeof(uint8_t), count);
+}
 
-        /* is there enough data */
-        if((offset < 0) || (offset + ((int)sizeof(ures)) > tag->size)) {
-            pdebug(DEBUG_WARN,"Data offset out of bounds.");
-            break;
-        }
 
-        ures = ((uint32_t)(tag->data[offset])) +
-               ((uint32_t)(tag->data[offset+1]) << 8) +
-               ((uint32_t)(tag->data[offset+2]) << 16) +
-               ((uint32_t)(tag->data[offset+3]) << 24);
-    }
+LIB_EXPORT int plc_tag_set_uint8_array(int32_t id, int offset, const uint8_t *src, int count)
+{
+    return set_array(id, offset, src, (int)sizeof(uint8_t), count);
+}
 
-    rc_dec(tag);
 
-    /* copy the data */
-    mem_copy(&res,&ures,sizeof(res));
 
-    return res;
+LIB_EXPORT int plc_tag_get_int8_array(int32_t id, int offset, int8_t *dst, int count)
+{
+    return get_array(id, offset, dst, (int)sizeof(int8_t), count);
 }
 
 
+LIB_EXPORT int plc_tag_set_int8_array(int32_t id, int offset, const int8_t *src, int count)
+{
+    return set_array(id, offset, src, (int)sizeof(int8_t), count);
+}
 
 
-LIB_EXPORT int plc_tag_set_float32(int32_t id, int offset, float fval)
-{
-    int rc = PLCTAG_STATUS_OK;
-    uint32_t val = 0;
-    plc_tag_p tag = lookup_tag(id);
 
-    pdebug(DEBUG_SPEW, "Starting.");
+LIB_EXPORT int plc_tag_get_float64_array(int32_t id, int offset, double *dst, int count)
+{
+    return get_array(id, offset, dst, (int)sizeof(double), count);
+}
 
-    if(!tag) {
-        pdebug(DEBUG_WARN,"Tag not found.");
-        return PLCTAG_ERR_NOT_FOUND;
-    }
 
-    mem_copy(&val, &fval, sizeof(val));
+LIB_EXPORT int plc_tag_set_float64_array(int32_t id, int offset, const double *src, int count)
+{
+    return set_array(id, offset, src, (int)sizeof(double), count);
+}
 
-    critical_block(tag->api_mutex) {
-        /* is there data? */
-        if(!tag->data) {
-            pdebug(DEBUG_WARN,"Tag has no data!");
-            rc = PLCTAG_ERR_NO_DATA;
-            break;
-        }
 
-        /* is there enough data */
-        if((offset < 0) || (offset + ((int)sizeof(val)) > tag->size)) {
-            pdebug(DEBUG_WARN,"Data offset out of bounds.");
-            rc = PLCTAG_ERR_OUT_OF_BOUNDS;
-            break;
-        }
 
-        tag->data[offset]   = (uint8_t)(val & 0xFF);
-        tag->data[offset+1] = (uint8_t)((val >> 8) & 0xFF);
-        tag->data[offset+2] = (uint8_t)((val >> 16) & 0xFF);
-        tag->data[offset+3] = (uint8_t)((val >> 24) & 0xFF);
-    }
+LIB_EXPORT int plc_tag_get_float32_array(int32_t id, int offset, float *dst, int count)
+{
+    return get_array(id, offset, dst, (int)sizeof(float), count);
+}
 
-    rc_dec(tag);
 
-    return rc;
+LIB_EXPORT int plc_tag_set_float32_array(int32_t id, int offset, const float *src, int count)
+{
+    return set_array(id, offset, src, (int)sizeof(float), count);
 }
 
 
@@ -1748,34 +3155,66 @@ LIB_EXPORT int plc_tag_set_float32(int32_t id, int offset, float fval)
  ****************************************************************************************************/
 
 
+/*
+ * lookup_tag
+ *
+ * Find the tag with the ID and take a reference to it.  This only
+ * locks the tag's slot, so lookups of different tags do not contend.
+ * The slot holds a reference to the tag, so the tag cannot go away
+ * while we hold the slot lock.
+ */
+
 plc_tag_p lookup_tag(int32_t tag_id)
 {
     plc_tag_p tag = NULL;
 
-    critical_block(tag_lookup_mutex) {
-        tag = hashtable_get(tags, (int64_t)tag_id);
+    if(tag_id <= 0 || tag_id > TAG_ID_MASK || !tag_slots) {
+        pdebug(DEBUG_WARN, "Tag ID %d is not valid.", tag_id);
+        return NULL;
+    }
 
-        if(tag) {
-            debug_set_tag_id(tag->tag_id);
-        } else {
-            /* FIXME - remove this. */
-            pdebug(DEBUG_WARN, "Tag with ID %d not found.", tag_id);
-        }
+    spin_block(&tag_slots[tag_id & TAG_SLOT_MASK].lock) {
+        plc_tag_p *entry = find_slot_entry_unsafe(tag_id);
 
-        if(tag && tag->tag_id == tag_id) {
-            pdebug(DEBUG_SPEW, "Found tag %p with id %d.", tag, tag->tag_id);
-            tag = rc_inc(tag);
-        } else {
-            debug_set_tag_id(0);
-            tag = NULL;
+        if(*entry) {
+            tag = rc_inc(*entry);
         }
     }
 
+    if(tag) {
+        debug_set_tag_id(tag->tag_id);
+        pdebug(DEBUG_SPEW, "Found tag %p with id %d.", tag, tag->tag_id);
+    } else {
+        debug_set_tag_id(0);
+        pdebug(DEBUG_WARN, "Tag with ID %d not found.", tag_id);
+    }
+
     return tag;
 }
 
 
 
+/*
+ * find_slot_entry_unsafe
+ *
+ * Find the link in the tag's slot chain that points to the tag with the
+ * ID.  If there is no such tag, the link at the end of the chain is
+ * returned, and it points to NULL.  Must be called with the slot locked.
+ */
+
+plc_tag_p *find_slot_entry_unsafe(int32_t tag_id)
+{
+    plc_tag_p *entry = &(tag_slots[tag_id & TAG_SLOT_MASK].tag);
+
+    while(*entry && (*entry)->tag_id != tag_id) {
+        entry = &((*entry)->slot_next);
+    }
+
+    return entry;
+}
+
+
+
 int tag_id_inc(int id)
 {
     if(id <= 0) {
@@ -1795,48 +3234,44 @@ int tag_id_inc(int id)
 
 
 
+/*
+ * add_tag_lookup
+ *
+ * Find the next tag ID that is not in use and put the tag at the head
+ * of the ID's slot chain.  The slot takes over the caller's reference.
+ */
+
 int add_tag_lookup(plc_tag_p tag)
 {
-    int rc = PLCTAG_ERR_NOT_FOUND;
+    int rc = PLCTAG_ERR_NO_RESOURCES;
     int new_id = 0;
 
     pdebug(DEBUG_DETAIL, "Starting.");
 
     critical_block(tag_lookup_mutex) {
-        int attempts = 0;
-
         /* only get this when we hold the mutex. */
         new_id = next_tag_id;
 
-        do {
+        for(int attempts = 0; attempts < TAG_ID_MASK && rc != PLCTAG_STATUS_OK; attempts++) {
             new_id = tag_id_inc(new_id);
 
-            if(new_id <=0) {
-                pdebug(DEBUG_WARN,"ID %d is illegal!", new_id);
-                attempts = MAX_TAG_MAP_ATTEMPTS;
-                break;
-            }
-
             pdebug(DEBUG_SPEW,"Trying new ID %d.", new_id);
 
-            if(!hashtable_get(tags,(int64_t)new_id)) {
-                pdebug(DEBUG_DETAIL,"Found unused ID %d", new_id);
-                break;
+            spin_block(&tag_slots[new_id & TAG_SLOT_MASK].lock) {
+                if(!*find_slot_entry_unsafe(new_id)) {
+                    tag->tag_id = new_id;
+                    tag->slot_next = tag_slots[new_id & TAG_SLOT_MASK].tag;
+                    tag_slots[new_id & TAG_SLOT_MASK].tag = tag;
+                    rc = PLCTAG_STATUS_OK;
+                }
             }
-
-            attempts++;
-        } while(attempts < MAX_TAG_MAP_ATTEMPTS);
-
-        if(attempts < MAX_TAG_MAP_ATTEMPTS) {
-            rc = hashtable_put(tags, (int64_t)new_id, tag);
-        } else {
-            rc = PLCTAG_ERR_NO_RESOURCES;
         }
 
         next_tag_id = new_id;
     }
 
     if(rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN, "No free tag IDs!");
         new_id = rc;
     }
 
@@ -1844,3 +3279,164 @@ int add_tag_lookup(plc_tag_p tag)
 
     return new_id;
 }
+
+
+
+/*
+ * copy_elements
+ *
+ * Copy count elements of elem_size bytes, converting between little endian
+ * tag data and the host byte order.  The conversion is its own inverse so
+ * the same routine works in both directions.
+ */
+
+void copy_elements(uint8_t *dst, const uint8_t *src, int elem_size, int count)
+{
+    const uint16_t endian_probe = 1;
+
+    if(elem_size == 1 || *((const uint8_t *)&endian_probe) == 1) {
+        mem_copy(dst, (void *)src, elem_size * count);
+        return;
+    }
+
+    for(int i=0; i < count; i++) {
+        for(int j=0; j < elem_size; j++) {
+            dst[j] = src[elem_size - 1 - j];
+        }
+
+        dst += elem_size;
+        src += elem_size;
+    }
+}
+
+
+
+/*
+ * check_array_bounds
+ *
+ * Make sure that count elements of elem_size bytes at offset fit in the
+ * tag's data.  The size of the data never changes so this does not need
+ * the tag API mutex.
+ */
+
+int check_array_bounds(plc_tag_p tag, int offset, int elem_size, int count)
+{
+    if(!tag->data) {
+        pdebug(DEBUG_WARN,"Tag has no data!");
+        return PLCTAG_ERR_NO_DATA;
+    }
+
+    /* careful, count * elem_size can overflow. */
+    if(offset < 0 || count < 0 || offset > tag->size || count > (tag->size - offset) / elem_size) {
+        pdebug(DEBUG_WARN,"Data offset or element count out of bounds.");
+        return PLCTAG_ERR_OUT_OF_BOUNDS;
+    }
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * read_tag_data
+ *
+ * Copy elements out of the front data buffer without taking the tag API
+ * mutex.  The copy is retried if the data changed while it was made, see
+ * tag_data_for_update().  Data buffers are only freed when the tag is,
+ * so the copy never touches freed memory.
+ */
+
+int read_tag_data(plc_tag_p tag, int offset, uint8_t *dst, int elem_size, int count)
+{
+    uint32_t seq = 0;
+    int rc = check_array_bounds(tag, offset, elem_size, count);
+
+    if(rc != PLCTAG_STATUS_OK) {
+        return rc;
+    }
+
+    do {
+        /* odd means a change is being made. */
+        while((seq = tag->data_seq) & 1) { }
+
+        mem_barrier();
+
+        copy_elements(dst, tag->data + offset, elem_size, count);
+
+        mem_barrier();
+    } while(seq != tag->data_seq);
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+int get_array(int32_t id, int offset, void *dst, int elem_size, int count)
+{
+    int rc = PLCTAG_STATUS_OK;
+    plc_tag_p tag = NULL;
+
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    if(!dst) {
+        pdebug(DEBUG_WARN,"Null destination buffer.");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    tag = lookup_tag(id);
+    if(!tag) {
+        pdebug(DEBUG_WARN,"Tag not found.");
+        return PLCTAG_ERR_NOT_FOUND;
+    }
+
+    rc = read_tag_data(tag, offset, (uint8_t *)dst, elem_size, count);
+
+    rc_dec(tag);
+
+    pdebug(DEBUG_SPEW, "Done.");
+
+    return rc;
+}
+
+
+
+int set_array(int32_t id, int offset, const void *src, int elem_size, int count)
+{
+    int rc = PLCTAG_STATUS_OK;
+    plc_tag_p tag = NULL;
+
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    if(!src) {
+        pdebug(DEBUG_WARN,"Null source buffer.");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    tag = lookup_tag(id);
+    if(!tag) {
+        pdebug(DEBUG_WARN,"Tag not found.");
+        return PLCTAG_ERR_NOT_FOUND;
+    }
+
+    tag_api_block(tag) {
+        rc = check_array_bounds(tag, offset, elem_size, count);
+        if(rc != PLCTAG_STATUS_OK) {
+            break;
+        }
+
+        if(!tag_data_for_update(tag)) {
+            rc = PLCTAG_ERR_NO_RESOURCES;
+            break;
+        }
+
+        copy_elements(tag->data + offset, (const uint8_t *)src, elem_size, count);
+
+        tag_data_update_done(tag);
+    }
+
+    rc_dec(tag);
+
+    pdebug(DEBUG_SPEW, "Done.");
+
+    return rc;
+}
@@ -109,6 +109,14 @@ extern "C" {
     #define PLCTAG_ERR_WINSOCK          (-36)
     #define PLCTAG_ERR_WRITE            (-37)
     #define PLCTAG_ERR_PARTIAL          (-38)
+    #define PLCTAG_ERR_PLC_OFFLINE      (-39)
+
+
+    /* events passed to tag callbacks. */
+    #define PLCTAG_EVENT_READ_COMPLETED     (1)
+    #define PLCTAG_EVENT_WRITE_COMPLETED    (2)
+    #define PLCTAG_EVENT_ABORTED            (3)
+    #define PLCTAG_EVENT_ERROR              (4)
 
 
 
@@ -233,6 +241,50 @@ extern "C" {
 
 
 
+    /*
+     * plc_tag_read_many
+     *
+     * Start reads on count tags at once.  The requests are queued together
+     * so that they are packed into as few packets as the PLC connection
+     * allows.  If the timeout is non-zero, wait until all the reads are done
+     * or the timeout occurs.  Reads not done by the timeout are aborted.
+     *
+     * Returns the first error of any of the reads, PLCTAG_STATUS_PENDING if the
+     * timeout is zero and reads are still running, or PLCTAG_STATUS_OK.  Check
+     * each tag with plc_tag_status() for its own result.
+     */
+    LIB_EXPORT int plc_tag_read_many(int32_t *tags, int count, int timeout);
+
+
+
+
+    /*
+     * plc_tag_subscribe
+     *
+     * Have the library read the tag every period_ms milliseconds in the
+     * background.  Reads of subscribed tags that come due at the same time
+     * are queued together so that they are packed.  If a read of the tag is
+     * still running when the next one is due, that read is skipped.  Use a
+     * callback or plc_tag_status() to find out when new data is there.
+     *
+     * Subscribing a tag again changes the period.
+     */
+    LIB_EXPORT int plc_tag_subscribe(int32_t tag, int period_ms);
+
+
+
+
+    /*
+     * plc_tag_unsubscribe
+     *
+     * Stop the periodic reads of the tag.  Returns PLCTAG_ERR_NOT_FOUND if the
+     * tag is not subscribed.
+     */
+    LIB_EXPORT int plc_tag_unsubscribe(int32_t tag);
+
+
+
+
     /*
      * plc_tag_status
      *
@@ -265,12 +317,65 @@ extern "C" {
 
 
 
+    /*
+     * plc_tag_register_callback
+     *
+     * Register a function to be called when a read or write on the tag finishes.
+     * The event is one of the PLCTAG_EVENT_xyz values and the status is the final
+     * status of the operation.  An operation that finished with an error raises
+     * PLCTAG_EVENT_ERROR.  An operation that was aborted, by plc_tag_abort() or by a
+     * timeout in plc_tag_read() or plc_tag_write(), raises PLCTAG_EVENT_ABORTED.
+     *
+     * Callbacks are called from an internal library thread or from the thread that
+     * called the API function that finished the operation.  The tag is not locked
+     * while the callback runs, so it can call other API functions on the tag.  Keep
+     * callbacks short as they hold up processing of other tags.
+     *
+     * Only one callback can be registered per tag.  Returns PLCTAG_ERR_DUPLICATE if
+     * there already is one.
+     */
+
+    typedef void (*tag_callback_func)(int32_t tag_id, int event, int status, void *userdata);
+
+    LIB_EXPORT int plc_tag_register_callback(int32_t tag, tag_callback_func callback_func, void *userdata);
+
+
+
+
+    /*
+     * plc_tag_unregister_callback
+     *
+     * Remove the callback from the tag.  Returns PLCTAG_ERR_NOT_FOUND if there
+     * is no callback registered.
+     */
+
+    LIB_EXPORT int plc_tag_unregister_callback(int32_t tag);
+
+
+
+
     /*
      * Tag data accessors.
      */
 
     LIB_EXPORT int plc_tag_get_size(int32_t tag);
 
+    /*
+     * Time, in milliseconds since the epoch, at which the read that got the
+     * current data was started.  Tags read together share the same time.
+     * Zero if the tag has not been read.
+     */
+    LIB_EXPORT int64_t plc_tag_get_read_time(int32_t tag);
+
+    /*
+     * Get a read-only pointer to the tag data without copying it.  The data
+     * does not change until the pointer is released, even if the tag is read
+     * or set again.  The generation goes up each time the tag data changes.
+     * The size and generation pointers can be NULL.  Every pin must be released.
+     */
+    LIB_EXPORT int plc_tag_pin_data(int32_t tag, const uint8_t **data, int *size, uint64_t *generation);
+    LIB_EXPORT int plc_tag_release_data(int32_t tag, const uint8_t *data);
+
     LIB_EXPORT uint64_t plc_tag_get_uint64(int32_t tag, int offset);
     LIB_EXPORT int plc_tag_set_uint64(int32_t tag, int offset, uint64_t val);
 
@@ -306,6 +411,47 @@ extern "C" {
     LIB_EXPORT int plc_tag_set_float32(int32_t tag, int offset, float val);
 
 
+    /*
+     * Bulk accessors.  These copy count elements, or size bytes, starting at the
+     * byte offset into or out of the tag data with one call.  They return
+     * PLCTAG_STATUS_OK or an error such as PLCTAG_ERR_OUT_OF_BOUNDS.
+     */
+
+    LIB_EXPORT int plc_tag_get_bytes(int32_t tag, int offset, uint8_t *buffer, int size);
+    LIB_EXPORT int plc_tag_set_bytes(int32_t tag, int offset, const uint8_t *buffer, int size);
+
+    LIB_EXPORT int plc_tag_get_uint64_array(int32_t tag, int offset, uint64_t *dst, int count);
+    LIB_EXPORT int plc_tag_set_uint64_array(int32_t tag, int offset, const uint64_t *src, int count);
+
+    LIB_EXPORT int plc_tag_get_int64_array(int32_t tag, int offset, int64_t *dst, int count);
+    LIB_EXPORT int plc_tag_set_int64_array(int32_t tag, int offset, const int64_t *src, int count);
+
+    LIB_EXPORT int plc_tag_get_uint32_array(int32_t tag, int offset, uint32_t *dst, int count);
+    LIB_EXPORT int plc_tag_set_uint32_array(int32_t tag, int offset, const uint32_t *src, int count);
+
+    LIB_EXPORT int plc_tag_get_int32_array(int32_t tag, int offset, int32_t *dst, int count);
+    LIB_EXPORT int plc_tag_set_int32_array(int32_t tag, int offset, const int32_t *src, int count);
+
+    LIB_EXPORT int plc_tag_get_uint16_array(int32_t tag, int offset, uint16_t *dst, int count);
+    LIB_EXPORT int plc_tag_set_uint16_array(int32_t tag, int offset, const uint16_t *src, int count);
+
+    LIB_EXPORT int plc_tag_get_int16_array(int32_t tag, int offset, int16_t *dst, int count);
+    LIB_EXPORT int plc_tag_set_int16_array(int32_t tag, int offset, const int16_t *src, int count);
+
+    LIB_EXPORT int plc_tag_get_uint8_array(int32_t tag, int offset, uint8_t *dst, int count);
+    LIB_EXPORT int plc_tag_set_uint8_array(int32_t tag, int offset, const uint8_t *src, int count);
+
+    LIB_EXPORT int plc_tag_get_int8_array(int32_t tag, int offset, int8_t *dst, int count);
+    LIB_EXPORT int plc_tag_set_int8_array(int32_t tag, int offset, const int8_t *src, int count);
+
+    LIB_EXPORT int plc_tag_get_float64_array(int32_t tag, int offset, double *dst, int count);
+    LIB_EXPORT int plc_tag_set_float64_array(int32_t tag, int offset, const double *src, int count);
+
+    LIB_EXPORT int plc_tag_get_float32_array(int32_t tag, int offset, float *dst, int count);
+    LIB_EXPORT int plc_tag_set_float32_array(int32_t tag, int offset, const float *src, int count);
+
+
+
 #ifdef __cplusplus
 }
 #endif
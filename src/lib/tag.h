@@ -40,6 +40,9 @@
 #define PLCTAG_DATA_LITTLE_ENDIAN   (0)
 #define PLCTAG_DATA_BIG_ENDIAN      (1)
 
+/* how many copies of the tag data can exist while snapshots are pinned. */
+#define TAG_MAX_DATA_BUFFERS        (4)
+
 //extern mutex_p global_library_mutex;
 
 typedef struct plc_tag_t *plc_tag_p;
@@ -61,6 +64,20 @@ struct tag_vtable_t {
     tag_vtable_func status;
     tag_vtable_func tickler;
     tag_vtable_func write;
+
+    /*
+     * optional, may be NULL.  Requests started between batch_start and
+     * batch_end are held back so that they can be packed together.
+     */
+    tag_vtable_func batch_start;
+    tag_vtable_func batch_end;
+
+    /*
+     * optional, may be NULL.  Called by plc_tag_create() once the tag
+     * has finished its create wait and has its tag ID, just before the
+     * ID is returned.
+     */
+    tag_vtable_func created;
 };
 
 typedef struct tag_vtable_t *tag_vtable_p;
@@ -76,12 +93,30 @@ typedef struct tag_vtable_t *tag_vtable_p;
 #define TAG_BASE_STRUCT tag_vtable_p vtable; \
                         mutex_p ext_mutex; \
                         mutex_p api_mutex; \
+                        cond_p tag_cond; \
+                        tag_callback_func callback; \
+                        void *userdata; \
+                        int read_in_flight; \
+                        int write_in_flight; \
+                        volatile int tickle_pending; \
+                        int subscribe_ms; \
+                        int subscribe_generation; \
                         int status; \
                         int endian; \
                         int tag_id; \
+                        struct plc_tag_t *slot_next; \
                         int64_t read_cache_expire; \
                         int64_t read_cache_ms; \
+                        int64_t read_start_time; \
+                        int64_t read_time; \
                         int size; \
+                        uint8_t *data_buffers[TAG_MAX_DATA_BUFFERS]; \
+                        int data_pins[TAG_MAX_DATA_BUFFERS]; \
+                        int num_data_buffers; \
+                        int data_front; \
+                        int data_back; \
+                        volatile uint32_t data_seq; \
+                        uint64_t data_generation; \
                         uint8_t *data
 
 struct plc_tag_dummy {
@@ -102,6 +137,38 @@ extern int plc_tag_abort_mapped(plc_tag_p tag);
 extern int plc_tag_destroy_mapped(plc_tag_p tag);
 extern int plc_tag_status_mapped(plc_tag_p tag);
 
+/* called by the protocol layers when a request for a tag is done. */
+extern void tag_notify_complete(int32_t tag_id);
+
+/*
+ * Use this instead of critical_block() on a tag's API mutex.  When the
+ * mutex is released, tag_api_unlock() hands the tag back to the tickler
+ * thread if the tickler found it locked while a request completed.
+ */
+#define tag_api_block(tag) \
+for(int __sync_flag_nargle_api_##__LINE__ = 1; __sync_flag_nargle_api_##__LINE__ ; __sync_flag_nargle_api_##__LINE__ = 0, tag_api_unlock((plc_tag_p)(tag)))  for(int __sync_rc_nargle_api_##__LINE__ = mutex_lock((tag)->api_mutex); __sync_rc_nargle_api_##__LINE__ == PLCTAG_STATUS_OK && __sync_flag_nargle_api_##__LINE__ ; __sync_flag_nargle_api_##__LINE__ = 0)
+
+extern void tag_api_unlock(plc_tag_p tag);
+
+/*
+ * called by the protocol layers before changing the tag data in place.
+ * Returns the buffer to change, which is tag->data, or NULL if no free
+ * buffer is left.  Call tag_data_update_done() when the change is made.
+ */
+extern uint8_t *tag_data_for_update(plc_tag_p tag);
+extern void tag_data_update_done(plc_tag_p tag);
+
+/*
+ * called by the protocol layers to get the buffer to copy read data into.
+ * Call tag_data_read_done() with the number of bytes read when the whole
+ * read is in to make the new data visible to getters all at once.
+ */
+extern uint8_t *tag_data_read_buffer(plc_tag_p tag);
+extern void tag_data_read_done(plc_tag_p tag, int size_read);
+
+/* called by the protocol layers when the tag is destroyed, before freeing tag->data. */
+extern void tag_data_buffers_destroy(plc_tag_p tag);
+
 
 
 #endif
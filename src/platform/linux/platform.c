@@ -42,10 +42,16 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <fcntl.h>
 #include <time.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+#include <poll.h>
 
 #include <lib/libplctag.h>
 #include <util/debug.h>
@@ -535,6 +541,195 @@ int mutex_destroy(mutex_p *m)
 
 
 
+/***************************************************************************
+ ****************************** Conditions *********************************
+ **************************************************************************/
+
+struct cond_t {
+    pthread_mutex_t p_mutex;
+    pthread_cond_t p_cond;
+    int flag;
+};
+
+
+int cond_create(cond_p *c)
+{
+    pthread_condattr_t attr;
+
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    if(!c) {
+        pdebug(DEBUG_WARN, "null condition pointer.");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    *c = (struct cond_t *)mem_alloc(sizeof(struct cond_t));
+    if(! *c) {
+        pdebug(DEBUG_ERROR, "Unable to allocate new condition!");
+        return PLCTAG_ERR_NO_MEM;
+    }
+
+    if(pthread_mutex_init(&((*c)->p_mutex), NULL)) {
+        mem_free(*c);
+        *c = NULL;
+        pdebug(DEBUG_ERROR, "Error initializing condition mutex.");
+        return PLCTAG_ERR_MUTEX_INIT;
+    }
+
+    pthread_condattr_init(&attr);
+
+#ifdef __linux__
+    /* do not let wall clock changes mess up the timeouts. */
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+#endif
+
+    if(pthread_cond_init(&((*c)->p_cond), &attr)) {
+        pthread_condattr_destroy(&attr);
+        pthread_mutex_destroy(&((*c)->p_mutex));
+        mem_free(*c);
+        *c = NULL;
+        pdebug(DEBUG_ERROR, "Error initializing condition.");
+        return PLCTAG_ERR_MUTEX_INIT;
+    }
+
+    pthread_condattr_destroy(&attr);
+
+    (*c)->flag = 0;
+
+    pdebug(DEBUG_SPEW, "Done.");
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+/*
+ * cond_wait
+ *
+ * Wait until the condition is signaled or the timeout passes.  Returns
+ * PLCTAG_ERR_TIMEOUT if the condition was not signaled in time.
+ */
+int cond_wait(cond_p c, int timeout_ms)
+{
+    int rc = PLCTAG_STATUS_OK;
+    struct timespec deadline;
+
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    if(!c) {
+        pdebug(DEBUG_WARN, "null condition pointer.");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    if(timeout_ms < 0) {
+        timeout_ms = 0;
+    }
+
+#ifdef __linux__
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+#else
+    clock_gettime(CLOCK_REALTIME, &deadline);
+#endif
+
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+
+    if(deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&(c->p_mutex));
+
+    while(!c->flag) {
+        int wait_rc = pthread_cond_timedwait(&(c->p_cond), &(c->p_mutex), &deadline);
+
+        if(wait_rc == ETIMEDOUT) {
+            break;
+        }
+    }
+
+    if(c->flag) {
+        c->flag = 0;
+        rc = PLCTAG_STATUS_OK;
+    } else {
+        rc = PLCTAG_ERR_TIMEOUT;
+    }
+
+    pthread_mutex_unlock(&(c->p_mutex));
+
+    pdebug(DEBUG_SPEW, "Done.");
+
+    return rc;
+}
+
+
+int cond_signal(cond_p c)
+{
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    if(!c) {
+        pdebug(DEBUG_WARN, "null condition pointer.");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    pthread_mutex_lock(&(c->p_mutex));
+
+    c->flag = 1;
+    pthread_cond_broadcast(&(c->p_cond));
+
+    pthread_mutex_unlock(&(c->p_mutex));
+
+    pdebug(DEBUG_SPEW, "Done.");
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+int cond_clear(cond_p c)
+{
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    if(!c) {
+        pdebug(DEBUG_WARN, "null condition pointer.");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    pthread_mutex_lock(&(c->p_mutex));
+
+    c->flag = 0;
+
+    pthread_mutex_unlock(&(c->p_mutex));
+
+    pdebug(DEBUG_SPEW, "Done.");
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+int cond_destroy(cond_p *c)
+{
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    if(!c || ! *c) {
+        pdebug(DEBUG_WARN, "null condition pointer.");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    pthread_cond_destroy(&((*c)->p_cond));
+    pthread_mutex_destroy(&((*c)->p_mutex));
+
+    mem_free(*c);
+
+    *c = NULL;
+
+    pdebug(DEBUG_SPEW, "Done.");
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+
 /***************************************************************************
  ******************************* Threads ***********************************
  **************************************************************************/
@@ -726,18 +921,37 @@ extern void lock_release(lock_t *lock)
 }
 
 
+extern void mem_barrier(void)
+{
+    __sync_synchronize();
+}
+
+
 /***************************************************************************
  ******************************* Sockets ***********************************
  **************************************************************************/
 
+#define MAX_IPS (8)
+
 struct sock_t {
     int fd;
     int port;
     int is_open;
+
+    /* connection attempts raced while connecting, -1 when not running. */
+    int num_ips;
+    int num_attempts;
+    struct in_addr ips[MAX_IPS];
+    int attempt_fds[MAX_IPS];
+    int64_t next_attempt_time;
+    int64_t connect_deadline;
 };
 
 
-#define MAX_IPS (8)
+static int socket_start_attempt(sock_p s, int index);
+static void socket_stop_attempts(sock_p s, int keep_fd);
+static int socket_get_fds(sock_p s, int *fds);
+
 
 extern int socket_create(sock_p *s)
 {
@@ -755,91 +969,53 @@ extern int socket_create(sock_p *s)
         return PLCTAG_ERR_NO_MEM;
     }
 
+    (*s)->fd = -1;
+
+    for(int i=0; i < MAX_IPS; i++) {
+        (*s)->attempt_fds[i] = -1;
+    }
+
     pdebug(DEBUG_DETAIL, "Done.");
 
     return PLCTAG_STATUS_OK;
 }
 
 
-extern int socket_connect_tcp(sock_p s, const char *host, int port)
+/*
+ * socket_connect_tcp_start
+ *
+ * Resolve the host and start connecting to it without blocking.  When the
+ * host resolves to several IP addresses, a connection attempt is started
+ * on the first one and, every SOCKET_CONNECT_ATTEMPT_DELAY_MS or as soon as
+ * the running attempts have all failed, on the next one.  The first attempt
+ * to connect wins and the others are closed.
+ *
+ * Returns PLCTAG_STATUS_PENDING while the connection is being set up.  Call
+ * socket_connect_tcp_check() when the socket is writable or the attempt
+ * delay passes to move things along.
+ */
+extern int socket_connect_tcp_start(sock_p s, const char *host, int port, int timeout_ms)
 {
-    struct in_addr ips[MAX_IPS];
-    int num_ips = 0;
-    struct sockaddr_in gw_addr;
-    int sock_opt = 1;
-    int i = 0;
-    int done = 0;
-    int fd;
-    int flags;
-    struct timeval timeout; /* used for timing out connections etc. */
-    struct linger so_linger; /* used to set up short/no lingering after connections are close()ed. */
-
     pdebug(DEBUG_DETAIL,"Starting.");
 
-    /* Open a socket for communication with the gateway. */
-    fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-
-    /* check for errors */
-    if(fd < 0) {
-        pdebug(DEBUG_ERROR,"Socket creation failed, errno: %d",errno);
-        return PLCTAG_ERR_OPEN;
-    }
-
-    /* set up our socket to allow reuse if we crash suddenly. */
-    sock_opt = 1;
-
-    if(setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,(char*)&sock_opt,sizeof(sock_opt))) {
-        close(fd);
-        pdebug(DEBUG_ERROR, "Error setting socket reuse option, errno: %d",errno);
-        return PLCTAG_ERR_OPEN;
-    }
-
-#ifdef SO_NOSIGPIPE
-    /* On *BSD and macOS, set the socket option to prevent SIGPIPE. */
-    if(setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, (char*)&sock_opt, sizeof(sock_opt))) {
-        close(fd);
-        pdebug(DEBUG_ERROR, "Error setting socket SIGPIPE suppression option, errno: %d",errno);
-        return PLCTAG_ERR_OPEN;
-    }
-#endif
-
-    timeout.tv_sec = 10;
-    timeout.tv_usec = 0;
-
-    if(setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout))) {
-        close(fd);
-        pdebug(DEBUG_ERROR,"Error setting socket receive timeout option, errno: %d",errno);
-        return PLCTAG_ERR_OPEN;
-    }
-
-    if(setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, (char*)&timeout, sizeof(timeout))) {
-        close(fd);
-        pdebug(DEBUG_ERROR, "Error setting socket set timeout option, errno: %d",errno);
-        return PLCTAG_ERR_OPEN;
-    }
-
-    /* abort the connection immediately upon close. */
-    so_linger.l_onoff = 1;
-    so_linger.l_linger = 0;
-
-    if(setsockopt(fd, SOL_SOCKET, SO_LINGER,(char*)&so_linger,sizeof(so_linger))) {
-        close(fd);
-        pdebug(DEBUG_ERROR,"Error setting socket close linger option, errno: %d",errno);
-        return PLCTAG_ERR_OPEN;
+    if(!s || !host) {
+        pdebug(DEBUG_WARN, "null socket or host pointer.");
+        return PLCTAG_ERR_NULL_PTR;
     }
 
     /* figure out what address we are connecting to. */
 
     /* try a numeric IP address conversion first. */
-    if(inet_pton(AF_INET,host,(struct in_addr *)ips) > 0) {
+    if(inet_pton(AF_INET,host,(struct in_addr *)s->ips) > 0) {
         pdebug(DEBUG_DETAIL, "Found numeric IP address: %s",host);
-        num_ips = 1;
+        s->num_ips = 1;
     } else {
         struct addrinfo hints;
         struct addrinfo *res=NULL;
+        struct addrinfo *entry = NULL;
         int rc = 0;
 
-        mem_set(&ips, 0, sizeof(ips));
+        mem_set(&(s->ips), 0, sizeof(s->ips));
         mem_set(&hints, 0, sizeof(hints));
 
         hints.ai_socktype = SOCK_STREAM; /* TCP */
@@ -855,113 +1031,288 @@ extern int socket_connect_tcp(sock_p s, const char *host, int port)
             return PLCTAG_ERR_BAD_GATEWAY;
         }
 
-        for(num_ips = 0; res && num_ips < MAX_IPS; num_ips++) {
-            ips[num_ips].s_addr = ((struct sockaddr_in *)(res->ai_addr))->sin_addr.s_addr;
-            res = res->ai_next;
+        entry = res;
+
+        for(s->num_ips = 0; entry && s->num_ips < MAX_IPS; s->num_ips++) {
+            s->ips[s->num_ips].s_addr = ((struct sockaddr_in *)(entry->ai_addr))->sin_addr.s_addr;
+            entry = entry->ai_next;
         }
 
         freeaddrinfo(res);
     }
 
+    s->port = port;
+    s->num_attempts = 0;
+    s->next_attempt_time = 0;
+    s->connect_deadline = time_ms() + timeout_ms;
 
-    /* now try to connect to the remote gateway.  We may need to
-     * try several of the IPs we have.
-     */
-
-    i = 0;
-    done = 0;
-
-    memset((void *)&gw_addr,0, sizeof(gw_addr));
-    gw_addr.sin_family = AF_INET ;
-    gw_addr.sin_port = htons((uint16_t)port);
-
-    do {
-        int rc;
-        /* try each IP until we run out or get a connection. */
-        gw_addr.sin_addr.s_addr = ips[i].s_addr;
+    pdebug(DEBUG_DETAIL, "Done.");
 
-        pdebug(DEBUG_DETAIL, "Attempting to connect to %s",inet_ntoa(*((struct in_addr *)&ips[i])));
+    /* this starts the first attempt. */
+    return socket_connect_tcp_check(s);
+}
 
-        rc = connect(fd,(struct sockaddr *)&gw_addr,sizeof(gw_addr));
 
-        if( rc == 0) {
-            pdebug(DEBUG_DETAIL, "Attempt to connect to %s succeeded.",inet_ntoa(*((struct in_addr *)&ips[i])));
-            done = 1;
-        } else {
-            pdebug(DEBUG_DETAIL, "Attempt to connect to %s failed, errno: %d",inet_ntoa(*((struct in_addr *)&ips[i])),errno);
-            i++;
-        }
-    } while(!done && i < num_ips);
+/*
+ * socket_connect_tcp_check
+ *
+ * Check the running connection attempts without blocking.  Returns
+ * PLCTAG_STATUS_OK once one of them is connected, PLCTAG_STATUS_PENDING
+ * while they are still running, PLCTAG_ERR_TIMEOUT when the connect
+ * timeout passes and PLCTAG_ERR_OPEN when every IP address has failed.
+ */
+extern int socket_connect_tcp_check(sock_p s)
+{
+    struct pollfd pfds[MAX_IPS];
+    int live = 0;
+    int64_t now = 0;
 
-    if(!done) {
-        close(fd);
-        pdebug(DEBUG_ERROR, "Unable to connect to any gateway host IP address!");
-        return PLCTAG_ERR_OPEN;
+    if(!s) {
+        return PLCTAG_ERR_NULL_PTR;
     }
 
+    if(s->fd >= 0) {
+        return PLCTAG_STATUS_OK;
+    }
 
-    /* FIXME
-     * connect() is a little easier to handle in blocking mode, for now
-     * we make the socket non-blocking here, after connect(). */
-    flags=fcntl(fd,F_GETFL,0);
+    for(int i=0; i < s->num_attempts; i++) {
+        pfds[i].fd = s->attempt_fds[i];
+        pfds[i].events = POLLOUT;
+        pfds[i].revents = 0;
+    }
 
-    if(flags<0) {
-        pdebug(DEBUG_ERROR, "Error getting socket options, errno: %d", errno);
-        close(fd);
+    if(s->num_attempts > 0 && poll(pfds, (nfds_t)s->num_attempts, 0) < 0 && errno != EINTR) {
+        pdebug(DEBUG_WARN, "Error polling connection attempts, errno: %d", errno);
+        socket_stop_attempts(s, -1);
         return PLCTAG_ERR_OPEN;
     }
 
-    flags |= O_NONBLOCK;
+    /* the earliest IP address that connected wins. */
+    for(int i=0; i < s->num_attempts; i++) {
+        int err = 0;
+        socklen_t err_len = sizeof(err);
 
-    if(fcntl(fd,F_SETFL,flags)<0) {
-        pdebug(DEBUG_ERROR, "Error setting socket to non-blocking, errno: %d", errno);
-        close(fd);
-        return PLCTAG_ERR_OPEN;
-    }
+        if(s->attempt_fds[i] < 0 || !pfds[i].revents) {
+            continue;
+        }
 
-    /* save the values */
-    s->fd = fd;
-    s->port = port;
+        if(getsockopt(s->attempt_fds[i], SOL_SOCKET, SO_ERROR, &err, &err_len)) {
+            err = errno;
+        }
 
-    pdebug(DEBUG_DETAIL, "Done.");
+        if(err == 0 && (pfds[i].revents & POLLOUT)) {
+            pdebug(DEBUG_DETAIL, "Attempt to connect to %s succeeded.",inet_ntoa(s->ips[i]));
 
-    return PLCTAG_STATUS_OK;
-}
+            s->fd = s->attempt_fds[i];
+            socket_stop_attempts(s, s->fd);
 
+            return PLCTAG_STATUS_OK;
+        }
 
+        pdebug(DEBUG_DETAIL, "Attempt to connect to %s failed, errno: %d",inet_ntoa(s->ips[i]), err);
 
+        close(s->attempt_fds[i]);
+        s->attempt_fds[i] = -1;
+    }
 
-extern int socket_read(sock_p s, uint8_t *buf, int size)
-{
-    int rc;
+    now = time_ms();
 
-    if(!s || !buf) {
-        return PLCTAG_ERR_NULL_PTR;
+    if(now >= s->connect_deadline) {
+        pdebug(DEBUG_WARN, "Timed out connecting to the gateway!");
+        socket_stop_attempts(s, -1);
+        return PLCTAG_ERR_TIMEOUT;
     }
 
-    /* The socket is non-blocking. */
-    rc = (int)read(s->fd,buf,(size_t)size);
+    for(int i=0; i < s->num_attempts; i++) {
+        if(s->attempt_fds[i] >= 0) {
+            live++;
+        }
+    }
 
-    if(rc < 0) {
-        if(errno == EAGAIN || errno == EWOULDBLOCK) {
-            return 0;
-        } else {
-            pdebug(DEBUG_WARN,"Socket read error: rc=%d, errno=%d", rc, errno);
-            return PLCTAG_ERR_READ;
+    /* start the next attempt when it is due or when nothing else is running. */
+    while(s->num_attempts < s->num_ips && (!live || now >= s->next_attempt_time)) {
+        if(socket_start_attempt(s, s->num_attempts++) == PLCTAG_STATUS_OK) {
+            live++;
+            s->next_attempt_time = now + SOCKET_CONNECT_ATTEMPT_DELAY_MS;
         }
     }
 
-    return rc;
+    if(!live) {
+        pdebug(DEBUG_ERROR, "Unable to connect to any gateway host IP address!");
+        return PLCTAG_ERR_OPEN;
+    }
+
+    return PLCTAG_STATUS_PENDING;
 }
 
 
-extern int socket_write(sock_p s, uint8_t *buf, int size)
+int socket_start_attempt(sock_p s, int index)
 {
-    int rc;
+    struct sockaddr_in gw_addr;
+    int sock_opt = 1;
+    int fd;
+    int flags;
+    struct linger so_linger; /* used to set up short/no lingering after connections are close()ed. */
 
-    if(!s || !buf) {
-        return PLCTAG_ERR_NULL_PTR;
-    }
+    /* Open a socket for communication with the gateway. */
+    fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+    /* check for errors */
+    if(fd < 0) {
+        pdebug(DEBUG_ERROR,"Socket creation failed, errno: %d",errno);
+        return PLCTAG_ERR_OPEN;
+    }
+
+    /* set up our socket to allow reuse if we crash suddenly. */
+    sock_opt = 1;
+
+    if(setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,(char*)&sock_opt,sizeof(sock_opt))) {
+        close(fd);
+        pdebug(DEBUG_ERROR, "Error setting socket reuse option, errno: %d",errno);
+        return PLCTAG_ERR_OPEN;
+    }
+
+#ifdef SO_NOSIGPIPE
+    /* On *BSD and macOS, set the socket option to prevent SIGPIPE. */
+    if(setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, (char*)&sock_opt, sizeof(sock_opt))) {
+        close(fd);
+        pdebug(DEBUG_ERROR, "Error setting socket SIGPIPE suppression option, errno: %d",errno);
+        return PLCTAG_ERR_OPEN;
+    }
+#endif
+
+    /* abort the connection immediately upon close. */
+    so_linger.l_onoff = 1;
+    so_linger.l_linger = 0;
+
+    if(setsockopt(fd, SOL_SOCKET, SO_LINGER,(char*)&so_linger,sizeof(so_linger))) {
+        close(fd);
+        pdebug(DEBUG_ERROR,"Error setting socket close linger option, errno: %d",errno);
+        return PLCTAG_ERR_OPEN;
+    }
+
+    /* do not hold back small packets when several requests are in flight. */
+    sock_opt = 1;
+
+    if(setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char*)&sock_opt, sizeof(sock_opt))) {
+        close(fd);
+        pdebug(DEBUG_ERROR, "Error setting socket no delay option, errno: %d",errno);
+        return PLCTAG_ERR_OPEN;
+    }
+
+    /* the socket is non-blocking from the start, including connect(). */
+    flags=fcntl(fd,F_GETFL,0);
+
+    if(flags<0) {
+        pdebug(DEBUG_ERROR, "Error getting socket options, errno: %d", errno);
+        close(fd);
+        return PLCTAG_ERR_OPEN;
+    }
+
+    flags |= O_NONBLOCK;
+
+    if(fcntl(fd,F_SETFL,flags)<0) {
+        pdebug(DEBUG_ERROR, "Error setting socket to non-blocking, errno: %d", errno);
+        close(fd);
+        return PLCTAG_ERR_OPEN;
+    }
+
+    memset((void *)&gw_addr,0, sizeof(gw_addr));
+    gw_addr.sin_family = AF_INET ;
+    gw_addr.sin_port = htons((uint16_t)s->port);
+    gw_addr.sin_addr.s_addr = s->ips[index].s_addr;
+
+    pdebug(DEBUG_DETAIL, "Attempting to connect to %s",inet_ntoa(s->ips[index]));
+
+    /* a connect that finishes at once is picked up by the next check. */
+    if(connect(fd,(struct sockaddr *)&gw_addr,sizeof(gw_addr)) && errno != EINPROGRESS) {
+        pdebug(DEBUG_DETAIL, "Attempt to connect to %s failed, errno: %d",inet_ntoa(s->ips[index]),errno);
+        close(fd);
+        return PLCTAG_ERR_OPEN;
+    }
+
+    s->attempt_fds[index] = fd;
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+/* close all the connection attempts except the one passed. */
+void socket_stop_attempts(sock_p s, int keep_fd)
+{
+    for(int i=0; i < s->num_attempts; i++) {
+        if(s->attempt_fds[i] >= 0 && s->attempt_fds[i] != keep_fd) {
+            close(s->attempt_fds[i]);
+        }
+
+        s->attempt_fds[i] = -1;
+    }
+
+    s->num_attempts = 0;
+}
+
+
+/*
+ * the file descriptors the event loop should watch for this socket.  While
+ * connecting that is every running attempt.
+ */
+int socket_get_fds(sock_p s, int *fds)
+{
+    int count = 0;
+
+    if(s->fd >= 0) {
+        fds[count++] = s->fd;
+    } else {
+        for(int i=0; i < s->num_attempts; i++) {
+            if(s->attempt_fds[i] >= 0) {
+                fds[count++] = s->attempt_fds[i];
+            }
+        }
+    }
+
+    return count;
+}
+
+
+
+
+extern int socket_read(sock_p s, uint8_t *buf, int size)
+{
+    int rc;
+
+    if(!s || !buf) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    /* The socket is non-blocking. */
+    rc = (int)read(s->fd,buf,(size_t)size);
+
+    if(rc < 0) {
+        if(errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        } else {
+            pdebug(DEBUG_WARN,"Socket read error: rc=%d, errno=%d", rc, errno);
+            return PLCTAG_ERR_READ;
+        }
+    }
+
+    /* zero bytes from a readable socket means the other end closed it. */
+    if(rc == 0 && size > 0) {
+        pdebug(DEBUG_WARN,"Socket closed by remote end.");
+        return PLCTAG_ERR_READ;
+    }
+
+    return rc;
+}
+
+
+extern int socket_write(sock_p s, uint8_t *buf, int size)
+{
+    int rc;
+
+    if(!s || !buf) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
 
     /* The socket is non-blocking. */
 #ifdef SO_NOSIGPIPE
@@ -990,10 +1341,19 @@ extern int socket_close(sock_p s)
 {
     /*pdebug(1,"Starting.");*/
 
+    int rc = 0;
+
     if(!s)
         return PLCTAG_ERR_NULL_PTR;
 
-    return close(s->fd);
+    socket_stop_attempts(s, -1);
+
+    if(s->fd >= 0) {
+        rc = close(s->fd);
+        s->fd = -1;
+    }
+
+    return rc;
 }
 
 
@@ -1014,6 +1374,553 @@ extern int socket_destroy(sock_p *s)
 
 
 
+/***************************************************************************
+ ****************************** Event Loop *********************************
+ **************************************************************************/
+
+/*
+ * On Linux the event loop is an epoll set plus an eventfd used for wake ups.
+ * Other POSIX systems get a poll() based version with a self-pipe.
+ */
+
+#define EVENT_LOOP_MAX_EVENTS (32)
+
+struct event_loop_t {
+    int wake_fd;
+#ifdef __linux__
+    int epoll_fd;
+#else
+    int wake_write_fd;
+    int num_fds;
+    int fds_capacity;
+    struct pollfd *fds;
+    void **contexts;
+#endif
+};
+
+
+#ifdef __linux__
+
+static uint32_t event_loop_to_epoll(int events)
+{
+    uint32_t result = EPOLLRDHUP;
+
+    if(events & EVENT_LOOP_READ) {
+        result |= EPOLLIN;
+    }
+
+    if(events & EVENT_LOOP_WRITE) {
+        result |= EPOLLOUT;
+    }
+
+    return result;
+}
+
+
+static int event_loop_from_epoll(uint32_t events)
+{
+    int result = 0;
+
+    if(events & EPOLLIN) {
+        result |= EVENT_LOOP_READ;
+    }
+
+    if(events & EPOLLOUT) {
+        result |= EVENT_LOOP_WRITE;
+    }
+
+    if(events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) {
+        result |= EVENT_LOOP_ERROR;
+    }
+
+    return result;
+}
+
+
+int event_loop_create(event_loop_p *loop)
+{
+    struct epoll_event ev;
+
+    pdebug(DEBUG_DETAIL, "Starting.");
+
+    if(!loop) {
+        pdebug(DEBUG_WARN, "null event loop pointer.");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    *loop = (event_loop_p)mem_alloc(sizeof(struct event_loop_t));
+    if(! *loop) {
+        pdebug(DEBUG_ERROR, "Failed to allocate memory for event loop.");
+        return PLCTAG_ERR_NO_MEM;
+    }
+
+    (*loop)->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if((*loop)->epoll_fd < 0) {
+        pdebug(DEBUG_ERROR, "Unable to create epoll set, errno: %d", errno);
+        mem_free(*loop);
+        *loop = NULL;
+        return PLCTAG_ERR_CREATE;
+    }
+
+    (*loop)->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if((*loop)->wake_fd < 0) {
+        pdebug(DEBUG_ERROR, "Unable to create wake up event, errno: %d", errno);
+        close((*loop)->epoll_fd);
+        mem_free(*loop);
+        *loop = NULL;
+        return PLCTAG_ERR_CREATE;
+    }
+
+    /* the loop itself marks the wake up event. */
+    mem_set(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = *loop;
+
+    if(epoll_ctl((*loop)->epoll_fd, EPOLL_CTL_ADD, (*loop)->wake_fd, &ev)) {
+        pdebug(DEBUG_ERROR, "Unable to add wake up event to epoll set, errno: %d", errno);
+        close((*loop)->wake_fd);
+        close((*loop)->epoll_fd);
+        mem_free(*loop);
+        *loop = NULL;
+        return PLCTAG_ERR_CREATE;
+    }
+
+    pdebug(DEBUG_DETAIL, "Done.");
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+static int event_loop_ctl(event_loop_p loop, int op, sock_p s, int events, void *context)
+{
+    struct epoll_event ev;
+    int fds[MAX_IPS];
+    int num_fds = 0;
+
+    if(!loop || !s) {
+        pdebug(DEBUG_WARN, "null event loop or socket pointer.");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    mem_set(&ev, 0, sizeof(ev));
+    ev.events = event_loop_to_epoll(events);
+    ev.data.ptr = context;
+
+    num_fds = socket_get_fds(s, fds);
+
+    for(int i=0; i < num_fds; i++) {
+        if(epoll_ctl(loop->epoll_fd, op, fds[i], &ev)) {
+            pdebug(DEBUG_WARN, "Unable to change epoll set, errno: %d", errno);
+            return PLCTAG_ERR_BAD_PARAM;
+        }
+    }
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+int event_loop_add_socket(event_loop_p loop, sock_p s, int events, void *context)
+{
+    return event_loop_ctl(loop, EPOLL_CTL_ADD, s, events, context);
+}
+
+
+int event_loop_mod_socket(event_loop_p loop, sock_p s, int events, void *context)
+{
+    return event_loop_ctl(loop, EPOLL_CTL_MOD, s, events, context);
+}
+
+
+int event_loop_remove_socket(event_loop_p loop, sock_p s)
+{
+    return event_loop_ctl(loop, EPOLL_CTL_DEL, s, 0, NULL);
+}
+
+
+/*
+ * event_loop_wait
+ *
+ * Wait until at least one socket is ready, the loop is woken or the
+ * timeout passes.  A negative timeout waits forever.  Returns the number
+ * of socket events filled in, zero on wake up or timeout, or an error.
+ */
+int event_loop_wait(event_loop_p loop, int timeout_ms, event_loop_event_t *events, int max_events)
+{
+    struct epoll_event ep_events[EVENT_LOOP_MAX_EVENTS];
+    int num_events = 0;
+    int count = 0;
+
+    if(!loop || !events) {
+        pdebug(DEBUG_WARN, "null event loop or event pointer.");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    if(max_events > EVENT_LOOP_MAX_EVENTS) {
+        max_events = EVENT_LOOP_MAX_EVENTS;
+    }
+
+    if(max_events <= 0) {
+        pdebug(DEBUG_WARN, "Must wait for at least one event!");
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+
+    num_events = epoll_wait(loop->epoll_fd, ep_events, max_events, (timeout_ms < 0 ? -1 : timeout_ms));
+    if(num_events < 0) {
+        if(errno == EINTR) {
+            return 0;
+        }
+
+        pdebug(DEBUG_WARN, "Error waiting on epoll set, errno: %d", errno);
+        return PLCTAG_ERR_READ;
+    }
+
+    for(int i=0; i < num_events; i++) {
+        if(ep_events[i].data.ptr == loop) {
+            uint64_t counter = 0;
+
+            /* eat the wake up. */
+            if(read(loop->wake_fd, &counter, sizeof(counter)) < 0 && errno != EAGAIN) {
+                pdebug(DEBUG_WARN, "Error reading wake up event, errno: %d", errno);
+            }
+        } else {
+            events[count].context = ep_events[i].data.ptr;
+            events[count].events = event_loop_from_epoll(ep_events[i].events);
+            count++;
+        }
+    }
+
+    return count;
+}
+
+
+int event_loop_wake(event_loop_p loop)
+{
+    uint64_t counter = 1;
+
+    if(!loop) {
+        pdebug(DEBUG_WARN, "null event loop pointer.");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    /* EAGAIN means the counter is saturated, the loop will wake anyway. */
+    if(write(loop->wake_fd, &counter, sizeof(counter)) < 0 && errno != EAGAIN) {
+        pdebug(DEBUG_WARN, "Error writing wake up event, errno: %d", errno);
+        return PLCTAG_ERR_WRITE;
+    }
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+int event_loop_destroy(event_loop_p *loop)
+{
+    pdebug(DEBUG_DETAIL, "Starting.");
+
+    if(!loop || ! *loop) {
+        pdebug(DEBUG_WARN, "null event loop pointer.");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    close((*loop)->wake_fd);
+    close((*loop)->epoll_fd);
+
+    mem_free(*loop);
+
+    *loop = NULL;
+
+    pdebug(DEBUG_DETAIL, "Done.");
+
+    return PLCTAG_STATUS_OK;
+}
+
+#else /* !__linux__ */
+
+static short event_loop_to_poll(int events)
+{
+    short result = 0;
+
+    if(events & EVENT_LOOP_READ) {
+        result |= POLLIN;
+    }
+
+    if(events & EVENT_LOOP_WRITE) {
+        result |= POLLOUT;
+    }
+
+    return result;
+}
+
+
+static int event_loop_from_poll(short events)
+{
+    int result = 0;
+
+    if(events & POLLIN) {
+        result |= EVENT_LOOP_READ;
+    }
+
+    if(events & POLLOUT) {
+        result |= EVENT_LOOP_WRITE;
+    }
+
+    if(events & (POLLERR | POLLHUP | POLLNVAL)) {
+        result |= EVENT_LOOP_ERROR;
+    }
+
+    return result;
+}
+
+
+int event_loop_create(event_loop_p *loop)
+{
+    int pipe_fds[2];
+
+    pdebug(DEBUG_DETAIL, "Starting.");
+
+    if(!loop) {
+        pdebug(DEBUG_WARN, "null event loop pointer.");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    *loop = (event_loop_p)mem_alloc(sizeof(struct event_loop_t));
+    if(! *loop) {
+        pdebug(DEBUG_ERROR, "Failed to allocate memory for event loop.");
+        return PLCTAG_ERR_NO_MEM;
+    }
+
+    (*loop)->fds_capacity = 4;
+    (*loop)->fds = (struct pollfd *)mem_alloc((*loop)->fds_capacity * (int)sizeof(struct pollfd));
+    (*loop)->contexts = (void **)mem_alloc((*loop)->fds_capacity * (int)sizeof(void *));
+
+    if(!(*loop)->fds || !(*loop)->contexts || pipe(pipe_fds)) {
+        pdebug(DEBUG_ERROR, "Unable to set up event loop!");
+        mem_free((*loop)->fds);
+        mem_free((*loop)->contexts);
+        mem_free(*loop);
+        *loop = NULL;
+        return PLCTAG_ERR_CREATE;
+    }
+
+    fcntl(pipe_fds[0], F_SETFL, fcntl(pipe_fds[0], F_GETFL, 0) | O_NONBLOCK);
+    fcntl(pipe_fds[1], F_SETFL, fcntl(pipe_fds[1], F_GETFL, 0) | O_NONBLOCK);
+
+    (*loop)->wake_fd = pipe_fds[0];
+    (*loop)->wake_write_fd = pipe_fds[1];
+
+    /* the first entry is always the wake up pipe. */
+    (*loop)->fds[0].fd = (*loop)->wake_fd;
+    (*loop)->fds[0].events = POLLIN;
+    (*loop)->num_fds = 1;
+
+    pdebug(DEBUG_DETAIL, "Done.");
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+static int event_loop_find_fd(event_loop_p loop, int fd)
+{
+    for(int i=1; i < loop->num_fds; i++) {
+        if(loop->fds[i].fd == fd) {
+            return i;
+        }
+    }
+
+    return PLCTAG_ERR_NOT_FOUND;
+}
+
+
+int event_loop_add_socket(event_loop_p loop, sock_p s, int events, void *context)
+{
+    int fds[MAX_IPS];
+    int num_fds = 0;
+
+    if(!loop || !s) {
+        pdebug(DEBUG_WARN, "null event loop or socket pointer.");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    num_fds = socket_get_fds(s, fds);
+
+    while(loop->num_fds + num_fds > loop->fds_capacity) {
+        int new_capacity = loop->fds_capacity * 2;
+        struct pollfd *new_fds = (struct pollfd *)mem_alloc(new_capacity * (int)sizeof(struct pollfd));
+        void **new_contexts = (void **)mem_alloc(new_capacity * (int)sizeof(void *));
+
+        if(!new_fds || !new_contexts) {
+            pdebug(DEBUG_ERROR, "Unable to grow event loop!");
+            mem_free(new_fds);
+            mem_free(new_contexts);
+            return PLCTAG_ERR_NO_MEM;
+        }
+
+        mem_copy(new_fds, loop->fds, loop->num_fds * (int)sizeof(struct pollfd));
+        mem_copy(new_contexts, loop->contexts, loop->num_fds * (int)sizeof(void *));
+
+        mem_free(loop->fds);
+        mem_free(loop->contexts);
+
+        loop->fds = new_fds;
+        loop->contexts = new_contexts;
+        loop->fds_capacity = new_capacity;
+    }
+
+    for(int i=0; i < num_fds; i++) {
+        loop->fds[loop->num_fds].fd = fds[i];
+        loop->fds[loop->num_fds].events = event_loop_to_poll(events);
+        loop->fds[loop->num_fds].revents = 0;
+        loop->contexts[loop->num_fds] = context;
+        loop->num_fds++;
+    }
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+int event_loop_mod_socket(event_loop_p loop, sock_p s, int events, void *context)
+{
+    int fds[MAX_IPS];
+    int num_fds = 0;
+
+    if(!loop || !s) {
+        pdebug(DEBUG_WARN, "null event loop or socket pointer.");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    num_fds = socket_get_fds(s, fds);
+
+    for(int i=0; i < num_fds; i++) {
+        int index = event_loop_find_fd(loop, fds[i]);
+
+        if(index < 0) {
+            pdebug(DEBUG_WARN, "Socket not found in event loop!");
+            return index;
+        }
+
+        loop->fds[index].events = event_loop_to_poll(events);
+        loop->contexts[index] = context;
+    }
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+int event_loop_remove_socket(event_loop_p loop, sock_p s)
+{
+    int fds[MAX_IPS];
+    int num_fds = 0;
+
+    if(!loop || !s) {
+        pdebug(DEBUG_WARN, "null event loop or socket pointer.");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    num_fds = socket_get_fds(s, fds);
+
+    for(int i=0; i < num_fds; i++) {
+        int index = event_loop_find_fd(loop, fds[i]);
+
+        if(index < 0) {
+            pdebug(DEBUG_WARN, "Socket not found in event loop!");
+            return index;
+        }
+
+        /* move the last entry into the hole. */
+        loop->num_fds--;
+        loop->fds[index] = loop->fds[loop->num_fds];
+        loop->contexts[index] = loop->contexts[loop->num_fds];
+    }
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+int event_loop_wait(event_loop_p loop, int timeout_ms, event_loop_event_t *events, int max_events)
+{
+    int rc = 0;
+    int count = 0;
+
+    if(!loop || !events) {
+        pdebug(DEBUG_WARN, "null event loop or event pointer.");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    rc = poll(loop->fds, (nfds_t)loop->num_fds, (timeout_ms < 0 ? -1 : timeout_ms));
+    if(rc < 0) {
+        if(errno == EINTR) {
+            return 0;
+        }
+
+        pdebug(DEBUG_WARN, "Error polling sockets, errno: %d", errno);
+        return PLCTAG_ERR_READ;
+    }
+
+    if(loop->fds[0].revents & POLLIN) {
+        uint8_t junk[16];
+
+        /* eat the wake ups. */
+        while(read(loop->wake_fd, junk, sizeof(junk)) > 0) { }
+    }
+
+    for(int i=1; i < loop->num_fds && count < max_events; i++) {
+        if(loop->fds[i].revents) {
+            events[count].context = loop->contexts[i];
+            events[count].events = event_loop_from_poll(loop->fds[i].revents);
+            count++;
+        }
+    }
+
+    return count;
+}
+
+
+int event_loop_wake(event_loop_p loop)
+{
+    uint8_t wake = 1;
+
+    if(!loop) {
+        pdebug(DEBUG_WARN, "null event loop pointer.");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    /* EAGAIN means the pipe is full, the loop will wake anyway. */
+    if(write(loop->wake_write_fd, &wake, sizeof(wake)) < 0 && errno != EAGAIN) {
+        pdebug(DEBUG_WARN, "Error writing wake up event, errno: %d", errno);
+        return PLCTAG_ERR_WRITE;
+    }
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+int event_loop_destroy(event_loop_p *loop)
+{
+    pdebug(DEBUG_DETAIL, "Starting.");
+
+    if(!loop || ! *loop) {
+        pdebug(DEBUG_WARN, "null event loop pointer.");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    close((*loop)->wake_fd);
+    close((*loop)->wake_write_fd);
+
+    mem_free((*loop)->fds);
+    mem_free((*loop)->contexts);
+    mem_free(*loop);
+
+    *loop = NULL;
+
+    pdebug(DEBUG_DETAIL, "Done.");
+
+    return PLCTAG_STATUS_OK;
+}
+
+#endif /* __linux__ */
+
+
+
+
 
 
 
@@ -1056,3 +1963,20 @@ int64_t time_ms(void)
 
     return  ((int64_t)tv.tv_sec*1000)+ ((int64_t)tv.tv_usec/1000);
 }
+
+
+/*
+ * cpu_count
+ *
+ * Return the number of CPUs that are online, at least one.
+ */
+int cpu_count(void)
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if(count < 1) {
+        return 1;
+    }
+
+    return (count > INT_MAX ? INT_MAX : (int)count);
+}
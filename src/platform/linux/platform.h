@@ -126,6 +126,20 @@ extern int mutex_destroy(mutex_p *m);
 #define critical_block(lock) \
 for(int __sync_flag_nargle_##__LINE__ = 1; __sync_flag_nargle_##__LINE__ ; __sync_flag_nargle_##__LINE__ = 0, mutex_unlock(lock))  for(int __sync_rc_nargle_##__LINE__ = mutex_lock(lock); __sync_rc_nargle_##__LINE__ == PLCTAG_STATUS_OK && __sync_flag_nargle_##__LINE__ ; __sync_flag_nargle_##__LINE__ = 0)
 
+/*
+ * condition functions/defs
+ *
+ * A condition is a flag that one thread sets and another waits on.  A
+ * signal that happens before the wait is not lost.  cond_wait() clears
+ * the flag when it returns.
+ */
+typedef struct cond_t *cond_p;
+extern int cond_create(cond_p *c);
+extern int cond_wait(cond_p c, int timeout_ms);
+extern int cond_signal(cond_p c);
+extern int cond_clear(cond_p c);
+extern int cond_destroy(cond_p *c);
+
 /* thread functions/defs */
 typedef struct thread_t *thread_p;
 typedef void *(*thread_func_t)(void *arg);
@@ -154,15 +168,56 @@ extern int lock_acquire_try(lock_t *lock);
 extern int lock_acquire(lock_t *lock);
 extern void lock_release(lock_t *lock);
 
-/* socket functions */
+/* full memory fence, orders loads and stores on both sides. */
+extern void mem_barrier(void);
+
+/*
+ * socket functions
+ *
+ * Connecting does not block.  When the host has several IP addresses they
+ * are tried in parallel, a new attempt starting every
+ * SOCKET_CONNECT_ATTEMPT_DELAY_MS until one connects.
+ */
+#define SOCKET_CONNECT_ATTEMPT_DELAY_MS (250)
+
 typedef struct sock_t *sock_p;
 extern int socket_create(sock_p *s);
-extern int socket_connect_tcp(sock_p s, const char *host, int port);
+extern int socket_connect_tcp_start(sock_p s, const char *host, int port, int timeout_ms);
+extern int socket_connect_tcp_check(sock_p s);
 extern int socket_read(sock_p s, uint8_t *buf, int size);
 extern int socket_write(sock_p s, uint8_t *buf, int size);
 extern int socket_close(sock_p s);
 extern int socket_destroy(sock_p *s);
 
+/*
+ * event loop functions
+ *
+ * An event loop waits on any number of sockets, an internal wake up
+ * event and a timeout at the same time.  event_loop_wake() can be called
+ * from any thread to make a waiting event_loop_wait() return.
+ */
+#define EVENT_LOOP_READ     (0x01)
+#define EVENT_LOOP_WRITE    (0x02)
+#define EVENT_LOOP_ERROR    (0x04)
+
+/* epoll has no limit of its own on the sockets in one loop. */
+#define EVENT_LOOP_MAX_SOCKETS (INT32_MAX)
+
+typedef struct event_loop_t *event_loop_p;
+
+typedef struct {
+    void *context;
+    int events;
+} event_loop_event_t;
+
+extern int event_loop_create(event_loop_p *loop);
+extern int event_loop_add_socket(event_loop_p loop, sock_p s, int events, void *context);
+extern int event_loop_mod_socket(event_loop_p loop, sock_p s, int events, void *context);
+extern int event_loop_remove_socket(event_loop_p loop, sock_p s);
+extern int event_loop_wait(event_loop_p loop, int timeout_ms, event_loop_event_t *events, int max_events);
+extern int event_loop_wake(event_loop_p loop);
+extern int event_loop_destroy(event_loop_p *loop);
+
 /* serial handling */
 typedef struct serial_port_t *serial_port_p;
 #define PLC_SERIAL_PORT_NULL ((plc_serial_port)NULL)
@@ -176,6 +231,7 @@ extern int plc_lib_serial_port_write(serial_port_p serial_port, uint8_t *data, i
 /* misc functions */
 extern int sleep_ms(int ms);
 extern int64_t time_ms(void);
+extern int cpu_count(void);
 
 #define snprintf_platform snprintf
 
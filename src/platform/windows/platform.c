@@ -569,6 +569,146 @@ int mutex_destroy(mutex_p *m)
 
 
 
+/***************************************************************************
+ ****************************** Conditions *********************************
+ **************************************************************************/
+
+/* an auto-reset event has exactly the semantics we want. */
+struct cond_t {
+    HANDLE h_event;
+};
+
+
+int cond_create(cond_p *c)
+{
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    if(!c) {
+        pdebug(DEBUG_WARN, "null condition pointer.");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    *c = (struct cond_t *)mem_alloc(sizeof(struct cond_t));
+    if(! *c) {
+        pdebug(DEBUG_ERROR, "Unable to allocate new condition!");
+        return PLCTAG_ERR_NO_MEM;
+    }
+
+    (*c)->h_event = CreateEvent(
+                        NULL,                   /* default security attributes  */
+                        FALSE,                  /* auto reset                   */
+                        FALSE,                  /* initially not signaled       */
+                        NULL);                  /* unnamed event                */
+
+    if(!(*c)->h_event) {
+        mem_free(*c);
+        *c = NULL;
+        pdebug(DEBUG_ERROR, "Error initializing condition.");
+        return PLCTAG_ERR_MUTEX_INIT;
+    }
+
+    pdebug(DEBUG_SPEW, "Done.");
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+/*
+ * cond_wait
+ *
+ * Wait until the condition is signaled or the timeout passes.  Returns
+ * PLCTAG_ERR_TIMEOUT if the condition was not signaled in time.
+ */
+int cond_wait(cond_p c, int timeout_ms)
+{
+    DWORD dwWaitResult = 0;
+
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    if(!c) {
+        pdebug(DEBUG_WARN, "null condition pointer.");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    if(timeout_ms < 0) {
+        timeout_ms = 0;
+    }
+
+    dwWaitResult = WaitForSingleObject(c->h_event, (DWORD)timeout_ms);
+
+    pdebug(DEBUG_SPEW, "Done.");
+
+    if(dwWaitResult == WAIT_OBJECT_0) {
+        return PLCTAG_STATUS_OK;
+    }
+
+    if(dwWaitResult == WAIT_TIMEOUT) {
+        return PLCTAG_ERR_TIMEOUT;
+    }
+
+    pdebug(DEBUG_WARN, "Error waiting on condition!");
+
+    return PLCTAG_ERR_MUTEX_LOCK;
+}
+
+
+int cond_signal(cond_p c)
+{
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    if(!c) {
+        pdebug(DEBUG_WARN, "null condition pointer.");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    SetEvent(c->h_event);
+
+    pdebug(DEBUG_SPEW, "Done.");
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+int cond_clear(cond_p c)
+{
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    if(!c) {
+        pdebug(DEBUG_WARN, "null condition pointer.");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    ResetEvent(c->h_event);
+
+    pdebug(DEBUG_SPEW, "Done.");
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+int cond_destroy(cond_p *c)
+{
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    if(!c || ! *c) {
+        pdebug(DEBUG_WARN, "null condition pointer.");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    CloseHandle((*c)->h_event);
+
+    mem_free(*c);
+
+    *c = NULL;
+
+    pdebug(DEBUG_SPEW, "Done.");
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+
 /***************************************************************************
  ******************************* Threads ***********************************
  **************************************************************************/
@@ -776,6 +916,12 @@ extern void lock_release(lock_t *lock)
 }
 
 
+extern void mem_barrier(void)
+{
+    MemoryBarrier();
+}
+
+
 
 
 
@@ -788,14 +934,27 @@ extern void lock_release(lock_t *lock)
  **************************************************************************/
 
 
+#define MAX_IPS (8)
+
+
 struct sock_t {
     SOCKET fd;
     int port;
     int is_open;
+
+    /* connection attempts raced while connecting, INVALID_SOCKET when not running. */
+    int num_ips;
+    int num_attempts;
+    IN_ADDR ips[MAX_IPS];
+    SOCKET attempt_fds[MAX_IPS];
+    int64_t next_attempt_time;
+    int64_t connect_deadline;
 };
 
 
-#define MAX_IPS (8)
+static int socket_start_attempt(sock_p s, int index);
+static void socket_stop_attempts(sock_p s, SOCKET keep_fd);
+static int socket_get_fds(sock_p s, SOCKET *fds);
 
 
 /* windows needs to have the Winsock library initialized
@@ -832,6 +991,12 @@ extern int socket_create(sock_p *s)
         return PLCTAG_ERR_NO_MEM;
     }
 
+    (*s)->fd = INVALID_SOCKET;
+
+    for(int i=0; i < MAX_IPS; i++) {
+        (*s)->attempt_fds[i] = INVALID_SOCKET;
+    }
+
     pdebug(DEBUG_DETAIL, "Done.");
 
     return PLCTAG_STATUS_OK;
@@ -839,76 +1004,34 @@ extern int socket_create(sock_p *s)
 
 
 
-extern int socket_connect_tcp(sock_p s, const char *host, int port)
+/*
+ * socket_connect_tcp_start
+ *
+ * Resolve the host and start connecting to it without blocking.  See the
+ * POSIX version for how several IP addresses are raced.
+ */
+extern int socket_connect_tcp_start(sock_p s, const char *host, int port, int timeout_ms)
 {
-    IN_ADDR ips[MAX_IPS];
-    int num_ips = 0;
-    struct sockaddr_in gw_addr;
-    int sock_opt = 1;
-    u_long non_blocking=1;
-    int i = 0;
-    int done = 0;
-    SOCKET fd;
-    struct timeval timeout; /* used for timing out connections etc. */
-    struct linger so_linger;
-
     pdebug(DEBUG_DETAIL, "Starting.");
 
-    /* Open a socket for communication with the gateway. */
-    fd = socket(AF_INET, SOCK_STREAM, 0/*IPPROTO_TCP*/);
-
-    /* check for errors */
-    if(fd < 0) {
-        /*pdebug("Socket creation failed, errno: %d",errno);*/
-        return PLCTAG_ERR_OPEN;
-    }
-
-    /* set up our socket to allow reuse if we crash suddenly. */
-    sock_opt = 1;
-
-    if(setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,(char*)&sock_opt,sizeof(sock_opt))) {
-        closesocket(fd);
-        pdebug(DEBUG_WARN,"Error setting socket reuse option, errno: %d",errno);
-        return PLCTAG_ERR_OPEN;
-    }
-
-    timeout.tv_sec = 10;
-    timeout.tv_usec = 0;
-
-    if(setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout))) {
-        closesocket(fd);
-        pdebug(DEBUG_WARN,"Error setting socket receive timeout option, errno: %d",errno);
-        return PLCTAG_ERR_OPEN;
-    }
-
-    if(setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, (char*)&timeout, sizeof(timeout))) {
-        closesocket(fd);
-        pdebug(DEBUG_WARN,"Error setting socket set timeout option, errno: %d",errno);
-        return PLCTAG_ERR_OPEN;
-    }
-
-    /* abort the connection on close. */
-    so_linger.l_onoff = 1;
-    so_linger.l_linger = 0;
-
-    if(setsockopt(fd, SOL_SOCKET, SO_LINGER,(char*)&so_linger,sizeof(so_linger))) {
-        closesocket(fd);
-        pdebug(DEBUG_ERROR,"Error setting socket close linger option, errno: %d",errno);
-        return PLCTAG_ERR_OPEN;
+    if(!s || !host) {
+        pdebug(DEBUG_WARN, "null socket or host pointer.");
+        return PLCTAG_ERR_NULL_PTR;
     }
 
     /* figure out what address we are connecting to. */
 
     /* try a numeric IP address conversion first. */
-    if(inet_pton(AF_INET,host,(struct in_addr *)ips) > 0) {
+    if(inet_pton(AF_INET,host,(struct in_addr *)s->ips) > 0) {
         pdebug(DEBUG_DETAIL, "Found numeric IP address: %s", host);
-        num_ips = 1;
+        s->num_ips = 1;
     } else {
         struct addrinfo hints;
         struct addrinfo *res = NULL;
+        struct addrinfo *entry = NULL;
         int rc = 0;
 
-        mem_set(&ips, 0, sizeof(ips));
+        mem_set(&(s->ips), 0, sizeof(s->ips));
         mem_set(&hints, 0, sizeof(hints));
 
         hints.ai_socktype = SOCK_STREAM; /* TCP */
@@ -924,81 +1047,223 @@ extern int socket_connect_tcp(sock_p s, const char *host, int port)
             return PLCTAG_ERR_BAD_GATEWAY;
         }
 
-        for (num_ips = 0; res && num_ips < MAX_IPS; num_ips++) {
-            ips[num_ips].s_addr = ((struct sockaddr_in *)(res->ai_addr))->sin_addr.s_addr;
-            res = res->ai_next;
+        entry = res;
+
+        for (s->num_ips = 0; entry && s->num_ips < MAX_IPS; s->num_ips++) {
+            s->ips[s->num_ips].s_addr = ((struct sockaddr_in *)(entry->ai_addr))->sin_addr.s_addr;
+            entry = entry->ai_next;
         }
 
         freeaddrinfo(res);
     }
 
+    s->port = port;
+    s->num_attempts = 0;
+    s->next_attempt_time = 0;
+    s->connect_deadline = time_ms() + timeout_ms;
 
-    /* now try to connect to the remote gateway.  We may need to
-     * try several of the IPs we have.
-     */
+    pdebug(DEBUG_DETAIL, "Done.");
 
-    i = 0;
-    done = 0;
+    /* this starts the first attempt. */
+    return socket_connect_tcp_check(s);
+}
 
-    memset((void *)&gw_addr,0, sizeof(gw_addr));
-    gw_addr.sin_family = AF_INET ;
-    gw_addr.sin_port = htons(port);
 
-    do {
-        int rc;
-        /* try each IP until we run out or get a connection. */
-        gw_addr.sin_addr.s_addr = ips[i].s_addr;
 
-        /*pdebug(DEBUG_DETAIL,"Attempting to connect to %s",inet_ntoa(*((struct in_addr *)&ips[i])));*/
+extern int socket_connect_tcp_check(sock_p s)
+{
+    fd_set write_fds;
+    fd_set error_fds;
+    struct timeval no_wait = {0, 0};
+    int live = 0;
+    int64_t now = 0;
 
-        rc = connect(fd,(struct sockaddr *)&gw_addr,sizeof(gw_addr));
+    if(!s) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    if(s->is_open) {
+        return PLCTAG_STATUS_OK;
+    }
 
-        if( rc == 0) {
-            /* Windows MSVC does not like inet_ntoa(), not safe.
-             * pdebug(DEBUG_DETAIL, "Attempt to connect to %s succeeded.",inet_ntoa(*((struct in_addr *)&ips[i])));
-             */
-            done = 1;
+    FD_ZERO(&write_fds);
+    FD_ZERO(&error_fds);
+
+    for(int i=0; i < s->num_attempts; i++) {
+        if(s->attempt_fds[i] != INVALID_SOCKET) {
+            FD_SET(s->attempt_fds[i], &write_fds);
+            FD_SET(s->attempt_fds[i], &error_fds);
+            live++;
+        }
+    }
+
+    /* Windows reports failed connects in the exception set. */
+    if(live && select(0, NULL, &write_fds, &error_fds, &no_wait) == SOCKET_ERROR) {
+        pdebug(DEBUG_WARN, "Error checking connection attempts, error: %d", WSAGetLastError());
+        socket_stop_attempts(s, INVALID_SOCKET);
+        return PLCTAG_ERR_OPEN;
+    }
+
+    live = 0;
+
+    /* the earliest IP address that connected wins. */
+    for(int i=0; i < s->num_attempts; i++) {
+        if(s->attempt_fds[i] == INVALID_SOCKET) {
+            continue;
+        }
+
+        if(FD_ISSET(s->attempt_fds[i], &write_fds)) {
+            pdebug(DEBUG_DETAIL, "Attempt to connect to IP address %d succeeded.", i);
+
+            s->fd = s->attempt_fds[i];
+            s->is_open = 1;
+            socket_stop_attempts(s, s->fd);
+
+            return PLCTAG_STATUS_OK;
+        }
+
+        if(FD_ISSET(s->attempt_fds[i], &error_fds)) {
+            pdebug(DEBUG_DETAIL, "Attempt to connect to IP address %d failed.", i);
+
+            closesocket(s->attempt_fds[i]);
+            s->attempt_fds[i] = INVALID_SOCKET;
         } else {
-            /* MSVC does not like inet_ntoa(), not safe.
-             * pdebug(DEBUG_DETAIL, "Attempt to connect to %s failed, errno: %d",inet_ntoa(*((struct in_addr *)&ips[i])),errno);
-             */
-            i++;
+            live++;
         }
-    } while(!done && i < num_ips);
+    }
 
-    if(!done) {
-        closesocket(fd);
+    now = time_ms();
+
+    if(now >= s->connect_deadline) {
+        pdebug(DEBUG_WARN, "Timed out connecting to the gateway!");
+        socket_stop_attempts(s, INVALID_SOCKET);
+        return PLCTAG_ERR_TIMEOUT;
+    }
+
+    /* start the next attempt when it is due or when nothing else is running. */
+    while(s->num_attempts < s->num_ips && (!live || now >= s->next_attempt_time)) {
+        if(socket_start_attempt(s, s->num_attempts++) == PLCTAG_STATUS_OK) {
+            live++;
+            s->next_attempt_time = now + SOCKET_CONNECT_ATTEMPT_DELAY_MS;
+        }
+    }
+
+    if(!live) {
         pdebug(DEBUG_WARN,"Unable to connect to any gateway host IP address!");
         return PLCTAG_ERR_OPEN;
     }
 
+    return PLCTAG_STATUS_PENDING;
+}
+
 
-    /* FIXME
-     * connect() is a little easier to handle in blocking mode, for now
-     * we make the socket non-blocking here, after connect().
-     */
 
+int socket_start_attempt(sock_p s, int index)
+{
+    struct sockaddr_in gw_addr;
+    int sock_opt = 1;
+    u_long non_blocking=1;
+    SOCKET fd;
+    struct linger so_linger;
+
+    /* Open a socket for communication with the gateway. */
+    fd = socket(AF_INET, SOCK_STREAM, 0/*IPPROTO_TCP*/);
+
+    /* check for errors */
+    if(fd == INVALID_SOCKET) {
+        /*pdebug("Socket creation failed, errno: %d",errno);*/
+        return PLCTAG_ERR_OPEN;
+    }
+
+    /* set up our socket to allow reuse if we crash suddenly. */
+    sock_opt = 1;
+
+    if(setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,(char*)&sock_opt,sizeof(sock_opt))) {
+        closesocket(fd);
+        pdebug(DEBUG_WARN,"Error setting socket reuse option, errno: %d",errno);
+        return PLCTAG_ERR_OPEN;
+    }
+
+    /* abort the connection on close. */
+    so_linger.l_onoff = 1;
+    so_linger.l_linger = 0;
+
+    if(setsockopt(fd, SOL_SOCKET, SO_LINGER,(char*)&so_linger,sizeof(so_linger))) {
+        closesocket(fd);
+        pdebug(DEBUG_ERROR,"Error setting socket close linger option, errno: %d",errno);
+        return PLCTAG_ERR_OPEN;
+    }
+
+    /* do not hold back small packets when several requests are in flight. */
+    sock_opt = 1;
+
+    if(setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char*)&sock_opt, sizeof(sock_opt))) {
+        closesocket(fd);
+        pdebug(DEBUG_ERROR, "Error setting socket no delay option, errno: %d",errno);
+        return PLCTAG_ERR_OPEN;
+    }
+
+    /* the socket is non-blocking from the start, including connect(). */
     if(ioctlsocket(fd,FIONBIO,&non_blocking)) {
         /*pdebug("Error getting socket options, errno: %d", errno);*/
         closesocket(fd);
         return PLCTAG_ERR_OPEN;
     }
 
-    /* save the values */
-    s->fd = fd;
-    s->port = port;
-    s->is_open = 1;
+    memset((void *)&gw_addr,0, sizeof(gw_addr));
+    gw_addr.sin_family = AF_INET ;
+    gw_addr.sin_port = htons(s->port);
+    gw_addr.sin_addr.s_addr = s->ips[index].s_addr;
 
-    pdebug(DEBUG_DETAIL, "Done.");
+    /* a connect that finishes at once is picked up by the next check. */
+    if(connect(fd,(struct sockaddr *)&gw_addr,sizeof(gw_addr)) && WSAGetLastError() != WSAEWOULDBLOCK) {
+        /* MSVC does not like inet_ntoa(), not safe. */
+        pdebug(DEBUG_DETAIL, "Attempt to connect to IP address %d failed, error: %d", index, WSAGetLastError());
+        closesocket(fd);
+        return PLCTAG_ERR_OPEN;
+    }
+
+    s->attempt_fds[index] = fd;
 
     return PLCTAG_STATUS_OK;
 }
 
 
+/* close all the connection attempts except the one passed. */
+void socket_stop_attempts(sock_p s, SOCKET keep_fd)
+{
+    for(int i=0; i < s->num_attempts; i++) {
+        if(s->attempt_fds[i] != INVALID_SOCKET && s->attempt_fds[i] != keep_fd) {
+            closesocket(s->attempt_fds[i]);
+        }
+
+        s->attempt_fds[i] = INVALID_SOCKET;
+    }
+
+    s->num_attempts = 0;
+}
 
 
+/*
+ * the sockets the event loop should watch.  While connecting that is
+ * every running attempt.
+ */
+int socket_get_fds(sock_p s, SOCKET *fds)
+{
+    int count = 0;
 
+    if(s->is_open) {
+        fds[count++] = s->fd;
+    } else {
+        for(int i=0; i < s->num_attempts; i++) {
+            if(s->attempt_fds[i] != INVALID_SOCKET) {
+                fds[count++] = s->attempt_fds[i];
+            }
+        }
+    }
 
+    return count;
+}
 
 
 
@@ -1025,6 +1290,12 @@ extern int socket_read(sock_p s, uint8_t *buf, int size)
         }
     }
 
+    /* zero bytes from a readable socket means the other end closed it. */
+    if(rc == 0 && size > 0) {
+        pdebug(DEBUG_WARN,"Socket closed by remote end.");
+        return PLCTAG_ERR_READ;
+    }
+
     return rc;
 }
 
@@ -1061,6 +1332,8 @@ extern int socket_close(sock_p s)
     if(!s)
         return PLCTAG_ERR_NULL_PTR;
 
+    socket_stop_attempts(s, INVALID_SOCKET);
+
     if(!s->is_open) {
         return PLCTAG_STATUS_OK;
     }
@@ -1069,7 +1342,7 @@ extern int socket_close(sock_p s)
         return PLCTAG_ERR_CLOSE;
     }
 
-    s->fd = 0;
+    s->fd = INVALID_SOCKET;
     s->is_open = 0;
 
     return PLCTAG_STATUS_OK;
@@ -1097,6 +1370,302 @@ extern int socket_destroy(sock_p *s)
 
 
 
+/***************************************************************************
+ ****************************** Event Loop *********************************
+ **************************************************************************/
+
+/*
+ * Each socket gets a WSA event via WSAEventSelect().  Slot zero of the
+ * event array is the wake up event.  Windows limits a single wait to
+ * WSA_MAXIMUM_WAIT_EVENTS handles.
+ */
+
+struct event_loop_t {
+    int num_events;
+    WSAEVENT events[WSA_MAXIMUM_WAIT_EVENTS];
+    sock_p socks[WSA_MAXIMUM_WAIT_EVENTS];
+    void *contexts[WSA_MAXIMUM_WAIT_EVENTS];
+};
+
+
+static long event_loop_to_wsa(int events)
+{
+    long result = FD_CLOSE;
+
+    if(events & EVENT_LOOP_READ) {
+        result |= FD_READ;
+    }
+
+    if(events & EVENT_LOOP_WRITE) {
+        result |= FD_WRITE | FD_CONNECT;
+    }
+
+    return result;
+}
+
+
+int event_loop_create(event_loop_p *loop)
+{
+    pdebug(DEBUG_DETAIL, "Starting.");
+
+    if(!loop) {
+        pdebug(DEBUG_WARN, "null event loop pointer.");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    *loop = (event_loop_p)mem_alloc(sizeof(struct event_loop_t));
+    if(! *loop) {
+        pdebug(DEBUG_ERROR, "Failed to allocate memory for event loop.");
+        return PLCTAG_ERR_NO_MEM;
+    }
+
+    (*loop)->events[0] = WSACreateEvent();
+    if((*loop)->events[0] == WSA_INVALID_EVENT) {
+        pdebug(DEBUG_ERROR, "Unable to create wake up event, error: %d", WSAGetLastError());
+        mem_free(*loop);
+        *loop = NULL;
+        return PLCTAG_ERR_CREATE;
+    }
+
+    (*loop)->num_events = 1;
+
+    pdebug(DEBUG_DETAIL, "Done.");
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+static int event_loop_find_socket(event_loop_p loop, sock_p s)
+{
+    for(int i=1; i < loop->num_events; i++) {
+        if(loop->socks[i] == s) {
+            return i;
+        }
+    }
+
+    return PLCTAG_ERR_NOT_FOUND;
+}
+
+
+int event_loop_add_socket(event_loop_p loop, sock_p s, int events, void *context)
+{
+    int index = 0;
+    SOCKET fds[MAX_IPS];
+    int num_fds = 0;
+
+    if(!loop || !s) {
+        pdebug(DEBUG_WARN, "null event loop or socket pointer.");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    if(loop->num_events >= WSA_MAXIMUM_WAIT_EVENTS) {
+        pdebug(DEBUG_WARN, "Event loop is full!");
+        return PLCTAG_ERR_NO_RESOURCES;
+    }
+
+    index = loop->num_events;
+
+    loop->events[index] = WSACreateEvent();
+    if(loop->events[index] == WSA_INVALID_EVENT) {
+        pdebug(DEBUG_WARN, "Unable to create socket event, error: %d", WSAGetLastError());
+        return PLCTAG_ERR_CREATE;
+    }
+
+    /* several sockets can share one event while connecting. */
+    num_fds = socket_get_fds(s, fds);
+
+    for(int i=0; i < num_fds; i++) {
+        if(WSAEventSelect(fds[i], loop->events[index], event_loop_to_wsa(events))) {
+            pdebug(DEBUG_WARN, "Unable to select socket events, error: %d", WSAGetLastError());
+            WSACloseEvent(loop->events[index]);
+            return PLCTAG_ERR_BAD_PARAM;
+        }
+    }
+
+    loop->socks[index] = s;
+    loop->contexts[index] = context;
+    loop->num_events++;
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+int event_loop_mod_socket(event_loop_p loop, sock_p s, int events, void *context)
+{
+    int index = 0;
+    SOCKET fds[MAX_IPS];
+    int num_fds = 0;
+
+    if(!loop || !s) {
+        pdebug(DEBUG_WARN, "null event loop or socket pointer.");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    index = event_loop_find_socket(loop, s);
+    if(index < 0) {
+        pdebug(DEBUG_WARN, "Socket not found in event loop!");
+        return index;
+    }
+
+    num_fds = socket_get_fds(s, fds);
+
+    for(int i=0; i < num_fds; i++) {
+        if(WSAEventSelect(fds[i], loop->events[index], event_loop_to_wsa(events))) {
+            pdebug(DEBUG_WARN, "Unable to select socket events, error: %d", WSAGetLastError());
+            return PLCTAG_ERR_BAD_PARAM;
+        }
+    }
+
+    loop->contexts[index] = context;
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+int event_loop_remove_socket(event_loop_p loop, sock_p s)
+{
+    int index = 0;
+    SOCKET fds[MAX_IPS];
+    int num_fds = 0;
+
+    if(!loop || !s) {
+        pdebug(DEBUG_WARN, "null event loop or socket pointer.");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    index = event_loop_find_socket(loop, s);
+    if(index < 0) {
+        pdebug(DEBUG_WARN, "Socket not found in event loop!");
+        return index;
+    }
+
+    num_fds = socket_get_fds(s, fds);
+
+    for(int i=0; i < num_fds; i++) {
+        WSAEventSelect(fds[i], NULL, 0);
+    }
+
+    WSACloseEvent(loop->events[index]);
+
+    /* move the last entry into the hole. */
+    loop->num_events--;
+    loop->events[index] = loop->events[loop->num_events];
+    loop->socks[index] = loop->socks[loop->num_events];
+    loop->contexts[index] = loop->contexts[loop->num_events];
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+int event_loop_wait(event_loop_p loop, int timeout_ms, event_loop_event_t *events, int max_events)
+{
+    DWORD rc = 0;
+    int count = 0;
+
+    if(!loop || !events) {
+        pdebug(DEBUG_WARN, "null event loop or event pointer.");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    rc = WSAWaitForMultipleEvents((DWORD)loop->num_events, loop->events, FALSE, (timeout_ms < 0 ? WSA_INFINITE : (DWORD)timeout_ms), FALSE);
+    if(rc == WSA_WAIT_FAILED) {
+        pdebug(DEBUG_WARN, "Error waiting on events, error: %d", WSAGetLastError());
+        return PLCTAG_ERR_READ;
+    }
+
+    if(rc == WSA_WAIT_TIMEOUT) {
+        return 0;
+    }
+
+    WSAResetEvent(loop->events[0]);
+
+    /* more than one event could be set, check them all. */
+    for(int i=1; i < loop->num_events && count < max_events; i++) {
+        WSANETWORKEVENTS net_events;
+
+        /* a socket still connecting is just checked again by its owner. */
+        if(!loop->socks[i]->is_open) {
+            if(WaitForSingleObject(loop->events[i], 0) == WAIT_OBJECT_0) {
+                WSAResetEvent(loop->events[i]);
+
+                events[count].context = loop->contexts[i];
+                events[count].events = EVENT_LOOP_WRITE;
+                count++;
+            }
+
+            continue;
+        }
+
+        if(WSAEnumNetworkEvents(loop->socks[i]->fd, loop->events[i], &net_events)) {
+            continue;
+        }
+
+        if(net_events.lNetworkEvents) {
+            events[count].context = loop->contexts[i];
+            events[count].events = 0;
+
+            if(net_events.lNetworkEvents & FD_READ) {
+                events[count].events |= EVENT_LOOP_READ;
+            }
+
+            if(net_events.lNetworkEvents & (FD_WRITE | FD_CONNECT)) {
+                events[count].events |= EVENT_LOOP_WRITE;
+            }
+
+            if(net_events.lNetworkEvents & FD_CLOSE) {
+                events[count].events |= EVENT_LOOP_ERROR;
+            }
+
+            count++;
+        }
+    }
+
+    return count;
+}
+
+
+int event_loop_wake(event_loop_p loop)
+{
+    if(!loop) {
+        pdebug(DEBUG_WARN, "null event loop pointer.");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    if(!WSASetEvent(loop->events[0])) {
+        pdebug(DEBUG_WARN, "Error setting wake up event, error: %d", WSAGetLastError());
+        return PLCTAG_ERR_WRITE;
+    }
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+int event_loop_destroy(event_loop_p *loop)
+{
+    pdebug(DEBUG_DETAIL, "Starting.");
+
+    if(!loop || ! *loop) {
+        pdebug(DEBUG_WARN, "null event loop pointer.");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    for(int i=0; i < (*loop)->num_events; i++) {
+        WSACloseEvent((*loop)->events[i]);
+    }
+
+    mem_free(*loop);
+
+    *loop = NULL;
+
+    pdebug(DEBUG_DETAIL, "Done.");
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+
+
 
 
 /***************************************************************************
@@ -1408,6 +1977,21 @@ int64_t time_ms(void)
 }
 
 
+/*
+ * cpu_count
+ *
+ * Return the number of CPUs, at least one.
+ */
+int cpu_count(void)
+{
+    SYSTEM_INFO info;
+
+    GetSystemInfo(&info);
+
+    return (info.dwNumberOfProcessors < 1 ? 1 : (int)info.dwNumberOfProcessors);
+}
+
+
 struct tm *localtime_r(const time_t *timep, struct tm *result)
 {
     time_t t = *timep;
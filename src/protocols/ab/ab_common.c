@@ -50,8 +50,10 @@
 
 //volatile ab_session_p sessions = NULL;
 //volatile mutex_p global_session_mut = NULL;
-//
-//volatile vector_p read_group_tags = NULL;
+
+/* all tags that were created with a read group, the references are weak. */
+static mutex_p read_group_mutex = NULL;
+static vector_p read_group_tags = NULL;
 
 
 /* request/response handling thread */
@@ -72,11 +74,16 @@ volatile int library_terminating = 0;
 #define DEFAULT_NUM_RETRIES (5)
 #define DEFAULT_RETRY_INTERVAL (300)
 
+#define READ_GROUP_MIN_SIZE (10)
+#define READ_GROUP_INC_SIZE (10)
+
 
 /* forward declarations*/
 static int get_tag_data_type(ab_tag_p tag, attr attribs);
 
 static void ab_tag_destroy(ab_tag_p tag);
+static int read_group_add(ab_tag_p tag);
+static void read_group_remove(ab_tag_p tag);
 //static tag_vtable_p set_tag_vtable(ab_tag_p tag);
 static int default_abort(plc_tag_p tag);
 static int default_read(plc_tag_p tag);
@@ -85,7 +92,7 @@ static int default_tickler(plc_tag_p tag);
 static int default_write(plc_tag_p tag);
 
 /* vtables for different kinds of tags */
-struct tag_vtable_t default_vtable = { default_abort, default_read, default_status, default_tickler, default_write };
+struct tag_vtable_t default_vtable = { default_abort, default_read, default_status, default_tickler, default_write, NULL, NULL, NULL };
 struct tag_vtable_t cip_vtable = {0}/*= { ab_tag_abort, ab_tag_destroy, eip_cip_tag_read_start, eip_cip_tag_status, eip_cip_tag_write_start }*/;
 struct tag_vtable_t plc_vtable = {0}/*= { ab_tag_abort, ab_tag_destroy, eip_pccc_tag_read_start, eip_pccc_tag_status, eip_pccc_tag_write_start }*/;
 struct tag_vtable_t plc_dhp_vtable = {0}/*= { ab_tag_abort, ab_tag_destroy, eip_dhp_pccc_tag_read_start, eip_dhp_pccc_tag_status, eip_dhp_pccc_tag_write_start}*/;
@@ -145,6 +152,16 @@ int ab_init(void)
         return rc;
     }
 
+    if((rc = mutex_create(&read_group_mutex)) != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_ERROR, "Unable to create read group mutex!");
+        return rc;
+    }
+
+    if((read_group_tags = vector_create(READ_GROUP_MIN_SIZE, READ_GROUP_INC_SIZE)) == NULL) {
+        pdebug(DEBUG_ERROR, "Unable to create read group tag list!");
+        return PLCTAG_ERR_NO_MEM;
+    }
+
     pdebug(DEBUG_INFO,"Finished initializing AB protocol library.");
 
     return rc;
@@ -169,6 +186,12 @@ void ab_teardown(void)
 
     session_teardown();
 
+    pdebug(DEBUG_INFO,"Freeing read group information.");
+
+    vector_destroy(read_group_tags);
+    read_group_tags = NULL;
+    mutex_destroy(&read_group_mutex);
+
     pdebug(DEBUG_INFO,"Done.");
 }
 
@@ -178,6 +201,7 @@ plc_tag_p ab_tag_create(attr attribs)
 {
     ab_tag_p tag = AB_TAG_NULL;
     const char *path = NULL;
+    const char *priority = NULL;
     int rc = PLCTAG_STATUS_OK;
 
     pdebug(DEBUG_INFO,"Starting.");
@@ -226,10 +250,12 @@ plc_tag_p ab_tag_create(attr attribs)
             pdebug(DEBUG_DETAIL, "Setting up PLC/5, SLC tag.");
             tag->use_connected_msg = 0;
             tag->vtable = &eip_pccc_vtable;
+            tag->read_start = eip_pccc_tag_read_start;
         } else {
             pdebug(DEBUG_DETAIL, "Setting up PLC/5 via DH+ bridge tag.");
             tag->use_connected_msg = 1;
             tag->vtable = &eip_dhp_pccc_vtable;
+            tag->read_start = eip_dhp_pccc_tag_read_start;
         }
 
         tag->allow_packing = 0;
@@ -240,6 +266,7 @@ plc_tag_p ab_tag_create(attr attribs)
         tag->use_connected_msg = 0;
         tag->allow_packing = 0;
         tag->vtable = &eip_lgx_pccc_vtable;
+        tag->read_start = eip_lgx_pccc_tag_read_start;
         break;
 
     case AB_PROTOCOL_MLGX:
@@ -247,6 +274,7 @@ plc_tag_p ab_tag_create(attr attribs)
         tag->use_connected_msg = 0;
         tag->allow_packing = 0;
         tag->vtable = &eip_pccc_vtable;
+        tag->read_start = eip_pccc_tag_read_start;
         break;
 
     case AB_PROTOCOL_LGX:
@@ -269,7 +297,9 @@ plc_tag_p ab_tag_create(attr attribs)
         /* default to requiring a connection. */
         tag->use_connected_msg = attr_get_int(attribs,"use_connected_msg", 1);
         tag->allow_packing = attr_get_int(attribs, "allow_packing", 1);
+        tag->pipeline_reads = attr_get_int(attribs, "pipeline_reads", 0);
         tag->vtable = &eip_cip_vtable;
+        tag->read_start = eip_cip_tag_read_start;
 
         break;
 
@@ -278,6 +308,7 @@ plc_tag_p ab_tag_create(attr attribs)
         tag->use_connected_msg = 1;
         tag->allow_packing = 0;
         tag->vtable = &eip_cip_vtable;
+        tag->read_start = eip_cip_tag_read_start;
         break;
 
     default:
@@ -344,6 +375,31 @@ plc_tag_p ab_tag_create(attr attribs)
         return (plc_tag_p)tag;
     }
 
+    /* which queue the tag's requests go in on the session. */
+    priority = attr_get_str(attribs, "priority", "normal");
+    if(str_cmp_i(priority, "high") == 0) {
+        tag->priority = SESSION_PRIORITY_HIGH;
+    } else if(str_cmp_i(priority, "normal") == 0) {
+        tag->priority = SESSION_PRIORITY_NORMAL;
+    } else if(str_cmp_i(priority, "bulk") == 0) {
+        tag->priority = SESSION_PRIORITY_BULK;
+    } else {
+        pdebug(DEBUG_WARN, "Priority must be high, normal or bulk, not %s!", priority);
+        tag->status = PLCTAG_ERR_BAD_PARAM;
+        return (plc_tag_p)tag;
+    }
+
+    /* tags in the same read group are always read together, see ab_tag_created(). */
+    if(attr_get_str(attribs, "read_group", NULL)) {
+        tag->read_group = str_dup(attr_get_str(attribs, "read_group", NULL));
+
+        if(!tag->read_group) {
+            pdebug(DEBUG_WARN, "Unable to copy read group name!");
+            tag->status = PLCTAG_ERR_NO_MEM;
+            return (plc_tag_p)tag;
+        }
+    }
+
     /* trigger the first read. */
     tag->first_read = 1;
 
@@ -578,6 +634,14 @@ int ab_tag_abort(ab_tag_p tag)
         tag->req = rc_dec(tag->req);
     }
 
+    for(int i=0; i < tag->num_read_frags; i++) {
+        if(tag->read_frag_reqs[i]) {
+            tag->read_frag_reqs[i]->abort_request = 1;
+            tag->read_frag_reqs[i] = rc_dec(tag->read_frag_reqs[i]);
+        }
+    }
+
+    tag->num_read_frags = 0;
     tag->read_in_progress = 0;
     tag->write_in_progress = 0;
     tag->byte_offset = 0;
@@ -587,6 +651,226 @@ int ab_tag_abort(ab_tag_p tag)
     return PLCTAG_STATUS_OK;
 }
 
+/*
+ * ab_tag_batch_start
+ *
+ * Hold the tag's session so that the requests of a batch are
+ * packed together.  Must be matched by ab_tag_batch_end().
+ */
+
+int ab_tag_batch_start(ab_tag_p tag)
+{
+    if(!tag->session) {
+        return PLCTAG_STATUS_OK;
+    }
+
+    return session_hold_requests(tag->session);
+}
+
+
+/*
+ * ab_tag_batch_end
+ *
+ * Release the hold taken by ab_tag_batch_start().
+ */
+
+int ab_tag_batch_end(ab_tag_p tag)
+{
+    if(!tag->session) {
+        return PLCTAG_STATUS_OK;
+    }
+
+    return session_release_requests(tag->session);
+}
+
+
+/*
+ * ab_tag_read
+ *
+ * Start a read from the API.  If the tag is in a read group, the whole
+ * group is read.
+ */
+
+int ab_tag_read(ab_tag_p tag)
+{
+    if(tag->read_group && !tag->in_group_read) {
+        return ab_tag_read_group_start(tag);
+    }
+
+    return tag->read_start(tag);
+}
+
+
+/*
+ * ab_tag_created
+ *
+ * Called by the library once the tag is set up and has its tag ID.
+ * Other threads reading the group lock, read and signal the members, so
+ * the tag is only put into its read group here.
+ */
+
+int ab_tag_created(ab_tag_p tag)
+{
+    int rc = PLCTAG_STATUS_OK;
+
+    if(tag->read_group) {
+        rc = read_group_add(tag);
+        if(rc != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_WARN, "Unable to add tag to read group!");
+        }
+    }
+
+    return rc;
+}
+
+
+/*
+ * ab_tag_read_group_start
+ *
+ * Start a read on the tag and on all the other tags in its read group.
+ * The sessions are held until every request is queued so that the
+ * group is packed into as few packets as possible.  All the members
+ * get the read start time of the tag.
+ *
+ * Members that are locked by another thread or that already have an
+ * operation in flight are skipped.  This is called with the tag's
+ * API mutex held.
+ */
+
+int ab_tag_read_group_start(ab_tag_p tag)
+{
+    int rc = PLCTAG_STATUS_OK;
+    vector_p members = find_read_group_tags(tag);
+
+    pdebug(DEBUG_DETAIL, "Starting.");
+
+    ab_tag_batch_start(tag);
+
+    for(int i=0; members && i < vector_length(members); i++) {
+        ab_tag_batch_start(vector_get(members, i));
+    }
+
+    tag->in_group_read = 1;
+    rc = tag->vtable->read((plc_tag_p)tag);
+    tag->in_group_read = 0;
+
+    for(int i=0; members && i < vector_length(members); i++) {
+        ab_tag_p member = vector_get(members, i);
+        int member_rc = PLCTAG_STATUS_OK;
+
+        if(mutex_try_lock(member->api_mutex) != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_DETAIL, "Skipping busy read group member %d.", member->tag_id);
+            continue;
+        }
+
+        if(!member->read_in_flight && !member->write_in_flight && !member->read_in_progress && !member->write_in_progress) {
+            cond_clear(member->tag_cond);
+
+            member->in_group_read = 1;
+            member_rc = member->vtable->read((plc_tag_p)member);
+            member->in_group_read = 0;
+
+            if(member_rc == PLCTAG_STATUS_PENDING || member_rc == PLCTAG_STATUS_OK) {
+                member->read_in_flight = 1;
+                member->write_in_flight = 0;
+                member->read_start_time = tag->read_start_time;
+            } else {
+                pdebug(DEBUG_WARN, "Unable to start read of read group member %d, %s!", member->tag_id, plc_tag_decode_error(member_rc));
+            }
+        }
+
+        tag_api_unlock((plc_tag_p)member);
+    }
+
+    /* let the sessions send the whole group. */
+    for(int i=0; members && i < vector_length(members); i++) {
+        ab_tag_batch_end(vector_get(members, i));
+    }
+
+    ab_tag_batch_end(tag);
+
+    if(members) {
+        while(vector_length(members) > 0) {
+            rc_dec(vector_remove(members, vector_length(members) - 1));
+        }
+
+        vector_destroy(members);
+    }
+
+    pdebug(DEBUG_DETAIL, "Done.");
+
+    return rc;
+}
+
+
+/*
+ * find_read_group_tags
+ *
+ * Return a vector with strong references to the other tags in the
+ * tag's read group.  The caller must release the references and
+ * destroy the vector.  Returns NULL if the tag is not in a group or
+ * on error.
+ */
+
+vector_p find_read_group_tags(ab_tag_p tag)
+{
+    vector_p result = NULL;
+
+    if(!tag->read_group) {
+        return NULL;
+    }
+
+    if((result = vector_create(READ_GROUP_MIN_SIZE, READ_GROUP_INC_SIZE)) == NULL) {
+        pdebug(DEBUG_ERROR, "Unable to create read group member list!");
+        return NULL;
+    }
+
+    critical_block(read_group_mutex) {
+        for(int i=0; i < vector_length(read_group_tags); i++) {
+            ab_tag_p member = vector_get(read_group_tags, i);
+
+            if(member == tag || str_cmp(member->read_group, tag->read_group)) {
+                continue;
+            }
+
+            /* the tag may be in the process of being destroyed. */
+            member = rc_inc(member);
+            if(member) {
+                vector_put(result, vector_length(result), member);
+            }
+        }
+    }
+
+    return result;
+}
+
+
+int read_group_add(ab_tag_p tag)
+{
+    int rc = PLCTAG_STATUS_OK;
+
+    critical_block(read_group_mutex) {
+        rc = vector_put(read_group_tags, vector_length(read_group_tags), tag);
+    }
+
+    return rc;
+}
+
+
+void read_group_remove(ab_tag_p tag)
+{
+    critical_block(read_group_mutex) {
+        for(int i=0; i < vector_length(read_group_tags); i++) {
+            if(vector_get(read_group_tags, i) == tag) {
+                vector_remove(read_group_tags, i);
+                break;
+            }
+        }
+    }
+}
+
+
+
 /*
  * ab_tag_destroy
  *
@@ -611,11 +895,17 @@ void ab_tag_destroy(ab_tag_p tag)
 
     session = tag->session;
 
+    if(tag->read_group) {
+        read_group_remove(tag);
+        mem_free(tag->read_group);
+        tag->read_group = NULL;
+    }
+
     /* tags should always have a session.  Release it. */
     pdebug(DEBUG_DETAIL,"Getting ready to release tag session %p",tag->session);
     if(session) {
         pdebug(DEBUG_DETAIL, "Removing tag from session.");
-        rc_dec(session);
+        session_release(session);
         tag->session = NULL;
     } else {
         pdebug(DEBUG_WARN,"No session pointer!");
@@ -631,6 +921,14 @@ void ab_tag_destroy(ab_tag_p tag)
         tag->api_mutex = NULL;
     }
 
+    if(tag->tag_cond) {
+        cond_destroy(&(tag->tag_cond));
+        tag->tag_cond = NULL;
+    }
+
+    /* get back the data buffer we allocated. */
+    tag_data_buffers_destroy((plc_tag_p)tag);
+
     if (tag->data) {
         mem_free(tag->data);
         tag->data = NULL;
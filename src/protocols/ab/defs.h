@@ -51,6 +51,7 @@
 #define AB_EIP_DEFAULT_TIMEOUT 2000 /* in ms */
 
 /* AB Commands */
+#define AB_EIP_LIST_IDENTITY        ((uint16_t)0x0063)
 #define AB_EIP_REGISTER_SESSION     ((uint16_t)0x0065)
 #define AB_EIP_UNREGISTER_SESSION   ((uint16_t)0x0066)
 #define AB_EIP_UNCONNECTED_SEND     ((uint16_t)0x006F)
@@ -68,6 +69,7 @@
 
 /* CIP embedded packet commands */
 #define AB_EIP_CMD_CIP_MULTI            ((uint8_t)0x0A)
+#define AB_EIP_CMD_CIP_GET_ATTR_SINGLE  ((uint8_t)0x0E)
 #define AB_EIP_CMD_CIP_READ             ((uint8_t)0x4C)
 #define AB_EIP_CMD_CIP_WRITE            ((uint8_t)0x4D)
 #define AB_EIP_CMD_CIP_READ_FRAG        ((uint8_t)0x52)
@@ -54,10 +54,14 @@
 //int allocate_write_request_slot(ab_tag_p tag);
 //int multi_tag_read_start(ab_tag_p tag);
 static int build_read_request_connected(ab_tag_p tag, int byte_offset);
+static int queue_read_request_connected(ab_tag_p tag, int byte_offset, int allow_packing, ab_request_p *req_out);
 static int build_read_request_unconnected(ab_tag_p tag, int byte_offset);
 static int build_write_request_connected(ab_tag_p tag, int byte_offset);
 static int build_write_request_unconnected(ab_tag_p tag, int byte_offset);
 static int check_read_status_connected(ab_tag_p tag);
+static int decode_read_response_connected(ab_tag_p tag, ab_request_p req, int byte_offset, int *bytes_read, int *partial_data);
+static int start_read_frags_connected(ab_tag_p tag);
+static int check_read_frags_connected(ab_tag_p tag);
 static int check_read_status_unconnected(ab_tag_p tag);
 static int check_write_status_connected(ab_tag_p tag);
 static int check_write_status_unconnected(ab_tag_p tag);
@@ -70,9 +74,10 @@ static int calculate_write_data_per_packet(ab_tag_p tag);
     tag_vtable_func status;
     tag_vtable_func tickler;
     tag_vtable_func write;
+    tag_vtable_func batch_start;
+    tag_vtable_func batch_end;
 */
 
-static int tag_read_start(ab_tag_p tag);
 static int tag_status(ab_tag_p tag);
 static int tag_tickler(ab_tag_p tag);
 static int tag_write_start(ab_tag_p tag);
@@ -80,10 +85,13 @@ static int tag_write_start(ab_tag_p tag);
 /* define the exported vtable for this tag type. */
 struct tag_vtable_t eip_cip_vtable = {
     (tag_vtable_func)ab_tag_abort, /* shared */
-    (tag_vtable_func)tag_read_start,
+    (tag_vtable_func)ab_tag_read, /* shared */
     (tag_vtable_func)tag_status,
     (tag_vtable_func)tag_tickler,
-    (tag_vtable_func)tag_write_start
+    (tag_vtable_func)tag_write_start,
+    (tag_vtable_func)ab_tag_batch_start, /* shared */
+    (tag_vtable_func)ab_tag_batch_end, /* shared */
+    (tag_vtable_func)ab_tag_created /* shared */
 };
 
 
@@ -136,7 +144,9 @@ int tag_tickler(ab_tag_p tag)
     pdebug(DEBUG_SPEW,"Starting.");
 
     if (tag->read_in_progress) {
-        if(tag->use_connected_msg) {
+        if(tag->num_read_frags > 0) {
+            rc = check_read_frags_connected(tag);
+        } else if(tag->use_connected_msg) {
             rc = check_read_status_connected(tag);
         } else {
             rc = check_read_status_unconnected(tag);
@@ -173,7 +183,7 @@ int tag_tickler(ab_tag_p tag)
 
 
 /*
- * tag_read_start
+ * eip_cip_tag_read_start
  *
  * This function must be called only from within one thread, or while
  * the tag's mutex is locked.
@@ -181,7 +191,7 @@ int tag_tickler(ab_tag_p tag)
  * The function starts the process of getting tag data from the PLC.
  */
 
-int tag_read_start(ab_tag_p tag)
+int eip_cip_tag_read_start(ab_tag_p tag)
 {
     int rc = PLCTAG_STATUS_OK;
 
@@ -240,7 +250,7 @@ int tag_write_start(ab_tag_p tag)
 
         tag->pre_write_read = 1;
 
-        return tag_read_start(tag);
+        return eip_cip_tag_read_start(tag);
     }
 
     if (rc != PLCTAG_STATUS_OK) {
@@ -271,6 +281,20 @@ int tag_write_start(ab_tag_p tag)
 
 
 int build_read_request_connected(ab_tag_p tag, int byte_offset)
+{
+    return queue_read_request_connected(tag, byte_offset, tag->allow_packing, &tag->req);
+}
+
+
+
+/*
+ * queue_read_request_connected
+ *
+ * Build a read of the tag from byte_offset on and queue it on the session.
+ * The request is returned in req_out.
+ */
+
+int queue_read_request_connected(ab_tag_p tag, int byte_offset, int allow_packing, ab_request_p *req_out)
 {
     eip_cip_co_req* cip = NULL;
     uint8_t* data = NULL;
@@ -340,19 +364,21 @@ int build_read_request_connected(ab_tag_p tag, int byte_offset)
     /* set the session so that we know what session the request is aiming at */
     //req->session = tag->session;
 
-    req->allow_packing = tag->allow_packing;
+    req->allow_packing = allow_packing;
+
+    req->priority = tag->priority;
 
     /* add the request to the session's list. */
     rc = session_add_request(tag->session, req);
 
     if (rc != PLCTAG_STATUS_OK) {
         pdebug(DEBUG_ERROR, "Unable to add request to session! rc=%d", rc);
-        tag->req = rc_dec(req);
+        *req_out = rc_dec(req);
         return rc;
     }
 
     /* save the request for later */
-    tag->req = req;
+    *req_out = req;
 
     pdebug(DEBUG_INFO, "Done");
 
@@ -470,6 +496,8 @@ int build_read_request_unconnected(ab_tag_p tag, int byte_offset)
     /* allow packing if the tag allows it. */
     req->allow_packing = tag->allow_packing;
 
+    req->priority = tag->priority;
+
     /* add the request to the session's list. */
     rc = session_add_request(tag->session, req);
 
@@ -606,6 +634,8 @@ int build_write_request_connected(ab_tag_p tag, int byte_offset)
     /* allow packing if the tag allows it. */
     req->allow_packing = tag->allow_packing;
 
+    req->priority = tag->priority;
+
     /* add the request to the session's list. */
     rc = session_add_request(tag->session, req);
 
@@ -778,6 +808,8 @@ int build_write_request_unconnected(ab_tag_p tag, int byte_offset)
     /* allow packing if the tag allows it. */
     req->allow_packing = tag->allow_packing;
 
+    req->priority = tag->priority;
+
     /* add the request to the session's list. */
     rc = session_add_request(tag->session, req);
 
@@ -813,9 +845,7 @@ int build_write_request_unconnected(ab_tag_p tag, int byte_offset)
 static int check_read_status_connected(ab_tag_p tag)
 {
     int rc = PLCTAG_STATUS_OK;
-    eip_cip_co_resp* cip_resp;
-    uint8_t* data;
-    uint8_t* data_end;
+    int bytes_read = 0;
     int partial_data = 0;
 
     pdebug(DEBUG_SPEW, "Starting.");
@@ -865,15 +895,93 @@ static int check_read_status_connected(ab_tag_p tag)
     }
 
     /* the request is ours exclusively. */
+    rc = decode_read_response_connected(tag, tag->req, tag->byte_offset, &bytes_read, &partial_data);
+    if(rc == PLCTAG_STATUS_OK) {
+        /* bump the byte offset */
+        tag->byte_offset += bytes_read;
+    }
+
+    /* clean up the request */
+    tag->req->abort_request = 1;
+    tag->req = rc_dec(tag->req);
+
+    /* are we actually done? */
+    if (rc == PLCTAG_STATUS_OK) {
+        /* skip if we are doing a pre-write read. */
+        if (!tag->pre_write_read && partial_data && tag->byte_offset < tag->size) {
+            if(tag->pipeline_reads && bytes_read > 0) {
+                /* now we know the size of a piece, ask for all the rest at once. */
+                pdebug(DEBUG_DETAIL, "requesting the remaining chunks together.");
+                rc = start_read_frags_connected(tag);
+            } else {
+                /* call read start again to get the next piece */
+                pdebug(DEBUG_DETAIL, "calling eip_cip_tag_read_start() to get the next chunk.");
+                rc = eip_cip_tag_read_start(tag);
+            }
+        } else {
+            /* done! */
+            if (!tag->pre_write_read) {
+                tag_data_read_done((plc_tag_p)tag, tag->byte_offset);
+            }
+
+            tag->first_read = 0;
+            tag->byte_offset = 0;
+
+            /* if this is a pre-read for a write, then pass off to the write routine */
+            if (tag->pre_write_read) {
+                pdebug(DEBUG_DETAIL, "Restarting write call now.");
+
+                tag->pre_write_read = 0;
+                rc = tag_write_start(tag);
+            }
+
+            /* do this after the write starts. This helps prevent races with the client. */
+            tag->read_in_progress = 0;
+        }
+    }
+
+    /* this is not an else clause because the above if could result in bad rc. */
+    if(rc != PLCTAG_STATUS_OK && rc != PLCTAG_STATUS_PENDING) {
+        /* error ! */
+        pdebug(DEBUG_WARN, "Error received!");
+
+        /* clean up everything. */
+        ab_tag_abort(tag);
+    }
+
+    pdebug(DEBUG_SPEW, "Done.");
+
+    return rc;
+}
+
+
+
+/*
+ * decode_read_response_connected
+ *
+ * Check the response to a connected read and copy its data into the tag's
+ * read buffer at byte_offset.  The number of data bytes is returned in
+ * bytes_read and partial_data is set if the PLC has more to send.
+ */
+
+static int decode_read_response_connected(ab_tag_p tag, ab_request_p req, int byte_offset, int *bytes_read, int *partial_data)
+{
+    int rc = PLCTAG_STATUS_OK;
+    eip_cip_co_resp* cip_resp;
+    uint8_t* data;
+    uint8_t* data_end;
+
+    *bytes_read = 0;
+    *partial_data = 0;
 
     /* point to the data */
-    cip_resp = (eip_cip_co_resp*)(tag->req->data);
+    cip_resp = (eip_cip_co_resp*)(req->data);
 
     /* point to the start of the data */
-    data = (tag->req->data) + sizeof(eip_cip_co_resp);
+    data = (req->data) + sizeof(eip_cip_co_resp);
 
     /* point the end of the data */
-    data_end = (tag->req->data + le2h16(cip_resp->encap_length) + sizeof(eip_encap));
+    data_end = (req->data + le2h16(cip_resp->encap_length) + sizeof(eip_encap));
 
     /* check the status */
     do {
@@ -913,7 +1021,7 @@ static int check_read_status_connected(ab_tag_p tag)
         }
 
         /* check to see if this is a partial response. */
-        partial_data = (cip_resp->status == AB_CIP_STATUS_FRAG);
+        *partial_data = (cip_resp->status == AB_CIP_STATUS_FRAG);
 
         /*
          * check to see if there is any data to process.  If this is a packed
@@ -965,12 +1073,12 @@ static int check_read_status_connected(ab_tag_p tag)
             }
 
             /* check data size. */
-            if ((tag->byte_offset + (data_end - data)) > tag->size) {
+            if ((byte_offset + (data_end - data)) > tag->size) {
                 pdebug(DEBUG_WARN,
                        "Read data is too long (%d bytes) to fit in tag data buffer (%d bytes)!",
-                       tag->byte_offset + (int)(data_end - data),
+                       byte_offset + (int)(data_end - data),
                        tag->size);
-                pdebug(DEBUG_WARN,"byte_offset=%d, data size=%d", tag->byte_offset, (int)(data_end - data));
+                pdebug(DEBUG_WARN,"byte_offset=%d, data size=%d", byte_offset, (int)(data_end - data));
                 rc = PLCTAG_ERR_TOO_LARGE;
                 break;
             }
@@ -984,11 +1092,17 @@ static int check_read_status_connected(ab_tag_p tag)
              * put into the tag's data buffer.
              */
             if (!tag->pre_write_read) {
-                mem_copy(tag->data + tag->byte_offset, data, (int)(data_end - data));
+                uint8_t *tag_data = tag_data_read_buffer((plc_tag_p)tag);
+
+                if(!tag_data) {
+                    rc = PLCTAG_ERR_NO_RESOURCES;
+                    break;
+                }
+
+                mem_copy(tag_data + byte_offset, data, (int)(data_end - data));
             }
 
-            /* bump the byte offset */
-            tag->byte_offset += (int)(data_end - data);
+            *bytes_read = (int)(data_end - data);
         } else {
             pdebug(DEBUG_DETAIL, "Response returned no data and no error.");
         }
@@ -997,41 +1111,148 @@ static int check_read_status_connected(ab_tag_p tag)
         rc = PLCTAG_STATUS_OK;
     } while(0);
 
-    /* clean up the request */
-    tag->req->abort_request = 1;
-    tag->req = rc_dec(tag->req);
+    return rc;
+}
 
-    /* are we actually done? */
-    if (rc == PLCTAG_STATUS_OK) {
-        /* skip if we are doing a pre-write read. */
-        if (!tag->pre_write_read && partial_data && tag->byte_offset < tag->size) {
-            /* call read start again to get the next piece */
-            pdebug(DEBUG_DETAIL, "calling tag_read_start() to get the next chunk.");
-            rc = tag_read_start(tag);
-        } else {
-            /* done! */
-            tag->first_read = 0;
-            tag->byte_offset = 0;
 
-            /* if this is a pre-read for a write, then pass off to the write routine */
-            if (tag->pre_write_read) {
-                pdebug(DEBUG_DETAIL, "Restarting write call now.");
 
-                tag->pre_write_read = 0;
-                rc = tag_write_start(tag);
+/*
+ * start_read_frags_connected
+ *
+ * The first piece of a large read tells us how much the PLC sends per
+ * response.  Queue reads for all of the remaining pieces at once so that
+ * they can go out back to back instead of one round trip each.  The
+ * pieces are not packed together because the PLC would have to split one
+ * response packet between them.
+ */
+
+static int start_read_frags_connected(ab_tag_p tag)
+{
+    int rc = PLCTAG_STATUS_OK;
+    int chunk_size = tag->byte_offset;
+    int remaining = tag->size - tag->byte_offset;
+    int num_frags = (remaining + chunk_size - 1) / chunk_size;
+
+    pdebug(DEBUG_DETAIL, "Starting.");
+
+    if(num_frags > AB_MAX_READ_FRAGS) {
+        num_frags = AB_MAX_READ_FRAGS;
+        chunk_size = (remaining + num_frags - 1) / num_frags;
+    }
+
+    for(int i=0; i < num_frags; i++) {
+        int offset = tag->byte_offset + (i * chunk_size);
+
+        tag->read_frag_offsets[i] = offset;
+        tag->read_frag_ends[i] = (offset + chunk_size < tag->size ? offset + chunk_size : tag->size);
+
+        rc = queue_read_request_connected(tag, offset, 0, &(tag->read_frag_reqs[i]));
+        if(rc != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_WARN, "Unable to queue read of chunk at offset %d!", offset);
+            break;
+        }
+
+        tag->num_read_frags = i + 1;
+    }
+
+    if(rc == PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_DETAIL, "Requested %d chunks of %d bytes.", num_frags, chunk_size);
+        rc = PLCTAG_STATUS_PENDING;
+    }
+
+    pdebug(DEBUG_DETAIL, "Done.");
+
+    return rc;
+}
+
+
+
+/*
+ * check_read_frags_connected
+ *
+ * Copy in the pieces of a pipelined read as they arrive.  If a response
+ * does not cover all of its piece, ask for the rest of that piece.  The
+ * read is done when every piece is in.
+ */
+
+static int check_read_frags_connected(ab_tag_p tag)
+{
+    int rc = PLCTAG_STATUS_OK;
+    int pending = 0;
+    int size_read = tag->byte_offset;
+
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    for(int i=0; i < tag->num_read_frags && rc == PLCTAG_STATUS_OK; i++) {
+        ab_request_p req = tag->read_frag_reqs[i];
+        int received = 0;
+        int bytes_read = 0;
+        int partial_data = 0;
+
+        if(!req) {
+            /* this piece is in. */
+            if(tag->read_frag_offsets[i] > size_read) {
+                size_read = tag->read_frag_offsets[i];
             }
 
-            /* do this after the write starts. This helps prevent races with the client. */
-            tag->read_in_progress = 0;
+            continue;
+        }
+
+        /* request can be used by two threads at once. */
+        spin_block(&req->lock) {
+            received = req->resp_received;
+
+            if(received && req->status != PLCTAG_STATUS_OK) {
+                rc = req->status;
+                pdebug(DEBUG_WARN,"Session reported failure of request: %s.", plc_tag_decode_error(rc));
+            }
+        }
+
+        if(!received) {
+            pending = 1;
+            continue;
+        }
+
+        if(rc == PLCTAG_STATUS_OK) {
+            rc = decode_read_response_connected(tag, req, tag->read_frag_offsets[i], &bytes_read, &partial_data);
+        }
+
+        /* the request is ours exclusively. */
+        req->abort_request = 1;
+        tag->read_frag_reqs[i] = rc_dec(req);
+
+        if(rc != PLCTAG_STATUS_OK) {
+            break;
+        }
+
+        tag->read_frag_offsets[i] += bytes_read;
+
+        /* the PLC can send less than we asked for, go back for the rest. */
+        if(partial_data && bytes_read > 0 && tag->read_frag_offsets[i] < tag->read_frag_ends[i]) {
+            rc = queue_read_request_connected(tag, tag->read_frag_offsets[i], 0, &(tag->read_frag_reqs[i]));
+            pending = 1;
+        } else if(tag->read_frag_offsets[i] > size_read) {
+            size_read = tag->read_frag_offsets[i];
         }
     }
 
-    /* this is not an else clause because the above if could result in bad rc. */
-    if(rc != PLCTAG_STATUS_OK && rc != PLCTAG_STATUS_PENDING) {
-        /* error ! */
+    if(rc == PLCTAG_STATUS_OK && pending) {
+        rc = PLCTAG_STATUS_PENDING;
+    } else if(rc == PLCTAG_STATUS_OK) {
+        /* done! */
+        pdebug(DEBUG_DETAIL, "All %d chunks are in.", tag->num_read_frags);
+
+        tag->num_read_frags = 0;
+
+        tag_data_read_done((plc_tag_p)tag, (size_read < tag->size ? size_read : tag->size));
+
+        tag->first_read = 0;
+        tag->byte_offset = 0;
+        tag->read_in_progress = 0;
+    } else {
         pdebug(DEBUG_WARN, "Error received!");
 
-        /* clean up everything. */
+        /* clean up everything, including the other pieces. */
         ab_tag_abort(tag);
     }
 
@@ -1215,7 +1436,14 @@ static int check_read_status_unconnected(ab_tag_p tag)
          * put into the tag's data buffer.
          */
         if (!tag->pre_write_read) {
-            mem_copy(tag->data + tag->byte_offset, data, (int)(data_end - data));
+            uint8_t *tag_data = tag_data_read_buffer((plc_tag_p)tag);
+
+            if(!tag_data) {
+                rc = PLCTAG_ERR_NO_RESOURCES;
+                break;
+            }
+
+            mem_copy(tag_data + tag->byte_offset, data, (int)(data_end - data));
         }
 
         /* bump the byte offset */
@@ -1235,10 +1463,14 @@ static int check_read_status_unconnected(ab_tag_p tag)
         /* skip if we are doing a pre-write read. */
         if (!tag->pre_write_read && partial_data && tag->byte_offset < tag->size) {
             /* call read start again to get the next piece */
-            pdebug(DEBUG_DETAIL, "calling tag_read_start() to get the next chunk.");
-            rc = tag_read_start(tag);
+            pdebug(DEBUG_DETAIL, "calling eip_cip_tag_read_start() to get the next chunk.");
+            rc = eip_cip_tag_read_start(tag);
         } else {
             /* done! */
+            if (!tag->pre_write_read) {
+                tag_data_read_done((plc_tag_p)tag, tag->byte_offset);
+            }
+
             tag->first_read = 0;
             tag->byte_offset = 0;
 
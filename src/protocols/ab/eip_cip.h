@@ -31,7 +31,7 @@
 #include <ab/ab_common.h>
 
 //extern int eip_cip_tag_status(ab_tag_p tag);
-//extern int eip_cip_tag_read_start(ab_tag_p tag);
+extern int eip_cip_tag_read_start(ab_tag_p tag);
 //extern int eip_cip_tag_write_start(ab_tag_p tag);
 //extern int eip_cip_tag_tickler(ab_tag_p tag);
 
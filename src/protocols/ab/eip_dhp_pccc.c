@@ -44,17 +44,19 @@ static int check_write_status(ab_tag_p tag);
 
 
 
-static int tag_read_start(ab_tag_p tag);
 static int tag_status(ab_tag_p tag);
 static int tag_tickler(ab_tag_p tag);
 static int tag_write_start(ab_tag_p tag);
 
 struct tag_vtable_t eip_dhp_pccc_vtable = {
     (tag_vtable_func)ab_tag_abort, /* shared */
-    (tag_vtable_func)tag_read_start,
+    (tag_vtable_func)ab_tag_read, /* shared */
     (tag_vtable_func)tag_status,
     (tag_vtable_func)tag_tickler,
-    (tag_vtable_func)tag_write_start
+    (tag_vtable_func)tag_write_start,
+    (tag_vtable_func)ab_tag_batch_start, /* shared */
+    (tag_vtable_func)ab_tag_batch_end, /* shared */
+    (tag_vtable_func)ab_tag_created /* shared */
 };
 
 
@@ -124,11 +126,11 @@ int tag_tickler(ab_tag_p tag)
 
 
 /*
- * tag_read_start
+ * eip_dhp_pccc_tag_read_start
  *
  * This does not support multiple request fragments.
  */
-int tag_read_start(ab_tag_p tag)
+int eip_dhp_pccc_tag_read_start(ab_tag_p tag)
 {
     pccc_dhp_co_req *pccc;
     uint8_t *data = NULL;
@@ -223,6 +225,8 @@ int tag_read_start(ab_tag_p tag)
     /* mark the request ready for sending */
     //req->send_request = 1;
 
+    req->priority = tag->priority;
+
     /* add the request to the session's list. */
     rc = session_add_request(tag->session, req);
 
@@ -389,6 +393,8 @@ int tag_write_start(ab_tag_p tag)
     /* this request is connected, so it needs the session exclusively */
     //req->connected_request = 1;
 
+    req->priority = tag->priority;
+
     /* add the request to the session's list. */
     rc = session_add_request(tag->session, req);
 
@@ -421,6 +427,7 @@ static int check_read_status(ab_tag_p tag)
     pccc_dhp_co_resp *resp;
     uint8_t *data;
     uint8_t *data_end;
+    uint8_t *tag_data;
     int pccc_res_type;
     int pccc_res_length;
     int rc = PLCTAG_STATUS_OK;
@@ -532,7 +539,15 @@ static int check_read_status(ab_tag_p tag)
         }
 
         /* copy data into the tag. */
-        mem_copy(tag->data, data, (int)(data_end - data));
+        tag_data = tag_data_read_buffer((plc_tag_p)tag);
+        if(!tag_data) {
+            rc = PLCTAG_ERR_NO_RESOURCES;
+            break;
+        }
+
+        mem_copy(tag_data, data, (int)(data_end - data));
+
+        tag_data_read_done((plc_tag_p)tag, (int)(data_end - data));
 
         rc = PLCTAG_STATUS_OK;
     } while(0);
@@ -60,17 +60,19 @@ START_PACK typedef struct {
 } END_PACK embedded_pccc;
 
 
-static int tag_read_start(ab_tag_p tag);
 static int tag_status(ab_tag_p tag);
 static int tag_tickler(ab_tag_p tag);
 static int tag_write_start(ab_tag_p tag);
 
 struct tag_vtable_t eip_lgx_pccc_vtable = {
     (tag_vtable_func)ab_tag_abort, /* shared */
-    (tag_vtable_func)tag_read_start,
+    (tag_vtable_func)ab_tag_read, /* shared */
     (tag_vtable_func)tag_status,
     (tag_vtable_func)tag_tickler,
-    (tag_vtable_func)tag_write_start
+    (tag_vtable_func)tag_write_start,
+    (tag_vtable_func)ab_tag_batch_start, /* shared */
+    (tag_vtable_func)ab_tag_batch_end, /* shared */
+    (tag_vtable_func)ab_tag_created /* shared */
 };
 
 static int check_read_status(ab_tag_p tag);
@@ -144,12 +146,12 @@ int tag_tickler(ab_tag_p tag)
 
 
 /*
- * tag_read_start
+ * eip_lgx_pccc_tag_read_start
  *
  * Start a PCCC tag read (PLC5, SLC).
  */
 
-int tag_read_start(ab_tag_p tag)
+int eip_lgx_pccc_tag_read_start(ab_tag_p tag)
 {
     int rc = PLCTAG_STATUS_OK;
     ab_request_p req;
@@ -303,6 +305,8 @@ int tag_read_start(ab_tag_p tag)
     //req->send_request = 1;
     req->allow_packing = tag->allow_packing;
 
+    req->priority = tag->priority;
+
     /* add the request to the session's list. */
     rc = session_add_request(tag->session, req);
 
@@ -464,7 +468,16 @@ static int check_read_status(ab_tag_p tag)
          * the user has set, possibly.
          */
         if(!tag->pre_write_read) {
-            mem_copy(tag->data, data, (int)(data_end - data));
+            uint8_t *tag_data = tag_data_read_buffer((plc_tag_p)tag);
+
+            if(!tag_data) {
+                rc = PLCTAG_ERR_NO_RESOURCES;
+                break;
+            }
+
+            mem_copy(tag_data, data, (int)(data_end - data));
+
+            tag_data_read_done((plc_tag_p)tag, (int)(data_end - data));
         }
 
         /* copy type data into tag. */
@@ -522,7 +535,7 @@ int tag_write_start(ab_tag_p tag)
 
         tag->pre_write_read = 1;
 
-        return tag_read_start(tag);
+        return eip_lgx_pccc_tag_read_start(tag);
     }
 
     pdebug(DEBUG_INFO,"Starting.");
@@ -662,6 +675,8 @@ int tag_write_start(ab_tag_p tag)
     /* get ready to add the request to the queue for this session */
     req->request_size = (int)(data - (req->data));
 
+    req->priority = tag->priority;
+
     /* add the request to the session's list. */
     rc = session_add_request(tag->session, req);
 
@@ -24,6 +24,8 @@
 #include <ab/ab_common.h>
 
 /* Logix with tags mapped onto PCCC */
+extern int eip_lgx_pccc_tag_read_start(ab_tag_p tag);
+
 extern struct tag_vtable_t eip_lgx_pccc_vtable;
 
 #endif
@@ -44,17 +44,19 @@ extern "C"
 
 
 /* PCCC */
-static int tag_read_start(ab_tag_p tag);
 static int tag_status(ab_tag_p tag);
 static int tag_tickler(ab_tag_p tag);
 static int tag_write_start(ab_tag_p tag);
 
 struct tag_vtable_t eip_pccc_vtable = {
     (tag_vtable_func)ab_tag_abort, /* shared */
-    (tag_vtable_func)tag_read_start,
+    (tag_vtable_func)ab_tag_read, /* shared */
     (tag_vtable_func)tag_status,
     (tag_vtable_func)tag_tickler,
-    (tag_vtable_func)tag_write_start
+    (tag_vtable_func)tag_write_start,
+    (tag_vtable_func)ab_tag_batch_start, /* shared */
+    (tag_vtable_func)ab_tag_batch_end, /* shared */
+    (tag_vtable_func)ab_tag_created /* shared */
 };
 
 
@@ -131,12 +133,12 @@ int tag_tickler(ab_tag_p tag)
 
 
 /*
- * tag_read_start
+ * eip_pccc_tag_read_start
  *
  * Start a PCCC tag read (PLC5, SLC).
  */
 
-int tag_read_start(ab_tag_p tag)
+int eip_pccc_tag_read_start(ab_tag_p tag)
 {
     int rc = PLCTAG_STATUS_OK;
     ab_request_p req;
@@ -250,6 +252,8 @@ int tag_read_start(ab_tag_p tag)
     /* mark it as ready to send */
     //req->send_request = 1;
 
+    req->priority = tag->priority;
+
     /* add the request to the session's list. */
     rc = session_add_request(tag->session, req);
     if(rc != PLCTAG_STATUS_OK) {
@@ -287,6 +291,7 @@ static int check_read_status(ab_tag_p tag)
     pccc_resp *pccc;
     uint8_t *data;
     uint8_t *data_end;
+    uint8_t *tag_data;
     int pccc_res_type;
     int pccc_res_length;
     int rc = PLCTAG_STATUS_OK;
@@ -401,7 +406,15 @@ static int check_read_status(ab_tag_p tag)
         }
 
         /* copy data into the tag. */
-        mem_copy(tag->data, data, (int)(data_end - data));
+        tag_data = tag_data_read_buffer((plc_tag_p)tag);
+        if(!tag_data) {
+            rc = PLCTAG_ERR_NO_RESOURCES;
+            break;
+        }
+
+        mem_copy(tag_data, data, (int)(data_end - data));
+
+        tag_data_read_done((plc_tag_p)tag, (int)(data_end - data));
 
         rc = PLCTAG_STATUS_OK;
     } while(0);
@@ -579,6 +592,8 @@ int tag_write_start(ab_tag_p tag)
     //req->conn_seq = conn_seq_id;
 
 
+    req->priority = tag->priority;
+
     /* add the request to the session's list. */
     rc = session_add_request(tag->session, req);
     if(rc != PLCTAG_STATUS_OK) {
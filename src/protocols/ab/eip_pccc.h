@@ -32,6 +32,8 @@
 
 
 /* PCCC with DH+ last hop */
+extern int eip_pccc_tag_read_start(ab_tag_p tag);
+
 extern struct tag_vtable_t eip_pccc_vtable;
 
 
@@ -26,8 +26,12 @@
 #include <ab/error_codes.h>
 #include <ab/session.h>
 #include <util/debug.h>
+#include <util/hash.h>
+#include <util/hashtable.h>
+#include <ctype.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
 
@@ -53,12 +57,39 @@
 
 /*
  * Number of milliseconds to wait to try to set up the session again
- * after a failure.
+ * after a failure.  The wait doubles with each failure in a row, up to
+ * the maximum.
  */
-#define RETRY_WAIT_MS (5000)
+#define RETRY_MIN_WAIT_MS (1000)
+#define RETRY_MAX_WAIT_MS (60000)
+
+/*
+ * After this many failures in a row the PLC is taken to be down.  New
+ * requests fail at once with PLCTAG_ERR_PLC_OFFLINE until a retry gets
+ * through.
+ */
+#define RETRY_CIRCUIT_FAILURES (3)
 
 #define SESSION_DISCONNECT_TIMEOUT (5000)
 
+/* the PLC may already be gone when we close the connections, so do not wait long. */
+#define SESSION_FORWARD_CLOSE_TIMEOUT (250)
+
+/* where session_exchange() is with the current packet. */
+#define EXCHANGE_IDLE (0)
+#define EXCHANGE_SEND (1)
+#define EXCHANGE_RECV (2)
+
+/* the steps of perform_forward_open(). */
+#define CONNECT_START       (0)
+#define CONNECT_CACHED      (1)
+#define CONNECT_EX          (2)
+#define CONNECT_EX_RETRY    (3)
+#define CONNECT_OLD         (4)
+#define CONNECT_OLD_RETRY   (5)
+#define CONNECT_MORE        (6)
+#define CONNECT_DONE        (7)
+
 
 
 static ab_session_p session_create_unsafe(const char *host, int gw_port, const char *path, int plc_type, int use_connected_msg);
@@ -66,37 +97,94 @@ static int session_init(ab_session_p session);
 static int get_plc_type(attr attribs);
 static int add_session_unsafe(ab_session_p n);
 static int remove_session_unsafe(ab_session_p n);
-static ab_session_p find_session_by_host_unsafe(const char *gateway, const char *path);
-static int session_match_valid(const char *host, const char *path, ab_session_p session);
-static int session_add_request_unsafe(ab_session_p sess, ab_request_p req);
+static int remove_session(ab_session_p s);
+static char *session_make_key(const char *host, int port, const char *path, int plc_type, int use_connected_msg);
+static int64_t session_hash_key(const char *key);
+static ab_session_p find_session_by_key_unsafe(const char *key);
+static int session_match_valid(const char *key, ab_session_p session);
 static int session_open_socket(ab_session_p session);
+static int session_check_socket(ab_session_p session);
 static void session_destroy(void *session);
 static int session_register(ab_session_p session);
 static int session_close_socket(ab_session_p session);
 static int session_unregister(ab_session_p session);
-static THREAD_FUNC(session_handler);
+static void session_run(ab_session_p session);
+static int session_set_events(ab_session_p session, int events);
+static int session_workers_start(int count);
+static void session_workers_stop(void);
+static int session_worker_add(void);
+static void session_worker_free(session_worker_p worker);
+static int session_attach(ab_session_p session);
+static void session_detach_unsafe(session_worker_p worker, ab_session_p session);
+static void session_kick(ab_session_p session);
+static THREAD_FUNC(session_worker_handler);
 static int process_requests(ab_session_p session);
+static void session_note_activity(ab_session_p session);
+static int session_retry_wait(ab_session_p session);
+static void session_open_circuit(ab_session_p session);
+static void session_close_circuit(ab_session_p session);
+static void session_fail_queued(ab_session_p session, int status);
+static int send_keepalive(ab_session_p session);
+static int match_keepalive_response(ab_session_p session);
+static int send_next_packet(ab_session_p session);
+static void get_queue_order(ab_session_p session, int *order);
+static int count_queued_requests(ab_session_p session);
+static int get_send_window(ab_session_p session);
+static int pick_connection(ab_session_p session);
+static int send_pending_data(ab_session_p session);
+static int recv_pending_data(ab_session_p session);
+static int request_matches_response(ab_request_p request, uint8_t *response);
+static int dispatch_response(ab_session_p session);
+static void session_fail_in_flight(ab_session_p session, int status);
 //static int check_packing(ab_session_p session, ab_request_p request);
 static int get_payload_size(ab_request_p request);
+static int get_request_command(ab_request_p request);
 static int pack_requests(ab_session_p session, ab_request_p *requests, int num_requests);
-static int prepare_request(ab_session_p session);
-static int send_eip_request(ab_session_p session, int timeout);
-static int recv_eip_response(ab_session_p session, int timeout);
+static int pack_unconnected_requests(ab_session_p session, ab_request_p *requests, int num_requests);
+static int prepare_request(ab_session_p session, int conn_index);
+static void session_start_exchange(ab_session_p session, int timeout_ms);
+static int session_exchange(ab_session_p session);
+static int recv_eip_response(ab_session_p session);
 static int unpack_response(ab_session_p session, ab_request_p request, int sub_packet);
 static int perform_forward_open(ab_session_p session);
+static int forward_open_cache_get(ab_session_p session, int *use_forward_open_ex, int *max_payload_size);
+static void forward_open_cache_put(ab_session_p session, int use_forward_open_ex, int max_payload_size);
+static void forward_open_cache_remove(ab_session_p session);
+static int forward_open_cache_free(hashtable_p table, int64_t key, void *data, void *context);
 static int perform_forward_close(ab_session_p session);
-static int try_forward_open_ex(ab_session_p session, int *max_payload_size_guess);
-static int try_forward_open(ab_session_p session);
-static int send_forward_open_req(ab_session_p session);
-static int send_forward_open_req_ex(ab_session_p session);
-static int recv_forward_open_resp(ab_session_p session, int *max_payload_size_guess);
-static int send_forward_close_req(ab_session_p session);
+static int try_forward_open_ex(ab_session_p session, ab_connection_t *conn, int *max_payload_size_guess);
+static int try_forward_open(ab_session_p session, ab_connection_t *conn);
+static int send_forward_open_req(ab_session_p session, ab_connection_t *conn);
+static int send_forward_open_req_ex(ab_session_p session, ab_connection_t *conn);
+static int recv_forward_open_resp(ab_session_p session, ab_connection_t *conn, int *max_payload_size_guess);
+static int send_forward_close_req(ab_session_p session, ab_connection_t *conn);
 static int recv_forward_close_resp(ab_session_p session);
 static void request_destroy(void *req_arg);
 
 
 static volatile mutex_p session_mutex = NULL;
-static volatile vector_p sessions = NULL;
+
+/*
+ * sessions are indexed by the hash of their key, see session_make_key().
+ * Each entry is a vector of the sessions with that hash as more than one
+ * session can have the same key when sessions are not shared.
+ */
+static volatile hashtable_p sessions = NULL;
+
+/*
+ * The Forward Open parameters each PLC accepted, indexed like the
+ * sessions.  A reconnect starts with what worked last time instead of
+ * negotiating again.  The session workers use the cache, so it has its
+ * own mutex and they never wait on session_mutex.
+ */
+typedef struct {
+    char *key;
+    int use_forward_open_ex;
+    int max_payload_size;
+} forward_open_params_t;
+
+static volatile mutex_p forward_open_cache_mutex = NULL;
+static volatile hashtable_p forward_open_cache = NULL;
 
 
 
@@ -110,8 +198,18 @@ int session_startup()
         return rc;
     }
 
-    if((sessions = vector_create(25, 5)) == NULL) {
-        pdebug(DEBUG_ERROR, "Unable to create session vector!");
+    if((sessions = hashtable_create(SESSION_INDEX_SIZE)) == NULL) {
+        pdebug(DEBUG_ERROR, "Unable to create session index!");
+        return PLCTAG_ERR_NO_MEM;
+    }
+
+    if((rc = mutex_create((mutex_p *)&forward_open_cache_mutex)) != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_ERROR, "Unable to create Forward Open cache mutex %s!", plc_tag_decode_error(rc));
+        return rc;
+    }
+
+    if((forward_open_cache = hashtable_create(SESSION_INDEX_SIZE)) == NULL) {
+        pdebug(DEBUG_ERROR, "Unable to create Forward Open cache!");
         return PLCTAG_ERR_NO_MEM;
     }
 
@@ -122,18 +220,45 @@ int session_startup()
 void session_teardown()
 {
     if(sessions) {
-        for(int i=0; i < vector_length(sessions); i++) {
-            ab_session_p session = vector_get(sessions, i);
-            if(session) {
-                rc_dec(session);
+        vector_p all = vector_create(SESSION_INDEX_SIZE, SESSION_INDEX_SIZE);
+
+        /* take the sessions out of the index first, destroying them changes it. */
+        for(int i=0; i < hashtable_capacity(sessions); i++) {
+            vector_p chain = hashtable_get_index(sessions, i);
+
+            if(chain) {
+                for(int j=0; all && j < vector_length(chain); j++) {
+                    vector_put(all, vector_length(all), vector_get(chain, j));
+                }
+
+                vector_destroy(chain);
             }
         }
 
-        vector_destroy(sessions);
+        hashtable_destroy(sessions);
 
         sessions = NULL;
+
+        for(int i=0; all && i < vector_length(all); i++) {
+            rc_dec(vector_get(all, i));
+        }
+
+        if(all) {
+            vector_destroy(all);
+        }
     }
 
+    session_workers_stop();
+
+    if(forward_open_cache) {
+        hashtable_on_each(forward_open_cache, forward_open_cache_free, NULL);
+        hashtable_destroy(forward_open_cache);
+        forward_open_cache = NULL;
+    }
+
+    if(forward_open_cache_mutex) {
+        mutex_destroy((mutex_p *)&forward_open_cache_mutex);
+    }
 
     if(session_mutex) {
         mutex_destroy((mutex_p *)&session_mutex);
@@ -212,6 +337,12 @@ int session_find_or_create(ab_session_p *tag_session, attr attribs)
     int rc = PLCTAG_STATUS_OK;
     int auto_disconnect_enabled = 0;
     int auto_disconnect_timeout_ms = INT_MAX;
+    int max_packets_in_flight = SESSION_DEFAULT_PACKETS_IN_FLIGHT;
+    int connection_count = SESSION_DEFAULT_CONNECTIONS;
+    int connect_timeout_ms = SESSION_DEFAULT_CONNECT_TIMEOUT;
+    int session_workers = 0;
+    int keepalive_ms = 0;
+    char *session_key = NULL;
 
     pdebug(DEBUG_DETAIL, "Starting");
 
@@ -221,22 +352,64 @@ int session_find_or_create(ab_session_p *tag_session, attr attribs)
         auto_disconnect_enabled = 1;
     }
 
+    max_packets_in_flight = attr_get_int(attribs, "max_packets_in_flight", SESSION_DEFAULT_PACKETS_IN_FLIGHT);
+    if(max_packets_in_flight < 1 || max_packets_in_flight > SESSION_MAX_PACKETS_IN_FLIGHT) {
+        pdebug(DEBUG_WARN,"Max packets in flight must be between 1 and %d!", SESSION_MAX_PACKETS_IN_FLIGHT);
+        return PLCTAG_ERR_OUT_OF_BOUNDS;
+    }
+
+    connection_count = attr_get_int(attribs, "connection_count", SESSION_DEFAULT_CONNECTIONS);
+    if(connection_count < 1 || connection_count > SESSION_MAX_CONNECTIONS) {
+        pdebug(DEBUG_WARN,"Connection count must be between 1 and %d!", SESSION_MAX_CONNECTIONS);
+        return PLCTAG_ERR_OUT_OF_BOUNDS;
+    }
+
+    connect_timeout_ms = attr_get_int(attribs, "connect_timeout_ms", SESSION_DEFAULT_CONNECT_TIMEOUT);
+    if(connect_timeout_ms <= 0) {
+        pdebug(DEBUG_WARN,"Connect timeout must be greater than zero!");
+        return PLCTAG_ERR_OUT_OF_BOUNDS;
+    }
+
+    keepalive_ms = attr_get_int(attribs, "keepalive_ms", 0);
+    if(keepalive_ms < 0) {
+        pdebug(DEBUG_WARN,"Keep alive interval must not be negative!");
+        return PLCTAG_ERR_OUT_OF_BOUNDS;
+    }
+
+    session_workers = attr_get_int(attribs, "session_workers", 0);
+    if(session_workers < 0 || session_workers > SESSION_MAX_WORKERS) {
+        pdebug(DEBUG_WARN,"Session workers must be between 0 and %d!", SESSION_MAX_WORKERS);
+        return PLCTAG_ERR_OUT_OF_BOUNDS;
+    }
+
     if(plc_type == AB_PROTOCOL_PLC && str_length(session_path) > 0) {
         /* this means it is DH+ */
         use_connected_msg = 1;
         attr_set_int(attribs, "use_connected_msg", 1);
     }
 
+    session_key = session_make_key(session_gw, session_gw_port, session_path, plc_type, use_connected_msg);
+    if(!session_key) {
+        return PLCTAG_ERR_NO_MEM;
+    }
+
     critical_block(session_mutex) {
         /* if we are to share sessions, then look for an existing one. */
         if (shared_session) {
-            session = find_session_by_host_unsafe(session_gw, session_path);
+            session = find_session_by_key_unsafe(session_key);
         } else {
             /* no sharing, create a new one */
             session = AB_SESSION_NULL;
         }
 
         if (session == AB_SESSION_NULL) {
+            /* the worker pool is started along with the first session. */
+            rc = session_workers_start(session_workers);
+            if(rc != PLCTAG_STATUS_OK) {
+                pdebug(DEBUG_WARN, "Unable to start session workers!");
+                break;
+            }
+
             pdebug(DEBUG_DETAIL,"Creating new session.");
             session = session_create_unsafe(session_gw, session_gw_port, session_path, plc_type, use_connected_msg);
 
@@ -246,6 +419,10 @@ int session_find_or_create(ab_session_p *tag_session, attr attribs)
             } else {
                 session->auto_disconnect_enabled = auto_disconnect_enabled;
                 session->auto_disconnect_timeout_ms = auto_disconnect_timeout_ms;
+                session->max_packets_in_flight = max_packets_in_flight;
+                session->connection_count = connection_count;
+                session->connect_timeout_ms = connect_timeout_ms;
+                session->keepalive_ms = keepalive_ms;
 
                 new_session = 1;
             }
@@ -260,6 +437,26 @@ int session_find_or_create(ab_session_p *tag_session, attr attribs)
                 session->auto_disconnect_timeout_ms = auto_disconnect_timeout_ms;
             }
 
+            /* the keep alive interval only goes down. */
+            if(keepalive_ms > 0 && (session->keepalive_ms == 0 || session->keepalive_ms > keepalive_ms)) {
+                session->keepalive_ms = keepalive_ms;
+            }
+
+            /* the pipeline depth only goes up. */
+            if(session->max_packets_in_flight < max_packets_in_flight) {
+                session->max_packets_in_flight = max_packets_in_flight;
+            }
+
+            /* so does the number of connections, but only when they are next opened. */
+            if(session->connection_count < connection_count) {
+                session->connection_count = connection_count;
+            }
+
+            /* and the patience for slow gateways. */
+            if(session->connect_timeout_ms < connect_timeout_ms) {
+                session->connect_timeout_ms = connect_timeout_ms;
+            }
+
             pdebug(DEBUG_DETAIL,"Reusing existing session.");
         }
     }
@@ -280,6 +477,8 @@ int session_find_or_create(ab_session_p *tag_session, attr attribs)
         }
     }
 
+    mem_free(session_key);
+
     /* store it into the tag */
     *tag_session = session;
 
@@ -290,6 +489,44 @@ int session_find_or_create(ab_session_p *tag_session, attr attribs)
 
 
 
+/*
+ * session_release
+ *
+ * A tag lets go of the session it got from session_find_or_create().
+ * When the last tag is gone, the session is taken out of the index and
+ * its worker closes the connection to the PLC and then drops the final
+ * reference.  Nothing here waits on the PLC.
+ */
+void session_release(ab_session_p session)
+{
+    int last = 0;
+
+    pdebug(DEBUG_DETAIL, "Starting.");
+
+    critical_block(session->mutex) {
+        session->users--;
+
+        if(session->users <= 0 && !session->closing) {
+            session->closing = 1;
+            last = 1;
+        }
+    }
+
+    if(last) {
+        pdebug(DEBUG_DETAIL, "Last tag is gone, closing session %p.", session);
+
+        remove_session(session);
+
+        session_kick(session);
+    }
+
+    rc_dec(session);
+
+    pdebug(DEBUG_DETAIL, "Done.");
+}
+
+
+
 
 int get_plc_type(attr attribs)
 {
@@ -321,26 +558,36 @@ int get_plc_type(attr attribs)
 
 int add_session_unsafe(ab_session_p session)
 {
+    vector_p chain = NULL;
+    int rc = PLCTAG_STATUS_OK;
+
     pdebug(DEBUG_DETAIL, "Starting");
 
-    if (!session) {
+    if (!session || !sessions) {
         return PLCTAG_ERR_NULL_PTR;
     }
 
-    vector_put(sessions, vector_length(sessions), session);
+    chain = hashtable_get(sessions, session->key_hash);
+    if(!chain) {
+        chain = vector_create(1, 1);
+        if(!chain) {
+            pdebug(DEBUG_WARN, "Unable to allocate session index entry!");
+            return PLCTAG_ERR_NO_MEM;
+        }
 
-//    n->prev = NULL;
-//    n->next = sessions;
-//
-//    if (sessions) {
-//        sessions->prev = n;
-//    }
-//
-//    sessions = n;
+        rc = hashtable_put(sessions, session->key_hash, chain);
+        if(rc != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_WARN, "Unable to add session to the index!");
+            vector_destroy(chain);
+            return rc;
+        }
+    }
+
+    rc = vector_put(chain, vector_length(chain), session);
 
     pdebug(DEBUG_DETAIL, "Done");
 
-    return PLCTAG_STATUS_OK;
+    return rc;
 }
 
 
@@ -365,43 +612,31 @@ int add_session(ab_session_p s)
 
 int remove_session_unsafe(ab_session_p session)
 {
+    vector_p chain = NULL;
+
     pdebug(DEBUG_DETAIL, "Starting");
 
     if (!session || !sessions) {
         return 0;
     }
 
-    for(int i=0; i < vector_length(sessions); i++) {
-        ab_session_p tmp = vector_get(sessions, i);
+    chain = hashtable_get(sessions, session->key_hash);
+    if(!chain) {
+        pdebug(DEBUG_DETAIL, "Session not found.");
+        return PLCTAG_STATUS_OK;
+    }
 
-        if(tmp == session) {
-            vector_remove(sessions, i);
+    for(int i=0; i < vector_length(chain); i++) {
+        if(vector_get(chain, i) == session) {
+            vector_remove(chain, i);
             break;
         }
     }
 
-//    tmp = sessions;
-//
-//    while (tmp && tmp != n)
-//        tmp = tmp->next;
-//
-//    if (!tmp || tmp != n) {
-//        pdebug(DEBUG_WARN, "Session not found!");
-//        return PLCTAG_ERR_NOT_FOUND;
-//    }
-//
-//    if (n->next) {
-//        n->next->prev = n->prev;
-//    }
-//
-//    if (n->prev) {
-//        n->prev->next = n->next;
-//    } else {
-//        sessions = n->next;
-//    }
-//
-//    n->next = NULL;
-//    n->prev = NULL;
+    if(vector_length(chain) == 0) {
+        hashtable_remove(sessions, session->key_hash);
+        vector_destroy(chain);
+    }
 
     pdebug(DEBUG_DETAIL, "Done");
 
@@ -424,7 +659,7 @@ int remove_session(ab_session_p s)
 }
 
 
-int session_match_valid(const char *host, const char *path, ab_session_p session)
+int session_match_valid(const char *key, ab_session_p session)
 {
     if(!session) {
         return 0;
@@ -434,11 +669,7 @@ int session_match_valid(const char *host, const char *path, ab_session_p session
         return 0;
     }
 
-    if(str_cmp_i(host,session->host)) {
-        return 0;
-    }
-
-    if(str_cmp_i(path,session->path)) {
+    if(str_cmp(key, session->key)) {
         return 0;
     }
 
@@ -446,15 +677,38 @@ int session_match_valid(const char *host, const char *path, ab_session_p session
 }
 
 
-ab_session_p find_session_by_host_unsafe(const char *host, const char *path)
+ab_session_p find_session_by_key_unsafe(const char *key)
 {
-    for(int i=0; i < vector_length(sessions); i++) {
-        ab_session_p session = vector_get(sessions, i);
+    vector_p chain = NULL;
+
+    if(!sessions) {
+        return NULL;
+    }
+
+    chain = hashtable_get(sessions, session_hash_key(key));
+    if(!chain) {
+        return NULL;
+    }
+
+    for(int i=0; i < vector_length(chain); i++) {
+        ab_session_p session = vector_get(chain, i);
 
         /* is this session in the process of destruction? */
         session = rc_inc(session);
         if(session) {
-            if(session_match_valid(host, path, session)) {
+            int usable = 0;
+
+            /* a session whose last tag is gone is being closed by its worker. */
+            if(session_match_valid(key, session)) {
+                critical_block(session->mutex) {
+                    if(!session->closing) {
+                        session->users++;
+                        usable = 1;
+                    }
+                }
+            }
+
+            if(usable) {
                 return session;
             }
 
@@ -466,6 +720,42 @@ ab_session_p find_session_by_host_unsafe(const char *host, const char *path)
 }
 
 
+/*
+ * session_make_key
+ *
+ * Build the string that identifies the PLC a session talks to.  Host
+ * names and paths are not case sensitive, so they are lower cased.
+ */
+char *session_make_key(const char *host, int port, const char *path, int plc_type, int use_connected_msg)
+{
+    int size = str_length(host) + str_length(path) + 40;
+    char *key = mem_alloc(size);
+
+    if(!key) {
+        pdebug(DEBUG_WARN, "Unable to allocate session key!");
+        return NULL;
+    }
+
+    snprintf_platform(key, (size_t)size, "%s:%d/%s/%d/%d", host, port, (path ? path : ""), plc_type, use_connected_msg);
+
+    for(char *c = key; *c; c++) {
+        *c = (char)tolower((unsigned char)*c);
+    }
+
+    return key;
+}
+
+
+/* zero marks an empty slot in the hash table, so it is never used as a key. */
+int64_t session_hash_key(const char *key)
+{
+    size_t len = (size_t)str_length(key);
+    uint64_t result = ((uint64_t)hash((uint8_t *)key, len, 0x5e5510) << 32) | hash((uint8_t *)key, len, 0x0ab5e55);
+
+    return (result ? (int64_t)result : 1);
+}
+
+
 
 ab_session_p session_create_unsafe(const char *host, int gw_port, const char *path, int plc_type, int use_connected_msg)
 {
@@ -499,6 +789,14 @@ ab_session_p session_create_unsafe(const char *host, int gw_port, const char *pa
         return NULL;
     }
 
+    session->key = session_make_key(host, gw_port, path, plc_type, use_connected_msg);
+    if(!session->key) {
+        rc_dec(session);
+        return NULL;
+    }
+
+    session->key_hash = session_hash_key(session->key);
+
     rc = cip_encode_path(path, use_connected_msg, plc_type, &session->conn_path, &session->conn_path_size, &session->dhp_dest);
     if(rc != PLCTAG_STATUS_OK) {
         pdebug(DEBUG_INFO,"Unable to convert path links strings to binary path!");
@@ -506,9 +804,25 @@ ab_session_p session_create_unsafe(const char *host, int gw_port, const char *pa
         return NULL;
     }
 
-    session->requests = vector_create(SESSION_MIN_REQUESTS, SESSION_INC_REQUESTS);
-    if(!session->requests) {
-        pdebug(DEBUG_WARN,"Unable to allocate vector for requests!");
+    for(int i=0; i < SESSION_NUM_PRIORITIES; i++) {
+        session->requests[i] = queue_create(SESSION_MIN_REQUESTS);
+        if(!session->requests[i]) {
+            pdebug(DEBUG_WARN,"Unable to allocate queue for requests!");
+            rc_dec(session);
+            return NULL;
+        }
+    }
+
+    session->in_flight_requests = vector_create(SESSION_MAX_PACKETS_IN_FLIGHT, SESSION_INC_REQUESTS);
+    if(!session->in_flight_requests) {
+        pdebug(DEBUG_WARN,"Unable to allocate vector for requests in flight!");
+        rc_dec(session);
+        return NULL;
+    }
+
+    session->request_pool = rc_pool_create(SESSION_REQUEST_POOL_SIZE);
+    if(!session->request_pool) {
+        pdebug(DEBUG_WARN,"Unable to allocate request pool!");
         rc_dec(session);
         return NULL;
     }
@@ -517,7 +831,9 @@ ab_session_p session_create_unsafe(const char *host, int gw_port, const char *pa
     session->data_capacity = MAX_PACKET_SIZE_EX;
     session->use_connected_msg = use_connected_msg;
     session->status = PLCTAG_STATUS_PENDING;
-    session->conn_serial_number = (uint16_t)(intptr_t)(session);
+    session->sock_events = -1;
+    session->max_packets_in_flight = SESSION_DEFAULT_PACKETS_IN_FLIGHT;
+    session->connection_count = SESSION_DEFAULT_CONNECTIONS;
 
     /* check for ID set up. This does not need to be thread safe since we just need a random value. */
     if(srand_setup == 0) {
@@ -531,6 +847,12 @@ ab_session_p session_create_unsafe(const char *host, int gw_port, const char *pa
 
     session->session_seq_id = (uint64_t)rand();
 
+    /* each session gets its own jitter sequence, it must not be zero. */
+    session->retry_seed = (uint32_t)time_ms() ^ (uint32_t)(size_t)session;
+    if(session->retry_seed == 0) {
+        session->retry_seed = 1;
+    }
+
     /* guess the max CIP payload size. */
     switch(plc_type) {
     case AB_PROTOCOL_PLC:
@@ -565,10 +887,26 @@ ab_session_p session_create_unsafe(const char *host, int gw_port, const char *pa
      * FIXME - this could collide.  The probability is low, but it could happen
      * as there are only 32 bits.
      */
-    session->orig_connection_id = ++connection_id;
+    for(int i=0; i < SESSION_MAX_CONNECTIONS; i++) {
+        session->connections[i].orig_connection_id = ++connection_id;
+        session->connections[i].conn_serial_number = (uint16_t)((intptr_t)(session) + i);
+    }
+
+    /* other threads can find the session as soon as it is in the index. */
+    if(mutex_create(&(session->mutex)) != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN, "Unable to create session mutex!");
+        rc_dec(session);
+        return NULL;
+    }
+
+    /* the tag creating the session is its first user. */
+    session->users = 1;
 
-    /* add the new session to the list. */
-    add_session_unsafe(session);
+    /* add the new session to the index. */
+    if(add_session_unsafe(session) != PLCTAG_STATUS_OK) {
+        rc_dec(session);
+        return NULL;
+    }
 
     pdebug(DEBUG_INFO, "Done");
 
@@ -579,8 +917,8 @@ ab_session_p session_create_unsafe(const char *host, int gw_port, const char *pa
 /*
  * session_init
  *
- * This calls several blocking methods and so must not keep the main mutex
- * locked during them.
+ * This is called outside the main mutex.  It hands the session to a
+ * worker, which does the rest.
  */
 int session_init(ab_session_p session)
 {
@@ -588,14 +926,8 @@ int session_init(ab_session_p session)
 
     pdebug(DEBUG_INFO, "Starting.");
 
-    if((rc = mutex_create(&(session->mutex))) != PLCTAG_STATUS_OK) {
-        pdebug(DEBUG_WARN, "Unable to create session mutex!");
-        session->status = rc;
-        return rc;
-    }
-
-    if((rc = thread_create((thread_p *)&(session->handler_thread), session_handler, 32*1024, session)) != PLCTAG_STATUS_OK) {
-        pdebug(DEBUG_WARN, "Unable to create session thread!");
+    if((rc = session_attach(session)) != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN, "Unable to hand the session to a worker!");
         session->status = rc;
         return rc;
     }
@@ -608,7 +940,9 @@ int session_init(ab_session_p session)
 /*
  * session_open_socket()
  *
- * Connect to the host/port passed via TCP.
+ * Start connecting to the host/port passed via TCP.  This does not
+ * block, PLCTAG_STATUS_PENDING means that session_check_socket() must be
+ * called when the socket becomes writable.
  */
 
 int session_open_socket(ab_session_p session)
@@ -625,19 +959,69 @@ int session_open_socket(ab_session_p session)
         return 0;
     }
 
-    rc = socket_connect_tcp(session->sock, session->host, AB_EIP_DEFAULT_PORT);
+    /* not in the event loop yet. */
+    session->sock_events = -1;
 
-    if (rc != PLCTAG_STATUS_OK) {
+    rc = socket_connect_tcp_start(session->sock, session->host, AB_EIP_DEFAULT_PORT, session->connect_timeout_ms);
+
+    if (rc != PLCTAG_STATUS_OK && rc != PLCTAG_STATUS_PENDING) {
         pdebug(DEBUG_WARN, "Unable to connect socket for session!");
         return rc;
     }
 
+    /* while connecting we only care about the connect finishing. */
+    session->sock_events = (rc == PLCTAG_STATUS_PENDING ? EVENT_LOOP_WRITE : 0);
+
+    if(event_loop_add_socket(session->loop, session->sock, session->sock_events, session) != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN, "Unable to add socket to the session event loop!");
+        session->sock_events = -1;
+        return PLCTAG_ERR_CREATE;
+    }
+
     pdebug(DEBUG_INFO, "Done.");
 
     return rc;
 }
 
 
+/*
+ * session_check_socket()
+ *
+ * Move a pending connect along.  The set of sockets being raced can change
+ * in here, so they are taken out of the event loop around the check.
+ */
+
+int session_check_socket(ab_session_p session)
+{
+    int rc = PLCTAG_STATUS_OK;
+
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    event_loop_remove_socket(session->loop, session->sock);
+    session->sock_events = -1;
+
+    rc = socket_connect_tcp_check(session->sock);
+
+    if(rc != PLCTAG_STATUS_OK && rc != PLCTAG_STATUS_PENDING) {
+        pdebug(DEBUG_WARN, "Unable to connect socket for session!");
+        return rc;
+    }
+
+    /* no interest in any events until we send or receive something. */
+    session->sock_events = (rc == PLCTAG_STATUS_PENDING ? EVENT_LOOP_WRITE : 0);
+
+    if(event_loop_add_socket(session->loop, session->sock, session->sock_events, session) != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN, "Unable to add socket to the session event loop!");
+        session->sock_events = -1;
+        return PLCTAG_ERR_CREATE;
+    }
+
+    pdebug(DEBUG_SPEW, "Done.");
+
+    return rc;
+}
+
+
 
 int session_register(ab_session_p session)
 {
@@ -645,50 +1029,44 @@ int session_register(ab_session_p session)
     eip_encap *resp;
     int rc = PLCTAG_STATUS_OK;
 
-    pdebug(DEBUG_INFO, "Starting.");
+    pdebug(DEBUG_DETAIL, "Starting.");
 
-    /*
-     * clear the session data.
-     *
-     * We use the receiving buffer because we do not have a request and nothing can
-     * be coming in (we hope) on the socket yet.
-     */
-    mem_set(session->data, 0, sizeof(eip_session_reg_req));
+    if(session->exchange_state == EXCHANGE_IDLE) {
+        /*
+         * clear the session data.
+         *
+         * We use the receiving buffer because we do not have a request and nothing can
+         * be coming in (we hope) on the socket yet.
+         */
+        mem_set(session->data, 0, sizeof(eip_session_reg_req));
 
-    req = (eip_session_reg_req *)(session->data);
+        req = (eip_session_reg_req *)(session->data);
 
-    /* fill in the fields of the request */
-    req->encap_command = h2le16(AB_EIP_REGISTER_SESSION);
-    req->encap_length = h2le16(sizeof(eip_session_reg_req) - sizeof(eip_encap));
-    req->encap_session_handle = h2le32(session->session_handle);
-    req->encap_status = h2le32(0);
-    req->encap_sender_context = h2le64((uint64_t)0);
-    req->encap_options = h2le32(0);
+        /* fill in the fields of the request */
+        req->encap_command = h2le16(AB_EIP_REGISTER_SESSION);
+        req->encap_length = h2le16(sizeof(eip_session_reg_req) - sizeof(eip_encap));
+        req->encap_session_handle = h2le32(session->session_handle);
+        req->encap_status = h2le32(0);
+        req->encap_sender_context = h2le64((uint64_t)0);
+        req->encap_options = h2le32(0);
 
-    req->eip_version = h2le16(AB_EIP_VERSION);
-    req->option_flags = h2le16(0);
+        req->eip_version = h2le16(AB_EIP_VERSION);
+        req->option_flags = h2le16(0);
 
-    /*
-     * socket ops here are _ASYNCHRONOUS_!
-     *
-     * This is done this way because we do not have everything
-     * set up for a request to be handled by the thread.  I think.
-     */
+        /* send registration to the gateway */
+        session->data_size = sizeof(eip_session_reg_req);
 
-    /* send registration to the gateway */
-    session->data_size = sizeof(eip_session_reg_req);
-    session->data_offset = 0;
+        session_start_exchange(session, SESSION_DEFAULT_TIMEOUT);
+    }
 
-    rc = send_eip_request(session, SESSION_DEFAULT_TIMEOUT);
-    if(rc != PLCTAG_STATUS_OK) {
-        pdebug(DEBUG_WARN,"Error sending session registration request %s!", plc_tag_decode_error(rc));
+    /* get the response from the gateway, this returns PLCTAG_STATUS_PENDING until it is in. */
+    rc = session_exchange(session);
+    if(rc == PLCTAG_STATUS_PENDING) {
         return rc;
     }
 
-    /* get the response from the gateway */
-    rc = recv_eip_response(session, SESSION_DEFAULT_TIMEOUT);
     if(rc != PLCTAG_STATUS_OK) {
-        pdebug(DEBUG_WARN, "Error receiving session registration response %s!", plc_tag_decode_error(rc));
+        pdebug(DEBUG_WARN, "Error exchanging session registration %s!", plc_tag_decode_error(rc));
         return rc;
     }
 
@@ -712,7 +1090,7 @@ int session_register(ab_session_p session)
      */
     session->session_handle = le2h32(resp->encap_session_handle);
 
-    pdebug(DEBUG_INFO, "Done.");
+    pdebug(DEBUG_DETAIL, "Done.");
 
     return PLCTAG_STATUS_OK;
 }
@@ -737,7 +1115,21 @@ int session_close_socket(ab_session_p session)
 {
     pdebug(DEBUG_INFO,"Starting.");
 
+    /* nothing sent on this socket will get a response now. */
+    session_fail_in_flight(session, PLCTAG_ERR_ABORT);
+
+    /* drop any set up or tear down step that was part way through. */
+    session->exchange_state = EXCHANGE_IDLE;
+    session->connect_step = CONNECT_START;
+    session->close_index = 0;
+    session->close_status = PLCTAG_STATUS_OK;
+
     if (session->sock) {
+        if(session->sock_events >= 0) {
+            event_loop_remove_socket(session->loop, session->sock);
+            session->sock_events = -1;
+        }
+
         socket_close(session->sock);
         socket_destroy(&(session->sock));
         session->sock = NULL;
@@ -764,30 +1156,21 @@ void session_destroy(void *session_arg)
     }
 
     /* so remove the session from the list so no one else can reference it. */
-    remove_session(session);
+    if(!session->closing) {
+        remove_session(session);
+    }
 
     pdebug(DEBUG_INFO, "Session sent %"PRId64" packets.", session->packet_count);
 
-    /* terminate the thread first. */
+    /*
+     * The worker closes the connections to the PLC before it lets go of
+     * the session, see SESSION_TERMINATE.  If the session never got to a
+     * worker, or the library is shutting down, all that is left to do is
+     * to close the socket.
+     */
     session->terminating = 1;
 
-    /* get rid of the handler thread. */
-    if(session->handler_thread) {
-        thread_join(session->handler_thread);
-        thread_destroy(&(session->handler_thread));
-        session->handler_thread = NULL;
-    }
-
-    if(session->targ_connection_id) {
-        /*
-         * we do not want the internal loop to immediately
-         * return, so set the flag like we are not terminating.
-         * There is still a timeout that applies.
-         */
-        session->terminating = 0;
-        perform_forward_close(session);
-        session->terminating = 1;
-    }
+    session_fail_in_flight(session, PLCTAG_ERR_ABORT);
 
     if(session->session_handle) {
         session_unregister(session);
@@ -797,13 +1180,26 @@ void session_destroy(void *session_arg)
         session_close_socket(session);
     }
 
-    if(session->requests) {
-        for(int i=0; i < vector_length(session->requests); i++) {
-            rc_dec(vector_get(session->requests, i));
+    for(int i=0; i < SESSION_NUM_PRIORITIES; i++) {
+        if(session->requests[i]) {
+            while(queue_length(session->requests[i]) > 0) {
+                rc_dec(queue_get(session->requests[i]));
+            }
+
+            queue_destroy(session->requests[i]);
+            session->requests[i] = NULL;
         }
+    }
+
+    if(session->in_flight_requests) {
+        vector_destroy(session->in_flight_requests);
+        session->in_flight_requests = NULL;
+    }
 
-        vector_destroy(session->requests);
-        session->requests = NULL;
+    /* requests still held by tags are freed when the tags let go of them. */
+    if(session->request_pool) {
+        rc_pool_destroy(session->request_pool);
+        session->request_pool = NULL;
     }
 
     /* we are done with the mutex, finally destroy it. */
@@ -827,6 +1223,11 @@ void session_destroy(void *session_arg)
         session->host = NULL;
     }
 
+    if(session->key) {
+        mem_free(session->key);
+        session->key = NULL;
+    }
+
     pdebug(DEBUG_INFO, "Done.");
 
     return;
@@ -836,19 +1237,19 @@ void session_destroy(void *session_arg)
 
 
 /*
- * session_add_request_unsafe
+ * session_add_request
  *
- * You must hold the mutex before calling this!
+ * Queue the request for the session worker.  This takes the session
+ * mutex to check that the PLC is not known to be down, see
+ * session_open_circuit(), and refuses the request if it is.
  */
-int session_add_request_unsafe(ab_session_p session, ab_request_p req)
+int session_add_request(ab_session_p sess, ab_request_p req)
 {
     int rc = PLCTAG_STATUS_OK;
-//    ab_request_p cur, prev;
-//    int total_requests = 0;
 
-    pdebug(DEBUG_INFO, "Starting.");
+    pdebug(DEBUG_DETAIL, "Starting. sess=%p, req=%p", sess, req);
 
-    if(!session) {
+    if(!sess) {
         pdebug(DEBUG_WARN, "Session is null!");
         return PLCTAG_ERR_NULL_PTR;
     }
@@ -860,65 +1261,103 @@ int session_add_request_unsafe(ab_session_p session, ab_request_p req)
         return PLCTAG_ERR_NULL_PTR;
     }
 
-    /* make sure the request points to the session */
-    //req->session = sess;
+    if(req->priority < 0 || req->priority >= SESSION_NUM_PRIORITIES) {
+        pdebug(DEBUG_WARN, "Request has unknown priority %d!", req->priority);
+        rc_dec(req);
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+
+    /* do not let requests pile up for a PLC that is down. */
+    critical_block(sess->mutex) {
+        if(sess->circuit_open) {
+            rc = PLCTAG_ERR_PLC_OFFLINE;
+            break;
+        }
+
+        rc = queue_put(sess->requests[req->priority], req);
+    }
+
+    if(rc == PLCTAG_ERR_PLC_OFFLINE) {
+        pdebug(DEBUG_DETAIL, "PLC is offline, not queuing request.");
+        rc_dec(req);
+        return rc;
+    }
 
-    /* insert into the requests vector */
-    vector_put(session->requests, vector_length(session->requests), req);
+    if(rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN, "Unable to queue request!");
+        rc_dec(req);
+        return rc;
+    }
 
-    pdebug(DEBUG_INFO,"Total requests in the queue: %d",vector_length(session->requests));
+    /* kick the worker so that it sees the new request. */
+    session_kick(sess);
 
-    pdebug(DEBUG_INFO, "Done.");
+    pdebug(DEBUG_DETAIL, "Done.");
 
     return rc;
 }
 
+
 /*
- * session_add_request
+ * session_hold_requests
  *
- * This is a thread-safe version of the above routine.
+ * Stop the session worker from sending queued requests until the
+ * matching call to session_release_requests().  This lets a caller
+ * queue a whole batch of requests and have them packed into as few
+ * packets as possible instead of going out one at a time as they
+ * are added.  Holds nest.
  */
-int session_add_request(ab_session_p sess, ab_request_p req)
+int session_hold_requests(ab_session_p session)
 {
-    int rc = PLCTAG_STATUS_OK;
+    pdebug(DEBUG_DETAIL, "Starting.");
 
-    pdebug(DEBUG_DETAIL, "Starting. sess=%p, req=%p", sess, req);
+    if(!session) {
+        pdebug(DEBUG_WARN, "Session is null!");
+        return PLCTAG_ERR_NULL_PTR;
+    }
 
-    critical_block(sess->mutex) {
-        rc = session_add_request_unsafe(sess, req);
+    critical_block(session->mutex) {
+        session->batch_holds++;
     }
 
     pdebug(DEBUG_DETAIL, "Done.");
 
-    return rc;
+    return PLCTAG_STATUS_OK;
 }
 
 
 /*
- * session_remove_request_unsafe
+ * session_release_requests
  *
- * You must hold the mutex before calling this!
+ * Undo one call to session_hold_requests().  When the last hold is
+ * released, the session worker is woken to send the queued requests.
  */
-int session_remove_request_unsafe(ab_session_p session, ab_request_p req)
+int session_release_requests(ab_session_p session)
 {
     int rc = PLCTAG_STATUS_OK;
-//    ab_request_p cur, prev;
+    int wake = 0;
 
     pdebug(DEBUG_DETAIL, "Starting.");
 
-    if(session == NULL || req == NULL) {
-        return rc;
+    if(!session) {
+        pdebug(DEBUG_WARN, "Session is null!");
+        return PLCTAG_ERR_NULL_PTR;
     }
 
-    for(int i=0; i < vector_length(session->requests); i++) {
-        if(vector_get(session->requests, i) == req) {
-            vector_remove(session->requests, i);
+    critical_block(session->mutex) {
+        if(session->batch_holds <= 0) {
+            pdebug(DEBUG_WARN, "Session requests are not held!");
+            rc = PLCTAG_ERR_BAD_PARAM;
             break;
         }
+
+        session->batch_holds--;
+        wake = (session->batch_holds == 0);
     }
 
-    /* release the request refcount */
-    rc_dec(req);
+    if(wake) {
+        session_kick(session);
+    }
 
     pdebug(DEBUG_DETAIL, "Done.");
 
@@ -926,131 +1365,248 @@ int session_remove_request_unsafe(ab_session_p session, ab_request_p req)
 }
 
 
-
 /*****************************************************************
  **************** Session handling functions *********************
  ****************************************************************/
 
 
-typedef enum { SESSION_OPEN_SOCKET, SESSION_REGISTER, SESSION_CONNECT,
-               SESSION_IDLE, SESSION_DISCONNECT, SESSION_UNREGISTER,
-               SESSION_CLOSE_SOCKET, SESSION_START_RETRY, SESSION_WAIT_RETRY,
-               SESSION_WAIT_RECONNECT
-             } session_state_t;
-
-
-THREAD_FUNC(session_handler)
+/*
+ * session_run
+ *
+ * Run the session state machine until it has to wait for something.  The
+ * states that set up and tear down the connection are chained together
+ * and run in one go.  Before returning, the socket events to wait for are
+ * set in the worker's event loop and session->wait_until is set to the
+ * time the session must be run again even if nothing happens.
+ */
+void session_run(ab_session_p session)
 {
-    ab_session_p session = arg;
     int rc = PLCTAG_STATUS_OK;
-    session_state_t state = SESSION_OPEN_SOCKET;
-    int64_t timeout_time = 0;
-    int64_t auto_disconnect_time = 0;
-    int auto_disconnect = 0;
 
+    pdebug(DEBUG_SPEW, "Running session %p", session);
+
+    if(session->sock_lost && session->state == SESSION_IDLE) {
+        /* the PLC closed the connection on us. */
+        pdebug(DEBUG_WARN, "Connection lost while idle!");
+        session->status = PLCTAG_ERR_BAD_CONNECTION;
+        session->state = SESSION_CLOSE_SOCKET;
+    }
 
-    pdebug(DEBUG_INFO, "Starting thread for session %p", session);
+    session->sock_lost = 0;
+    session->wait_until = INT64_MAX;
 
     while(!session->terminating) {
         int idle = 0;
+        int wait_events = 0;
+        int64_t wait_until = INT64_MAX;
+
+        /*
+         * once the last tag is gone there is no point in connecting or waiting
+         * to connect again.  Set up steps that are under way run to the end so
+         * that the PLC is left in a known state, then the tear down states run.
+         */
+        if(session->closing) {
+            switch(session->state) {
+            case SESSION_OPEN_SOCKET:
+            case SESSION_WAIT_SOCKET:
+                session->state = SESSION_CLOSE_SOCKET;
+                break;
+
+            case SESSION_START_RETRY:
+            case SESSION_WAIT_RETRY:
+            case SESSION_WAIT_RECONNECT:
+                session->state = SESSION_TERMINATE;
+                break;
+
+            default:
+                break;
+            }
+        }
 
-        switch(state) {
+        switch(session->state) {
         case SESSION_OPEN_SOCKET:
             pdebug(DEBUG_DETAIL,"in SESSION_OPEN_SOCKET state.");
             session->status = PLCTAG_STATUS_PENDING;
 
             /* we must connect to the gateway*/
-            if ((rc = session_open_socket(session)) != PLCTAG_STATUS_OK) {
+            rc = session_open_socket(session);
+            if(rc == PLCTAG_STATUS_PENDING) {
+                session->state = SESSION_WAIT_SOCKET;
+            } else if (rc != PLCTAG_STATUS_OK) {
                 pdebug(DEBUG_WARN, "session connect failed %s!", plc_tag_decode_error(rc));
                 session->status = rc;
-                state = SESSION_CLOSE_SOCKET;
+                session->state = SESSION_CLOSE_SOCKET;
             } else {
                 /* set the timeout for disconnect. */
-                //if(session->auto_disconnect_enabled) {
-                    auto_disconnect_time = time_ms() + SESSION_DISCONNECT_TIMEOUT;
-                //}
+                session_note_activity(session);
+
+                session->state = SESSION_REGISTER;
+            }
+            break;
+
+        case SESSION_WAIT_SOCKET:
+            pdebug(DEBUG_SPEW,"in SESSION_WAIT_SOCKET state.");
+
+            rc = session_check_socket(session);
+            if(rc == PLCTAG_STATUS_PENDING) {
+                /* wait for a connect to finish or for the next address to be due. */
+                idle = 1;
+                wait_events = EVENT_LOOP_WRITE;
+                wait_until = time_ms() + SOCKET_CONNECT_ATTEMPT_DELAY_MS;
+            } else if (rc != PLCTAG_STATUS_OK) {
+                pdebug(DEBUG_WARN, "session connect failed %s!", plc_tag_decode_error(rc));
+                session->status = rc;
+                session->state = SESSION_CLOSE_SOCKET;
+            } else {
+                session_note_activity(session);
 
-                state = SESSION_REGISTER;
+                session->state = SESSION_REGISTER;
             }
             break;
 
         case SESSION_REGISTER:
             pdebug(DEBUG_DETAIL,"in SESSION_REGISTER state.");
-            if ((rc = session_register(session)) != PLCTAG_STATUS_OK) {
+            if((rc = session_register(session)) == PLCTAG_STATUS_PENDING) {
+                /* wait for the gateway to take the request or to answer. */
+                idle = 1;
+                wait_events = session->exchange_events;
+                wait_until = session->exchange_timeout;
+            } else if (rc != PLCTAG_STATUS_OK) {
                 pdebug(DEBUG_WARN, "session registration failed %s!", plc_tag_decode_error(rc));
                 session->status = rc;
-                state = SESSION_CLOSE_SOCKET;
+                session->state = SESSION_CLOSE_SOCKET;
             } else {
                 if(session->use_connected_msg) {
-                    state = SESSION_CONNECT;
+                    session->state = SESSION_CONNECT;
                 } else {
-                    state = SESSION_IDLE;
+                    session_close_circuit(session);
+                    session->state = SESSION_IDLE;
                 }
             }
             break;
 
         case SESSION_CONNECT:
             pdebug(DEBUG_DETAIL,"in SESSION_CONNECT state.");
-            if((rc = perform_forward_open(session)) != PLCTAG_STATUS_OK) {
+            if((rc = perform_forward_open(session)) == PLCTAG_STATUS_PENDING) {
+                idle = 1;
+                wait_events = session->exchange_events;
+                wait_until = session->exchange_timeout;
+            } else if(rc != PLCTAG_STATUS_OK) {
                 pdebug(DEBUG_WARN, "Forward open failed %s!", plc_tag_decode_error(rc));
                 session->status = rc;
-                state = SESSION_UNREGISTER;
+                session->state = SESSION_UNREGISTER;
             } else {
                 pdebug(DEBUG_DETAIL,"forward open succeeded, going to idle state.");
-                state = SESSION_IDLE;
+                session_close_circuit(session);
+                session->state = SESSION_IDLE;
             }
             break;
 
         case SESSION_IDLE:
             pdebug(DEBUG_SPEW, "in SESSION_IDLE state.");
 
-            idle = 1;
             session->status = PLCTAG_STATUS_OK;
 
             /* if there is work to do, make sure we do not disconnect. */
             critical_block(session->mutex) {
-                if(vector_length(session->requests) > 0) {
-                    auto_disconnect_time = time_ms() + SESSION_DISCONNECT_TIMEOUT;
+                if(count_queued_requests(session) > 0 || session->packets_in_flight > 0) {
+                    session_note_activity(session);
                 }
             }
 
             if((rc = process_requests(session)) != PLCTAG_STATUS_OK) {
                 pdebug(DEBUG_WARN, "Error while processing requests %s!", plc_tag_decode_error(rc));
                 session->status = rc;
-                idle = 0;
                 if(session->use_connected_msg) {
-                    state = SESSION_DISCONNECT;
+                    session->state = SESSION_DISCONNECT;
                 } else {
-                    state = SESSION_UNREGISTER;
+                    session->state = SESSION_UNREGISTER;
+                }
+            } else {
+                int can_send = (session->data_offset >= session->data_size && session->packets_in_flight < get_send_window(session));
+
+                /* only wait if there is nothing left in the queue that we could send now. */
+                critical_block(session->mutex) {
+                    idle = !(can_send && !session->batch_holds && count_queued_requests(session) > 0);
+                }
+
+                wait_until = session->auto_disconnect_time;
+
+                if(session->keepalive_time < wait_until) {
+                    wait_until = session->keepalive_time;
+                }
+
+                if(session->keepalive_pending > 0 && session->keepalive_sent + SESSION_DEFAULT_TIMEOUT < wait_until) {
+                    wait_until = session->keepalive_sent + SESSION_DEFAULT_TIMEOUT + 1;
+                }
+
+                /* responses can arrive at any time and a partial packet may still need to go out. */
+                wait_events = EVENT_LOOP_READ;
+
+                if(session->data_offset < session->data_size) {
+                    wait_events |= EVENT_LOOP_WRITE;
+                }
+
+                /* wake up in time to catch a response timeout. */
+                if(vector_length(session->in_flight_requests) > 0) {
+                    ab_request_p oldest = vector_get(session->in_flight_requests, 0);
+
+                    if(oldest->time_sent + SESSION_DEFAULT_TIMEOUT < wait_until) {
+                        wait_until = oldest->time_sent + SESSION_DEFAULT_TIMEOUT + 1;
+                    }
                 }
             }
 
-            /* check if we should disconnect */
-            //if(session->auto_disconnect_enabled) {
-                if(auto_disconnect_time < time_ms()) {
-                    pdebug(DEBUG_DETAIL, "Disconnecting due to inactivity.");
+            /* the last tag is gone, close down once the packets on the wire are answered. */
+            if(session->closing) {
+                session_fail_queued(session, PLCTAG_ERR_ABORT);
+
+                if(session->packets_in_flight == 0 && session->data_offset >= session->data_size) {
+                    pdebug(DEBUG_DETAIL, "Closing session, no tags are using it.");
 
-                    auto_disconnect = 1;
                     idle = 0;
 
                     if(session->use_connected_msg) {
-                        state = SESSION_DISCONNECT;
+                        session->state = SESSION_DISCONNECT;
                     } else {
-                        state = SESSION_UNREGISTER;
+                        session->state = SESSION_UNREGISTER;
                     }
+
+                    break;
+                }
+            }
+
+            /* check if we should disconnect */
+            if(session->auto_disconnect_time < time_ms()) {
+                pdebug(DEBUG_DETAIL, "Disconnecting due to inactivity.");
+
+                session->auto_disconnect = 1;
+                idle = 0;
+
+                if(session->use_connected_msg) {
+                    session->state = SESSION_DISCONNECT;
+                } else {
+                    session->state = SESSION_UNREGISTER;
                 }
-            //}
+            }
 
             break;
 
         case SESSION_DISCONNECT:
             pdebug(DEBUG_DETAIL,"in SESSION_DISCONNECT state.");
-            if((rc = perform_forward_close(session)) != PLCTAG_STATUS_OK) {
+            if((rc = perform_forward_close(session)) == PLCTAG_STATUS_PENDING) {
+                idle = 1;
+                wait_events = session->exchange_events;
+                wait_until = session->exchange_timeout;
+                break;
+            }
+
+            if(rc != PLCTAG_STATUS_OK) {
                 pdebug(DEBUG_WARN, "Forward close failed %s!", plc_tag_decode_error(rc));
                 session->status = rc;
             }
 
-            state = SESSION_UNREGISTER;
+            session->state = SESSION_UNREGISTER;
             break;
 
         case SESSION_UNREGISTER:
@@ -1060,7 +1616,7 @@ THREAD_FUNC(session_handler)
                 session->status = rc;
             }
 
-            state = SESSION_CLOSE_SOCKET;
+            session->state = SESSION_CLOSE_SOCKET;
             break;
 
         case SESSION_CLOSE_SOCKET:
@@ -1070,10 +1626,12 @@ THREAD_FUNC(session_handler)
                 session->status = rc;
             }
 
-            if(auto_disconnect) {
-                state = SESSION_WAIT_RECONNECT;
+            if(session->closing) {
+                session->state = SESSION_TERMINATE;
+            } else if(session->auto_disconnect) {
+                session->state = SESSION_WAIT_RECONNECT;
             } else {
-                state = SESSION_START_RETRY;
+                session->state = SESSION_START_RETRY;
             }
 
             break;
@@ -1082,290 +1640,1511 @@ THREAD_FUNC(session_handler)
             pdebug(DEBUG_DETAIL, "in SESSION_START_RETRY state.");
 
             /* set up timer for retry. */
+            session->retry_count++;
+            session->retry_time = time_ms() + session_retry_wait(session);
+
+            if(session->retry_count >= RETRY_CIRCUIT_FAILURES) {
+                session_open_circuit(session);
+            }
+
+            /* start waiting. */
+            session->state = SESSION_WAIT_RETRY;
+
+            break;
+
+        case SESSION_WAIT_RETRY:
+            pdebug(DEBUG_SPEW, "in SESSION_WAIT_RETRY state.");
+
+            /* wait until the retry time. */
+            idle = 1;
+            wait_until = session->retry_time;
+
+            if(session->retry_time < time_ms()) {
+                pdebug(DEBUG_DETAIL, "Transitioning to SESSION_OPEN_SOCKET.");
+                session->state = SESSION_OPEN_SOCKET;
+            }
+
+            break;
+
+        case SESSION_WAIT_RECONNECT:
+            /* wait for at least one request to queue before reconnecting. */
+            pdebug(DEBUG_SPEW, "in SESSION_WAIT_RECONNECT state.");
+
+            idle = 1;
+            session->auto_disconnect = 0;
+
+            /* if there is work to do, reconnect.. */
+            critical_block(session->mutex) {
+                if(count_queued_requests(session) > 0) {
+                    pdebug(DEBUG_DETAIL, "There are requests waiting, reopening connection to PLC.");
+
+                    idle = 0;
+                    session->state = SESSION_OPEN_SOCKET;
+                }
+            }
+
+            break;
+
+        case SESSION_TERMINATE:
+            /* the socket is closed, the worker lets go of the session when we return. */
+            pdebug(DEBUG_DETAIL, "in SESSION_TERMINATE state.");
+
+            session->terminating = 1;
+
+            break;
+
+        default:
+            pdebug(DEBUG_ERROR, "Unknown state %d!",session->state);
+
+            /* FIXME - this logic is not complete.  We might be here without
+             * a connected session or a registered session. */
+            if(session->use_connected_msg) {
+                session->state = SESSION_DISCONNECT;
+            } else {
+                session->state = SESSION_UNREGISTER;
+            }
+
+            break;
+        }
+
+        /*
+         * stop here if we need to wait for something.  A busy idle session
+         * also stops after each pass so that the other sessions on the
+         * worker get a turn.  New requests and termination wake us up.
+         */
+        if(idle || session->state == SESSION_IDLE) {
+            if(!idle) {
+                wait_until = 0;
+            }
 
-            /* FIXME - make this a tag attribute. */
-            timeout_time = time_ms() + RETRY_WAIT_MS;
+            if((rc = session_set_events(session, wait_events)) != PLCTAG_STATUS_OK) {
+                session->status = rc;
+                session->state = SESSION_CLOSE_SOCKET;
+                continue;
+            }
+
+            session->wait_until = wait_until;
+
+            break;
+        }
+    }
+
+    pdebug(DEBUG_SPEW, "Done.");
+}
+
+
+
+/*****************************************************************
+ ********************* Session worker threads ********************
+ ****************************************************************/
+
+/*
+ * Sessions are run by a pool of worker threads instead of one thread per
+ * PLC.  Each worker has one event loop holding the sockets of all of its
+ * sessions.  A worker runs the sessions that have socket events, were
+ * kicked by a new request or have a timeout due, and then waits on its
+ * event loop.
+ *
+ * An event loop can only hold EVENT_LOOP_MAX_SOCKETS sockets, which is
+ * small on Windows.  When every worker is full another one is started.
+ * The pool is only changed with the session mutex held.
+ *
+ * Only the worker touches its event loop.  The worker holds a reference to
+ * each of its sessions.  When the last tag lets go of a session, the
+ * worker runs the tear down states, takes the session out of its loop
+ * and drops that reference.
+ */
+
+#define SESSION_WORKER_MAX_EVENTS (32)
+
+struct session_worker_t {
+    thread_p thread;
+    event_loop_p loop;
+    mutex_p mutex;
+    int terminating;
+    cond_p empty;   /* signalled when the worker lets go of its last session */
+
+    /* the sessions run by this worker and space to copy them while running. */
+    vector_p sessions;
+    ab_session_p *running;
+    int running_capacity;
+};
+
+static session_worker_p workers[SESSION_MAX_WORKERS];
+static int num_workers = 0;
+
+
+int session_workers_start(int count)
+{
+    int rc = PLCTAG_STATUS_OK;
+
+    if(num_workers > 0) {
+        if(count > 0 && count != num_workers) {
+            pdebug(DEBUG_WARN, "Session workers already started, keeping %d workers instead of %d.", num_workers, count);
+        }
+
+        return PLCTAG_STATUS_OK;
+    }
+
+    if(count <= 0) {
+        count = cpu_count();
+    }
+
+    if(count > SESSION_MAX_WORKERS) {
+        count = SESSION_MAX_WORKERS;
+    }
+
+    pdebug(DEBUG_INFO, "Starting %d session workers.", count);
+
+    for(int i=0; i < count && rc == PLCTAG_STATUS_OK; i++) {
+        rc = session_worker_add();
+    }
+
+    if(rc != PLCTAG_STATUS_OK) {
+        session_workers_stop();
+    }
+
+    return rc;
+}
+
+
+void session_workers_stop(void)
+{
+    for(int i=0; i < num_workers; i++) {
+        session_worker_free(workers[i]);
+        workers[i] = NULL;
+    }
+
+    num_workers = 0;
+}
+
+
+/*
+ * session_worker_add
+ *
+ * Start one more worker and add it to the pool.  Must be called with
+ * the session mutex held.
+ */
+int session_worker_add(void)
+{
+    int rc = PLCTAG_STATUS_OK;
+    session_worker_p worker = NULL;
+
+    if(num_workers >= SESSION_MAX_WORKERS) {
+        pdebug(DEBUG_WARN, "Already running the most session workers, %d!", SESSION_MAX_WORKERS);
+        return PLCTAG_ERR_NO_RESOURCES;
+    }
+
+    worker = mem_alloc((int)sizeof(struct session_worker_t));
+    if(!worker) {
+        pdebug(DEBUG_ERROR, "Unable to allocate session worker!");
+        return PLCTAG_ERR_NO_MEM;
+    }
+
+    do {
+        if((rc = mutex_create(&(worker->mutex))) != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_ERROR, "Unable to create session worker mutex!");
+            break;
+        }
+
+        if((rc = cond_create(&(worker->empty))) != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_ERROR, "Unable to create session worker condition!");
+            break;
+        }
+
+        if((worker->sessions = vector_create(SESSION_MIN_REQUESTS, SESSION_INC_REQUESTS)) == NULL) {
+            pdebug(DEBUG_ERROR, "Unable to create session worker session list!");
+            rc = PLCTAG_ERR_NO_MEM;
+            break;
+        }
+
+        if((rc = event_loop_create(&(worker->loop))) != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_ERROR, "Unable to create session worker event loop!");
+            break;
+        }
+
+        if((rc = thread_create(&(worker->thread), session_worker_handler, 32*1024, worker)) != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_ERROR, "Unable to create session worker thread!");
+            break;
+        }
+    } while(0);
+
+    if(rc != PLCTAG_STATUS_OK) {
+        session_worker_free(worker);
+        return rc;
+    }
+
+    workers[num_workers++] = worker;
+
+    return rc;
+}
+
+
+/*
+ * session_worker_free
+ *
+ * Stop the worker's thread if it is running and free the worker.  The
+ * worker gets a little while to close its sessions with the PLCs first.
+ * Whatever is left after that is closed without telling the PLC.
+ */
+void session_worker_free(session_worker_p worker)
+{
+    if(worker->thread) {
+        int64_t timeout_time = time_ms() + SESSION_DEFAULT_TIMEOUT;
+        int remaining = 0;
+
+        critical_block(worker->mutex) {
+            for(int i=0; i < vector_length(worker->sessions); i++) {
+                ab_session_p session = vector_get(worker->sessions, i);
+
+                session->closing = 1;
+                session->ready = 1;
+            }
+
+            remaining = vector_length(worker->sessions);
+        }
+
+        event_loop_wake(worker->loop);
+
+        while(remaining > 0 && timeout_time > time_ms()) {
+            cond_wait(worker->empty, (int)(timeout_time - time_ms()));
+
+            critical_block(worker->mutex) {
+                remaining = vector_length(worker->sessions);
+            }
+        }
+
+        worker->terminating = 1;
+        event_loop_wake(worker->loop);
+        thread_join(worker->thread);
+        thread_destroy(&(worker->thread));
+    }
+
+    /* the thread is gone, so the sessions and the loop are ours. */
+    if(worker->sessions) {
+        while(vector_length(worker->sessions) > 0) {
+            ab_session_p session = vector_get(worker->sessions, 0);
+
+            pdebug(DEBUG_WARN, "Session %p did not close in time.", session);
+
+            session_detach_unsafe(worker, session);
+            rc_dec(session);
+        }
+
+        vector_destroy(worker->sessions);
+    }
+
+    if(worker->loop) {
+        event_loop_destroy(&(worker->loop));
+    }
+
+    if(worker->empty) {
+        cond_destroy(&(worker->empty));
+    }
+
+    if(worker->mutex) {
+        mutex_destroy(&(worker->mutex));
+    }
+
+    mem_free(worker->running);
+    mem_free(worker);
+}
+
+
+/*
+ * session_attach
+ *
+ * Give the session to the worker with the fewest sessions.  If every
+ * worker's event loop is full, start another worker for it.
+ */
+int session_attach(ab_session_p session)
+{
+    session_worker_p worker = NULL;
+    int rc = PLCTAG_STATUS_OK;
+
+    critical_block(session_mutex) {
+        int fewest = EVENT_LOOP_MAX_SOCKETS;
+
+        if(num_workers == 0) {
+            pdebug(DEBUG_WARN, "No session workers are running!");
+            rc = PLCTAG_ERR_NOT_FOUND;
+            break;
+        }
+
+        for(int i=0; i < num_workers; i++) {
+            int count = 0;
+
+            critical_block(workers[i]->mutex) {
+                count = vector_length(workers[i]->sessions);
+            }
+
+            if(count < fewest) {
+                fewest = count;
+                worker = workers[i];
+            }
+        }
+
+        if(!worker) {
+            pdebug(DEBUG_INFO, "All %d session workers are full, starting another.", num_workers);
+
+            rc = session_worker_add();
+            if(rc != PLCTAG_STATUS_OK) {
+                break;
+            }
+
+            worker = workers[num_workers - 1];
+        }
+
+        critical_block(worker->mutex) {
+            rc = vector_put(worker->sessions, vector_length(worker->sessions), session);
+            if(rc != PLCTAG_STATUS_OK) {
+                break;
+            }
+
+            /* the worker's own reference, dropped once it has closed the session. */
+            rc_inc(session);
+
+            session->worker = worker;
+            session->loop = worker->loop;
+            session->ready = 1;
+        }
+    }
+
+    if(rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN, "Unable to add session to worker, %s!", plc_tag_decode_error(rc));
+        return rc;
+    }
+
+    event_loop_wake(worker->loop);
+
+    return rc;
+}
+
+
+/* only called by the worker, with the worker mutex held, or once the worker has stopped. */
+void session_detach_unsafe(session_worker_p worker, ab_session_p session)
+{
+    if(session->sock && session->sock_events >= 0) {
+        event_loop_remove_socket(worker->loop, session->sock);
+        session->sock_events = -1;
+    }
+
+    for(int i=0; i < vector_length(worker->sessions); i++) {
+        if(vector_get(worker->sessions, i) == session) {
+            vector_remove(worker->sessions, i);
+            break;
+        }
+    }
+
+    session->worker = NULL;
+    session->loop = NULL;
+
+    if(vector_length(worker->sessions) == 0) {
+        cond_signal(worker->empty);
+    }
+}
+
+
+/*
+ * session_kick
+ *
+ * Make the worker run the session soon, for instance to send a new request.
+ */
+void session_kick(ab_session_p session)
+{
+    session_worker_p worker = session->worker;
+
+    if(!worker) {
+        return;
+    }
+
+    critical_block(worker->mutex) {
+        session->ready = 1;
+    }
+
+    event_loop_wake(worker->loop);
+}
+
+
+/*
+ * session_set_events
+ *
+ * Change the socket events the worker waits on for this session.
+ */
+int session_set_events(ab_session_p session, int events)
+{
+    int rc = PLCTAG_STATUS_OK;
+
+    /* only change the socket interest set when we need to. */
+    if(session->sock && session->sock_events >= 0 && session->sock_events != events) {
+        rc = event_loop_mod_socket(session->loop, session->sock, events, session);
+        if(rc != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_WARN, "Unable to change socket events, %s!", plc_tag_decode_error(rc));
+            return rc;
+        }
+
+        session->sock_events = events;
+    }
+
+    return rc;
+}
+
+
+THREAD_FUNC(session_worker_handler)
+{
+    session_worker_p worker = arg;
+    event_loop_event_t events[SESSION_WORKER_MAX_EVENTS];
+
+    pdebug(DEBUG_INFO, "Starting session worker %p", worker);
+
+    while(!worker->terminating) {
+        int num_running = 0;
+        int64_t now = time_ms();
+        int64_t wait_until = INT64_MAX;
+        int timeout_ms = -1;
+        int rc = 0;
+
+        /* find the sessions that need to run, holding a reference to each while they do. */
+        critical_block(worker->mutex) {
+            int num_sessions = vector_length(worker->sessions);
+
+            if(worker->running_capacity < num_sessions) {
+                ab_session_p *running = mem_alloc(num_sessions * 2 * (int)sizeof(ab_session_p));
+
+                if(running) {
+                    mem_free(worker->running);
+                    worker->running = running;
+                    worker->running_capacity = num_sessions * 2;
+                }
+            }
+
+            for(int i = num_sessions - 1; i >= 0; i--) {
+                ab_session_p session = vector_get(worker->sessions, i);
+
+                if((session->ready || session->wait_until <= now) && num_running < worker->running_capacity && rc_inc(session)) {
+                    session->ready = 0;
+                    worker->running[num_running++] = session;
+                } else if(session->wait_until < wait_until) {
+                    wait_until = session->wait_until;
+                }
+            }
+        }
+
+        for(int i=0; i < num_running; i++) {
+            ab_session_p session = worker->running[i];
+
+            session_run(session);
+
+            if(session->terminating) {
+                /* the session is closed, let go of it along with the worker's reference. */
+                critical_block(worker->mutex) {
+                    session_detach_unsafe(worker, session);
+                }
+
+                rc_dec(session);
+            } else if(session->wait_until < wait_until) {
+                wait_until = session->wait_until;
+            }
+
+            /* this can destroy the session. */
+            rc_dec(session);
+        }
+
+        now = time_ms();
+
+        if(wait_until != INT64_MAX) {
+            if(wait_until <= now) {
+                timeout_ms = 0;
+            } else if(wait_until - now > INT_MAX) {
+                timeout_ms = INT_MAX;
+            } else {
+                timeout_ms = (int)(wait_until - now);
+            }
+        }
+
+        rc = event_loop_wait(worker->loop, timeout_ms, events, SESSION_WORKER_MAX_EVENTS);
+        if(rc < 0) {
+            pdebug(DEBUG_WARN, "Error waiting for session events, %s!", plc_tag_decode_error(rc));
+            sleep_ms(1);
+            continue;
+        }
+
+        /* sessions are only freed after this thread lets go of them, so the contexts are good. */
+        critical_block(worker->mutex) {
+            for(int i=0; i < rc; i++) {
+                ab_session_p session = events[i].context;
+
+                session->ready = 1;
+
+                /* an error with no data to read means the connection is gone. */
+                if((events[i].events & EVENT_LOOP_ERROR) && !(events[i].events & EVENT_LOOP_READ)) {
+                    pdebug(DEBUG_WARN, "Socket closed or in error!");
+                    session->sock_lost = 1;
+                }
+            }
+        }
+    }
+
+    pdebug(DEBUG_INFO, "Session worker %p done.", worker);
+
+    THREAD_RETURN(0);
+}
+
+
+int process_requests(ab_session_p session)
+{
+    int rc = PLCTAG_STATUS_OK;
+
+    debug_set_tag_id(0);
+
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    if(!session) {
+        pdebug(DEBUG_WARN, "Null session pointer!");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    do {
+        /* finish sending any partially sent packet first. */
+        if((rc = send_pending_data(session)) != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_WARN, "Error sending packet %s!", plc_tag_decode_error(rc));
+            break;
+        }
+
+        /* fill the window with new packets while the socket takes them. */
+        while(session->data_offset >= session->data_size && session->packets_in_flight < get_send_window(session)) {
+            rc = send_next_packet(session);
+            if(rc != PLCTAG_STATUS_OK) {
+                break;
+            }
+
+            if((rc = send_pending_data(session)) != PLCTAG_STATUS_OK) {
+                pdebug(DEBUG_WARN, "Error sending packet %s!", plc_tag_decode_error(rc));
+                break;
+            }
+        }
+
+        /* running out of requests is not an error. */
+        if(rc == PLCTAG_ERR_NO_DATA) {
+            rc = PLCTAG_STATUS_OK;
+        }
+
+        if(rc != PLCTAG_STATUS_OK) {
+            break;
+        }
+
+        /* pick up any responses that have arrived. */
+        if((rc = recv_pending_data(session)) != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_WARN, "Error receiving packet response %s!", plc_tag_decode_error(rc));
+            break;
+        }
+
+        /* responses come back in order, so only the oldest one can be late. */
+        if(vector_length(session->in_flight_requests) > 0) {
+            ab_request_p oldest = vector_get(session->in_flight_requests, 0);
+
+            if(oldest->time_sent + SESSION_DEFAULT_TIMEOUT < time_ms()) {
+                pdebug(DEBUG_WARN, "Timed out waiting for response to packet!");
+                rc = PLCTAG_ERR_TIMEOUT;
+                break;
+            }
+        }
+
+        /* no answer to a keep alive means the PLC or the network is gone. */
+        if(session->keepalive_pending > 0 && session->keepalive_sent + SESSION_DEFAULT_TIMEOUT < time_ms()) {
+            pdebug(DEBUG_WARN, "Timed out waiting for response to keep alive!");
+            rc = PLCTAG_ERR_TIMEOUT;
+            break;
+        }
+
+        /* keep the connection open if nothing else has been sent for a while. */
+        if(session->keepalive_time <= time_ms() && session->keepalive_pending == 0 && session->packets_in_flight == 0 && session->data_offset >= session->data_size) {
+            if((rc = send_keepalive(session)) != PLCTAG_STATUS_OK) {
+                pdebug(DEBUG_WARN, "Error sending keep alive %s!", plc_tag_decode_error(rc));
+                break;
+            }
+        }
+    } while(0);
+
+    /* problem? the session will be reset, so dump everything on the wire. */
+    if(rc != PLCTAG_STATUS_OK) {
+        session_fail_in_flight(session, rc);
+    }
+
+    debug_set_tag_id(0);
+
+    pdebug(DEBUG_SPEW,"Done.");
+
+    return rc;
+}
+
+
+
+/*
+ * session_note_activity
+ *
+ * Push back the idle disconnect and the next keep alive after the tags
+ * used the session.  A session disconnects after auto_disconnect_ms
+ * without requests if that was asked for.  Otherwise, a session sending
+ * keep alives stays connected and the rest disconnect after
+ * SESSION_DISCONNECT_TIMEOUT.
+ */
+void session_note_activity(ab_session_p session)
+{
+    int64_t now = time_ms();
+
+    if(session->auto_disconnect_enabled) {
+        session->auto_disconnect_time = now + session->auto_disconnect_timeout_ms;
+    } else if(session->keepalive_ms > 0) {
+        session->auto_disconnect_time = INT64_MAX;
+    } else {
+        session->auto_disconnect_time = now + SESSION_DISCONNECT_TIMEOUT;
+    }
+
+    if(session->keepalive_ms > 0) {
+        session->keepalive_time = now + session->keepalive_ms;
+    } else {
+        session->keepalive_time = INT64_MAX;
+    }
+}
+
+
+
+/*
+ * session_retry_wait
+ *
+ * Exponential backoff with jitter.  Up to half of the wait is taken off
+ * at random so that sessions that failed at the same time, such as when
+ * a switch went down, do not all retry at the same time.
+ */
+int session_retry_wait(ab_session_p session)
+{
+    int wait = RETRY_MIN_WAIT_MS;
+
+    for(int i=1; i < session->retry_count && wait < RETRY_MAX_WAIT_MS; i++) {
+        wait *= 2;
+    }
+
+    if(wait > RETRY_MAX_WAIT_MS) {
+        wait = RETRY_MAX_WAIT_MS;
+    }
+
+    /* xorshift, rand() is shared by every thread and not safe to call from the workers. */
+    session->retry_seed ^= session->retry_seed << 13;
+    session->retry_seed ^= session->retry_seed >> 17;
+    session->retry_seed ^= session->retry_seed << 5;
+
+    wait -= (int)(session->retry_seed % (uint32_t)(wait/2 + 1));
+
+    pdebug(DEBUG_DETAIL, "Retry %d in %dms.", session->retry_count, wait);
+
+    return wait;
+}
+
+
+
+/*
+ * session_open_circuit
+ *
+ * The PLC is down.  Requests already queued fail now rather than when
+ * they time out and new ones are refused until a retry connects.  The
+ * retries keep going and act as the probe that finds out the PLC is
+ * back.
+ */
+void session_open_circuit(ab_session_p session)
+{
+    int was_open = 0;
+
+    critical_block(session->mutex) {
+        was_open = session->circuit_open;
+        session->circuit_open = 1;
+    }
+
+    if(!was_open) {
+        pdebug(DEBUG_WARN, "PLC %s is not reachable after %d tries, failing requests until it is.", session->host, session->retry_count);
+    }
+
+    session_fail_queued(session, PLCTAG_ERR_PLC_OFFLINE);
+}
+
+
+
+void session_close_circuit(ab_session_p session)
+{
+    int was_open = 0;
+
+    critical_block(session->mutex) {
+        was_open = session->circuit_open;
+        session->circuit_open = 0;
+    }
+
+    if(was_open) {
+        pdebug(DEBUG_WARN, "PLC %s is reachable again.", session->host);
+    }
+
+    session->retry_count = 0;
+}
+
+
+
+void session_fail_queued(ab_session_p session, int status)
+{
+    for(int i=0; i < SESSION_NUM_PRIORITIES; i++) {
+        ab_request_p request = NULL;
+
+        while((request = queue_get(session->requests[i]))) {
+            spin_block(&request->lock) {
+                request->status = status;
+                request->request_size = 0;
+                request->resp_received = 1;
+            }
+
+            tag_notify_complete(request->tag_id);
+
+            rc_dec(request);
+        }
+    }
+}
+
+
+
+/*
+ * send_keepalive
+ *
+ * Unconnected sessions send a ListIdentity.  The PLC also times out
+ * idle CIP connections, so connected sessions read the vendor ID of
+ * the identity object over each connection instead.  Only the arrival
+ * of the reply matters, not what is in it.
+ */
+int send_keepalive(ab_session_p session)
+{
+    uint8_t *data = session->data;
+    int64_t now = time_ms();
+
+    pdebug(DEBUG_DETAIL, "Starting.");
+
+    if(session->use_connected_msg) {
+        for(int i=0; i < session->num_connections; i++) {
+            eip_cip_co_req *req = (eip_cip_co_req *)data;
+            uint8_t *cip = data + sizeof(eip_cip_co_req);
+
+            mem_set(req, 0, (int)sizeof(*req));
+
+            /* Get Attribute Single on class 1, instance 1, attribute 1. */
+            *cip++ = AB_EIP_CMD_CIP_GET_ATTR_SINGLE;
+            *cip++ = 3;
+            *cip++ = 0x20;
+            *cip++ = 0x01;
+            *cip++ = 0x24;
+            *cip++ = 0x01;
+            *cip++ = 0x30;
+            *cip++ = 0x01;
+
+            session->conn_seq_num++;
+
+            req->encap_command = h2le16(AB_EIP_CONNECTED_SEND);
+            req->encap_length = h2le16((uint16_t)(cip - data - (int)sizeof(eip_encap)));
+            req->encap_session_handle = h2le32(session->session_handle);
+            req->router_timeout = h2le16(1);
+            req->cpf_item_count = h2le16(2);
+            req->cpf_cai_item_type = h2le16(AB_EIP_ITEM_CAI);
+            req->cpf_cai_item_length = h2le16(4);
+            req->cpf_targ_conn_id = h2le32(session->connections[i].targ_connection_id);
+            req->cpf_cdi_item_type = h2le16(AB_EIP_ITEM_CDI);
+            req->cpf_cdi_item_length = h2le16((uint16_t)(cip - (uint8_t *)(&req->cpf_conn_seq_num)));
+            req->cpf_conn_seq_num = h2le16(session->conn_seq_num);
+
+            session->connections[i].keepalive_seq = session->conn_seq_num;
+            session->connections[i].keepalive_pending = 1;
+            session->keepalive_pending++;
+
+            data = cip;
+        }
+    } else {
+        eip_encap *encap = (eip_encap *)data;
+
+        mem_set(encap, 0, (int)sizeof(*encap));
+
+        encap->encap_command = h2le16(AB_EIP_LIST_IDENTITY);
+        encap->encap_session_handle = h2le32(session->session_handle);
+
+        session->keepalive_pending = 1;
+
+        data += sizeof(eip_encap);
+    }
+
+    session->data_size = (uint32_t)(data - session->data);
+    session->data_offset = 0;
+
+    session->keepalive_sent = now;
+    session->keepalive_time = now + session->keepalive_ms;
+
+    pdebug(DEBUG_DETAIL, "Sending %d bytes of keep alive.", (int)session->data_size);
+    pdebug_dump_bytes(DEBUG_DETAIL, session->data, (int)(session->data_size));
+
+    pdebug(DEBUG_DETAIL, "Done.");
+
+    return send_pending_data(session);
+}
+
+
+
+/* returns non-zero if the packet just received answers a keep alive. */
+int match_keepalive_response(ab_session_p session)
+{
+    eip_encap *encap = (eip_encap *)(session->rx_data);
+
+    if(session->keepalive_pending == 0) {
+        return 0;
+    }
+
+    if(le2h16(encap->encap_command) == AB_EIP_LIST_IDENTITY) {
+        session->keepalive_pending = 0;
+        return 1;
+    }
+
+    if(le2h16(encap->encap_command) == AB_EIP_CONNECTED_SEND) {
+        uint16_t seq = le2h16(((eip_cip_co_resp *)(session->rx_data))->cpf_conn_seq_num);
+
+        for(int i=0; i < session->num_connections; i++) {
+            if(session->connections[i].keepalive_pending && session->connections[i].keepalive_seq == seq) {
+                session->connections[i].keepalive_pending = 0;
+                session->keepalive_pending--;
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * get_queue_order
+ *
+ * Decide which priority queues the next packet is filled from, in order.
+ * Higher priorities go first, except that when bulk requests have been
+ * waiting for SESSION_BULK_SHARE packets, they go first once.
+ */
+void get_queue_order(ab_session_p session, int *order)
+{
+    int bulk_waiting = (queue_length(session->requests[SESSION_PRIORITY_BULK]) > 0);
+    int others_waiting = (queue_length(session->requests[SESSION_PRIORITY_HIGH]) > 0 ||
+                          queue_length(session->requests[SESSION_PRIORITY_NORMAL]) > 0);
+
+    order[0] = SESSION_PRIORITY_HIGH;
+    order[1] = SESSION_PRIORITY_NORMAL;
+    order[2] = SESSION_PRIORITY_BULK;
+
+    if(!bulk_waiting || !others_waiting) {
+        session->bulk_skipped = 0;
+        return;
+    }
+
+    if(session->bulk_skipped >= SESSION_BULK_SHARE) {
+        pdebug(DEBUG_DETAIL, "Giving waiting bulk requests their share.");
+
+        order[0] = SESSION_PRIORITY_BULK;
+        order[1] = SESSION_PRIORITY_HIGH;
+        order[2] = SESSION_PRIORITY_NORMAL;
+
+        session->bulk_skipped = 0;
+    } else {
+        session->bulk_skipped++;
+    }
+}
+
+
+
+/*
+ * count_queued_requests
+ *
+ * Total requests waiting in all the priority queues.
+ */
+int count_queued_requests(ab_session_p session)
+{
+    int total = 0;
+
+    for(int i=0; i < SESSION_NUM_PRIORITIES; i++) {
+        total += queue_length(session->requests[i]);
+    }
+
+    return total;
+}
+
+
+
+/*
+ * get_send_window
+ *
+ * The packets in flight limit applies to each open connection.
+ */
+int get_send_window(ab_session_p session)
+{
+    if(session->use_connected_msg && session->num_connections > 1) {
+        return session->max_packets_in_flight * session->num_connections;
+    }
+
+    return session->max_packets_in_flight;
+}
+
+
+
+/*
+ * pick_connection
+ *
+ * Choose the open connection with the fewest packets in flight for the
+ * next packet.  Ties go round robin so that the load is spread out.
+ */
+int pick_connection(ab_session_p session)
+{
+    int best = 0;
+
+    if(session->num_connections < 2) {
+        return 0;
+    }
+
+    best = session->next_connection % session->num_connections;
+
+    for(int n=1; n < session->num_connections; n++) {
+        int i = (session->next_connection + n) % session->num_connections;
+
+        if(session->connections[i].packets_in_flight < session->connections[best].packets_in_flight) {
+            best = i;
+        }
+    }
+
+    session->next_connection = (best + 1) % session->num_connections;
+
+    return best;
+}
+
+
+
+/*
+ * send_next_packet
+ *
+ * Take the next batch of requests off the queue, pack them into the session
+ * buffer and get it ready to send.  The requests move to the in flight list.
+ * Returns PLCTAG_ERR_NO_DATA if there was nothing to send.
+ */
+int send_next_packet(ab_session_p session)
+{
+    int rc = PLCTAG_STATUS_OK;
+    ab_request_p request = NULL;
+    ab_request_p bundled_requests[MAX_REQUESTS] = {NULL};
+    int num_bundled_requests = 0;
+    ab_request_p aborted_requests[MAX_REQUESTS] = {NULL};
+    int num_aborted_requests = 0;
+    int remaining_space = 0;
+    int skipped_tags[SESSION_NUM_PRIORITIES * SESSION_PACK_LOOK_AHEAD];
+    int num_skipped_tags = 0;
+    int holds = 0;
+
+    pdebug(DEBUG_SPEW, "Checking for requests to process.");
+
+    critical_block(session->mutex) {
+        holds = session->batch_holds;
+    }
+
+    /* is there anything to do?  Wait for the rest of a batch before packing. */
+    if(!holds) {
+        int order[SESSION_NUM_PRIORITIES];
+        int done = 0;
+
+        get_queue_order(session, order);
+
+        remaining_space = session->max_payload_size - (int)sizeof(cip_multi_req_header);
+
+        for(int i=0; i < SESSION_NUM_PRIORITIES && !done; i++) {
+            queue_p queue = session->requests[order[i]];
+            int index = 0;
+
+            /*
+             * Look past requests that do not fit for ones that do, first fit.  Once
+             * a tag has a request left behind, its later requests stay behind too
+             * so that each tag's requests still go out in order.
+             *
+             * Only this thread takes requests off the queues, so they do not move under us.
+             */
+            while(num_bundled_requests < MAX_REQUESTS && index < SESSION_PACK_LOOK_AHEAD && (request = queue_peek_at(queue, index))) {
+                int payload_size = 0;
+
+                /* aborted requests are dropped when we see them. */
+                if(request->abort_request) {
+                    if(num_aborted_requests >= MAX_REQUESTS) {
+                        done = 1;
+                        break;
+                    }
+
+                    aborted_requests[num_aborted_requests] = queue_remove_at(queue, index);
+                    num_aborted_requests++;
+
+                    continue;
+                }
+
+                payload_size = get_payload_size(request);
+
+                /*
+                 * The first request always goes, packable or not.  After that, only
+                 * packable requests that fit and are not behind a skipped one from
+                 * the same tag.
+                 */
+                if(num_bundled_requests > 0) {
+                    int tag_skipped = 0;
+                    int same_command = (get_request_command(request) == get_request_command(bundled_requests[0]));
+
+                    for(int j=0; j < num_skipped_tags && !tag_skipped; j++) {
+                        tag_skipped = (skipped_tags[j] == request->tag_id);
+                    }
+
+                    if(tag_skipped || !same_command || !request->allow_packing || payload_size > remaining_space) {
+                        if(!tag_skipped) {
+                            skipped_tags[num_skipped_tags] = request->tag_id;
+                            num_skipped_tags++;
+                        }
+
+                        index++;
+                        continue;
+                    }
+                }
+
+                remaining_space = remaining_space - payload_size;
+
+                /* packed unconnected requests still need the route path and a pad byte. */
+                if(num_bundled_requests == 0 && get_request_command(request) == AB_EIP_UNCONNECTED_SEND) {
+                    remaining_space = remaining_space - (session->conn_path_size + 2 + 1);
+                }
+
+                bundled_requests[num_bundled_requests] = queue_remove_at(queue, index);
+                num_bundled_requests++;
+
+                if(!request->allow_packing || remaining_space <= 0) {
+                    done = 1;
+                    break;
+                }
+            }
+        }
+    }
+
+    /* this can cause destroy actions. */
+    if(num_aborted_requests > 0) {
+
+        pdebug(DEBUG_SPEW, "%d requests to abort.", num_aborted_requests);
+
+        for(int i=0; i < num_aborted_requests; i++) {
+            request = aborted_requests[i];
+
+            debug_set_tag_id(request->tag_id);
+
+            pdebug(DEBUG_DETAIL, "Request %p is aborted.", request);
+
+            request->status = PLCTAG_ERR_ABORT;
+            request->request_size = 0;
+            request->resp_received = 1;
+
+            tag_notify_complete(request->tag_id);
+
+            aborted_requests[i] = rc_dec(request);
+        }
+    }
+
+    debug_set_tag_id(0);
+
+    if(num_bundled_requests == 0) {
+        return PLCTAG_ERR_NO_DATA;
+    }
+
+    pdebug(DEBUG_DETAIL, "%d requests to process.", num_bundled_requests);
+
+    do {
+        eip_encap *encap = (eip_encap *)(session->data);
+        int64_t now = time_ms();
+        int conn_index = pick_connection(session);
+
+        /* copy and pack the requests into the session buffer. */
+        rc = pack_requests(session, bundled_requests, num_bundled_requests);
+        if(rc != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_WARN, "Error while packing requests, %s!", plc_tag_decode_error(rc));
+            break;
+        }
+
+        /* fill in all the necessary parts to the request. */
+        if((rc = prepare_request(session, conn_index)) != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_WARN, "Unable to prepare request, %s!", plc_tag_decode_error(rc));
+            break;
+        }
+
+        /* remember which packet each request went out in so that we can match the response. */
+        for(int i=0; i < num_bundled_requests; i++) {
+            request = bundled_requests[i];
+
+            request->time_sent = now;
+            request->packing_num = i;
+
+            if(le2h16(encap->encap_command) == AB_EIP_CONNECTED_SEND) {
+                request->conn_seq_num = session->conn_seq_num;
+                request->connection = conn_index;
+            } else {
+                request->session_seq_id = session->session_seq_id;
+            }
+
+            /* the in flight list takes over our reference. */
+            vector_put(session->in_flight_requests, vector_length(session->in_flight_requests), request);
+            bundled_requests[i] = NULL;
+        }
+
+        if(le2h16(encap->encap_command) == AB_EIP_CONNECTED_SEND) {
+            session->connections[conn_index].packets_in_flight++;
+        }
+
+        if(num_bundled_requests > 1) {
+            int used = session->max_payload_size - remaining_space;
+
+            pdebug(DEBUG_DETAIL, "Packed %d requests into %d of %d bytes (%d%%), %d tags left for later packets.", num_bundled_requests, used, session->max_payload_size, (used * 100) / session->max_payload_size, num_skipped_tags);
+        }
+
+        session->packets_in_flight++;
+        session->packet_count++;
+        session->data_offset = 0;
+
+        pdebug(DEBUG_DETAIL, "%d packets in flight.", session->packets_in_flight);
+    } while(0);
+
+    /* problem? clean up the pending requests and dump everything. */
+    if(rc != PLCTAG_STATUS_OK) {
+        for(int i=0; i < num_bundled_requests; i++) {
+            if(bundled_requests[i]) {
+                bundled_requests[i]->status = rc;
+                bundled_requests[i]->request_size = 0;
+                bundled_requests[i]->resp_received = 1;
+                tag_notify_complete(bundled_requests[i]->tag_id);
+                bundled_requests[i] = rc_dec(bundled_requests[i]);
+            }
+        }
+    }
+
+    return rc;
+}
+
+
+
+/*
+ * send_pending_data
+ *
+ * Write as much of the packet in the session buffer as the socket
+ * will take without blocking.
+ */
+int send_pending_data(ab_session_p session)
+{
+    int rc = PLCTAG_STATUS_OK;
 
-            /* start waiting. */
-            state = SESSION_WAIT_RETRY;
+    while(session->data_offset < session->data_size) {
+        rc = socket_write(session->sock, session->data + session->data_offset, (int)session->data_size - (int)session->data_offset);
 
+        /* the socket buffer is full, try again when it drains. */
+        if(rc == PLCTAG_ERR_NO_DATA) {
             break;
+        }
 
-        case SESSION_WAIT_RETRY:
-            pdebug(DEBUG_SPEW, "in SESSION_WAIT_RETRY state.");
+        if(rc < 0) {
+            pdebug(DEBUG_WARN,"Error, %d, writing socket!", rc);
+            return rc;
+        }
 
-            /* make us sleep on each iteration. */
-            idle = 1;
+        session->data_offset += (uint32_t)rc;
+    }
 
-            if(timeout_time < time_ms()) {
-                pdebug(DEBUG_DETAIL, "Transitioning to SESSION_OPEN_SOCKET.");
-                state = SESSION_OPEN_SOCKET;
-            }
+    return PLCTAG_STATUS_OK;
+}
 
-            break;
 
-        case SESSION_WAIT_RECONNECT:
-            /* wait for at least one request to queue before reconnecting. */
-            pdebug(DEBUG_SPEW, "in SESSION_WAIT_RECONNECT state.");
 
-            idle = 1;
-            auto_disconnect = 0;
+/*
+ * recv_pending_data
+ *
+ * Read whatever the socket has for us and hand off each complete
+ * response packet as it comes in.
+ */
+int recv_pending_data(ab_session_p session)
+{
+    int rc = PLCTAG_STATUS_OK;
 
-            /* if there is work to do, reconnect.. */
-            critical_block(session->mutex) {
-                if(vector_length(session->requests) > 0) {
-                    pdebug(DEBUG_DETAIL, "There are requests waiting, reopening connection to PLC.");
+    while(1) {
+        uint32_t data_needed = sizeof(eip_encap);
 
-                    idle = 0;
-                    state = SESSION_OPEN_SOCKET;
-                }
+        /* once we have the header, we know how big the packet is. */
+        if(session->rx_offset >= sizeof(eip_encap)) {
+            data_needed = (uint32_t)(sizeof(eip_encap) + le2h16(((eip_encap *)(session->rx_data))->encap_length));
+
+            if(data_needed > sizeof(session->rx_data)) {
+                pdebug(DEBUG_WARN,"Packet response (%d) is larger than possible buffer size (%d)!", data_needed, (int)sizeof(session->rx_data));
+                return PLCTAG_ERR_TOO_LARGE;
             }
+        }
 
-            break;
+        if(session->rx_offset < data_needed) {
+            rc = socket_read(session->sock, session->rx_data + session->rx_offset, (int)(data_needed - session->rx_offset));
+            if(rc < 0) {
+                pdebug(DEBUG_WARN,"Error reading socket! rc=%d",rc);
+                return rc;
+            }
 
+            if(rc == 0) {
+                /* nothing more to read right now. */
+                break;
+            }
 
-        default:
-            pdebug(DEBUG_ERROR, "Unknown state %d!",state);
+            session->rx_offset += (uint32_t)rc;
+        } else {
+            session->rx_size = data_needed;
 
-            /* FIXME - this logic is not complete.  We might be here without
-             * a connected session or a registered session. */
-            if(session->use_connected_msg) {
-                state = SESSION_DISCONNECT;
-            } else {
-                state = SESSION_UNREGISTER;
-            }
+            rc = dispatch_response(session);
 
-            break;
-        }
+            session->rx_offset = 0;
+            session->rx_size = 0;
 
-        /*
-         * give up the CPU a bit, but only if we are not
-         * doing some linked states.
-         */
-        if(idle && !session->terminating) {
-            sleep_ms(1);
+            if(rc != PLCTAG_STATUS_OK) {
+                return rc;
+            }
         }
     }
 
-    THREAD_RETURN(0);
+    return PLCTAG_STATUS_OK;
 }
 
 
-int process_requests(ab_session_p session)
-{
-    int rc = PLCTAG_STATUS_OK;
-    ab_request_p request = NULL;
-    ab_request_p bundled_requests[MAX_REQUESTS] = {NULL};
-    int num_bundled_requests = 0;
-    ab_request_p aborted_requests[MAX_REQUESTS] = {NULL};
-    int num_aborted_requests = 0;
-    int remaining_space = 0;
 
-    debug_set_tag_id(0);
+/*
+ * request_matches_response
+ *
+ * Unconnected responses echo the sender context of the request and
+ * connected responses echo the connection sequence number.
+ */
+int request_matches_response(ab_request_p request, uint8_t *response)
+{
+    eip_encap *req_encap = (eip_encap *)(request->data);
+    eip_encap *resp_encap = (eip_encap *)response;
 
-    pdebug(DEBUG_SPEW, "Starting.");
+    if(le2h16(req_encap->encap_command) != le2h16(resp_encap->encap_command)) {
+        return 0;
+    }
 
-    if(!session) {
-        pdebug(DEBUG_WARN, "Null session pointer!");
-        return PLCTAG_ERR_NULL_PTR;
+    if(le2h16(resp_encap->encap_command) == AB_EIP_CONNECTED_SEND) {
+        return request->conn_seq_num == le2h16(((eip_cip_co_resp *)response)->cpf_conn_seq_num);
+    } else {
+        return request->session_seq_id == le2h64(resp_encap->encap_sender_context);
     }
+}
 
-    pdebug(DEBUG_SPEW, "Checking for requests to process.");
 
-    rc = PLCTAG_STATUS_OK;
-    request = NULL;
-    session->data_size = 0;
-    session->data_offset = 0;
 
-    /* grab a request off the front of the list. */
-    critical_block(session->mutex) {
-        /* is there anything to do? */
-        if(vector_length(session->requests)) {
-            //int blocked = 0;
+/*
+ * dispatch_response
+ *
+ * Find the requests that went out in the packet we just received a
+ * response for and copy the results back to them.
+ */
+int dispatch_response(ab_session_p session)
+{
+    int rc = PLCTAG_STATUS_OK;
+    ab_request_p requests[MAX_REQUESTS] = {NULL};
+    int num_requests = 0;
+    eip_encap *encap = (eip_encap *)(session->rx_data);
 
-            /* remove the aborted requests. */
-            for(int i=0; i < vector_length(session->requests) && num_aborted_requests < MAX_REQUESTS; i++) {
-                request = vector_get(session->requests, i);
+    pdebug(DEBUG_DETAIL, "Starting.");
 
-                /* filter out the aborts. */
-                if(request && request->abort_request) {
-                    aborted_requests[num_aborted_requests] = request;
-                    num_aborted_requests++;
+    pdebug(DEBUG_DETAIL, "Received packet of size %d.", session->rx_size);
+    pdebug_dump_bytes(DEBUG_DETAIL, session->rx_data, (int)(session->rx_size));
 
-                    /* remove it from the queue. */
-                    vector_remove(session->requests, i);
+    session->resp_seq_id = le2h64(encap->encap_sender_context);
 
-                    /* vector size has changed, back up one. */
-                    i--;
-                }
-            }
+    /* keep alive replies only tell us that the connection still works. */
+    if(match_keepalive_response(session)) {
+        pdebug(DEBUG_DETAIL, "Received keep alive response.");
+        return PLCTAG_STATUS_OK;
+    }
 
-            remaining_space = session->max_payload_size - (int)sizeof(cip_multi_req_header);
+    /* pull out the requests that were sent in this packet, in packing order. */
+    for(int i=0; i < vector_length(session->in_flight_requests) && num_requests < MAX_REQUESTS; i++) {
+        ab_request_p request = vector_get(session->in_flight_requests, i);
 
-            /* if there are still requests after purging all the aborted requests, process them. */
-            if(vector_length(session->requests)) {
-                do {
-                    request = vector_get(session->requests, 0);
+        if(request_matches_response(request, session->rx_data)) {
+            requests[num_requests] = request;
+            num_requests++;
 
-                    remaining_space = remaining_space - get_payload_size(request);
+            vector_remove(session->in_flight_requests, i);
+            i--;
+        }
+    }
 
+    if(num_requests == 0) {
+        pdebug(DEBUG_WARN, "Received a response that does not match any packet in flight, dropping it.");
+        return PLCTAG_STATUS_OK;
+    }
 
-                    /*
-                     * If we have a non-packable request, only queue it if it is the first one.
-                     * If the request is packable, keep queuing as long as there is space.
-                     */
+    session->packets_in_flight--;
 
-                    if(num_bundled_requests == 0 || (request->allow_packing && remaining_space > 0)) {
-                        //pdebug(DEBUG_DETAIL, "packed %d requests with remaining space %d", num_bundled_requests+1, remaining_space);
-                        bundled_requests[num_bundled_requests] = request;
-                        num_bundled_requests++;
+    if(le2h16(encap->encap_command) == AB_EIP_CONNECTED_SEND && requests[0]->connection < SESSION_MAX_CONNECTIONS) {
+        session->connections[requests[0]->connection].packets_in_flight--;
+    }
 
-                        /* remove it from the queue. */
-                        vector_remove(session->requests, 0);
-                    }
-                } while(vector_length(session->requests) && remaining_space > 0 && num_bundled_requests < MAX_REQUESTS && request->allow_packing);
-            } else {
-                pdebug(DEBUG_DETAIL, "All requests in queue were aborted, nothing to do.");
+    do {
+        /* check status. */
+        if(le2h32(encap->encap_status) != AB_EIP_OK) {
+            pdebug(DEBUG_WARN, "EIP command failed, response code: %d", le2h32(encap->encap_status));
+            rc = PLCTAG_ERR_BAD_STATUS;
+            break;
+        }
+
+        /*
+         * check the CIP status, but only if this is a bundled
+         * response.   If it is a singleton, then we pass the
+         * status back to the tag.
+         */
+        if(num_requests > 1) {
+            if(le2h16(encap->encap_command) == AB_EIP_UNCONNECTED_SEND) {
+                eip_cip_uc_resp *resp = (eip_cip_uc_resp *)(session->rx_data);
+                pdebug(DEBUG_INFO,"Received unconnected packet with session sequence ID %llx",resp->encap_sender_context);
+
+                /* punt if we got an overall error or it is not a partial/bundled error. */
+                if(resp->status != AB_EIP_OK && resp->status != AB_CIP_ERR_PARTIAL_ERROR) {
+                    rc = decode_cip_error_code(&(resp->status));
+                    pdebug(DEBUG_WARN,"Command failed! (%d/%d) %s", resp->status, rc, plc_tag_decode_error(rc));
+                    break;
+                }
+            } else if(le2h16(encap->encap_command) == AB_EIP_CONNECTED_SEND) {
+                eip_cip_co_resp *resp = (eip_cip_co_resp *)(session->rx_data);
+                pdebug(DEBUG_INFO,"Received connected packet with connection ID %x and sequence ID %u(%x)",le2h32(resp->cpf_orig_conn_id), le2h16(resp->cpf_conn_seq_num), le2h16(resp->cpf_conn_seq_num));
+
+                /* punt if we got an overall error or it is not a partial/bundled error. */
+                if(resp->status != AB_EIP_OK && resp->status != AB_CIP_ERR_PARTIAL_ERROR) {
+                    rc = decode_cip_error_code(&(resp->status));
+                    pdebug(DEBUG_WARN,"Command failed! (%d/%d) %s", resp->status, rc, plc_tag_decode_error(rc));
+                    break;
+                }
             }
         }
-    }
 
-    /* this can cause destroy actions so do this outside the mutex. */
-    if(num_aborted_requests > 0) {
+        /* copy the results back out. Every request gets a copy. */
+        for(int i=0; i < num_requests; i++) {
+            int unpack_rc = PLCTAG_STATUS_OK;
 
-        pdebug(DEBUG_SPEW, "%d requests to abort.", num_aborted_requests);
+            debug_set_tag_id(requests[i]->tag_id);
 
-        for(int i=0; i < num_aborted_requests; i++) {
-            request = aborted_requests[i];
+            /* a bad sub-response only fails its own request, not the session. */
+            unpack_rc = unpack_response(session, requests[i], requests[i]->packing_num);
+            if(unpack_rc != PLCTAG_STATUS_OK) {
+                pdebug(DEBUG_WARN, "Unable to unpack response!");
+                requests[i]->status = unpack_rc;
+                requests[i]->request_size = 0;
+                requests[i]->resp_received = 1;
+            }
 
-            debug_set_tag_id(request->tag_id);
+            tag_notify_complete(requests[i]->tag_id);
 
-            pdebug(DEBUG_DETAIL, "Request %p is aborted.", request);
+            /* release our reference */
+            requests[i] = rc_dec(requests[i]);
+        }
 
-            request->status = PLCTAG_ERR_ABORT;
-            request->request_size = 0;
-            request->resp_received = 1;
+        debug_set_tag_id(0);
+    } while(0);
 
-            aborted_requests[i] = rc_dec(request);
+    /* problem? fail the rest of the requests in this packet. */
+    for(int i=0; i < num_requests; i++) {
+        if(requests[i]) {
+            requests[i]->status = rc;
+            requests[i]->request_size = 0;
+            requests[i]->resp_received = 1;
+            tag_notify_complete(requests[i]->tag_id);
+            requests[i] = rc_dec(requests[i]);
         }
     }
 
-    debug_set_tag_id(0);
-
-    if(num_bundled_requests > 0) {
+    pdebug(DEBUG_DETAIL, "Done.");
 
-        pdebug(DEBUG_DETAIL, "%d requests to process.", num_bundled_requests);
+    return rc;
+}
 
-        do {
-            /* copy and pack the requests into the session buffer. */
-            rc = pack_requests(session, bundled_requests, num_bundled_requests);
-            if(rc != PLCTAG_STATUS_OK) {
-                pdebug(DEBUG_WARN, "Error while packing requests, %s!", plc_tag_decode_error(rc));
-                break;
-            }
 
-            /* fill in all the necessary parts to the request. */
-            if((rc = prepare_request(session)) != PLCTAG_STATUS_OK) {
-                pdebug(DEBUG_WARN, "Unable to prepare request, %s!", plc_tag_decode_error(rc));
-                break;
-            }
 
-            /* send the request */
-            if((rc = send_eip_request(session, SESSION_DEFAULT_TIMEOUT)) != PLCTAG_STATUS_OK) {
-                pdebug(DEBUG_WARN, "Error sending packet %s!", plc_tag_decode_error(rc));
-                break;
-            }
+/*
+ * session_fail_in_flight
+ *
+ * Any response to the packets on the wire is lost when the session
+ * resets.  Fail the waiting requests so that the tags see an error.
+ */
+void session_fail_in_flight(ab_session_p session, int status)
+{
+    if(!session->in_flight_requests) {
+        return;
+    }
 
-            /* wait for the response */
-            if((rc = recv_eip_response(session, SESSION_DEFAULT_TIMEOUT)) != PLCTAG_STATUS_OK) {
-                pdebug(DEBUG_WARN, "Error receiving packet response %s!", plc_tag_decode_error(rc));
-                break;
-            }
+    for(int i=0; i < vector_length(session->in_flight_requests); i++) {
+        ab_request_p request = vector_get(session->in_flight_requests, i);
 
-            /*
-             * check the CIP status, but only if this is a bundled
-             * response.   If it is a singleton, then we pass the
-             * status back to the tag.
-             */
-            if(num_bundled_requests > 1) {
-                if(le2h16(((eip_encap *)(session->data))->encap_command) == AB_EIP_UNCONNECTED_SEND) {
-                    eip_cip_uc_resp *resp = (eip_cip_uc_resp *)(session->data);
-                    pdebug(DEBUG_INFO,"Received unconnected packet with session sequence ID %llx",resp->encap_sender_context);
-
-                    /* punt if we got an overall error or it is not a partial/bundled error. */
-                    if(resp->status != AB_EIP_OK && resp->status != AB_CIP_ERR_PARTIAL_ERROR) {
-                        rc = decode_cip_error_code(&(resp->status));
-                        pdebug(DEBUG_WARN,"Command failed! (%d/%d) %s", resp->status, rc, plc_tag_decode_error(rc));
-                        break;
-                    }
-                } else if(le2h16(((eip_encap *)(session->data))->encap_command) == AB_EIP_CONNECTED_SEND) {
-                    eip_cip_co_resp *resp = (eip_cip_co_resp *)(session->data);
-                    pdebug(DEBUG_INFO,"Received connected packet with connection ID %x and sequence ID %u(%x)",le2h32(resp->cpf_orig_conn_id), le2h16(resp->cpf_conn_seq_num), le2h16(resp->cpf_conn_seq_num));
-
-                    /* punt if we got an overall error or it is not a partial/bundled error. */
-                    if(resp->status != AB_EIP_OK && resp->status != AB_CIP_ERR_PARTIAL_ERROR) {
-                        rc = decode_cip_error_code(&(resp->status));
-                        pdebug(DEBUG_WARN,"Command failed! (%d/%d) %s", resp->status, rc, plc_tag_decode_error(rc));
-                        break;
-                    }
-                }
+        if(request) {
+            spin_block(&request->lock) {
+                request->status = status;
+                request->request_size = 0;
+                request->resp_received = 1;
             }
 
-            /* copy the results back out. Every request gets a copy. */
-            for(int i=0; i < num_bundled_requests; i++) {
-                debug_set_tag_id(bundled_requests[i]->tag_id);
+            tag_notify_complete(request->tag_id);
 
-                rc = unpack_response(session, bundled_requests[i], i);
-                if(rc != PLCTAG_STATUS_OK) {
-                    pdebug(DEBUG_WARN, "Unable to unpack response!");
-                    break;
-                }
+            rc_dec(request);
+        }
+    }
 
-                /* release our reference */
-                bundled_requests[i] = rc_dec(bundled_requests[i]);
-            }
+    while(vector_length(session->in_flight_requests) > 0) {
+        vector_remove(session->in_flight_requests, vector_length(session->in_flight_requests) - 1);
+    }
 
-            rc = PLCTAG_STATUS_OK;
-        } while(0);
+    session->packets_in_flight = 0;
 
-        /* problem? clean up the pending requests and dump everything. */
-        if(rc != PLCTAG_STATUS_OK) {
-            for(int i=0; i < num_bundled_requests; i++) {
-                if(bundled_requests[i]) {
-                    bundled_requests[i]->status = rc;
-                    bundled_requests[i]->request_size = 0;
-                    bundled_requests[i]->resp_received = 1;
-                    bundled_requests[i] = rc_dec(bundled_requests[i]);
-                }
-            }
-        }
+    for(int i=0; i < SESSION_MAX_CONNECTIONS; i++) {
+        session->connections[i].packets_in_flight = 0;
+        session->connections[i].keepalive_pending = 0;
     }
 
-    debug_set_tag_id(0);
-
-    pdebug(DEBUG_SPEW,"Done.");
+    session->keepalive_pending = 0;
 
-    return rc;
+    /* throw away any partial packet. */
+    session->data_offset = 0;
+    session->data_size = 0;
+    session->rx_offset = 0;
+    session->rx_size = 0;
 }
 
 
 int unpack_response(ab_session_p session, ab_request_p request, int sub_packet)
 {
-    eip_cip_co_resp *packed_resp = (eip_cip_co_resp *)(session->data);
-    eip_cip_co_resp *unpacked_resp = NULL;
+    int connected = (le2h16(((eip_encap *)(session->rx_data))->encap_command) == AB_EIP_CONNECTED_SEND);
+    uint8_t *reply = NULL;
+    int header_size = 0;
     uint8_t *pkt_start = NULL;
     uint8_t *pkt_end = NULL;
     int new_eip_len = 0;
 
     pdebug(DEBUG_DETAIL, "Starting.");
 
+    /* the CIP reply starts after the CPF items, which differ for connected and unconnected responses. */
+    if(connected) {
+        reply = &(((eip_cip_co_resp *)(session->rx_data))->reply_service);
+    } else {
+        reply = &(((eip_cip_uc_resp *)(session->rx_data))->reply_service);
+    }
+
+    header_size = (int)(reply - session->rx_data);
+
     /* clear out the request data. */
     mem_set(request->data, 0, request->request_capacity);
 
     /* change what we do depending on the type. */
-    if(packed_resp->reply_service != (AB_EIP_CMD_CIP_MULTI | AB_EIP_CMD_CIP_OK)) {
+    if(*reply != (AB_EIP_CMD_CIP_MULTI | AB_EIP_CMD_CIP_OK)) {
         /* copy the data back into the request buffer. */
-        new_eip_len = (int)session->data_size;
+        new_eip_len = (int)session->rx_size;
         pdebug(DEBUG_DETAIL, "Got single response packet.  Copying %d bytes unchanged.", new_eip_len);
 
         if(new_eip_len > request->request_capacity) {
@@ -1373,9 +3152,9 @@ int unpack_response(ab_session_p session, ab_request_p request, int sub_packet)
             return PLCTAG_ERR_TOO_LARGE;
         }
 
-        mem_copy(request->data, session->data, new_eip_len);
+        mem_copy(request->data, session->rx_data, new_eip_len);
     } else {
-        cip_multi_resp_header *multi = (cip_multi_resp_header *)(&packed_resp->reply_service);
+        cip_multi_resp_header *multi = (cip_multi_resp_header *)reply;
         uint16_t total_responses = le2h16(multi->request_count);
         int pkt_len = 0;
 
@@ -1391,20 +3170,13 @@ int unpack_response(ab_session_p session, ab_request_p request, int sub_packet)
             /* not the last response */
             pkt_end = (uint8_t *)(&multi->request_count) + le2h16(multi->request_offsets[sub_packet + 1]);
         } else {
-            pkt_end = (session->data + le2h16(packed_resp->encap_length) + sizeof(eip_encap));
+            pkt_end = (session->rx_data + le2h16(((eip_encap *)(session->rx_data))->encap_length) + sizeof(eip_encap));
         }
 
         pkt_len = (int)(pkt_end - pkt_start);
 
-        /* point to the response buffer in a structured way. */
-        unpacked_resp = (eip_cip_co_resp *)(request->data);
-
-        /* copy the header down */
-        mem_copy(request->data, session->data, (int)sizeof(eip_cip_co_resp));
-
         /* size of the new packet */
-        new_eip_len = (uint16_t)(((uint8_t *)(&unpacked_resp->reply_service) + pkt_len) /* end of the packet */
-                                 - (uint8_t *)(request->data));                                      /* start of the packet */
+        new_eip_len = header_size + pkt_len;
 
         /* too big? */
         if(new_eip_len > request->request_capacity) {
@@ -1412,12 +3184,22 @@ int unpack_response(ab_session_p session, ab_request_p request, int sub_packet)
             return PLCTAG_ERR_TOO_LARGE;
         }
 
-        /* now copy the packet over that. */
-        mem_copy(&unpacked_resp->reply_service, pkt_start, pkt_len);
+        /* copy the header down and then the packet after it. */
+        mem_copy(request->data, session->rx_data, header_size);
+        mem_copy(request->data + header_size, pkt_start, pkt_len);
 
         /* stitch up the packet sizes. */
-        unpacked_resp->cpf_cdi_item_length = h2le16((uint16_t)(pkt_len + (int)sizeof(uint16_le))); /* extra for the connection sequence */
-        unpacked_resp->encap_length = h2le16((uint16_t)(new_eip_len - (uint16_t)sizeof(eip_encap)));
+        if(connected) {
+            eip_cip_co_resp *unpacked_resp = (eip_cip_co_resp *)(request->data);
+
+            unpacked_resp->cpf_cdi_item_length = h2le16((uint16_t)(pkt_len + (int)sizeof(uint16_le))); /* extra for the connection sequence */
+            unpacked_resp->encap_length = h2le16((uint16_t)(new_eip_len - (int)sizeof(eip_encap)));
+        } else {
+            eip_cip_uc_resp *unpacked_resp = (eip_cip_uc_resp *)(request->data);
+
+            unpacked_resp->cpf_udi_item_length = h2le16((uint16_t)pkt_len);
+            unpacked_resp->encap_length = h2le16((uint16_t)(new_eip_len - (int)sizeof(eip_encap)));
+        }
     }
 
     pdebug(DEBUG_DETAIL, "Unpacked packet:");
@@ -1460,12 +3242,24 @@ int unpack_response(ab_session_p session, ab_request_p request, int sub_packet)
 //}
 //
 
+/*
+ * get_request_command
+ *
+ * Requests can only be packed with others sent the same way.
+ */
+int get_request_command(ab_request_p request)
+{
+    return le2h16(((eip_encap *)(request->data))->encap_command);
+}
+
+
+
 int get_payload_size(ab_request_p request)
 {
     int request_data_size = 0;
     eip_encap *header = (eip_encap *)(request->data);
     eip_cip_co_req *co_req = NULL;
-//    eip_cip_uc_req *uc_req = NULL;
+    eip_cip_uc_req *uc_req = NULL;
 
     if(le2h16(header->encap_command) == AB_EIP_CONNECTED_SEND) {
         co_req = (eip_cip_co_req *)(request->data);
@@ -1474,17 +3268,14 @@ int get_payload_size(ab_request_p request)
                             - 2  /* for connection sequence ID */
                             + 2  /* for multipacket offset */
                             ;
-    }
-//    else if(le2h16(header->encap_command) == AB_EIP_UNCONNECTED_SEND) {
-//        uc_req = (eip_cip_uc_req *)(request->data);
-//        /* get length of new request */
-//        request_data_size = le2h16(uc_req->uc_cmd_length)
-//                            - 2  /* for connection sequence ID */
-//                            + 2  /* for multipacket offset */
-//                            ;
-//
-//    }
-    else {
+    } else if(le2h16(header->encap_command) == AB_EIP_UNCONNECTED_SEND && ((eip_cip_uc_req *)(request->data))->cm_service_code == AB_EIP_CMD_UNCONNECTED_SEND) {
+        /* only CIP requests wrapped in an Unconnected Send, not PCCC. */
+        uc_req = (eip_cip_uc_req *)(request->data);
+        /* get length of the embedded request */
+        request_data_size = le2h16(uc_req->uc_cmd_length)
+                            + 2  /* for multipacket offset */
+                            ;
+    } else {
         pdebug(DEBUG_WARN, "Not a supported type EIP packet type %d!", le2h16(header->encap_command));
         request_data_size = INT_MAX;
     }
@@ -1526,6 +3317,12 @@ int pack_requests(ab_session_p session, ab_request_p *requests, int num_requests
         return PLCTAG_STATUS_OK;
     }
 
+    if(le2h16(((eip_encap *)(requests[0]->data))->encap_command) == AB_EIP_UNCONNECTED_SEND) {
+        debug_set_tag_id(0);
+
+        return pack_unconnected_requests(session, requests, num_requests);
+    }
+
     /* set up Multi packet header. */
 
     header_size = (int)(sizeof(cip_multi_req_header)
@@ -1589,7 +3386,99 @@ int pack_requests(ab_session_p session, ab_request_p *requests, int num_requests
     }
 
     /* stitch up the CPF packet length */
-    packed_req->cpf_cdi_item_length = h2le16((uint16_t)(next_pkt_data - (uint8_t *)(&packed_req->cpf_conn_seq_num)));
+    packed_req->cpf_cdi_item_length = h2le16((uint16_t)(next_pkt_data - (uint8_t *)(&packed_req->cpf_conn_seq_num)));
+
+    /* stick up the EIP packet length */
+    packed_req->encap_length = h2le16((uint16_t)((size_t)(next_pkt_data - session->data) - sizeof(eip_encap)));
+
+    /* set the total data size */
+    session->data_size = (uint32_t)(next_pkt_data - session->data);
+
+    debug_set_tag_id(0);
+
+    pdebug(DEBUG_INFO, "Done.");
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * pack_unconnected_requests
+ *
+ * An unconnected request is a CIP request embedded in an Unconnected Send
+ * with the route path to the PLC after it.  The Multiple Service request
+ * is embedded in its place, followed by the same route path.
+ */
+int pack_unconnected_requests(ab_session_p session, ab_request_p *requests, int num_requests)
+{
+    eip_cip_uc_req *first_req = (eip_cip_uc_req *)(requests[0]->data);
+    eip_cip_uc_req *packed_req = (eip_cip_uc_req *)(session->data);
+    cip_multi_req_header *multi_header = NULL;
+    uint8_t *embed_start = NULL;
+    uint8_t *next_pkt_data = NULL;
+    uint8_t *route_start = NULL;
+    int route_len = 0;
+    int current_offset = 0;
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    /* the route path follows the embedded request, after a pad byte if it is odd. */
+    route_start = requests[0]->data + sizeof(eip_cip_uc_req) + le2h16(first_req->uc_cmd_length);
+    if(le2h16(first_req->uc_cmd_length) & 0x01) {
+        route_start++;
+    }
+
+    route_len = requests[0]->request_size - (int)(route_start - requests[0]->data);
+
+    /* the static part comes from the first request. */
+    mem_copy(session->data, requests[0]->data, (int)sizeof(eip_cip_uc_req));
+
+    embed_start = session->data + sizeof(eip_cip_uc_req);
+
+    /* set up Multi packet header. */
+    multi_header = (cip_multi_req_header *)embed_start;
+    multi_header->service_code = AB_EIP_CMD_CIP_MULTI;
+    multi_header->req_path_size = 0x02; /* length of path in words */
+    multi_header->req_path[0] = 0x20; /* Class */
+    multi_header->req_path[1] = 0x02; /* CM */
+    multi_header->req_path[2] = 0x24; /* Instance */
+    multi_header->req_path[3] = 0x01; /* #1 */
+    multi_header->request_count = h2le16((uint16_t)num_requests);
+
+    current_offset = (int)(sizeof(uint16_le) + (sizeof(uint16_le) * (size_t)num_requests));
+    next_pkt_data = (uint8_t *)(&multi_header->request_offsets[num_requests]);
+
+    /* copy in the embedded requests. */
+    for(int i=0; i < num_requests; i++) {
+        eip_cip_uc_req *new_req = (eip_cip_uc_req *)(requests[i]->data);
+        int pkt_len = le2h16(new_req->uc_cmd_length);
+
+        debug_set_tag_id(requests[i]->tag_id);
+
+        pdebug(DEBUG_DETAIL, "packet %d is of length %d.", i, pkt_len);
+
+        multi_header->request_offsets[i] = h2le16((uint16_t)current_offset);
+
+        mem_copy(next_pkt_data, requests[i]->data + sizeof(eip_cip_uc_req), pkt_len);
+
+        next_pkt_data += pkt_len;
+        current_offset += pkt_len;
+    }
+
+    packed_req->uc_cmd_length = h2le16((uint16_t)(next_pkt_data - embed_start));
+
+    /* the route path must start on a 16-bit boundary. */
+    if((next_pkt_data - embed_start) & 0x01) {
+        *next_pkt_data = 0;
+        next_pkt_data++;
+    }
+
+    mem_copy(next_pkt_data, route_start, route_len);
+    next_pkt_data += route_len;
+
+    /* stitch up the CPF packet length */
+    packed_req->cpf_udi_item_length = h2le16((uint16_t)(next_pkt_data - (uint8_t *)(&packed_req->cm_service_code)));
 
     /* stick up the EIP packet length */
     packed_req->encap_length = h2le16((uint16_t)((size_t)(next_pkt_data - session->data) - sizeof(eip_encap)));
@@ -1606,7 +3495,7 @@ int pack_requests(ab_session_p session, ab_request_p *requests, int num_requests
 
 
 
-int prepare_request(ab_session_p session)
+int prepare_request(ab_session_p session, int conn_index)
 {
     eip_encap *encap = NULL;
     int payload_size = 0;
@@ -1639,18 +3528,17 @@ int prepare_request(ab_session_p session)
         pdebug(DEBUG_INFO,"Preparing unconnected packet with session sequence ID %llx",session->session_seq_id);
     } else if(le2h16(encap->encap_command) == AB_EIP_CONNECTED_SEND) {
         eip_cip_co_req *conn_req = (eip_cip_co_req *)(session->data);
+        ab_connection_t *conn = &(session->connections[conn_index]);
 
-        pdebug(DEBUG_DETAIL, "cpf_targ_conn_id=%x", session->targ_connection_id);
+        pdebug(DEBUG_DETAIL, "cpf_targ_conn_id=%x", conn->targ_connection_id);
 
         /* set up the connection information */
-        conn_req->cpf_targ_conn_id = h2le32(session->targ_connection_id);
-//        request->conn_id = session->orig_connection_id;
+        conn_req->cpf_targ_conn_id = h2le32(conn->targ_connection_id);
 
         session->conn_seq_num++;
         conn_req->cpf_conn_seq_num = h2le16(session->conn_seq_num);
-//        request->conn_seq = session->conn_seq_num;
 
-        pdebug(DEBUG_INFO,"Preparing connected packet with connection ID %x and sequence ID %u(%x)", session->orig_connection_id, session->conn_seq_num, session->conn_seq_num);
+        pdebug(DEBUG_INFO,"Preparing connected packet with connection ID %x and sequence ID %u(%x)", conn->orig_connection_id, session->conn_seq_num, session->conn_seq_num);
     } else {
         pdebug(DEBUG_WARN, "Unsupported packet type %x!", le2h16(encap->encap_command));
         return PLCTAG_ERR_UNSUPPORTED;
@@ -1668,98 +3556,112 @@ int prepare_request(ab_session_p session)
 
 
 
-int send_eip_request(ab_session_p session, int timeout)
+/*
+ * session_start_exchange
+ *
+ * Start sending the session->data_size bytes in the session buffer.  The
+ * rest of the exchange, sending the packet and reading the response into
+ * the same buffer, is done by session_exchange().  The whole exchange
+ * must finish within timeout_ms.
+ */
+void session_start_exchange(ab_session_p session, int timeout_ms)
 {
-    int rc = PLCTAG_STATUS_OK;
-    int64_t timeout_time = 0;
-
-    pdebug(DEBUG_DETAIL, "Starting.");
-
-    if(!session) {
-        pdebug(DEBUG_WARN, "Session pointer is null.");
-        return PLCTAG_ERR_NULL_PTR;
-    }
-
-    if(timeout > 0) {
-        timeout_time = time_ms() + timeout;
-    } else {
-        timeout_time = INT64_MAX;
-    }
-
     pdebug(DEBUG_DETAIL,"Sending packet of size %d",session->data_size);
     pdebug_dump_bytes(DEBUG_DETAIL, session->data, (int)(session->data_size));
 
     session->data_offset = 0;
     session->packet_count++;
 
-    /* send the packet */
-    do {
-        rc = socket_write(session->sock, session->data + session->data_offset, (int)session->data_size - (int)session->data_offset);
+    session->exchange_state = EXCHANGE_SEND;
+    session->exchange_timeout = time_ms() + timeout_ms;
+}
 
-        if(rc >= 0) {
-            session->data_offset += (uint32_t)rc;
-        }
 
-        /* give up the CPU if we still are looping */
-        if(!session->terminating && rc >= 0 && session->data_offset < session->data_size) {
-            sleep_ms(1);
+/*
+ * session_exchange
+ *
+ * Carry on with the exchange started by session_start_exchange() as far
+ * as the socket lets us without blocking.  This is used for the steps
+ * that set up and tear down the connection, while there are no other
+ * requests on the wire.
+ *
+ * Returns PLCTAG_STATUS_PENDING until the whole response is in the
+ * session buffer.  Wait for session->exchange_events on the socket or
+ * until session->exchange_timeout, then call this again.  Any other
+ * return ends the exchange.
+ */
+int session_exchange(ab_session_p session)
+{
+    int rc = PLCTAG_STATUS_OK;
+
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    if(session->exchange_state == EXCHANGE_SEND) {
+        rc = send_pending_data(session);
+        if(rc != PLCTAG_STATUS_OK) {
+            session->exchange_state = EXCHANGE_IDLE;
+            return rc;
         }
-    } while(!session->terminating && rc >= 0 && session->data_offset < session->data_size && timeout_time > time_ms());
 
-    if(session->terminating) {
-        pdebug(DEBUG_WARN, "Session is terminating.");
-        return PLCTAG_ERR_ABORT;
+        if(session->data_offset >= session->data_size) {
+            /* all sent, the response goes into the same buffer. */
+            session->exchange_state = EXCHANGE_RECV;
+            session->data_offset = 0;
+            session->data_size = 0;
+        }
     }
 
-    if(rc < 0) {
-        pdebug(DEBUG_WARN,"Error, %d, writing socket!", rc);
-        return rc;
+    if(session->exchange_state == EXCHANGE_RECV) {
+        rc = recv_eip_response(session);
+        if(rc != PLCTAG_STATUS_PENDING) {
+            session->exchange_state = EXCHANGE_IDLE;
+            return rc;
+        }
     }
 
-    if(timeout_time <= time_ms()) {
-        pdebug(DEBUG_WARN, "Timed out waiting to send data!");
+    if(session->exchange_timeout <= time_ms()) {
+        pdebug(DEBUG_WARN, "Timed out waiting for the %s!", (session->exchange_state == EXCHANGE_SEND ? "socket to take the request" : "response"));
+        session->exchange_state = EXCHANGE_IDLE;
         return PLCTAG_ERR_TIMEOUT;
     }
 
-    pdebug(DEBUG_DETAIL, "Done.");
+    session->exchange_events = (session->exchange_state == EXCHANGE_SEND ? EVENT_LOOP_WRITE : EVENT_LOOP_READ);
 
-    return PLCTAG_STATUS_OK;
-}
+    pdebug(DEBUG_SPEW, "Done.");
 
+    return PLCTAG_STATUS_PENDING;
+}
 
 
 /*
  * recv_eip_response
  *
- * Look at the passed session and read any data we can
- * to fill in a packet.  If we already have a full packet,
- * punt.
+ * Read as much of the response packet as the socket has into the
+ * session buffer.  Returns PLCTAG_STATUS_PENDING until the whole packet
+ * is in.
  */
-int recv_eip_response(ab_session_p session, int timeout)
+int recv_eip_response(ab_session_p session)
 {
-    uint32_t data_needed = 0;
+    uint32_t data_needed = sizeof(eip_encap);
     int rc = PLCTAG_STATUS_OK;
-    int64_t timeout_time = 0;
-
-    pdebug(DEBUG_DETAIL,"Starting.");
 
-    if(!session) {
-        pdebug(DEBUG_WARN,"Called with null session!");
-        return PLCTAG_ERR_NULL_PTR;
-    }
+    pdebug(DEBUG_SPEW,"Starting.");
 
+    while(1) {
+        /* recalculate the amount of data needed if we have the encap header */
+        if(session->data_offset >= sizeof(eip_encap)) {
+            data_needed = (uint32_t)(sizeof(eip_encap) + le2h16(((eip_encap *)(session->data))->encap_length));
 
-    if(timeout > 0) {
-        timeout_time = time_ms() + timeout;
-    } else {
-        timeout_time = INT64_MAX;
-    }
+            if(data_needed > session->data_capacity) {
+                pdebug(DEBUG_WARN,"Packet response (%d) is larger than possible buffer size (%d)!", data_needed, session->data_capacity);
+                return PLCTAG_ERR_TOO_LARGE;
+            }
+        }
 
-    session->data_offset = 0;
-    session->data_size = 0;
-    data_needed = sizeof(eip_encap);
+        if(session->data_offset >= data_needed) {
+            break;
+        }
 
-    do {
         rc = socket_read(session->sock, session->data + session->data_offset,
                          (int)(data_needed - session->data_offset));
 
@@ -1767,37 +3669,14 @@ int recv_eip_response(ab_session_p session, int timeout)
             /* error! */
             pdebug(DEBUG_WARN,"Error reading socket! rc=%d",rc);
             return rc;
-        } else {
-            session->data_offset += (uint32_t)rc;
-
-            /*pdebug_dump_bytes(session->debug, session->data, session->data_offset);*/
-
-            /* recalculate the amount of data needed if we have just completed the read of an encap header */
-            if(session->data_offset >= sizeof(eip_encap)) {
-                data_needed = (uint32_t)(sizeof(eip_encap) + le2h16(((eip_encap *)(session->data))->encap_length));
-
-                if(data_needed > session->data_capacity) {
-                    pdebug(DEBUG_WARN,"Packet response (%d) is larger than possible buffer size (%d)!", data_needed, session->data_capacity);
-                    return PLCTAG_ERR_TOO_LARGE;
-                }
-            }
         }
 
-        /* did we get all the data? */
-        if(!session->terminating && session->data_offset < data_needed) {
-            /* do not hog the CPU */
-            sleep_ms(1);
+        if(rc == 0) {
+            /* wait for more data to arrive. */
+            return PLCTAG_STATUS_PENDING;
         }
-    } while(!session->terminating && session->data_offset < data_needed && timeout_time > time_ms());
 
-    if(session->terminating) {
-        pdebug(DEBUG_INFO,"Session is terminating, returning...");
-        return PLCTAG_ERR_ABORT;
-    }
-
-    if(timeout_time <= time_ms()) {
-        pdebug(DEBUG_WARN, "Timed out waiting for data to read!");
-        return PLCTAG_ERR_TIMEOUT;
+        session->data_offset += (uint32_t)rc;
     }
 
     session->resp_seq_id = le2h64(((eip_encap *)(session->data))->encap_sender_context);
@@ -1814,192 +3693,455 @@ int recv_eip_response(ab_session_p session, int timeout)
         rc = PLCTAG_ERR_BAD_STATUS;
     }
 
-    pdebug(DEBUG_DETAIL, "Done.");
+    pdebug(DEBUG_SPEW, "Done.");
 
     return rc;
 }
 
 
 
+/*
+ * perform_forward_open
+ *
+ * Open the CIP connections of the session.  This does not block, each
+ * call carries on from where the last one stopped and it returns
+ * PLCTAG_STATUS_PENDING until all the connections are open or one of
+ * the steps fails.
+ *
+ * If we have opened a connection to this PLC before, the Forward Open
+ * command and packet size that worked then are tried first.  Otherwise,
+ * or if those no longer work, a Forward Open Ex with a large packet is
+ * tried, then the size the PLC says it supports, and then the old
+ * Forward Open.  The rest of the connections use what the first one
+ * settled on.
+ */
 int perform_forward_open(ab_session_p session)
 {
     int rc = PLCTAG_STATUS_OK;
-    int max_payload_size = session->max_payload_size;
+    ab_connection_t *first_conn = &(session->connections[0]);
 
-    pdebug(DEBUG_INFO, "Starting.");
+    pdebug(DEBUG_DETAIL, "Starting.");
 
     do {
-        /*
-         * Try with a large packet if this is a Logix-class PLC
-         * and we are doing connected messaging.
-         */
+        switch(session->connect_step) {
+        case CONNECT_START:
+            session->num_connections = 0;
+            session->next_connection = 0;
+            session->connect_use_ex = 1;
+            session->connect_old_payload = session->max_payload_size;
+
+            if(forward_open_cache_get(session, &session->connect_use_ex, &session->connect_payload_guess)) {
+                pdebug(DEBUG_DETAIL, "Trying cached %s with packet size %d.", (session->connect_use_ex ? "ForwardOpenEx" : "ForwardOpen"), session->connect_payload_guess);
+
+                if(!session->connect_use_ex) {
+                    critical_block(session->mutex) {
+                        session->max_payload_size = (uint16_t)session->connect_payload_guess;
+                    }
+                }
 
-        if(session->plc_type == AB_PROTOCOL_LGX && session->use_connected_msg) {
-            max_payload_size = MAX_CIP_MSG_SIZE_EX;
-        }
+                session->connect_step = CONNECT_CACHED;
+                break;
+            }
 
-        rc = try_forward_open_ex(session, &max_payload_size);
-        if(rc == PLCTAG_ERR_TOO_LARGE) {
-            /* we support the Forward Open Extended command, but we need to use a smaller size. */
-            pdebug(DEBUG_DETAIL,"ForwardOpenEx is supported but packet size of %d is not, trying %d.", MAX_CIP_MSG_SIZE_EX, max_payload_size);
+            /* Try with a large packet if this is a Logix-class PLC and we are doing connected messaging. */
+            if(session->plc_type == AB_PROTOCOL_LGX && session->use_connected_msg) {
+                session->connect_payload_guess = MAX_CIP_MSG_SIZE_EX;
+            } else {
+                session->connect_payload_guess = session->max_payload_size;
+            }
 
-            rc = try_forward_open_ex(session, &max_payload_size);
-            if(rc != PLCTAG_STATUS_OK) {
-                pdebug(DEBUG_WARN,"Unable to open connection to PLC (%s)!", plc_tag_decode_error(rc));
+            session->connect_step = CONNECT_EX;
+            break;
+
+        case CONNECT_CACHED:
+            if(session->connect_use_ex) {
+                rc = try_forward_open_ex(session, first_conn, &session->connect_payload_guess);
             } else {
-                pdebug(DEBUG_DETAIL,"ForwardOpenEx succeeded with packet size %d.", session->max_payload_size);
+                rc = try_forward_open(session, first_conn);
+            }
+
+            if(rc == PLCTAG_ERR_TOO_LARGE || rc == PLCTAG_ERR_UNSUPPORTED) {
+                /* the PLC changed, perhaps new firmware or a new module in the path. */
+                pdebug(DEBUG_DETAIL, "Cached Forward Open parameters no longer work, negotiating again.");
+
+                forward_open_cache_remove(session);
+
+                critical_block(session->mutex) {
+                    session->max_payload_size = session->connect_old_payload;
+                }
+
+                session->connect_use_ex = 1;
+
+                /* skip the cache this time around. */
+                if(session->plc_type == AB_PROTOCOL_LGX && session->use_connected_msg) {
+                    session->connect_payload_guess = MAX_CIP_MSG_SIZE_EX;
+                } else {
+                    session->connect_payload_guess = session->max_payload_size;
+                }
+
+                session->connect_step = CONNECT_EX;
+                rc = PLCTAG_STATUS_OK;
+            } else if(rc == PLCTAG_STATUS_OK) {
+                session->connect_step = CONNECT_MORE;
             }
-        } else if(rc == PLCTAG_ERR_UNSUPPORTED) {
-            rc = try_forward_open(session);
+            break;
+
+        case CONNECT_EX:
+            rc = try_forward_open_ex(session, first_conn, &session->connect_payload_guess);
             if(rc == PLCTAG_ERR_TOO_LARGE) {
                 /* we support the Forward Open Extended command, but we need to use a smaller size. */
+                pdebug(DEBUG_DETAIL,"ForwardOpenEx is supported but packet size of %d is not, trying %d.", MAX_CIP_MSG_SIZE_EX, session->connect_payload_guess);
+                session->connect_step = CONNECT_EX_RETRY;
+                rc = PLCTAG_STATUS_OK;
+            } else if(rc == PLCTAG_ERR_UNSUPPORTED) {
+                session->connect_use_ex = 0;
+                session->connect_step = CONNECT_OLD;
+                rc = PLCTAG_STATUS_OK;
+            } else if(rc == PLCTAG_STATUS_OK) {
+                forward_open_cache_put(session, 1, session->max_payload_size);
+                session->connect_step = CONNECT_MORE;
+            }
+            break;
+
+        case CONNECT_EX_RETRY:
+            rc = try_forward_open_ex(session, first_conn, &session->connect_payload_guess);
+            if(rc == PLCTAG_STATUS_OK) {
+                pdebug(DEBUG_DETAIL,"ForwardOpenEx succeeded with packet size %d.", session->max_payload_size);
+                forward_open_cache_put(session, 1, session->max_payload_size);
+                session->connect_step = CONNECT_MORE;
+            } else if(rc != PLCTAG_STATUS_PENDING) {
+                pdebug(DEBUG_WARN,"Unable to open connection to PLC (%s)!", plc_tag_decode_error(rc));
+            }
+            break;
+
+        case CONNECT_OLD:
+            rc = try_forward_open(session, first_conn);
+            if(rc == PLCTAG_ERR_TOO_LARGE) {
+                /* we support the Forward Open command, but we need to use a smaller size. */
                 pdebug(DEBUG_DETAIL,"ForwardOpen is supported but packet size of %d is not, trying %d.", MAX_CIP_MSG_SIZE, session->max_payload_size);
+                session->connect_step = CONNECT_OLD_RETRY;
+                rc = PLCTAG_STATUS_OK;
+            } else if(rc == PLCTAG_STATUS_OK) {
+                forward_open_cache_put(session, 0, session->max_payload_size);
+                session->connect_step = CONNECT_MORE;
+            }
+            break;
 
-                rc = try_forward_open(session);
-                if(rc != PLCTAG_STATUS_OK) {
-                    pdebug(DEBUG_WARN,"Unable to open connection to PLC (%s)!", plc_tag_decode_error(rc));
-                } else {
-                    pdebug(DEBUG_DETAIL,"ForwardOpen succeeded with packet size %d.", session->max_payload_size);
-                }
+        case CONNECT_OLD_RETRY:
+            rc = try_forward_open(session, first_conn);
+            if(rc == PLCTAG_STATUS_OK) {
+                pdebug(DEBUG_DETAIL,"ForwardOpen succeeded with packet size %d.", session->max_payload_size);
+                forward_open_cache_put(session, 0, session->max_payload_size);
+                session->connect_step = CONNECT_MORE;
+            } else if(rc != PLCTAG_STATUS_PENDING) {
+                pdebug(DEBUG_WARN,"Unable to open connection to PLC (%s)!", plc_tag_decode_error(rc));
             }
-        } /*else {
-            pdebug(DEBUG_WARN, "Unknown error! rc=%d", rc);
-        }*/
-    } while(0);
+            break;
 
-    if(rc == PLCTAG_STATUS_OK) {
-        pdebug(DEBUG_DETAIL, "ForwardOpen succeeded and maximum CIP packet size is %d.", session->max_payload_size);
-    }
+        case CONNECT_MORE:
+            if(session->num_connections == 0) {
+                pdebug(DEBUG_DETAIL, "ForwardOpen succeeded and maximum CIP packet size is %d.", session->max_payload_size);
+                session->num_connections = 1;
+            }
+
+            if(session->num_connections >= session->connection_count) {
+                session->connect_step = CONNECT_DONE;
+                break;
+            }
 
-    //session->status = rc;
+            /*
+             * The rest of the connections use the packet size and command that
+             * the first one settled on.   If the PLC runs out of connections, we
+             * keep the ones we have rather than failing the session.
+             */
+            if(session->connect_use_ex) {
+                int max_payload_size = session->max_payload_size;
+                rc = try_forward_open_ex(session, &(session->connections[session->num_connections]), &max_payload_size);
+            } else {
+                rc = try_forward_open(session, &(session->connections[session->num_connections]));
+            }
 
-    pdebug(DEBUG_INFO, "Done.");
+            if(rc == PLCTAG_STATUS_OK) {
+                session->num_connections++;
+            } else if(rc != PLCTAG_STATUS_PENDING) {
+                pdebug(DEBUG_WARN, "PLC only accepted %d of %d connections (%s).", session->num_connections, session->connection_count, plc_tag_decode_error(rc));
+                session->connect_step = CONNECT_DONE;
+                rc = PLCTAG_STATUS_OK;
+            }
+            break;
+
+        default:
+            pdebug(DEBUG_ERROR, "Unknown Forward Open step %d!", session->connect_step);
+            rc = PLCTAG_ERR_BAD_STATUS;
+            break;
+        }
+    } while(rc == PLCTAG_STATUS_OK && session->connect_step != CONNECT_DONE);
+
+    /* start over next time unless we are waiting on the PLC. */
+    if(rc != PLCTAG_STATUS_PENDING) {
+        session->connect_step = CONNECT_START;
+    }
+
+    pdebug(DEBUG_DETAIL, "Done.");
 
     return rc;
 }
 
 
-int perform_forward_close(ab_session_p session)
+/* returns non-zero and fills in the parameters if this PLC is in the cache. */
+int forward_open_cache_get(ab_session_p session, int *use_forward_open_ex, int *max_payload_size)
 {
-    int rc = PLCTAG_STATUS_OK;
+    int found = 0;
 
-    pdebug(DEBUG_INFO, "Starting.");
+    critical_block(forward_open_cache_mutex) {
+        forward_open_params_t *params = NULL;
 
-    do {
-        rc = send_forward_close_req(session);
-        if(rc != PLCTAG_STATUS_OK) {
-            pdebug(DEBUG_DETAIL,"Sending forward close failed, %s!",plc_tag_decode_error(rc));
+        if(!forward_open_cache) {
             break;
         }
 
-        rc = recv_forward_close_resp(session);
-        if(rc != PLCTAG_STATUS_OK) {
-            pdebug(DEBUG_DETAIL,"Forward close not received, %s!", plc_tag_decode_error(rc));
+        params = hashtable_get(forward_open_cache, session->key_hash);
+        if(params && !str_cmp(params->key, session->key)) {
+            *use_forward_open_ex = params->use_forward_open_ex;
+            *max_payload_size = params->max_payload_size;
+            found = 1;
+        }
+    }
+
+    return found;
+}
+
+
+void forward_open_cache_put(ab_session_p session, int use_forward_open_ex, int max_payload_size)
+{
+    critical_block(forward_open_cache_mutex) {
+        forward_open_params_t *params = NULL;
+
+        if(!forward_open_cache) {
             break;
         }
-    } while(0);
 
-    pdebug(DEBUG_INFO, "Done.");
+        params = hashtable_get(forward_open_cache, session->key_hash);
+        if(params && str_cmp(params->key, session->key)) {
+            /* a different PLC with the same hash, this one replaces it. */
+            hashtable_remove(forward_open_cache, session->key_hash);
+            forward_open_cache_free(forward_open_cache, session->key_hash, params, NULL);
+            params = NULL;
+        }
 
-    return rc;
+        if(!params) {
+            params = mem_alloc((int)sizeof(*params));
+            if(!params) {
+                pdebug(DEBUG_WARN, "Unable to allocate Forward Open cache entry!");
+                break;
+            }
+
+            params->key = str_dup(session->key);
+            if(!params->key || hashtable_put(forward_open_cache, session->key_hash, params) != PLCTAG_STATUS_OK) {
+                pdebug(DEBUG_WARN, "Unable to add Forward Open cache entry!");
+                forward_open_cache_free(forward_open_cache, session->key_hash, params, NULL);
+                break;
+            }
+        }
+
+        params->use_forward_open_ex = use_forward_open_ex;
+        params->max_payload_size = max_payload_size;
+    }
+}
+
+
+void forward_open_cache_remove(ab_session_p session)
+{
+    critical_block(forward_open_cache_mutex) {
+        forward_open_params_t *params = NULL;
+
+        if(!forward_open_cache) {
+            break;
+        }
+
+        params = hashtable_get(forward_open_cache, session->key_hash);
+        if(params && !str_cmp(params->key, session->key)) {
+            hashtable_remove(forward_open_cache, session->key_hash);
+            forward_open_cache_free(forward_open_cache, session->key_hash, params, NULL);
+        }
+    }
+}
+
+
+int forward_open_cache_free(hashtable_p table, int64_t key, void *data, void *context)
+{
+    forward_open_params_t *params = data;
+
+    (void)table;
+    (void)key;
+    (void)context;
+
+    if(params) {
+        if(params->key) {
+            mem_free(params->key);
+        }
+
+        mem_free(params);
+    }
+
+    return PLCTAG_STATUS_OK;
 }
 
 
-int try_forward_open_ex(ab_session_p session, int *packet_size_guess)
+/*
+ * perform_forward_close
+ *
+ * Close the CIP connections of the session one at a time.  Like
+ * perform_forward_open(), this returns PLCTAG_STATUS_PENDING while it
+ * waits on the PLC and carries on from there on the next call.
+ */
+int perform_forward_close(ab_session_p session)
 {
     int rc = PLCTAG_STATUS_OK;
-    ab_request_p req=NULL;
-    uint16_t old_max_payload_size = 0;
 
+    pdebug(DEBUG_DETAIL, "Starting.");
 
-    pdebug(DEBUG_INFO,"Starting.");
+    while(session->close_index < session->num_connections) {
+        int conn_rc = PLCTAG_STATUS_OK;
 
-    critical_block(session->mutex) {
-        old_max_payload_size = session->max_payload_size;
-        session->max_payload_size = (uint16_t)*packet_size_guess;
+        do {
+            if(session->exchange_state == EXCHANGE_IDLE) {
+                send_forward_close_req(session, &(session->connections[session->close_index]));
+            }
+
+            conn_rc = session_exchange(session);
+            if(conn_rc == PLCTAG_STATUS_PENDING) {
+                break;
+            }
+
+            if(conn_rc != PLCTAG_STATUS_OK) {
+                pdebug(DEBUG_DETAIL,"Forward close not received, %s!", plc_tag_decode_error(conn_rc));
+                break;
+            }
+
+            conn_rc = recv_forward_close_resp(session);
+        } while(0);
+
+        if(conn_rc == PLCTAG_STATUS_PENDING) {
+            pdebug(DEBUG_DETAIL, "Done.");
+            return conn_rc;
+        }
+
+        /* keep going so that the PLC can free the rest, but report the first problem. */
+        if(session->close_status == PLCTAG_STATUS_OK) {
+            session->close_status = conn_rc;
+        }
+
+        session->close_index++;
     }
 
-    /* get a request buffer */
-    rc = session_create_request(session, 0, &req);
+    rc = session->close_status;
+
+    session->num_connections = 0;
+    session->close_index = 0;
+    session->close_status = PLCTAG_STATUS_OK;
+
+    pdebug(DEBUG_DETAIL, "Done.");
+
+    return rc;
+}
+
+
+/*
+ * try_forward_open_ex
+ *
+ * Try one Forward Open Ex with a packet size of *packet_size_guess.
+ * Returns PLCTAG_STATUS_PENDING while the exchange is under way.
+ */
+int try_forward_open_ex(ab_session_p session, ab_connection_t *conn, int *packet_size_guess)
+{
+    int rc = PLCTAG_STATUS_OK;
+
+    pdebug(DEBUG_DETAIL,"Starting.");
+
+    if(session->exchange_state == EXCHANGE_IDLE) {
+        critical_block(session->mutex) {
+            session->connect_try_payload = session->max_payload_size;
+            session->max_payload_size = (uint16_t)*packet_size_guess;
+        }
+
+        /* send the ForwardOpenEx command to the PLC */
+        send_forward_open_req_ex(session, conn);
+    }
 
     do {
-        if(rc != PLCTAG_STATUS_OK) {
-            pdebug(DEBUG_WARN,"Unable to get new request, %s!",plc_tag_decode_error(rc));
-            rc = 0;
+        rc = session_exchange(session);
+        if(rc == PLCTAG_STATUS_PENDING) {
             break;
         }
 
-        /* send the ForwardOpenEx command to the PLC */
-        if((rc = send_forward_open_req_ex(session)) != PLCTAG_STATUS_OK) {
-            pdebug(DEBUG_WARN,"Unable to send ForwardOpenEx packet!");
+        if(rc != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_WARN,"Unable to receive ForwardOpenEx response, %s!", plc_tag_decode_error(rc));
             break;
         }
 
         /* check for the ForwardOpen response. */
-        if((rc = recv_forward_open_resp(session, packet_size_guess)) != PLCTAG_STATUS_OK) {
+        if((rc = recv_forward_open_resp(session, conn, packet_size_guess)) != PLCTAG_STATUS_OK) {
             pdebug(DEBUG_WARN,"Unable to use ForwardOpen response!");
             break;
         }
     } while(0);
 
-    if(req) {
-        req = rc_dec(req);
-    }
-
-    if(rc != PLCTAG_STATUS_OK) {
+    if(rc != PLCTAG_STATUS_OK && rc != PLCTAG_STATUS_PENDING) {
         critical_block(session->mutex) {
-            session->max_payload_size = old_max_payload_size;
+            session->max_payload_size = session->connect_try_payload;
         }
     }
 
-    pdebug(DEBUG_INFO,"Done.");
+    pdebug(DEBUG_DETAIL,"Done.");
 
     return rc;
 }
 
 
-int try_forward_open(ab_session_p session)
+/*
+ * try_forward_open
+ *
+ * Try one old style Forward Open with the current packet size.
+ * Returns PLCTAG_STATUS_PENDING while the exchange is under way.
+ */
+int try_forward_open(ab_session_p session, ab_connection_t *conn)
 {
     int rc = PLCTAG_STATUS_OK;
-    ab_request_p req=NULL;
 
-    pdebug(DEBUG_INFO,"Starting.");
+    pdebug(DEBUG_DETAIL,"Starting.");
 
-    /* get a request buffer */
-    rc = session_create_request(session, 0, &req);
+    if(session->exchange_state == EXCHANGE_IDLE) {
+        /* send the ForwardOpen command to the PLC */
+        send_forward_open_req(session, conn);
+    }
 
     do {
-        if(rc != PLCTAG_STATUS_OK) {
-            pdebug(DEBUG_WARN,"Unable to get new request, %s!",plc_tag_decode_error(rc));
-            rc = 0;
+        rc = session_exchange(session);
+        if(rc == PLCTAG_STATUS_PENDING) {
             break;
         }
 
-        /* send the ForwardOpen command to the PLC */
-        if((rc = send_forward_open_req(session)) != PLCTAG_STATUS_OK) {
-            pdebug(DEBUG_WARN,"Unable to send ForwardOpenEx packet!");
+        if(rc != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_WARN,"Unable to receive ForwardOpen response, %s!", plc_tag_decode_error(rc));
             break;
         }
 
         /* check for the ForwardOpen response. */
-        if((rc = recv_forward_open_resp(session, NULL)) != PLCTAG_STATUS_OK) {
+        if((rc = recv_forward_open_resp(session, conn, NULL)) != PLCTAG_STATUS_OK) {
             pdebug(DEBUG_WARN,"Unable to use ForwardOpen response!");
             break;
         }
     } while(0);
 
-    if(req) {
-        req = rc_dec(req);
-    }
-
-    pdebug(DEBUG_INFO,"Done.");
+    pdebug(DEBUG_DETAIL,"Done.");
 
     return rc;
 }
 
 
 
-int send_forward_open_req(ab_session_p session)
+int send_forward_open_req(ab_session_p session, ab_connection_t *conn)
 {
     eip_forward_open_request_t *fo = NULL;
     uint8_t *data;
@@ -2046,9 +4188,9 @@ int send_forward_open_req(ab_session_p session)
     fo->secs_per_tick = AB_EIP_SECS_PER_TICK;         /* seconds per tick, no used? */
     fo->timeout_ticks = AB_EIP_TIMEOUT_TICKS;         /* timeout = srd_secs_per_tick * src_timeout_ticks, not used? */
     fo->orig_to_targ_conn_id = h2le32(0);             /* is this right?  Our connection id on the other machines? */
-    fo->targ_to_orig_conn_id = h2le32(session->orig_connection_id); /* Our connection id in the other direction. */
+    fo->targ_to_orig_conn_id = h2le32(conn->orig_connection_id); /* Our connection id in the other direction. */
     /* this might need to be globally unique */
-    fo->conn_serial_number = h2le16(session->conn_serial_number); /* our connection SEQUENCE number. */
+    fo->conn_serial_number = h2le16(conn->conn_serial_number); /* our connection SEQUENCE number. */
     fo->orig_vendor_id = h2le16(AB_EIP_VENDOR_ID);               /* our unique :-) vendor ID */
     fo->orig_serial_number = h2le32(AB_EIP_VENDOR_SN);           /* our serial number. */
     fo->conn_timeout_multiplier = AB_EIP_TIMEOUT_MULTIPLIER;     /* timeout = mult * RPI */
@@ -2062,7 +4204,7 @@ int send_forward_open_req(ab_session_p session)
     /* set the size of the request */
     session->data_size = (uint32_t)(data - (session->data));
 
-    rc = send_eip_request(session, 0);
+    session_start_exchange(session, SESSION_DEFAULT_TIMEOUT);
 
     pdebug(DEBUG_INFO, "Done");
 
@@ -2071,7 +4213,7 @@ int send_forward_open_req(ab_session_p session)
 
 
 /* new version of Forward Open */
-int send_forward_open_req_ex(ab_session_p session)
+int send_forward_open_req_ex(ab_session_p session, ab_connection_t *conn)
 {
     eip_forward_open_request_ex_t *fo = NULL;
     uint8_t *data;
@@ -2118,9 +4260,9 @@ int send_forward_open_req_ex(ab_session_p session)
     fo->secs_per_tick = AB_EIP_SECS_PER_TICK;         /* seconds per tick, no used? */
     fo->timeout_ticks = AB_EIP_TIMEOUT_TICKS;         /* timeout = srd_secs_per_tick * src_timeout_ticks, not used? */
     fo->orig_to_targ_conn_id = h2le32(0);             /* is this right?  Our connection id on the other machines? */
-    fo->targ_to_orig_conn_id = h2le32(session->orig_connection_id); /* Our connection id in the other direction. */
+    fo->targ_to_orig_conn_id = h2le32(conn->orig_connection_id); /* Our connection id in the other direction. */
     /* this might need to be globally unique */
-    fo->conn_serial_number = h2le16(session->conn_serial_number); /* our connection ID/serial number. */
+    fo->conn_serial_number = h2le16(conn->conn_serial_number); /* our connection ID/serial number. */
     fo->orig_vendor_id = h2le16(AB_EIP_VENDOR_ID);               /* our unique :-) vendor ID */
     fo->orig_serial_number = h2le32(AB_EIP_VENDOR_SN);           /* our serial number. */
     fo->conn_timeout_multiplier = AB_EIP_TIMEOUT_MULTIPLIER;     /* timeout = mult * RPI */
@@ -2134,7 +4276,7 @@ int send_forward_open_req_ex(ab_session_p session)
     /* set the size of the request */
     session->data_size = (uint32_t)(data - (session->data));
 
-    rc = send_eip_request(session, SESSION_DEFAULT_TIMEOUT);
+    session_start_exchange(session, SESSION_DEFAULT_TIMEOUT);
 
     pdebug(DEBUG_INFO, "Done");
 
@@ -2144,19 +4286,13 @@ int send_forward_open_req_ex(ab_session_p session)
 
 
 
-int recv_forward_open_resp(ab_session_p session, int *max_payload_size_guess)
+int recv_forward_open_resp(ab_session_p session, ab_connection_t *conn, int *max_payload_size_guess)
 {
     eip_forward_open_response_t *fo_resp;
     int rc = PLCTAG_STATUS_OK;
 
     pdebug(DEBUG_INFO,"Starting");
 
-    rc = recv_eip_response(session, 0);
-    if(rc != PLCTAG_STATUS_OK) {
-        pdebug(DEBUG_WARN,"Unable to receive Forward Open response.");
-        return rc;
-    }
-
     fo_resp = (eip_forward_open_response_t *)(session->data);
 
     do {
@@ -2202,10 +4338,10 @@ int recv_forward_open_resp(ab_session_p session, int *max_payload_size_guess)
         }
 
         /* success! */
-        session->targ_connection_id = le2h32(fo_resp->orig_to_targ_conn_id);
-        session->orig_connection_id = le2h32(fo_resp->targ_to_orig_conn_id);
+        conn->targ_connection_id = le2h32(fo_resp->orig_to_targ_conn_id);
+        conn->orig_connection_id = le2h32(fo_resp->targ_to_orig_conn_id);
 
-        pdebug(DEBUG_INFO,"ForwardOpen succeeded with our connection ID %x and the PLC connection ID %x",session->orig_connection_id, session->targ_connection_id);
+        pdebug(DEBUG_INFO,"ForwardOpen succeeded with our connection ID %x and the PLC connection ID %x",conn->orig_connection_id, conn->targ_connection_id);
 
         pdebug(DEBUG_DETAIL,"Connection set up succeeded.");
 
@@ -2220,7 +4356,7 @@ int recv_forward_open_resp(ab_session_p session, int *max_payload_size_guess)
 }
 
 
-int send_forward_close_req(ab_session_p session)
+int send_forward_close_req(ab_session_p session, ab_connection_t *conn)
 {
     eip_forward_close_req_t *fo;
     uint8_t *data;
@@ -2263,7 +4399,7 @@ int send_forward_close_req(ab_session_p session)
     /* Forward Open Params */
     fo->secs_per_tick = AB_EIP_SECS_PER_TICK;         /* seconds per tick, no used? */
     fo->timeout_ticks = AB_EIP_TIMEOUT_TICKS;         /* timeout = srd_secs_per_tick * src_timeout_ticks, not used? */
-    fo->conn_serial_number = h2le16(session->conn_serial_number); /* our connection SEQUENCE number. */
+    fo->conn_serial_number = h2le16(conn->conn_serial_number); /* our connection SEQUENCE number. */
     fo->orig_vendor_id = h2le16(AB_EIP_VENDOR_ID);               /* our unique :-) vendor ID */
     fo->orig_serial_number = h2le32(AB_EIP_VENDOR_SN);           /* our serial number. */
     fo->path_size = session->conn_path_size/2; /* size in 16-bit words */
@@ -2271,7 +4407,7 @@ int send_forward_close_req(ab_session_p session)
     /* set the size of the request */
     session->data_size = (uint32_t)(data - (session->data));
 
-    rc = send_eip_request(session, 100);
+    session_start_exchange(session, SESSION_FORWARD_CLOSE_TIMEOUT);
 
     pdebug(DEBUG_INFO, "Done");
 
@@ -2286,12 +4422,6 @@ int recv_forward_close_resp(ab_session_p session)
 
     pdebug(DEBUG_INFO,"Starting");
 
-    rc = recv_eip_response(session, 150);
-    if(rc != PLCTAG_STATUS_OK) {
-        pdebug(DEBUG_WARN, "Unable to receive Forward Close response, %s!", plc_tag_decode_error(rc));
-        return rc;
-    }
-
     fo_resp = (eip_forward_close_resp_t *)(session->data);
 
     do {
@@ -2337,7 +4467,7 @@ int session_create_request(ab_session_p session, int tag_id, ab_request_p *req)
 
     pdebug(DEBUG_DETAIL,"Starting.");
 
-    res = (ab_request_p)rc_alloc((int)(sizeof(struct ab_request_t) + request_capacity), request_destroy);
+    res = (ab_request_p)rc_pool_alloc(session->request_pool, (int)(sizeof(struct ab_request_t) + request_capacity), request_destroy);
     if (!res) {
         *req = NULL;
         rc = PLCTAG_ERR_NO_MEM;
@@ -32,16 +32,74 @@
 #include <ab/defs.h>
 #include <util/rc.h>
 #include <util/vector.h>
+#include <util/queue.h>
 
 //#define MAX_SESSION_HOST    (128)
 
 #define SESSION_DEFAULT_TIMEOUT (2000)
 
+/* time allowed for the TCP connection to the gateway, over all its IP addresses. */
+#define SESSION_DEFAULT_CONNECT_TIMEOUT (10000)
+
 #define MAX_PACKET_SIZE_EX  (44 + 4002)
 
+/* starting size of the session index. */
+#define SESSION_INDEX_SIZE      (64)
+
 #define SESSION_MIN_REQUESTS    (10)
 #define SESSION_INC_REQUESTS    (10)
 
+/*
+ * Request priorities.  Each has its own queue and the higher ones are
+ * sent first.  When bulk requests are waiting, one packet in
+ * SESSION_BULK_SHARE goes to them so that they are not starved.
+ *
+ * A tag picks its priority with the priority attribute and every
+ * request it makes is served from that priority's queue.
+ */
+#define SESSION_PRIORITY_HIGH   (0)
+#define SESSION_PRIORITY_NORMAL (1)
+#define SESSION_PRIORITY_BULK   (2)
+#define SESSION_NUM_PRIORITIES  (3)
+
+#define SESSION_BULK_SHARE      (4)
+
+/* how far back in each queue to look for requests that fit in a packet. */
+#define SESSION_PACK_LOOK_AHEAD (64)
+
+/* number of unused request buffers a session keeps for reuse. */
+#define SESSION_REQUEST_POOL_SIZE (100)
+
+/* limits for the number of packets sent before waiting for a response. */
+#define SESSION_DEFAULT_PACKETS_IN_FLIGHT (1)
+#define SESSION_MAX_PACKETS_IN_FLIGHT (32)
+
+/* limits for the number of CIP connections opened over one session. */
+#define SESSION_DEFAULT_CONNECTIONS (1)
+#define SESSION_MAX_CONNECTIONS (8)
+
+/* most worker threads running sessions, zero means one per CPU. */
+#define SESSION_MAX_WORKERS (64)
+
+typedef enum { SESSION_OPEN_SOCKET, SESSION_WAIT_SOCKET, SESSION_REGISTER, SESSION_CONNECT,
+               SESSION_IDLE, SESSION_DISCONNECT, SESSION_UNREGISTER,
+               SESSION_CLOSE_SOCKET, SESSION_START_RETRY, SESSION_WAIT_RETRY,
+               SESSION_WAIT_RECONNECT, SESSION_TERMINATE
+             } session_state_t;
+
+typedef struct session_worker_t *session_worker_p;
+
+
+/* one CIP connection to the PLC, all share the session registration. */
+typedef struct {
+    uint32_t orig_connection_id;
+    uint32_t targ_connection_id;
+    uint16_t conn_serial_number;
+    int packets_in_flight;
+    uint16_t keepalive_seq;     /* sequence number of the keep alive sent on this connection */
+    int keepalive_pending;
+} ab_connection_t;
+
 
 struct ab_session_t {
     int status;
@@ -50,14 +108,19 @@ struct ab_session_t {
     char *host;
     int port;
     char *path;
+
+    /* identifies the PLC for sharing sessions, see session_make_key(). */
+    char *key;
+    int64_t key_hash;
     sock_p sock;
 
     /* connection variables. */
     int use_connected_msg;
-    uint32_t orig_connection_id;
-    uint32_t targ_connection_id;
-    uint16_t conn_seq_num;
-    uint16_t conn_serial_number;
+    ab_connection_t connections[SESSION_MAX_CONNECTIONS];
+    int connection_count;       /* how many to open */
+    int num_connections;        /* how many are open */
+    int next_connection;
+    uint16_t conn_seq_num;      /* shared by all connections so that responses can be matched on it alone */
 
     plc_type_t plc_type;
 
@@ -72,25 +135,84 @@ struct ab_session_t {
     /* Sequence ID for requests. */
     uint64_t session_seq_id;
 
-    /* list of outstanding requests for this session */
-    vector_p requests;
+    /* requests waiting to be sent, one queue per priority, in the order they were queued */
+    queue_p requests[SESSION_NUM_PRIORITIES];
+
+    /* packets sent while bulk requests were waiting, see SESSION_BULK_SHARE. */
+    int bulk_skipped;
+
+    /* request buffers are reused instead of freed. */
+    rc_pool_p request_pool;
 
-    /* data for receiving messages */
+    /* requests sent and waiting for a response, in the order they were sent. */
+    vector_p in_flight_requests;
+    int packets_in_flight;
+    int max_packets_in_flight;
+
+    /* while non-zero, queued requests are held back so that a batch can be packed together. */
+    int batch_holds;
+
+    /* data for sending messages and for connection set up */
     uint64_t resp_seq_id;
     uint32_t data_offset;
     uint32_t data_capacity;
     uint32_t data_size;
     uint8_t data[MAX_PACKET_SIZE_EX];
 
+    /* data for receiving responses while other packets are being sent */
+    uint32_t rx_offset;
+    uint32_t rx_size;
+    uint8_t rx_data[MAX_PACKET_SIZE_EX];
+
     uint64_t packet_count;
 
-    thread_p handler_thread;
     int terminating;
     mutex_p mutex;
 
-    /* disconnect handling */
+    /*
+     * the worker thread that runs this session and its event loop, which is
+     * shared with the worker's other sessions.
+     */
+    session_worker_p worker;
+    event_loop_p loop;
+    int sock_events;
+    int connect_timeout_ms;
+
+    /* handler state, the worker runs the session until it has to wait. */
+    session_state_t state;
+    int64_t wait_until;
+    int64_t retry_time;
+    int retry_count;    /* failed connection attempts in a row */
+    uint32_t retry_seed; /* jitter for the retry wait, see session_retry_wait() */
+    int circuit_open;   /* the PLC is known to be down, protected by the session mutex */
+    int64_t auto_disconnect_time;
+    int auto_disconnect;
+    int ready;          /* run the session on the next pass, protected by the worker mutex */
+    int sock_lost;      /* the event loop saw the socket close */
+    int users;          /* tags using the session, protected by the session mutex */
+    int closing;        /* the last tag is gone, the worker closes the session and lets go of it */
+
+    /* the request and response of a set up or tear down step, see session_exchange(). */
+    int exchange_state;
+    int exchange_events;
+    int64_t exchange_timeout;
+
+    /* how far perform_forward_open() and perform_forward_close() have got, and the packet sizes to go back to. */
+    int connect_step;
+    int connect_use_ex;
+    int connect_payload_guess;
+    uint16_t connect_old_payload;
+    uint16_t connect_try_payload;
+    int close_index;
+    int close_status;
+
+    /* idle connection handling, see session_note_activity(). */
     int auto_disconnect_enabled;
     int auto_disconnect_timeout_ms;
+    int keepalive_ms;           /* zero when no keep alives are sent */
+    int64_t keepalive_time;     /* when the next keep alive is due */
+    int64_t keepalive_sent;
+    int keepalive_pending;      /* keep alive replies we are waiting for */
 };
 
 struct ab_request_t {
@@ -108,11 +230,19 @@ struct ab_request_t {
 
     /* allow requests to be packed in the session */
     int allow_packing;
+
+    /* which queue the request waits in, SESSION_PRIORITY_xxx. */
+    int priority;
     int packing_num;
 
-    /* time stamp for debugging output */
+    /* time stamp for debugging output and response timeouts */
     int64_t time_sent;
 
+    /* ID of the packet this request was sent in, used to match the response. */
+    uint64_t session_seq_id;
+    uint16_t conn_seq_num;
+    int connection;
+
     /* used by the background thread for incrementally getting data */
     int request_size; /* total bytes, not just data */
     int request_capacity;
@@ -128,8 +258,11 @@ extern int session_startup();
 extern void session_teardown();
 
 extern int session_find_or_create(ab_session_p *session, attr attribs);
+extern void session_release(ab_session_p session);
 extern int session_get_max_payload(ab_session_p session);
 extern int session_create_request(ab_session_p session, int tag_id, ab_request_p *request);
 extern int session_add_request(ab_session_p sess, ab_request_p req);
+extern int session_hold_requests(ab_session_p session);
+extern int session_release_requests(ab_session_p session);
 
 #endif
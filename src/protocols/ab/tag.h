@@ -32,6 +32,7 @@
 #define MAX_TAG_NAME        (260)
 #define MAX_TAG_TYPE_INFO   (64)
 #define MAX_CONN_PATH       (260)   /* 256 plus padding. */
+#define AB_MAX_READ_FRAGS   (32)    /* most pieces of a pipelined read queued at once. */
 
 /* they are used in some of these includes */
 #include <lib/libplctag.h>
@@ -72,7 +73,12 @@ struct ab_tag_t {
     uint8_t encoded_name[MAX_TAG_NAME];
     int encoded_name_size;
 
-    const char *read_group;
+    /* tags in the same read group are read together, see ab_tag_read_group_start(). */
+    char *read_group;
+    int in_group_read;
+
+    /* the protocol's own read start, the vtable read is ab_tag_read(). */
+    int (*read_start)(ab_tag_p tag);
 
     /* the connection IOI path */
 //    uint8_t conn_path[MAX_CONN_PATH];
@@ -97,8 +103,18 @@ struct ab_tag_t {
     ab_request_p req;
     int byte_offset;
 
+    /* with pipeline_reads, the pieces of a large read after the first are requested together. */
+    int pipeline_reads;
+    int num_read_frags;
+    ab_request_p read_frag_reqs[AB_MAX_READ_FRAGS];
+    int read_frag_offsets[AB_MAX_READ_FRAGS];
+    int read_frag_ends[AB_MAX_READ_FRAGS];
+
     int allow_packing;
 
+    /* session queue for the tag's requests, SESSION_PRIORITY_xxx. */
+    int priority;
+
     /* flags for operations */
     int read_in_progress;
     int write_in_progress;
@@ -46,7 +46,7 @@ static int system_tag_read(plc_tag_p tag);
 static int system_tag_status(plc_tag_p tag);
 static int system_tag_write(plc_tag_p tag);
 
-struct tag_vtable_t system_tag_vtable = { system_tag_abort, /* system_tag_destroy, */ system_tag_read, system_tag_status, (tag_vtable_func)(intptr_t)(0), system_tag_write};
+struct tag_vtable_t system_tag_vtable = { system_tag_abort, /* system_tag_destroy, */ system_tag_read, system_tag_status, (tag_vtable_func)(intptr_t)(0), system_tag_write, NULL, NULL, NULL};
 
 
 plc_tag_p system_tag_create(attr attribs)
@@ -115,6 +115,24 @@ static void system_tag_destroy(plc_tag_p ptag)
         return;
     }
 
+    if(tag->ext_mutex) {
+        mutex_destroy(&(tag->ext_mutex));
+        tag->ext_mutex = NULL;
+    }
+
+    if(tag->api_mutex) {
+        mutex_destroy(&(tag->api_mutex));
+        tag->api_mutex = NULL;
+    }
+
+    if(tag->tag_cond) {
+        cond_destroy(&(tag->tag_cond));
+        tag->tag_cond = NULL;
+    }
+
+    /* the data buffer is part of the tag, only the extra ones are freed. */
+    tag_data_buffers_destroy(ptag);
+
     //mem_free(tag);
 
     return;
@@ -124,6 +142,7 @@ static void system_tag_destroy(plc_tag_p ptag)
 static int system_tag_read(plc_tag_p ptag)
 {
     system_tag_p tag = (system_tag_p)ptag;
+    uint8_t *data = NULL;
 
     pdebug(DEBUG_INFO,"Starting.");
 
@@ -131,19 +150,43 @@ static int system_tag_read(plc_tag_p ptag)
         return PLCTAG_ERR_NULL_PTR;
     }
 
+    data = tag_data_read_buffer(ptag);
+    if(!data) {
+        return PLCTAG_ERR_NO_RESOURCES;
+    }
+
     if(str_cmp_i(&tag->name[0],"version") == 0) {
         pdebug(DEBUG_DETAIL,"Version is %s",VERSION);
-        str_copy((char *)(&tag->data[0]), MAX_SYSTEM_TAG_SIZE , VERSION);
-        tag->data[str_length(VERSION)] = 0;
+        str_copy((char *)(&data[0]), MAX_SYSTEM_TAG_SIZE , VERSION);
+        data[str_length(VERSION)] = 0;
+        tag_data_read_done(ptag, str_length(VERSION) + 1);
         return PLCTAG_STATUS_OK;
     }
 
     if(str_cmp_i(&tag->name[0],"debug") == 0) {
         int debug_level = get_debug_level();
-        tag->data[0] = (uint8_t)(debug_level & 0xFF);
-        tag->data[1] = (uint8_t)((debug_level >> 8) & 0xFF);
-        tag->data[2] = (uint8_t)((debug_level >> 16) & 0xFF);
-        tag->data[3] = (uint8_t)((debug_level >> 24) & 0xFF);
+        data[0] = (uint8_t)(debug_level & 0xFF);
+        data[1] = (uint8_t)((debug_level >> 8) & 0xFF);
+        data[2] = (uint8_t)((debug_level >> 16) & 0xFF);
+        data[3] = (uint8_t)((debug_level >> 24) & 0xFF);
+        tag_data_read_done(ptag, 4);
+        return PLCTAG_STATUS_OK;
+    }
+
+    if(str_cmp_i(&tag->name[0],"pool_allocs") == 0 || str_cmp_i(&tag->name[0],"pool_reuses") == 0) {
+        int64_t allocs = 0;
+        int64_t reuses = 0;
+        uint64_t val = 0;
+
+        rc_pool_get_stats(&allocs, &reuses);
+
+        val = (uint64_t)(str_cmp_i(&tag->name[0],"pool_allocs") == 0 ? allocs : reuses);
+
+        for(int i=0; i < 8; i++) {
+            data[i] = (uint8_t)((val >> (i*8)) & 0xFF);
+        }
+
+        tag_data_read_done(ptag, 8);
         return PLCTAG_STATUS_OK;
     }
 
@@ -8,6 +8,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <netdb.h>
@@ -95,6 +96,15 @@ int main(void)
         } else {
             log("Got a connection from %s on port %d\n", inet_ntoa(client_addr.sin_addr), htons(client_addr.sin_port));
 
+            /* responses go out one at a time, do not let them sit in the stack. */
+            {
+                int flag = 1;
+
+                if(setsockopt(newsock, IPPROTO_TCP, TCP_NODELAY, (char *)&flag, sizeof(flag))) {
+                    log("Unable to turn off Nagle's algorithm!\n");
+                }
+            }
+
             /*
              * set up a new session.  We allocate it here to get rid of possible
              * threading race conditions.
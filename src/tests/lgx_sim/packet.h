@@ -4,6 +4,7 @@
 
 #include <stdint.h>
 
+#define EIP_LIST_IDENTITY        ((uint16_t)0x0063)
 #define EIP_REGISTER_SESSION     ((uint16_t)0x0065)
 #define EIP_UNREGISTER_SESSION   ((uint16_t)0x0066)
 #define EIP_UNCONNECTED_DATA     ((uint16_t)0x006F)
@@ -26,6 +27,7 @@
 
 #define CIP_STATUS_OK               ((uint8_t)0)
 #define CIP_STATUS_FRAG             ((uint8_t)0x06)
+#define CIP_STATUS_UNSUPPORTED      ((uint8_t)0x08)
 
 /* CPF Item Types */
 #define CPF_ITEM_NAI ((uint16_t)0x0000) /* NULL Address Item */
@@ -1,4 +1,5 @@
 
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -12,14 +13,43 @@
 static void print_buf(uint8_t *buf, size_t data_len);
 static int process_packet(session_context *session);
 static void register_session(session_context *session);
+static void list_identity(session_context *session);
 
-static void process_unconnected_data(session_context *session);
+static /*
+ * We do not have an identity to report, so the reply has no items.  The
+ * client only uses it to check that the connection is alive.
+ */
+void list_identity(session_context *session)
+{
+    eip_header *header = (eip_header *)session->buf;
+    uint8_t *data = (uint8_t *)(header + 1);
+    ssize_t rc = 0;
+
+    log("list_identity() got request.\n");
+
+    header->length = 2;
+    header->status = 0;
+
+    /* item count */
+    data[0] = 0;
+    data[1] = 0;
+
+    rc = write(session->sock, session->buf, sizeof(*header) + 2);
+    if(rc != (ssize_t)(sizeof(*header) + 2)) {
+        log("Amount written, %d, does not equal the response size, %d!\n", (int)rc, (int)(sizeof(*header) + 2));
+    }
+}
+
+
+
+void process_unconnected_data(session_context *session);
 static void handle_forward_open_ex(session_context *session);
 static void handle_forward_close(session_context *session);
 
 static void process_connected_data(session_context *session);
 static void handle_cip_read(session_context *session);
 static void handle_cip_write(session_context *session);
+static void handle_unsupported_service(session_context *session);
 
 static uint8_t *read_tag_path(uint8_t *buf, char **tag_name, int *item);
 
@@ -35,17 +65,43 @@ void *session_handler(void *session_arg)
     session_context *session = (session_context *)session_arg;
 
     while(continue_running) {
-        ssize_t rc = read(session->sock, session->buf, BUFFER_LEN);
+        size_t needed = sizeof(eip_header);
+        size_t got = 0;
+
+        /*
+         * the client can have several requests outstanding, so
+         * read exactly one packet at a time off the stream.
+         */
+        while(got < needed) {
+            ssize_t rc = read(session->sock, session->buf + got, needed - got);
+
+            if(rc <= 0) {
+                log("read() failed!\n");
+                continue_running = 0;
+                break;
+            }
 
-        if(rc < 0) {
-            log("read() failed!\n");
+            got += (size_t)rc; /* safe cast because we checked for negative above */
+
+            if(got == sizeof(eip_header)) {
+                needed = sizeof(eip_header) + ((eip_header *)session->buf)->length;
+
+                if(needed > BUFFER_LEN) {
+                    log("session_handler() packet size %d is larger than the buffer!\n", (int)needed);
+                    continue_running = 0;
+                    break;
+                }
+            }
+        }
+
+        if(!continue_running) {
             break;
         }
 
         log("session_handler() got packet:\n");
-        print_buf(session->buf, (size_t)rc); /* safe cast because we checked for negative above */
+        print_buf(session->buf, got);
 
-        session->buf_len = (uint16_t)rc;
+        session->buf_len = (uint16_t)got;
 
         continue_running = process_packet(session);
     }
@@ -79,6 +135,10 @@ int process_packet(session_context *session)
         register_session(session);
         break;
 
+    case EIP_LIST_IDENTITY:
+        list_identity(session);
+        break;
+
     case EIP_UNCONNECTED_DATA:
         process_unconnected_data(session);
         break;
@@ -279,6 +339,7 @@ void process_connected_data(session_context *session)
         log("process_connected_data() unsupported service code %x!\n", header->service_code);
         print_buf(session->buf,sizeof(eip_header) + header->length);
 
+        handle_unsupported_service(session);
         break;
     }
 }
@@ -665,3 +726,36 @@ void print_buf(uint8_t *buf, size_t data_len)
         log("\n");
     }
 }
+
+
+
+void handle_unsupported_service(session_context *session)
+{
+    connected_message *req = (connected_message *)(session->buf);
+    connected_message_cip_resp resp;
+    ssize_t rc = 0;
+
+    memset(&resp, 0, sizeof(resp));
+
+    resp.command = req->command;
+    resp.session_handle = req->session_handle;
+    resp.sender_context = req->sender_context;
+    resp.options = req->options;
+    resp.interface_handle = req->interface_handle;
+    resp.router_timeout = req->router_timeout;
+    resp.cpf_item_count = 2;
+    resp.cpf_cai_item_type = CPF_ITEM_CAI;
+    resp.cpf_cai_item_length = 4;
+    resp.cpf_targ_conn_id = session->connection_id_targ;
+    resp.cpf_cdi_item_type = CPF_ITEM_CDI;
+    resp.cpf_cdi_item_length = (uint16_t)(sizeof(resp) - offsetof(connected_message_cip_resp, cpf_conn_seq_num));
+    resp.cpf_conn_seq_num = req->cpf_conn_seq_num;
+    resp.service_code = req->service_code | CIP_CMD_OK;
+    resp.cip_status = CIP_STATUS_UNSUPPORTED;
+    resp.length = (uint16_t)(sizeof(resp) - sizeof(eip_header));
+
+    rc = write(session->sock, &resp, sizeof(resp));
+    if(rc != (ssize_t)sizeof(resp)) {
+        log("Amount written, %d, does not equal the response size, %d!\n", (int)rc, (int)sizeof(resp));
+    }
+}
@@ -0,0 +1,254 @@
+/***************************************************************************
+ *   Copyright (C) 2018 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU Library General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "../../lib/libplctag.h"
+#include "../../util/queue.h"
+#include "../../util/debug.h"
+
+#define START_CAPACITY (4)
+#define WRAP_ROUNDS (5)
+#define GROW_ENTRIES (20)
+#define PRODUCERS (4)
+#define PRODUCER_ENTRIES (5000)
+
+#define MAX_MODEL (GROW_ENTRIES)
+
+
+/* what the queue should hold, front first. */
+static int model[MAX_MODEL];
+static int model_len = 0;
+
+static void model_put(int val);
+static int model_remove_at(int index);
+static void check_contents(queue_p q);
+static void *producer(void *arg);
+
+
+int main(int argc, const char **argv)
+{
+    queue_p q = NULL;
+    int next_val = 1;
+    pthread_t threads[PRODUCERS];
+    int last_seen[PRODUCERS];
+    int received = 0;
+
+    (void)argc;
+    (void)argv;
+
+    pdebug(DEBUG_INFO,"Starting queue tests.");
+
+    set_debug_level(DEBUG_SPEW);
+
+    /* create a queue */
+    pdebug(DEBUG_INFO,"Creating queue with capacity %d.", START_CAPACITY);
+    q = queue_create(START_CAPACITY);
+    assert(q != NULL);
+    assert(queue_length(q) == 0);
+    assert(queue_peek(q) == NULL);
+    assert(queue_get(q) == NULL);
+
+    /* wrap-around tests. */
+    pdebug(DEBUG_INFO, "Running wrap-around tests.");
+    for(int round=0; round < WRAP_ROUNDS; round++) {
+        for(int i=0; i < START_CAPACITY - 1; i++) {
+            int rc = queue_put(q, (void*)(intptr_t)next_val);
+            assert(rc == PLCTAG_STATUS_OK);
+            model_put(next_val++);
+        }
+
+        check_contents(q);
+
+        while(model_len > 0) {
+            void *res = queue_get(q);
+            assert(model_remove_at(0) == (int)(intptr_t)res);
+        }
+
+        assert(queue_length(q) == 0);
+    }
+
+    /* fill the ring with the front part way through it. */
+    for(int i=0; i < START_CAPACITY; i++) {
+        int rc = queue_put(q, (void*)(intptr_t)next_val);
+        assert(rc == PLCTAG_STATUS_OK);
+        model_put(next_val++);
+    }
+
+    check_contents(q);
+    assert(queue_peek_at(q, -1) == NULL);
+    assert(queue_peek_at(q, START_CAPACITY) == NULL);
+
+    /* growth tests. */
+    pdebug(DEBUG_INFO, "Running growth tests.");
+    while(model_len < GROW_ENTRIES) {
+        int rc = queue_put(q, (void*)(intptr_t)next_val);
+        assert(rc == PLCTAG_STATUS_OK);
+        model_put(next_val++);
+
+        check_contents(q);
+    }
+
+    pdebug(DEBUG_INFO, "Queue grew to hold %d entries.", queue_length(q));
+
+    /* removal tests. */
+    pdebug(DEBUG_INFO, "Running removal tests.");
+    assert(queue_remove_at(q, -1) == NULL);
+    assert(queue_remove_at(q, model_len) == NULL);
+
+    /* the front and the back, then the middle from the front half and the back half. */
+    for(int i=0; i < 4; i++) {
+        int index = 0;
+
+        switch(i) {
+            case 0: index = 0; break;
+            case 1: index = model_len - 1; break;
+            case 2: index = 1; break;
+            default: index = model_len - 2; break;
+        }
+
+        assert(model_remove_at(index) == (int)(intptr_t)queue_remove_at(q, index));
+        check_contents(q);
+    }
+
+    /* the head has moved, so put some more on to wrap the back around. */
+    for(int i=0; i < 4; i++) {
+        int rc = queue_put(q, (void*)(intptr_t)next_val);
+        assert(rc == PLCTAG_STATUS_OK);
+        model_put(next_val++);
+    }
+
+    check_contents(q);
+
+    /* take items out on both sides until it is empty. */
+    while(model_len > 0) {
+        int index = (model_len % 2) ? model_len / 4 : model_len - 1 - (model_len / 4);
+
+        assert(model_remove_at(index) == (int)(intptr_t)queue_remove_at(q, index));
+        check_contents(q);
+    }
+
+    assert(queue_length(q) == 0);
+    assert(queue_remove_at(q, 0) == NULL);
+
+    queue_destroy(q);
+
+    /* concurrent growth tests. */
+    pdebug(DEBUG_INFO, "Running concurrent growth tests.");
+
+    set_debug_level(DEBUG_WARN);
+
+    q = queue_create(1);
+    assert(q != NULL);
+
+    for(int i=0; i < PRODUCERS; i++) {
+        int rc = pthread_create(&threads[i], NULL, producer, q);
+        assert(rc == 0);
+        last_seen[i] = -1;
+    }
+
+    /* each producer's entries must come off in the order it put them on. */
+    while(received < PRODUCERS * PRODUCER_ENTRIES) {
+        void *res = queue_get(q);
+
+        if(res) {
+            int val = (int)(intptr_t)res - 1;
+            int id = val / PRODUCER_ENTRIES;
+            int seq = val % PRODUCER_ENTRIES;
+
+            assert(id >= 0 && id < PRODUCERS);
+            assert(seq == last_seen[id] + 1);
+
+            last_seen[id] = seq;
+            received++;
+        }
+    }
+
+    for(int i=0; i < PRODUCERS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    set_debug_level(DEBUG_SPEW);
+
+    assert(queue_length(q) == 0);
+
+    queue_destroy(q);
+
+    pdebug(DEBUG_INFO, "Done.");
+
+    return 0;
+}
+
+
+
+void model_put(int val)
+{
+    assert(model_len < MAX_MODEL);
+
+    model[model_len++] = val;
+}
+
+
+int model_remove_at(int index)
+{
+    int val = model[index];
+
+    for(int i=index; i < model_len - 1; i++) {
+        model[i] = model[i+1];
+    }
+
+    model_len--;
+
+    return val;
+}
+
+
+void check_contents(queue_p q)
+{
+    assert(queue_length(q) == model_len);
+
+    for(int i=0; i < model_len; i++) {
+        assert(model[i] == (int)(intptr_t)queue_peek_at(q, i));
+    }
+
+    assert(queue_peek_at(q, model_len) == NULL);
+
+    if(model_len > 0) {
+        assert(model[0] == (int)(intptr_t)queue_peek(q));
+    }
+}
+
+
+/* puts id * PRODUCER_ENTRIES + seq + 1, so no entry is NULL. */
+void *producer(void *arg)
+{
+    queue_p q = (queue_p)arg;
+    static int next_id = 0;
+    int id = __sync_fetch_and_add(&next_id, 1);
+
+    for(int i=0; i < PRODUCER_ENTRIES; i++) {
+        int rc = queue_put(q, (void*)(intptr_t)(id * PRODUCER_ENTRIES + i + 1));
+        assert(rc == PLCTAG_STATUS_OK);
+    }
+
+    return NULL;
+}
@@ -0,0 +1,361 @@
+/***************************************************************************
+ *   Copyright (C) 2017 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library/Lesser General Public License as*
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU Library General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+#include <lib/libplctag.h>
+#include <platform.h>
+#include <util/debug.h>
+#include <util/queue.h>
+
+
+struct queue_t {
+    lock_t lock;
+    int head;
+    int len;
+    int capacity;
+    void **data;
+};
+
+
+
+static int grow(queue_p q, int old_capacity);
+
+
+queue_p queue_create(int capacity)
+{
+    queue_p q = NULL;
+
+    pdebug(DEBUG_SPEW,"Starting");
+
+    if(capacity <= 0) {
+        pdebug(DEBUG_WARN, "Called with negative capacity!");
+        return NULL;
+    }
+
+    q = mem_alloc((int)sizeof(struct queue_t));
+    if(!q) {
+        pdebug(DEBUG_ERROR,"Unable to allocate memory for queue!");
+        return NULL;
+    }
+
+    q->lock = LOCK_INIT;
+    q->capacity = capacity;
+
+    q->data = mem_alloc(capacity * (int)sizeof(void *));
+    if(!q->data) {
+        pdebug(DEBUG_ERROR,"Unable to allocate memory for queue data!");
+        queue_destroy(q);
+        return NULL;
+    }
+
+    pdebug(DEBUG_SPEW,"Done");
+
+    return q;
+}
+
+
+
+int queue_length(queue_p q)
+{
+    int len = 0;
+
+    pdebug(DEBUG_SPEW,"Starting");
+
+    if(!q) {
+        pdebug(DEBUG_WARN,"Null pointer or invalid pointer to queue passed!");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    spin_block(&q->lock) {
+        len = q->len;
+    }
+
+    pdebug(DEBUG_SPEW,"Done");
+
+    return len;
+}
+
+
+
+/*
+ * queue_put
+ *
+ * Add the data to the end of the queue.  If the ring is full, a bigger
+ * one is allocated without holding the lock and then swapped in.
+ */
+
+int queue_put(queue_p q, void *data)
+{
+    int rc = PLCTAG_STATUS_OK;
+    int done = 0;
+
+    pdebug(DEBUG_SPEW,"Starting");
+
+    if(!q) {
+        pdebug(DEBUG_WARN,"Null pointer or invalid pointer to queue passed!");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    while(!done && rc == PLCTAG_STATUS_OK) {
+        int capacity = 0;
+
+        spin_block(&q->lock) {
+            if(q->len < q->capacity) {
+                q->data[(q->head + q->len) % q->capacity] = data;
+                q->len++;
+                done = 1;
+            } else {
+                capacity = q->capacity;
+            }
+        }
+
+        if(!done) {
+            rc = grow(q, capacity);
+        }
+    }
+
+    pdebug(DEBUG_SPEW,"Done");
+
+    return rc;
+}
+
+
+
+/*
+ * queue_peek
+ *
+ * Return the data at the front of the queue without removing it, or
+ * NULL if the queue is empty.  Only the thread that takes items off
+ * can count on it still being at the front afterward.
+ */
+
+void *queue_peek(queue_p q)
+{
+    void *result = NULL;
+
+    pdebug(DEBUG_SPEW,"Starting");
+
+    if(!q) {
+        pdebug(DEBUG_WARN,"Null pointer or invalid pointer to queue passed!");
+        return NULL;
+    }
+
+    spin_block(&q->lock) {
+        if(q->len > 0) {
+            result = q->data[q->head];
+        }
+    }
+
+    pdebug(DEBUG_SPEW,"Done");
+
+    return result;
+}
+
+
+
+/*
+ * queue_get
+ *
+ * Remove and return the data at the front of the queue, or NULL if
+ * the queue is empty.
+ */
+
+void *queue_get(queue_p q)
+{
+    void *result = NULL;
+
+    pdebug(DEBUG_SPEW,"Starting");
+
+    if(!q) {
+        pdebug(DEBUG_WARN,"Null pointer or invalid pointer to queue passed!");
+        return NULL;
+    }
+
+    spin_block(&q->lock) {
+        if(q->len > 0) {
+            result = q->data[q->head];
+            q->data[q->head] = NULL;
+            q->head = (q->head + 1) % q->capacity;
+            q->len--;
+        }
+    }
+
+    pdebug(DEBUG_SPEW,"Done");
+
+    return result;
+}
+
+
+
+/*
+ * queue_peek_at
+ *
+ * Return the data index places back from the front of the queue without
+ * removing it, or NULL if the queue is not that long.
+ */
+
+void *queue_peek_at(queue_p q, int index)
+{
+    void *result = NULL;
+
+    pdebug(DEBUG_SPEW,"Starting");
+
+    if(!q) {
+        pdebug(DEBUG_WARN,"Null pointer or invalid pointer to queue passed!");
+        return NULL;
+    }
+
+    spin_block(&q->lock) {
+        if(index >= 0 && index < q->len) {
+            result = q->data[(q->head + index) % q->capacity];
+        }
+    }
+
+    pdebug(DEBUG_SPEW,"Done");
+
+    return result;
+}
+
+
+
+/*
+ * queue_remove_at
+ *
+ * Remove and return the data index places back from the front of the
+ * queue, or NULL if the queue is not that long.  The items on whichever
+ * side of it is shorter move over one place to close the gap, so taking
+ * the front is as cheap as queue_get().
+ */
+
+void *queue_remove_at(queue_p q, int index)
+{
+    void *result = NULL;
+
+    pdebug(DEBUG_SPEW,"Starting");
+
+    if(!q) {
+        pdebug(DEBUG_WARN,"Null pointer or invalid pointer to queue passed!");
+        return NULL;
+    }
+
+    spin_block(&q->lock) {
+        if(index >= 0 && index < q->len) {
+            result = q->data[(q->head + index) % q->capacity];
+
+            if(index < q->len / 2) {
+                /* move the items in front of it back and advance the head. */
+                for(int i=index; i > 0; i--) {
+                    q->data[(q->head + i) % q->capacity] = q->data[(q->head + i - 1) % q->capacity];
+                }
+
+                q->data[q->head] = NULL;
+                q->head = (q->head + 1) % q->capacity;
+            } else {
+                /* move the items behind it up. */
+                for(int i=index; i < q->len - 1; i++) {
+                    q->data[(q->head + i) % q->capacity] = q->data[(q->head + i + 1) % q->capacity];
+                }
+
+                q->data[(q->head + q->len - 1) % q->capacity] = NULL;
+            }
+
+            q->len--;
+        }
+    }
+
+    pdebug(DEBUG_SPEW,"Done");
+
+    return result;
+}
+
+
+
+int queue_destroy(queue_p q)
+{
+    pdebug(DEBUG_SPEW,"Starting.");
+
+    if(!q) {
+        pdebug(DEBUG_WARN,"Null pointer passed!");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    if(q->data) {
+        mem_free(q->data);
+    }
+
+    mem_free(q);
+
+    pdebug(DEBUG_SPEW,"Done.");
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+
+/***********************************************************************
+ *************** Private Helper Functions ******************************
+ **********************************************************************/
+
+
+/*
+ * grow
+ *
+ * Double a ring that was full at old_capacity.  The new ring is allocated
+ * and the old one freed outside the lock, so only the copy holds up the
+ * other threads.  The data is moved so that the front is at index zero.
+ * If another thread grew the ring first, ours is thrown away.
+ */
+
+int grow(queue_p q, int old_capacity)
+{
+    int new_capacity = old_capacity * 2;
+    void **new_data = NULL;
+    void **old_data = NULL;
+
+    new_data = mem_alloc(new_capacity * (int)sizeof(void *));
+    if(!new_data) {
+        pdebug(DEBUG_ERROR,"Unable to allocate new queue data!");
+        return PLCTAG_ERR_NO_MEM;
+    }
+
+    spin_block(&q->lock) {
+        int first_part = q->capacity - q->head;
+
+        if(q->capacity != old_capacity) {
+            old_data = new_data;
+            break;
+        }
+
+        /* the ring is full, so the items run from the head around to just before it. */
+        mem_copy(new_data, &q->data[q->head], first_part * (int)sizeof(void *));
+        mem_copy(&new_data[first_part], &q->data[0], q->head * (int)sizeof(void *));
+
+        old_data = q->data;
+
+        q->data = new_data;
+        q->head = 0;
+        q->capacity = new_capacity;
+    }
+
+    mem_free(old_data);
+
+    return PLCTAG_STATUS_OK;
+}
@@ -0,0 +1,44 @@
+/***************************************************************************
+ *   Copyright (C) 2017 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library/Lesser General Public License as*
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU Library General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#pragma once
+
+/*
+ * A first in, first out queue of pointers kept in a ring buffer.
+ *
+ * Adding to the end and taking from the front are O(1).  The queue
+ * has its own lock, so any number of threads can add while one thread
+ * takes items off.  The ring doubles in size when it fills, the new
+ * ring is allocated outside the lock.
+ *
+ * The thread taking items off can also look further back in the queue
+ * and take items out of the middle.  That is O(n) in the items moved.
+ */
+
+typedef struct queue_t *queue_p;
+
+extern queue_p queue_create(int capacity);
+extern int queue_length(queue_p q);
+extern int queue_put(queue_p q, void *data);
+extern void *queue_peek(queue_p q);
+extern void *queue_get(queue_p q);
+extern void *queue_peek_at(queue_p q, int index);
+extern void *queue_remove_at(queue_p q, int index);
+extern int queue_destroy(queue_p q);
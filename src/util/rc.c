@@ -62,6 +62,11 @@ struct refcount_t {
     //cleanup_p cleaners;
     rc_cleanup_func cleanup_func;
 
+    /* set if the block came from a pool. */
+    rc_pool_p pool;
+    int data_size;
+    struct refcount_t *next_free;
+
     /* FIXME - needed for alignment, this is a hack! */
     union {
         uint8_t dummy_u8;
@@ -77,7 +82,25 @@ struct refcount_t {
 
 typedef struct refcount_t *refcount_p;
 
+
+struct rc_pool_t {
+    lock_t lock;
+    int closed;
+    int outstanding;
+    int num_free;
+    int max_free;
+    int data_size;
+    refcount_p free_list;
+};
+
+static lock_t pool_stats_lock = LOCK_INIT;
+static int64_t pool_allocs = 0;
+static int64_t pool_reuses = 0;
+
+
 static void refcount_cleanup(refcount_p rc);
+static void free_block_list(refcount_p list);
+static void pool_release(refcount_p rc);
 //static cleanup_p cleanup_entry_create(const char *func, int line_num, rc_cleanup_func cleaner, int extra_arg_count, va_list extra_args);
 //static void cleanup_entry_destroy(cleanup_p entry);
 
@@ -251,7 +274,225 @@ void refcount_cleanup(refcount_p rc)
     rc->cleanup_func((void *)(rc+1));
 
     /* finally done. */
-    mem_free(rc);
+    if(rc->pool) {
+        pool_release(rc);
+    } else {
+        mem_free(rc);
+    }
 
     pdebug(DEBUG_INFO,"Done.");
 }
+
+
+
+
+/*
+ * rc_pool_create
+ *
+ * Create a pool that keeps up to max_free unused blocks for reuse.
+ */
+
+rc_pool_p rc_pool_create(int max_free)
+{
+    rc_pool_p pool = NULL;
+
+    pdebug(DEBUG_INFO,"Starting.");
+
+    pool = (rc_pool_p)mem_alloc((int)sizeof(struct rc_pool_t));
+    if(!pool) {
+        pdebug(DEBUG_WARN,"Unable to allocate pool!");
+        return NULL;
+    }
+
+    pool->lock = LOCK_INIT;
+    pool->max_free = max_free;
+
+    pdebug(DEBUG_INFO,"Done.");
+
+    return pool;
+}
+
+
+
+/*
+ * rc_pool_destroy
+ *
+ * Free the unused blocks.  Blocks still in use are freed when their
+ * count drops to zero, and the pool is freed with the last of them.
+ */
+
+void rc_pool_destroy(rc_pool_p pool)
+{
+    refcount_p list = NULL;
+    int free_pool = 0;
+
+    pdebug(DEBUG_INFO,"Starting.");
+
+    if(!pool) {
+        pdebug(DEBUG_WARN,"Pool is NULL!");
+        return;
+    }
+
+    spin_block(&pool->lock) {
+        pool->closed = 1;
+
+        list = pool->free_list;
+        pool->free_list = NULL;
+        pool->num_free = 0;
+
+        free_pool = (pool->outstanding == 0);
+    }
+
+    free_block_list(list);
+
+    if(free_pool) {
+        mem_free(pool);
+    }
+
+    pdebug(DEBUG_INFO,"Done.");
+}
+
+
+
+/*
+ * rc_pool_alloc
+ *
+ * Like rc_alloc() but take the block from the pool if there is a free one.
+ * The data is zeroed either way.
+ */
+
+void *rc_pool_alloc_impl(const char *func, int line_num, rc_pool_p pool, int data_size, rc_cleanup_func cleaner_func)
+{
+    refcount_p rc = NULL;
+    refcount_p stale = NULL;
+    int block_size = 0;
+    int reused = 0;
+
+    pdebug(DEBUG_DETAIL,"Starting, called from %s:%d",func, line_num);
+
+    if(!pool) {
+        return rc_alloc_impl(func, line_num, data_size, cleaner_func);
+    }
+
+    spin_block(&pool->lock) {
+        /* the free blocks are too small, get rid of them. */
+        if(data_size > pool->data_size) {
+            stale = pool->free_list;
+            pool->free_list = NULL;
+            pool->num_free = 0;
+            pool->data_size = data_size;
+        }
+
+        if(pool->free_list) {
+            rc = pool->free_list;
+            pool->free_list = rc->next_free;
+            pool->num_free--;
+        }
+
+        pool->outstanding++;
+        block_size = pool->data_size;
+    }
+
+    free_block_list(stale);
+
+    if(rc) {
+        mem_set(rc, 0, (int)sizeof(struct refcount_t) + block_size);
+        reused = 1;
+    } else {
+        rc = mem_alloc((int)sizeof(struct refcount_t) + block_size);
+        if(!rc) {
+            pdebug(DEBUG_WARN,"Unable to allocate pool block!");
+
+            spin_block(&pool->lock) {
+                pool->outstanding--;
+            }
+
+            return NULL;
+        }
+    }
+
+    spin_block(&pool_stats_lock) {
+        if(reused) {
+            pool_reuses++;
+        } else {
+            pool_allocs++;
+        }
+    }
+
+    rc->count = 1;
+    rc->lock = LOCK_INIT;
+    rc->cleanup_func = cleaner_func;
+    rc->function_name = func;
+    rc->line_num = line_num;
+    rc->pool = pool;
+    rc->data_size = block_size;
+
+    pdebug(DEBUG_DETAIL,"Done.");
+
+    return (char *)(rc + 1);
+}
+
+
+
+void rc_pool_get_stats(int64_t *allocs, int64_t *reuses)
+{
+    spin_block(&pool_stats_lock) {
+        if(allocs) {
+            *allocs = pool_allocs;
+        }
+
+        if(reuses) {
+            *reuses = pool_reuses;
+        }
+    }
+}
+
+
+
+void free_block_list(refcount_p list)
+{
+    while(list) {
+        refcount_p next = list->next_free;
+
+        mem_free(list);
+
+        list = next;
+    }
+}
+
+
+
+/*
+ * pool_release
+ *
+ * Put a block back in its pool, or free it if the pool is full, closed
+ * or has grown past the block's size.
+ */
+
+void pool_release(refcount_p rc)
+{
+    rc_pool_p pool = rc->pool;
+    int free_block = 0;
+    int free_pool = 0;
+
+    spin_block(&pool->lock) {
+        pool->outstanding--;
+
+        if(pool->closed || rc->data_size < pool->data_size || pool->num_free >= pool->max_free) {
+            free_block = 1;
+            free_pool = (pool->closed && pool->outstanding == 0);
+        } else {
+            rc->next_free = pool->free_list;
+            pool->free_list = rc;
+            pool->num_free++;
+        }
+    }
+
+    if(free_block) {
+        mem_free(rc);
+    }
+
+    if(free_pool) {
+        mem_free(pool);
+    }
+}
@@ -33,3 +33,22 @@ extern void *rc_inc_impl(const char *func, int line_num, void *ref);
 #define rc_dec(ref) rc_dec_impl(__func__, __LINE__, ref)
 extern void *rc_dec_impl(const char *func, int line_num, void *ref);
 
+
+/*
+ * Pools of reference counted blocks.
+ *
+ * A block allocated from a pool goes back to the pool instead of being
+ * freed when its count drops to zero.  The pool only keeps blocks of its
+ * current size, which grows to the largest size asked for.
+ */
+
+typedef struct rc_pool_t *rc_pool_p;
+
+extern rc_pool_p rc_pool_create(int max_free);
+extern void rc_pool_destroy(rc_pool_p pool);
+
+#define rc_pool_alloc(pool, size, cleaner) rc_pool_alloc_impl(__func__, __LINE__, pool, size, cleaner)
+extern void *rc_pool_alloc_impl(const char *func, int line_num, rc_pool_p pool, int size, rc_cleanup_func cleaner);
+
+/* counts of blocks allocated and reused by all pools. */
+extern void rc_pool_get_stats(int64_t *allocs, int64_t *reuses);